@@ -42,6 +42,10 @@ struct _VDAgent {
     void *ctx;
 
     GMainLoop *loop;
+
+    // writes from other threads, sent from the main context (vdagent_write_t)
+    GAsyncQueue *write_queue;
+    gint write_scheduled;
 };
 
 G_END_DECLS
@@ -83,6 +87,8 @@ static void vdagent_dispose(GObject *object)
     while (g_source_remove_by_user_data(agent))
         continue;
 
+    g_clear_pointer(&agent->write_queue, g_async_queue_unref);
+
     g_clear_pointer(&agent->loop, g_main_loop_unref);
     G_OBJECT_CLASS(vdagent_parent_class)->dispose(object);
 }
@@ -94,9 +100,12 @@ static void vdagent_class_init(VDAgentClass *klass)
     object_class->dispose = vdagent_dispose;
 }
 
+static void vdagent_write_free(gpointer data);
+
 static void vdagent_init(VDAgent *self)
 {
     self->loop = g_main_loop_new(NULL, FALSE);
+    self->write_queue = g_async_queue_new_full(vdagent_write_free);
 }
 
 static VDAgent *vdagent_new(const vdagent_cb_t *cb, void *ctx)
@@ -369,62 +378,78 @@ void vdagent_unref(VDAgent *agent)
 }
 
 typedef struct {
-    UdscsConnection *conn;
     struct udscs_message_header hdr;
-    const uint8_t *data;
-    GMutex mutex;
-    GCond cond;
-    gboolean is_done;
-} vdagent_write_params_t;
+    GBytes *data;
+} vdagent_write_t;
 
-static gboolean _vdagent_write_cb(gpointer user_data)
+static void vdagent_write_free(gpointer data)
 {
-    vdagent_write_params_t *params = (vdagent_write_params_t *)user_data;
+    vdagent_write_t *write = data;
 
-    udscs_write(params->conn,
-                params->hdr.type,
-                params->hdr.arg1,
-                params->hdr.arg2,
-                params->data,
-                params->hdr.size);
+    g_clear_pointer(&write->data, g_bytes_unref);
+    g_free(write);
+}
 
-    g_mutex_lock(&params->mutex);
-    params->is_done = TRUE;
-    g_cond_signal(&params->cond);
-    g_mutex_unlock(&params->mutex);
+// must be called with the main context acquired
+static void vdagent_flush_write_queue(VDAgent *agent)
+{
+    vdagent_write_t *write;
+
+    while ((write = g_async_queue_try_pop(agent->write_queue)) != NULL) {
+        if (agent->conn) {
+            udscs_write_bytes(agent->conn,
+                              write->hdr.type,
+                              write->hdr.arg1,
+                              write->hdr.arg2,
+                              write->data);
+        }
+        vdagent_write_free(write);
+    }
+}
+
+static gboolean _vdagent_write_cb(gpointer user_data)
+{
+    VDAgent *agent = user_data;
+
+    // writes queued from now on need a new callback
+    g_atomic_int_set(&agent->write_scheduled, FALSE);
+    vdagent_flush_write_queue(agent);
 
     return G_SOURCE_REMOVE;
 }
 
-// write can happen from any thread so we need to synchronize it with the main context
+// write can happen from any thread, the connection is only used from the main
+// context: writes from other threads are queued with a copy of their data, and
+// the caller returns at once
 static void vdagent_write(VDAgent *agent, uint32_t type, uint32_t arg1,
                           uint32_t arg2, const uint8_t *data, uint32_t size)
 {
-    vdagent_write_params_t params = {
-        .conn = agent->conn,
-        .hdr.type = type,
-        .hdr.arg1 = arg1,
-        .hdr.arg2 = arg2,
-        .hdr.size = size,
-        .data = data,
-    };
-
     // if we have the main context
     if (g_main_context_acquire(NULL)) {
+        // send what other threads queued first, to keep the order of messages
+        vdagent_flush_write_queue(agent);
         // we can call udscs_write directly
         udscs_write(agent->conn, type,
                     arg1, arg2, data, size);
         g_main_context_release(NULL);
-    } else {
-        // we have to synchronize with main context
-        g_mutex_init(&params.mutex);
-        g_cond_init(&params.cond);
-        g_mutex_lock(&params.mutex);
-        g_main_context_invoke(NULL, _vdagent_write_cb, &params);
-        while (!params.is_done) {
-            g_cond_wait(&params.cond, &params.mutex);
-        }
-        g_mutex_unlock(&params.mutex);
+        return;
+    }
+
+    vdagent_write_t *write = g_new0(vdagent_write_t, 1);
+    write->hdr.type = type;
+    write->hdr.arg1 = arg1;
+    write->hdr.arg2 = arg2;
+    write->hdr.size = size;
+    if (size > 0) {
+        write->data = g_bytes_new(data, size);
+    }
+    g_async_queue_push(agent->write_queue, write);
+
+    // a single callback drains all the queued writes, it keeps the agent
+    // alive until then
+    if (g_atomic_int_compare_and_exchange(&agent->write_scheduled, FALSE, TRUE)) {
+        g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, _vdagent_write_cb,
+                        g_object_ref(agent), g_object_unref);
     }
 }
 
@@ -24,11 +24,20 @@
 
 #include <stdlib.h>
 #include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
 #include <glib-unix.h>
 #include <gio/gunixsocketaddress.h>
+#include <gio/gunixconnection.h>
 #include "udscs.h"
+#include "vdagentd-proto.h"
 #include "vdagentd-proto-strings.h"
 #include "vdagent-connection.h"
+#include "vdagent-probes.h"
 
 // Maximum number of connected agents.
 // Avoid DoS from agents.
@@ -36,14 +45,38 @@
 // less than the number of file descriptors in the process (by default 1024).
 #define MAX_CONNECTED_AGENTS 128
 
+// Payloads of at least this size are passed in a sealed memfd
+// when the peer supports it, the message itself carries no data then.
+#define MEMFD_PAYLOAD_THRESHOLD (256 * 1024)
+
+// Set in the type of messages whose payload comes in a memfd
+#define MEMFD_PAYLOAD_FLAG 0x80000000u
+
 struct _UdscsConnection {
     VDAgentConnection parent_instance;
     int debug;
     udscs_read_callback read_callback;
+    /* peer accepts payloads passed in a memfd */
+    gboolean peer_fd_passing;
+    /* payload of the message being handled, when it came in a memfd */
+    GMappedFile *message_file;
+    gsize message_file_size;
+    /* traffic per message type, see udscs_get_stats */
+    VDAgentMessageStats stats[VDAGENTD_NO_MESSAGES];
+    /* header of the open message, appended along with its first piece */
+    GBytes *write_header;
+#ifndef UDSCS_NO_SERVER
+    /* node in udscs_server.connections, lets the server unlink us in O(1) */
+    GList server_link;
+#endif
 };
 
 G_DEFINE_TYPE(UdscsConnection, udscs_connection, VDAGENT_TYPE_CONNECTION)
 
+static void udscs_connection_setup(UdscsConnection   *conn,
+                                   GIOStream         *io_stream,
+                                   VDAgentConnErrorCb error_cb);
+
 static void debug_print_message_header(UdscsConnection             *conn,
                                        struct udscs_message_header *header,
                                        const gchar                 *direction)
@@ -60,10 +93,91 @@ static void debug_print_message_header(UdscsConnection             *conn,
         conn, direction, type, header->arg1, header->arg2, header->size);
 }
 
+static void count_message(UdscsConnection                   *conn,
+                          const struct udscs_message_header *header,
+                          gboolean                           sent)
+{
+    VDAgentMessageStats *stats;
+
+    if (header->type >= VDAGENTD_NO_MESSAGES)
+        return;
+
+    stats = &conn->stats[header->type];
+    if (sent) {
+        stats->messages_out++;
+        stats->bytes_out += header->size;
+    } else {
+        stats->messages_in++;
+        stats->bytes_in += header->size;
+    }
+}
+
 static gsize conn_handle_header(VDAgentConnection *conn,
                                 gpointer           header_buf)
 {
-    return ((struct udscs_message_header *)header_buf)->size;
+    struct udscs_message_header *header = header_buf;
+
+    /* the payload isn't sent inline */
+    if (header->type & MEMFD_PAYLOAD_FLAG) {
+        return 0;
+    }
+    return header->size;
+}
+
+static void conn_handle_memfd_message(UdscsConnection             *self,
+                                      struct udscs_message_header *header)
+{
+    GMappedFile *file;
+    GError *err = NULL;
+    gint fd;
+
+    header->type &= ~MEMFD_PAYLOAD_FLAG;
+    debug_print_message_header(self, header, "received (memfd)");
+    VDAGENT_PROBE(udscs__read, self, header->type, header->arg1, header->size);
+    count_message(self, header, FALSE);
+
+    fd = vdagent_connection_steal_fd(VDAGENT_CONNECTION(self));
+    if (fd == -1) {
+        syslog(LOG_ERR, "udscs: message %u without payload fd, ignoring",
+               header->type);
+        return;
+    }
+
+#ifdef F_GET_SEALS
+    /* the peer must not be able to change or truncate the mapping under us */
+    {
+        int seals = fcntl(fd, F_GET_SEALS);
+        if (seals == -1 ||
+            (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) != (F_SEAL_SHRINK | F_SEAL_WRITE)) {
+            syslog(LOG_ERR, "udscs: payload fd of message %u is not sealed, ignoring",
+                   header->type);
+            close(fd);
+            return;
+        }
+    }
+#endif
+
+    /* private copy-on-write mapping, the handler may modify the data */
+    file = g_mapped_file_new_from_fd(fd, TRUE, &err);
+    close(fd);
+    if (file == NULL) {
+        syslog(LOG_ERR, "udscs: mapping payload of message %u: %s",
+               header->type, err->message);
+        g_error_free(err);
+        return;
+    }
+    if (g_mapped_file_get_length(file) < header->size) {
+        syslog(LOG_ERR, "udscs: payload of message %u is truncated, ignoring",
+               header->type);
+        g_mapped_file_unref(file);
+        return;
+    }
+
+    self->message_file = file;
+    self->message_file_size = header->size;
+    self->read_callback(self, header, (uint8_t *)g_mapped_file_get_contents(file));
+    self->message_file = NULL;
+    g_mapped_file_unref(file);
 }
 
 static void conn_handle_message(VDAgentConnection *conn,
@@ -73,7 +187,19 @@ static void conn_handle_message(VDAgentConnection *conn,
     UdscsConnection *self = UDSCS_CONNECTION(conn);
     struct udscs_message_header *header = header_buf;
 
+    if (header->type & MEMFD_PAYLOAD_FLAG) {
+        conn_handle_memfd_message(self, header);
+        return;
+    }
+
     debug_print_message_header(self, header, "received");
+    VDAGENT_PROBE(udscs__read, self, header->type, header->arg1, header->size);
+    count_message(self, header, FALSE);
+
+    if (header->type == VDAGENTD_FD_PASSING) {
+        self->peer_fd_passing = TRUE;
+        return;
+    }
 
     self->read_callback(self, header, data);
 }
@@ -89,6 +215,7 @@ static void udscs_connection_finalize(GObject *obj)
     if (self->debug) {
         syslog(LOG_DEBUG, "%p disconnected", self);
     }
+    g_clear_pointer(&self->write_header, g_bytes_unref);
 
     G_OBJECT_CLASS(udscs_connection_parent_class)->finalize(obj);
 }
@@ -121,11 +248,7 @@ UdscsConnection *udscs_connect(const char *socketname,
     conn = g_object_new(UDSCS_TYPE_CONNECTION, NULL);
     conn->debug = debug;
     conn->read_callback = read_callback;
-    vdagent_connection_setup(VDAGENT_CONNECTION(conn),
-                             io_stream,
-                             FALSE,
-                             sizeof(struct udscs_message_header),
-                             error_cb);
+    udscs_connection_setup(conn, io_stream, error_cb);
 
     if (conn->debug) {
         syslog(LOG_DEBUG, "%p connected to %s", conn, socketname);
@@ -134,27 +257,252 @@ UdscsConnection *udscs_connect(const char *socketname,
     return conn;
 }
 
+/* Clipboard and file contents must not hold up control messages.
+ * The other clipboard messages go along with the data: a grab or release
+ * overtaking queued data would have that data answer a newer request. */
+static VDAgentConnectionPriority message_priority(uint32_t type)
+{
+    switch (type) {
+    case VDAGENTD_CLIPBOARD_GRAB:
+    case VDAGENTD_CLIPBOARD_REQUEST:
+    case VDAGENTD_CLIPBOARD_DATA:
+    case VDAGENTD_CLIPBOARD_RELEASE:
+    case VDAGENTD_FILE_XFER_DATA:
+        return VDAGENT_CONNECTION_PRIORITY_BULK;
+    default:
+        return VDAGENT_CONNECTION_PRIORITY_DEFAULT;
+    }
+}
+
+/* Serialize header and payload into a single immutable buffer */
+static GBytes *udscs_message_new(struct udscs_message_header *header,
+                                 const uint8_t               *data)
+{
+    gsize size = sizeof(*header) + header->size;
+    guint8 *buf = vdagent_payload_alloc(size);
+
+    memcpy(buf, header, sizeof(*header));
+    memcpy(buf + sizeof(*header), data, header->size);
+
+    return vdagent_payload_steal(buf, size, size);
+}
+
+static void udscs_write_message(UdscsConnection             *conn,
+                                struct udscs_message_header *header,
+                                GBytes                      *message)
+{
+    debug_print_message_header(conn, header, "sent");
+    VDAGENT_PROBE(udscs__write, conn, header->type, header->arg1, header->size);
+    count_message(conn, header, TRUE);
+
+    vdagent_connection_write_bytes(VDAGENT_CONNECTION(conn), &message, 1,
+                                   message_priority(header->type));
+}
+
+#ifdef HAVE_MEMFD_CREATE
+static gint payload_to_memfd(const uint8_t *data, gsize size)
+{
+    gsize written = 0;
+    gssize ret;
+    gint fd;
+
+    fd = memfd_create("spice-vdagent-payload", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        syslog(LOG_WARNING, "udscs: memfd_create: %m");
+        return -1;
+    }
+
+    while (written < size) {
+        ret = write(fd, data + written, size - written);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            goto error;
+        }
+        written += ret;
+    }
+
+    if (fcntl(fd, F_ADD_SEALS,
+              F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1) {
+        goto error;
+    }
+    return fd;
+
+error:
+    syslog(LOG_WARNING, "udscs: filling payload memfd: %m");
+    close(fd);
+    return -1;
+}
+#endif
+
+/* Queue the message with its payload in a memfd if that is worth it,
+ * returns FALSE if the payload has to be sent inline. */
+static gboolean udscs_write_memfd(UdscsConnection             *conn,
+                                  struct udscs_message_header *header,
+                                  const uint8_t               *data)
+{
+#ifdef HAVE_MEMFD_CREATE
+    struct udscs_message_header wire_header = *header;
+    GBytes *bytes;
+    gint fd;
+
+    if (!conn->peer_fd_passing || header->size < MEMFD_PAYLOAD_THRESHOLD) {
+        return FALSE;
+    }
+
+    fd = payload_to_memfd(data, header->size);
+    if (fd == -1) {
+        return FALSE;
+    }
+
+    debug_print_message_header(conn, header, "sent (memfd)");
+    VDAGENT_PROBE(udscs__write, conn, header->type, header->arg1, header->size);
+    count_message(conn, header, TRUE);
+
+    wire_header.type |= MEMFD_PAYLOAD_FLAG;
+    bytes = g_bytes_new(&wire_header, sizeof(wire_header));
+    vdagent_connection_write_fd(VDAGENT_CONNECTION(conn), &bytes, 1, fd,
+                                message_priority(header->type));
+    g_bytes_unref(bytes);
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
 void udscs_write(UdscsConnection *conn, uint32_t type, uint32_t arg1,
     uint32_t arg2, const uint8_t *data, uint32_t size)
 {
-    gpointer buf;
-    guint buf_size;
     struct udscs_message_header header;
-
-    buf_size = sizeof(header) + size;
-    buf = g_malloc(buf_size);
+    GBytes *message;
 
     header.type = type;
     header.arg1 = arg1;
     header.arg2 = arg2;
     header.size = size;
 
-    memcpy(buf, &header, sizeof(header));
-    memcpy(buf + sizeof(header), data, size);
+    if (udscs_write_memfd(conn, &header, data)) {
+        return;
+    }
+
+    message = udscs_message_new(&header, data);
+    udscs_write_message(conn, &header, message);
+    g_bytes_unref(message);
+}
+
+void udscs_write_bytes(UdscsConnection *conn, uint32_t type, uint32_t arg1,
+    uint32_t arg2, GBytes *data)
+{
+    struct udscs_message_header header;
+    GBytes *parts[2];
+
+    header.type = type;
+    header.arg1 = arg1;
+    header.arg2 = arg2;
+    header.size = data ? g_bytes_get_size(data) : 0;
+
+    if (data && udscs_write_memfd(conn, &header, g_bytes_get_data(data, NULL))) {
+        return;
+    }
+
+    debug_print_message_header(conn, &header, "sent");
+    VDAGENT_PROBE(udscs__write, conn, header.type, header.arg1, header.size);
+    count_message(conn, &header, TRUE);
+
+    parts[0] = g_bytes_new(&header, sizeof(header));
+    parts[1] = data;
+    vdagent_connection_write_bytes(VDAGENT_CONNECTION(conn), parts, 2,
+                                   message_priority(type));
+    g_bytes_unref(parts[0]);
+}
+
+void udscs_write_start(UdscsConnection *conn, uint32_t type, uint32_t arg1,
+    uint32_t arg2, uint32_t size)
+{
+    struct udscs_message_header header;
+    GBytes *bytes;
+
+    header.type = type;
+    header.arg1 = arg1;
+    header.arg2 = arg2;
+    header.size = size;
 
     debug_print_message_header(conn, &header, "sent");
+    VDAGENT_PROBE(udscs__write, conn, header.type, header.arg1, header.size);
+    count_message(conn, &header, TRUE);
+
+    vdagent_connection_write_start(VDAGENT_CONNECTION(conn),
+                                   sizeof(header) + size,
+                                   message_priority(type));
+    bytes = g_bytes_new(&header, sizeof(header));
+    if (size == 0) {
+        vdagent_connection_write_append(VDAGENT_CONNECTION(conn), bytes);
+        g_bytes_unref(bytes);
+    } else {
+        /* a header on its own would hold up the connection once written */
+        g_clear_pointer(&conn->write_header, g_bytes_unref);
+        conn->write_header = bytes;
+    }
+}
+
+void udscs_write_append(UdscsConnection *conn, GBytes *data)
+{
+    if (conn->write_header) {
+        vdagent_connection_write_append(VDAGENT_CONNECTION(conn),
+                                        conn->write_header);
+        g_clear_pointer(&conn->write_header, g_bytes_unref);
+    }
+    vdagent_connection_write_append(VDAGENT_CONNECTION(conn), data);
+}
+
+void udscs_write_cancel(UdscsConnection *conn)
+{
+    g_clear_pointer(&conn->write_header, g_bytes_unref);
+    vdagent_connection_write_cancel(VDAGENT_CONNECTION(conn));
+}
+
+GBytes *udscs_steal_message_data(UdscsConnection *conn)
+{
+    if (conn->message_file) {
+        GBytes *file_bytes = g_mapped_file_get_bytes(conn->message_file);
+        GBytes *bytes = g_bytes_new_from_bytes(file_bytes, 0,
+                                               conn->message_file_size);
+
+        g_bytes_unref(file_bytes);
+        return bytes;
+    }
+    return vdagent_connection_steal_message_data(VDAGENT_CONNECTION(conn));
+}
+
+const VDAgentMessageStats *udscs_get_stats(UdscsConnection *conn)
+{
+    return conn->stats;
+}
+
+static void udscs_connection_setup(UdscsConnection   *conn,
+                                   GIOStream         *io_stream,
+                                   VDAgentConnErrorCb error_cb)
+{
+#ifdef HAVE_MEMFD_CREATE
+    gboolean fd_passing = G_IS_UNIX_CONNECTION(io_stream);
+
+    if (fd_passing) {
+        vdagent_connection_set_fd_passing(VDAGENT_CONNECTION(conn));
+    }
+#endif
+
+    vdagent_connection_setup(VDAGENT_CONNECTION(conn),
+                             io_stream,
+                             FALSE,
+                             sizeof(struct udscs_message_header),
+                             error_cb);
 
-    vdagent_connection_write(VDAGENT_CONNECTION(conn), buf, buf_size);
+#ifdef HAVE_MEMFD_CREATE
+    /* let the peer know it can pass large payloads in a memfd */
+    if (fd_passing) {
+        udscs_write(conn, VDAGENTD_FD_PASSING, 0, 0, NULL, 0);
+    }
+#endif
 }
 
 #ifndef UDSCS_NO_SERVER
@@ -163,7 +511,7 @@ void udscs_write(UdscsConnection *conn, uint32_t type, uint32_t arg1,
 
 struct udscs_server {
     GSocketService *service;
-    GList *connections;
+    GQueue connections; /* of UdscsConnection, linked through server_link */
 
     int debug;
     udscs_connect_callback connect_callback;
@@ -236,7 +584,10 @@ void udscs_server_start(struct udscs_server *server)
 void udscs_server_destroy_connection(struct udscs_server *server,
                                      UdscsConnection     *conn)
 {
-    server->connections = g_list_remove(server->connections, conn);
+    if (conn->server_link.data == conn) {
+        g_queue_unlink(&server->connections, &conn->server_link);
+        conn->server_link.data = NULL;
+    }
     vdagent_connection_destroy(conn);
 }
 
@@ -245,7 +596,10 @@ void udscs_destroy_server(struct udscs_server *server)
     if (!server)
         return;
 
-    g_list_free_full(server->connections, vdagent_connection_destroy);
+    while (server->connections.head) {
+        UdscsConnection *conn = server->connections.head->data;
+        udscs_server_destroy_connection(server, conn);
+    }
     g_object_unref(server->service);
     g_free(server);
 }
@@ -259,7 +613,7 @@ static gboolean udscs_server_accept_cb(GSocketService    *service,
     UdscsConnection *new_conn;
 
     /* prevents DoS having too many agents attached */
-    if (g_list_length(server->connections) >= MAX_CONNECTED_AGENTS) {
+    if (server->connections.length >= MAX_CONNECTED_AGENTS) {
         syslog(LOG_ERR, "Too many agents connected");
         return TRUE;
     }
@@ -268,13 +622,10 @@ static gboolean udscs_server_accept_cb(GSocketService    *service,
     new_conn->debug = server->debug;
     new_conn->read_callback = server->read_callback;
     g_object_ref(socket_conn);
-    vdagent_connection_setup(VDAGENT_CONNECTION(new_conn),
-                             G_IO_STREAM(socket_conn),
-                             FALSE,
-                             sizeof(struct udscs_message_header),
-                             server->error_cb);
+    udscs_connection_setup(new_conn, G_IO_STREAM(socket_conn), server->error_cb);
 
-    server->connections = g_list_prepend(server->connections, new_conn);
+    new_conn->server_link.data = new_conn;
+    g_queue_push_head_link(&server->connections, &new_conn->server_link);
 
     if (server->debug)
         syslog(LOG_DEBUG, "new client accepted: %p", new_conn);
@@ -289,10 +640,24 @@ void udscs_server_write_all(struct udscs_server *server,
         uint32_t type, uint32_t arg1, uint32_t arg2,
         const uint8_t *data, uint32_t size)
 {
+    struct udscs_message_header header;
+    GBytes *message;
     GList *l;
-    for (l = server->connections; l; l = l->next) {
-        udscs_write(UDSCS_CONNECTION(l->data), type, arg1, arg2, data, size);
+
+    if (server->connections.head == NULL)
+        return;
+
+    header.type = type;
+    header.arg1 = arg1;
+    header.arg2 = arg2;
+    header.size = size;
+
+    /* serialize once, all the write queues reference the same buffer */
+    message = udscs_message_new(&header, data);
+    for (l = server->connections.head; l; l = l->next) {
+        udscs_write_message(UDSCS_CONNECTION(l->data), &header, message);
     }
+    g_bytes_unref(message);
 }
 
 int udscs_server_for_all_clients(struct udscs_server *server,
@@ -304,7 +669,7 @@ int udscs_server_for_all_clients(struct udscs_server *server,
     if (!server)
         return 0;
 
-    l = server->connections;
+    l = server->connections.head;
     while (l) {
         next = l->next;
         r += func(l->data, priv);
@@ -63,10 +63,43 @@ UdscsConnection *udscs_connect(const char *socketname,
     GError **err);
 
 /* Queue a message for delivery to the client connected through conn.
+ * Large payloads are handed over in a sealed memfd instead of being copied
+ * through the socket when both ends support it, this is transparent to
+ * the read callback of the receiver.
  */
 void udscs_write(UdscsConnection *conn, uint32_t type, uint32_t arg1,
         uint32_t arg2, const uint8_t *data, uint32_t size);
 
+/* Like udscs_write, but the payload in @data is queued without being copied,
+ * a reference to it is held until the message is written out.
+ * @data may be NULL for messages without payload.
+ */
+void udscs_write_bytes(UdscsConnection *conn, uint32_t type, uint32_t arg1,
+        uint32_t arg2, GBytes *data);
+
+/* Queue a message whose size bytes of payload are appended later, piece
+ * by piece, using udscs_write_append(). It is queued along with the first
+ * piece, once it started to be written nothing else is sent through conn
+ * until it is complete.
+ * udscs_write_cancel() gives up on an incomplete message, if part of it
+ * was already sent the rest of the payload is filled with zeroes.
+ */
+void udscs_write_start(UdscsConnection *conn, uint32_t type, uint32_t arg1,
+        uint32_t arg2, uint32_t size);
+
+void udscs_write_append(UdscsConnection *conn, GBytes *data);
+
+void udscs_write_cancel(UdscsConnection *conn);
+
+/* Take the payload of the message currently handed to the read callback,
+ * so it can be used after the callback returns without a copy where
+ * possible. Must only be called from the read callback. */
+GBytes *udscs_steal_message_data(UdscsConnection *conn);
+
+/* Returns the messages sent and received by @conn since it was set up,
+ * an array of VDAGENTD_NO_MESSAGES entries indexed by message type. */
+const VDAgentMessageStats *udscs_get_stats(UdscsConnection *conn);
+
 #ifndef UDSCS_NO_SERVER
 
 /* ---------- Server-side API ---------- */
@@ -113,7 +146,8 @@ void udscs_server_destroy_connection(struct udscs_server *server,
 void udscs_destroy_server(struct udscs_server *server);
 
 /* Like udscs_write, but then send the message to all clients connected to
- * the server.
+ * the server. The message is serialized once and the same buffer is
+ * referenced by the write queues of all the connections.
  */
 void udscs_server_write_all(struct udscs_server *server,
     uint32_t type, uint32_t arg1, uint32_t arg2,
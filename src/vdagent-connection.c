@@ -16,15 +16,85 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <string.h>
 #include <syslog.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <glib/gstdio.h>
 #include <gio/gunixinputstream.h>
 #include <gio/gunixoutputstream.h>
 #include <gio/gunixsocketaddress.h>
+#include <gio/gunixfdmessage.h>
 
 #include "vdagent-connection.h"
+#include "vdagent-probes.h"
+
+/* Maximum number of queued buffers handed to a single writev() */
+#define MAX_WRITE_VECTORS 64
+
+/* Default upper bound of bytes handed to a single writev() */
+#define DEFAULT_WRITE_BATCH_SIZE (256 * 1024)
+
+/* Size of the block incoming data is read into, messages that fit
+ * are parsed in place without further allocations */
+#define READ_BUF_SIZE (64 * 1024)
+
+/* Message bodies are handed to the subclasses aligned to this */
+#define READ_ALIGNMENT sizeof(guint64)
+
+/* Size classes of the buffer pool, larger buffers come from the heap */
+static const gsize buffer_pool_sizes[] = { 64, 256, 1024, 4096 };
+#define BUFFER_POOL_CLASSES G_N_ELEMENTS(buffer_pool_sizes)
+
+/* Number of buffers allocated at once when a size class runs empty */
+#define BUFFER_POOL_SLAB_COUNT 16
+
+/* Default budget of the heap allocated payloads */
+#define DEFAULT_PAYLOAD_BUDGET (128 * 1024 * 1024)
+
+/* Smaller payloads stay on the heap even beyond the budget */
+#define PAYLOAD_SPILL_MIN_SIZE (64 * 1024)
+
+/* Past this many spilled bytes, payloads go to the heap again rather
+ * than filling up shared memory */
+#define PAYLOAD_SPILL_LIMIT (1024 * 1024 * 1024)
+
+/* Payloads are freed by whoever holds the last reference, possibly
+ * from another thread */
+G_LOCK_DEFINE_STATIC(payloads);
+static VDAgentPayloadStats payloads = { .budget = DEFAULT_PAYLOAD_BUDGET };
+/* The spilled payloads, by address */
+static GHashTable *payloads_spilled;
+
+typedef struct Payload {
+    gpointer data;
+    gsize size;
+} Payload;
+
+/* A file descriptor received along with the data, it was sent with a
+ * message starting before @end, the stream position the read ended at */
+typedef struct ReceivedFd {
+    gint fd;
+    guint64 end;
+} ReceivedFd;
+
+/* Free pool buffers are chained through their first bytes */
+typedef struct PoolBuffer {
+    struct PoolBuffer *next;
+} PoolBuffer;
+
+/* A queued message, its parts are written back to back.
+ * @filled is smaller than @size while parts are still being appended.
+ * @fd, if not -1, is passed along with the first byte of the message. */
+typedef struct {
+    GPtrArray *parts;
+    gsize      size;
+    gsize      filled;
+    gint       fd;
+} WriteMessage;
 
 typedef struct {
     GIOStream         *io_stream;
@@ -32,18 +102,85 @@ typedef struct {
     VDAgentConnErrorCb error_cb;
     GCancellable      *cancellable;
 
-    GQueue            *write_queue;
+    GQueue            *write_queue[VDAGENT_CONNECTION_N_PRIORITIES];
+    gboolean           writing;
+    gint               write_partial;
+    WriteMessage      *write_open;
+    gint               write_open_priority;
     gsize              bytes_written;
+    gsize              write_batch_size;
+    gsize              queued_bytes;
+    gsize              pending_bytes;
+    gboolean           filling;
+
+    gsize              low_watermark;
+    gsize              high_watermark;
+    gboolean           congested;
+    VDAgentConnFlowCb  flow_cb;
+
+    gboolean           read_paused;
+    gboolean           read_stalled;
 
     gsize              header_size;
     gpointer           header_buf;
+    gboolean           header_read;
+    gsize              data_size;
+
+    /* body of a message larger than read_buf */
     gpointer           data_buf;
+    gsize              data_read;
+
+    /* body of the message handed to handle_message, see steal_message_data */
+    gpointer           message_body;
+
+    /* scratch copy of unaligned message bodies */
+    gpointer           align_buf;
+    gsize              align_buf_size;
+
+    guint8            *read_buf;
+    gsize              read_pos;
+    gsize              read_end;
+
+    /* file descriptors received along with the data */
+    gboolean           fd_passing;
+    GArray            *received_fds;
+    /* stream positions: bytes received and bytes of the messages handled */
+    guint64            received_bytes;
+    guint64            consumed_bytes;
+
+    PoolBuffer        *buffer_pool[BUFFER_POOL_CLASSES];
+    GPtrArray         *buffer_slabs;
 } VDAgentConnectionPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE(VDAgentConnection, vdagent_connection, G_TYPE_OBJECT)
 
 static void read_next_message(VDAgentConnection *self);
 
+/* Close the received fds that were sent with a message starting before
+ * @pos, which no handler claimed */
+static void close_received_fds(VDAgentConnectionPrivate *priv, guint64 pos)
+{
+    guint n = 0;
+
+    while (n < priv->received_fds->len &&
+           g_array_index(priv->received_fds, ReceivedFd, n).end <= pos) {
+        close(g_array_index(priv->received_fds, ReceivedFd, n).fd);
+        n++;
+    }
+    if (n > 0) {
+        g_array_remove_range(priv->received_fds, 0, n);
+    }
+}
+
+static void write_message_free(WriteMessage *msg)
+{
+    if (msg->fd != -1) {
+        close(msg->fd);
+    }
+    g_ptr_array_unref(msg->parts);
+    g_free(msg);
+}
+
 GIOStream *vdagent_file_open(const gchar *path, GError **err)
 {
     gint fd, errsv;
@@ -81,8 +218,16 @@ GIOStream *vdagent_socket_connect(const gchar *path, GError **err)
 static void vdagent_connection_init(VDAgentConnection *self)
 {
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    guint i;
+
     priv->cancellable = g_cancellable_new();
-    priv->write_queue = g_queue_new();
+    for (i = 0; i < VDAGENT_CONNECTION_N_PRIORITIES; i++) {
+        priv->write_queue[i] = g_queue_new();
+    }
+    priv->write_partial = -1;
+    priv->write_batch_size = DEFAULT_WRITE_BATCH_SIZE;
+    priv->buffer_slabs = g_ptr_array_new_with_free_func(g_free);
+    priv->received_fds = g_array_new(FALSE, FALSE, sizeof(ReceivedFd));
 }
 
 static void vdagent_connection_dispose(GObject *obj)
@@ -100,10 +245,25 @@ static void vdagent_connection_finalize(GObject *obj)
 {
     VDAgentConnection *self = VDAGENT_CONNECTION(obj);
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    guint i;
 
-    g_queue_free_full(priv->write_queue, (GDestroyNotify)g_bytes_unref);
+    for (i = 0; i < VDAGENT_CONNECTION_N_PRIORITIES; i++) {
+        g_queue_free_full(priv->write_queue[i], (GDestroyNotify)write_message_free);
+    }
+    /* not queued yet */
+    if (priv->write_open && priv->write_open->parts->len == 0) {
+        write_message_free(priv->write_open);
+    }
     g_free(priv->header_buf);
-    g_free(priv->data_buf);
+    if (priv->data_buf) {
+        vdagent_connection_buffer_release(self, priv->data_buf, priv->data_size);
+    }
+    g_free(priv->align_buf);
+    g_free(priv->read_buf);
+    close_received_fds(priv, G_MAXUINT64);
+    g_array_free(priv->received_fds, TRUE);
+    /* all the pooled buffers are released at this point */
+    g_ptr_array_free(priv->buffer_slabs, TRUE);
 
     G_OBJECT_CLASS(vdagent_connection_parent_class)->finalize(obj);
 }
@@ -126,8 +286,19 @@ void vdagent_connection_setup(VDAgentConnection *self,
     priv->opening = wait_on_opening;
     priv->header_size = header_size;
     priv->header_buf = g_malloc(header_size);
+    priv->read_buf = g_malloc(READ_BUF_SIZE);
     priv->error_cb = error_cb;
 
+    if (priv->fd_passing) {
+        GSocket *socket;
+
+        g_return_if_fail(G_IS_UNIX_CONNECTION(io_stream));
+        socket = g_socket_connection_get_socket(G_SOCKET_CONNECTION(io_stream));
+        /* the streams of the connection pass their own blocking flag,
+         * this only affects the direct receive/send of messages with fds */
+        g_socket_set_blocking(socket, FALSE);
+    }
+
     read_next_message(self);
 }
 
@@ -163,27 +334,464 @@ PidUid vdagent_connection_get_peer_pid_uid(VDAgentConnection *self,
     return pid_uid;
 }
 
+void vdagent_payload_set_budget(gsize budget)
+{
+    G_LOCK(payloads);
+    payloads.budget = budget;
+    G_UNLOCK(payloads);
+}
+
+/* Called without the lock, the size was already added to spilled_bytes */
+static gpointer payload_spill(gsize size)
+{
+    gpointer data;
+    gint fd;
+
+#ifdef HAVE_MEMFD_CREATE
+    fd = memfd_create("spice-vdagent-spill", MFD_CLOEXEC);
+#else
+    gchar *path = NULL;
+
+    fd = g_file_open_tmp("spice-vdagent-XXXXXX", &path, NULL);
+    if (fd != -1) {
+        g_unlink(path);
+    }
+    g_free(path);
+#endif
+    if (fd == -1) {
+        return NULL;
+    }
+
+    data = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    return data == MAP_FAILED ? NULL : data;
+}
+
+gpointer vdagent_payload_alloc(gsize size)
+{
+    gpointer data = NULL;
+    gboolean spill;
+
+    G_LOCK(payloads);
+    spill = payloads.budget && size >= PAYLOAD_SPILL_MIN_SIZE &&
+            payloads.heap_bytes + size > payloads.budget &&
+            payloads.spilled_bytes + size <= PAYLOAD_SPILL_LIMIT;
+    if (spill) {
+        /* reserved, so that concurrent spills stay within the limit */
+        payloads.spilled_bytes += size;
+    } else {
+        payloads.heap_bytes += size;
+        payloads.heap_high_water = MAX(payloads.heap_high_water,
+                                       payloads.heap_bytes);
+    }
+    G_UNLOCK(payloads);
+
+    if (!spill) {
+        return g_malloc(size);
+    }
+
+    data = payload_spill(size);
+
+    G_LOCK(payloads);
+    if (data) {
+        if (payloads_spilled == NULL) {
+            payloads_spilled = g_hash_table_new(NULL, NULL);
+        }
+        g_hash_table_add(payloads_spilled, data);
+        payloads.spills++;
+        payloads.spilled_high_water = MAX(payloads.spilled_high_water,
+                                          payloads.spilled_bytes);
+    } else {
+        payloads.spilled_bytes -= size;
+        payloads.heap_bytes += size;
+        payloads.heap_high_water = MAX(payloads.heap_high_water,
+                                       payloads.heap_bytes);
+    }
+    G_UNLOCK(payloads);
+
+    return data ? data : g_malloc(size);
+}
+
+void vdagent_payload_free(gpointer data, gsize size)
+{
+    gboolean spilled;
+
+    if (data == NULL) {
+        return;
+    }
+
+    G_LOCK(payloads);
+    spilled = payloads_spilled && g_hash_table_remove(payloads_spilled, data);
+    if (spilled) {
+        payloads.spilled_bytes -= size;
+    } else {
+        payloads.heap_bytes -= size;
+    }
+    G_UNLOCK(payloads);
+
+    if (spilled) {
+        munmap(data, size);
+    } else {
+        g_free(data);
+    }
+}
+
+gpointer vdagent_payload_realloc(gpointer data, gsize old_size, gsize new_size)
+{
+    gpointer new_data = vdagent_payload_alloc(new_size);
+
+    if (data) {
+        memcpy(new_data, data, MIN(old_size, new_size));
+        vdagent_payload_free(data, old_size);
+    }
+    return new_data;
+}
+
+static void payload_destroy(gpointer user_data)
+{
+    Payload *payload = user_data;
+
+    vdagent_payload_free(payload->data, payload->size);
+    g_free(payload);
+}
+
+GBytes *vdagent_payload_steal(gpointer data, gsize size, gsize len)
+{
+    Payload *payload = g_new(Payload, 1);
+
+    payload->data = data;
+    payload->size = size;
+    return g_bytes_new_with_free_func(data, len, payload_destroy, payload);
+}
+
+void vdagent_payload_get_stats(VDAgentPayloadStats *stats)
+{
+    G_LOCK(payloads);
+    *stats = payloads;
+    G_UNLOCK(payloads);
+}
+
+static gint buffer_pool_class(gsize size)
+{
+    guint i;
+
+    for (i = 0; i < BUFFER_POOL_CLASSES; i++) {
+        if (size <= buffer_pool_sizes[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+gpointer vdagent_connection_buffer_get(VDAgentConnection *self, gsize size)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    PoolBuffer *buf;
+    gint class = buffer_pool_class(size);
+
+    if (class < 0) {
+        return vdagent_payload_alloc(size);
+    }
+
+    if (priv->buffer_pool[class] == NULL) {
+        gsize buf_size = buffer_pool_sizes[class];
+        guint8 *slab = g_malloc(buf_size * BUFFER_POOL_SLAB_COUNT);
+        guint i;
+
+        for (i = 0; i < BUFFER_POOL_SLAB_COUNT; i++) {
+            buf = (PoolBuffer *)(slab + i * buf_size);
+            buf->next = priv->buffer_pool[class];
+            priv->buffer_pool[class] = buf;
+        }
+        g_ptr_array_add(priv->buffer_slabs, slab);
+    }
+
+    buf = priv->buffer_pool[class];
+    priv->buffer_pool[class] = buf->next;
+    return buf;
+}
+
+void vdagent_connection_buffer_release(VDAgentConnection *self,
+                                       gpointer           data,
+                                       gsize              size)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    PoolBuffer *buf = data;
+    gint class = buffer_pool_class(size);
+
+    if (class < 0) {
+        vdagent_payload_free(data, size);
+        return;
+    }
+
+    buf->next = priv->buffer_pool[class];
+    priv->buffer_pool[class] = buf;
+}
+
+GBytes *vdagent_connection_buffer_steal(VDAgentConnection *self,
+                                        gpointer           data,
+                                        gsize              size)
+{
+    GBytes *bytes;
+
+    if (buffer_pool_class(size) < 0) {
+        return vdagent_payload_steal(data, size, size);
+    }
+
+    bytes = g_bytes_new(data, size);
+    vdagent_connection_buffer_release(self, data, size);
+    return bytes;
+}
+
+GBytes *vdagent_connection_steal_message_data(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GBytes *bytes;
+
+    if (priv->data_size == 0) {
+        return g_bytes_new(NULL, 0);
+    }
+    g_return_val_if_fail(priv->message_body != NULL, NULL);
+
+    if (priv->message_body == priv->data_buf) {
+        bytes = vdagent_connection_buffer_steal(self, priv->data_buf, priv->data_size);
+        priv->data_buf = NULL;
+    } else {
+        /* it is in read_buf, which gets reused */
+        bytes = g_bytes_new(priv->message_body, priv->data_size);
+    }
+    priv->message_body = NULL;
+    return bytes;
+}
+
+static gboolean write_queue_is_empty(VDAgentConnectionPrivate *priv)
+{
+    guint i;
+
+    for (i = 0; i < VDAGENT_CONNECTION_N_PRIORITIES; i++) {
+        if (!g_queue_is_empty(priv->write_queue[i])) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static void check_watermarks(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    gsize queued = priv->queued_bytes + priv->pending_bytes;
+
+    /* pending bytes are being moved to the write queues */
+    if (priv->flow_cb == NULL || priv->filling) {
+        return;
+    }
+
+    if (!priv->congested && queued >= priv->high_watermark) {
+        priv->congested = TRUE;
+        priv->flow_cb(self, TRUE);
+    } else if (priv->congested && queued <= priv->low_watermark) {
+        priv->congested = FALSE;
+        priv->flow_cb(self, FALSE);
+    }
+}
+
+/* Add vectors for the parts of @msg starting @offset bytes into it,
+ * returns FALSE if they didn't all fit. */
+static gboolean gather_message(WriteMessage  *msg,
+                               gsize          offset,
+                               GOutputVector *vectors,
+                               guint         *n_vectors)
+{
+    guint i;
+
+    for (i = 0; i < msg->parts->len; i++) {
+        gsize size;
+        const guint8 *data = g_bytes_get_data(g_ptr_array_index(msg->parts, i),
+                                              &size);
+
+        if (offset >= size) {
+            offset -= size;
+            continue;
+        }
+        if (*n_vectors == MAX_WRITE_VECTORS) {
+            return FALSE;
+        }
+        vectors[*n_vectors].buffer = data + offset;
+        vectors[*n_vectors].size = size - offset;
+        (*n_vectors)++;
+        offset = 0;
+    }
+    return TRUE;
+}
+
+/* Send the start of @msg along with its fd directly through the socket,
+ * returns FALSE if the socket isn't writable. */
+static gboolean send_with_fd(VDAgentConnection *self,
+                             WriteMessage      *msg,
+                             GOutputVector     *vectors,
+                             guint              n_vectors,
+                             gboolean           block,
+                             gsize             *bytes_written,
+                             GError           **err)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GSocket *socket;
+    GSocketControlMessage *fd_msg;
+    gboolean ret = TRUE;
+
+    socket = g_socket_connection_get_socket(G_SOCKET_CONNECTION(priv->io_stream));
+    fd_msg = g_unix_fd_message_new();
+    if (!g_unix_fd_message_append_fd(G_UNIX_FD_MESSAGE(fd_msg), msg->fd, err)) {
+        g_object_unref(fd_msg);
+        return TRUE;
+    }
+
+#if GLIB_CHECK_VERSION(2, 60, 0)
+    if (g_socket_send_message_with_timeout(socket, NULL, vectors, n_vectors,
+                                           &fd_msg, 1, G_SOCKET_MSG_NONE,
+                                           block ? -1 : 0, bytes_written,
+                                           priv->cancellable, err) ==
+        G_POLLABLE_RETURN_WOULD_BLOCK) {
+        ret = FALSE;
+    }
+#else
+    {
+        gssize written;
+
+        if (block) {
+            g_socket_condition_wait(socket, G_IO_OUT, priv->cancellable, NULL);
+        }
+        written = g_socket_send_message(socket, NULL, vectors, n_vectors,
+                                        &fd_msg, 1, G_SOCKET_MSG_NONE,
+                                        priv->cancellable, err);
+        if (written > 0) {
+            *bytes_written = written;
+        }
+    }
+#endif
+    g_object_unref(fd_msg);
+
+    if (ret && *err == NULL) {
+        /* the peer got its own copy of the fd */
+        close(msg->fd);
+        msg->fd = -1;
+    }
+    return ret;
+}
+
 /* Performs single write operation,
- * returns TRUE if there's still data to be written, otherwise FALSE. */
+ * returns TRUE if there's still data to be written, otherwise FALSE.
+ *
+ * As many queued messages as fit into write_batch_size are handed
+ * to the stream at once, the first one is always written even if it is
+ * larger than the limit.
+ * A partially written message is always completed first, then the
+ * queues are drained in the order of their priority.
+ * Pending data of the subclass is pulled in as the queues run low. */
 static gboolean do_write(VDAgentConnection *self, gboolean block)
 {
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    VDAgentConnectionClass *klass = VDAGENT_CONNECTION_GET_CLASS(self);
     GOutputStream *out;
-    GBytes *msg;
-    gssize res;
+    GOutputVector vectors[MAX_WRITE_VECTORS];
+    gint msg_prio[MAX_WRITE_VECTORS];
+    guint n_vectors = 0, n_msgs = 0;
+    gsize batch_size = 0;
+    gsize res = 0;
+    WriteMessage *msg, *first;
+    gint prio;
+    guint i;
     GError *err = NULL;
 
-    msg = g_queue_peek_head(priv->write_queue);
     out = g_io_stream_get_output_stream(priv->io_stream);
 
-    if (!msg) {
+    if (klass->fill_write_queue && priv->pending_bytes > 0 &&
+        priv->queued_bytes < priv->write_batch_size) {
+        priv->filling = TRUE;
+        klass->fill_write_queue(self, priv->write_batch_size - priv->queued_bytes);
+        priv->filling = FALSE;
+    }
+
+    if (priv->write_partial != -1) {
+        msg = g_queue_peek_head(priv->write_queue[priv->write_partial]);
+        gather_message(msg, priv->bytes_written, vectors, &n_vectors);
+        msg_prio[n_msgs++] = priv->write_partial;
+        batch_size = msg->size - priv->bytes_written;
+        /* the rest of an open message has to come before anything else */
+        if (msg == priv->write_open) {
+            goto gathered;
+        }
+    }
+
+    for (prio = 0; prio < VDAGENT_CONNECTION_N_PRIORITIES; prio++) {
+        GList *l = priv->write_queue[prio]->head;
+
+        if (prio == priv->write_partial) {
+            l = l->next;
+        }
+        for (; l && n_vectors < MAX_WRITE_VECTORS && n_msgs < MAX_WRITE_VECTORS;
+             l = l->next) {
+            msg = l->data;
+            if (n_msgs > 0 && batch_size + msg->size > priv->write_batch_size) {
+                goto gathered;
+            }
+            /* a message carrying a fd starts a write of its own */
+            if (n_msgs > 0 && msg->fd != -1) {
+                goto gathered;
+            }
+            msg_prio[n_msgs++] = prio;
+            batch_size += msg->size;
+            if (!gather_message(msg, 0, vectors, &n_vectors) ||
+                msg == priv->write_open || msg->fd != -1) {
+                goto gathered;
+            }
+        }
+    }
+gathered:
+
+    if (n_msgs == 0) {
+        return FALSE;
+    }
+
+    /* nothing to write until more of the open message is appended */
+    first = g_queue_peek_head(priv->write_queue[msg_prio[0]]);
+    if (n_vectors == 0 && first == priv->write_open) {
         return FALSE;
     }
 
-    res = g_pollable_stream_write(out,
-        g_bytes_get_data(msg, NULL) + priv->bytes_written,
-        g_bytes_get_size(msg) - priv->bytes_written,
-        block, priv->cancellable, &err);
+    if (n_vectors > 0 && first->fd != -1) {
+        if (!send_with_fd(self, first, vectors, n_vectors, block, &res, &err)) {
+            return TRUE;
+        }
+    } else if (n_vectors > 0) {
+#if GLIB_CHECK_VERSION(2, 60, 0)
+        if (block) {
+            g_output_stream_writev(out, vectors, n_vectors, &res,
+                                   priv->cancellable, &err);
+        } else {
+            GPollableReturn ret;
+
+            ret = g_pollable_output_stream_writev_nonblocking(
+                G_POLLABLE_OUTPUT_STREAM(out), vectors, n_vectors, &res,
+                priv->cancellable, &err);
+            if (ret == G_POLLABLE_RETURN_WOULD_BLOCK) {
+                return TRUE;
+            }
+        }
+#else
+        gssize written;
+
+        written = g_pollable_stream_write(out,
+            vectors[0].buffer, vectors[0].size,
+            block, priv->cancellable, &err);
+        if (written > 0) {
+            res = written;
+        }
+#endif
+    }
 
     if (err) {
         if (g_error_matches (err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
@@ -198,41 +806,331 @@ static gboolean do_write(VDAgentConnection *self, gboolean block)
         }
     }
 
-    priv->bytes_written += res;
+    priv->queued_bytes -= res;
+    VDAGENT_PROBE(connection__write__done, self, res);
 
-    if (priv->bytes_written == g_bytes_get_size(msg)) {
-        g_bytes_unref(g_queue_pop_head(priv->write_queue));
+    /* release the messages that were written completely,
+     * remember how far we got in the last one */
+    for (i = 0; i < n_msgs; i++) {
+        GQueue *queue = priv->write_queue[msg_prio[i]];
+        gsize remaining;
+
+        msg = g_queue_peek_head(queue);
+        remaining = msg->size - priv->bytes_written;
+        if (res < remaining) {
+            if (res > 0) {
+                priv->bytes_written += res;
+                priv->write_partial = msg_prio[i];
+            }
+            break;
+        }
+        res -= remaining;
+        write_message_free(g_queue_pop_head(queue));
         priv->bytes_written = 0;
+        priv->write_partial = -1;
     }
 
-    return !g_queue_is_empty(priv->write_queue);
+    check_watermarks(self);
+
+    return !write_queue_is_empty(priv) || priv->pending_bytes > 0;
 }
 
 static gboolean out_stream_ready_cb(GObject *pollable_stream,
                                     gpointer user_data)
 {
-    return do_write(user_data, FALSE);
+    VDAgentConnection *self = user_data;
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    priv->writing = do_write(self, FALSE);
+    return priv->writing;
+}
+
+static void start_writing(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GPollableOutputStream *out;
+    GSource *source;
+
+    if (priv->writing) {
+        return;
+    }
+
+    out = G_POLLABLE_OUTPUT_STREAM(g_io_stream_get_output_stream(priv->io_stream));
+
+    source = g_pollable_output_stream_create_source(out, priv->cancellable);
+    g_source_set_callback(source, (GSourceFunc) out_stream_ready_cb,
+        g_object_ref(self), g_object_unref);
+    g_source_attach(source, NULL);
+    g_source_unref(source);
+    priv->writing = TRUE;
+}
+
+static WriteMessage *write_message_new(gsize size)
+{
+    WriteMessage *msg;
+
+    msg = g_new0(WriteMessage, 1);
+    msg->parts = g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+    msg->size = size;
+    msg->fd = -1;
+    return msg;
+}
+
+static WriteMessage *queue_message(VDAgentConnection        *self,
+                                   gsize                     size,
+                                   VDAgentConnectionPriority priority)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    WriteMessage *msg = write_message_new(size);
+
+    g_queue_push_tail(priv->write_queue[priority], msg);
+    return msg;
+}
+
+static void append_part(VDAgentConnection *self,
+                        WriteMessage      *msg,
+                        GBytes            *part)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    gsize size = g_bytes_get_size(part);
+
+    g_ptr_array_add(msg->parts, g_bytes_ref(part));
+    msg->filled += size;
+    priv->queued_bytes += size;
+}
+
+void vdagent_connection_write_bytes(VDAgentConnection        *self,
+                                    GBytes                  **parts,
+                                    guint                     n_parts,
+                                    VDAgentConnectionPriority priority)
+{
+    vdagent_connection_write_fd(self, parts, n_parts, -1, priority);
+}
+
+void vdagent_connection_write_fd(VDAgentConnection        *self,
+                                 GBytes                  **parts,
+                                 guint                     n_parts,
+                                 gint                      fd,
+                                 VDAgentConnectionPriority priority)
+{
+    WriteMessage *msg;
+    gsize size = 0;
+    guint i;
+
+    g_return_if_fail(priority < VDAGENT_CONNECTION_N_PRIORITIES);
+
+    for (i = 0; i < n_parts; i++) {
+        if (parts[i]) {
+            size += g_bytes_get_size(parts[i]);
+        }
+    }
+    /* the fd is passed along with the first byte */
+    g_return_if_fail(fd == -1 || size > 0);
+
+    msg = queue_message(self, size, priority);
+    msg->fd = fd;
+    for (i = 0; i < n_parts; i++) {
+        if (parts[i]) {
+            append_part(self, msg, parts[i]);
+        }
+    }
+
+    start_writing(self);
+    check_watermarks(self);
+}
+
+void vdagent_connection_write_start(VDAgentConnection        *self,
+                                    gsize                     size,
+                                    VDAgentConnectionPriority priority)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    g_return_if_fail(priority < VDAGENT_CONNECTION_N_PRIORITIES);
+    g_return_if_fail(priv->write_open == NULL);
+
+    if (size == 0) {
+        vdagent_connection_write_bytes(self, NULL, 0, priority);
+        return;
+    }
+
+    /* queued with its first part, so that it doesn't hold up the messages
+     * written in the meantime while there is nothing of it to write */
+    priv->write_open = write_message_new(size);
+    priv->write_open_priority = priority;
+}
+
+void vdagent_connection_write_append(VDAgentConnection *self,
+                                     GBytes            *data)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    WriteMessage *msg = priv->write_open;
+
+    g_return_if_fail(msg != NULL);
+    g_return_if_fail(msg->filled + g_bytes_get_size(data) <= msg->size);
+
+    if (msg->parts->len == 0) {
+        g_queue_push_tail(priv->write_queue[priv->write_open_priority], msg);
+    }
+    append_part(self, msg, data);
+    if (msg->filled == msg->size) {
+        priv->write_open = NULL;
+    }
+
+    start_writing(self);
+    check_watermarks(self);
+}
+
+void vdagent_connection_write_cancel(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    WriteMessage *msg = priv->write_open;
+    GQueue *queue;
+    GBytes *padding;
+
+    if (msg == NULL) {
+        return;
+    }
+
+    if (msg->parts->len == 0) {
+        priv->write_open = NULL;
+        write_message_free(msg);
+        return;
+    }
+
+    queue = priv->write_queue[priv->write_open_priority];
+    if (priv->write_partial != priv->write_open_priority ||
+        g_queue_peek_head(queue) != msg) {
+        /* nothing of it was written yet */
+        g_queue_remove(queue, msg);
+        priv->queued_bytes -= msg->filled;
+        priv->write_open = NULL;
+        write_message_free(msg);
+        check_watermarks(self);
+        return;
+    }
+
+    padding = g_bytes_new_take(g_malloc0(msg->size - msg->filled),
+                               msg->size - msg->filled);
+    vdagent_connection_write_append(self, padding);
+    g_bytes_unref(padding);
+}
+
+void vdagent_connection_write_with_priority(VDAgentConnection        *self,
+                                            gpointer                  data,
+                                            gsize                     size,
+                                            VDAgentConnectionPriority priority)
+{
+    GBytes *bytes = g_bytes_new_take(data, size);
+
+    vdagent_connection_write_bytes(self, &bytes, 1, priority);
+    g_bytes_unref(bytes);
 }
 
 void vdagent_connection_write(VDAgentConnection *self,
                               gpointer           data,
                               gsize              size)
+{
+    vdagent_connection_write_with_priority(self, data, size,
+                                           VDAGENT_CONNECTION_PRIORITY_DEFAULT);
+}
+
+void vdagent_connection_set_watermarks(VDAgentConnection *self,
+                                       gsize              low_watermark,
+                                       gsize              high_watermark,
+                                       VDAgentConnFlowCb  flow_cb)
 {
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
-    GPollableOutputStream *out;
-    GSource *source;
 
-    g_queue_push_tail(priv->write_queue, g_bytes_new_take(data, size));
+    g_return_if_fail(low_watermark < high_watermark);
 
-    if (g_queue_get_length(priv->write_queue) == 1) {
-        out = G_POLLABLE_OUTPUT_STREAM(g_io_stream_get_output_stream(priv->io_stream));
+    priv->low_watermark = low_watermark;
+    priv->high_watermark = high_watermark;
+    priv->flow_cb = flow_cb;
+    check_watermarks(self);
+}
 
-        source = g_pollable_output_stream_create_source(out, priv->cancellable);
-        g_source_set_callback(source, (GSourceFunc) out_stream_ready_cb,
-            g_object_ref(self), g_object_unref);
-        g_source_attach(source, NULL);
-        g_source_unref(source);
+gboolean vdagent_connection_is_congested(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    return priv->congested;
+}
+
+gsize vdagent_connection_get_queued_bytes(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    return priv->queued_bytes + priv->pending_bytes;
+}
+
+guint vdagent_connection_get_queued_messages(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    guint i, n = 0;
+
+    for (i = 0; i < VDAGENT_CONNECTION_N_PRIORITIES; i++) {
+        n += g_queue_get_length(priv->write_queue[i]);
+    }
+    return n;
+}
+
+static void message_stats_append_sample(GString     *out,
+                                        const gchar *prefix,
+                                        const gchar *labels,
+                                        const gchar *direction,
+                                        guint        type,
+                                        guint64      messages,
+                                        guint64      bytes)
+{
+    const gchar *sep = labels ? "," : "";
+
+    if (messages == 0) {
+        return;
+    }
+    labels = labels ? labels : "";
+    g_string_append_printf(out, "%s_messages_total{%s%sdirection=\"%s\",type=\"%u\"} %"
+                           G_GUINT64_FORMAT "\n",
+                           prefix, labels, sep, direction, type, messages);
+    g_string_append_printf(out, "%s_bytes_total{%s%sdirection=\"%s\",type=\"%u\"} %"
+                           G_GUINT64_FORMAT "\n",
+                           prefix, labels, sep, direction, type, bytes);
+}
+
+void vdagent_message_stats_append(GString                   *out,
+                                  const gchar               *prefix,
+                                  const gchar               *labels,
+                                  const VDAgentMessageStats *stats,
+                                  guint                      n_types)
+{
+    guint i;
+
+    for (i = 0; i < n_types; i++) {
+        message_stats_append_sample(out, prefix, labels, "in", i,
+                                    stats[i].messages_in, stats[i].bytes_in);
+        message_stats_append_sample(out, prefix, labels, "out", i,
+                                    stats[i].messages_out, stats[i].bytes_out);
+    }
+}
+
+void vdagent_connection_add_pending_bytes(VDAgentConnection *self,
+                                          gssize             delta)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    g_return_if_fail(delta >= 0 || priv->pending_bytes >= (gsize)-delta);
+
+    priv->pending_bytes += delta;
+    if (priv->pending_bytes > 0) {
+        start_writing(self);
     }
+    check_watermarks(self);
+}
+
+void vdagent_connection_set_write_batch_size(VDAgentConnection *self,
+                                             gsize              max_bytes)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    g_return_if_fail(max_bytes > 0);
+    priv->write_batch_size = max_bytes;
 }
 
 void vdagent_connection_flush(VDAgentConnection *self)
@@ -240,26 +1138,144 @@ void vdagent_connection_flush(VDAgentConnection *self)
     while (do_write(self, TRUE));
 }
 
-static void message_read_cb(GObject      *source_object,
-                            GAsyncResult *res,
-                            gpointer      user_data)
+static void handle_read_error(VDAgentConnection *self, GError *err)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        g_error_free(err);
+    } else {
+        priv->error_cb(self, err);
+    }
+}
+
+/* Returns a pointer to @data_size bytes of message body at @data,
+ * copied to an aligned scratch buffer if needed. */
+static gpointer get_aligned_body(VDAgentConnectionPrivate *priv,
+                                 guint8                   *data,
+                                 gsize                     data_size)
+{
+    if (((guintptr)data % READ_ALIGNMENT) == 0) {
+        return data;
+    }
+
+    if (priv->align_buf_size < data_size) {
+        g_free(priv->align_buf);
+        priv->align_buf_size = MAX(data_size, 2 * priv->align_buf_size);
+        priv->align_buf = g_malloc(priv->align_buf_size);
+    }
+    memcpy(priv->align_buf, data, data_size);
+    return priv->align_buf;
+}
+
+/* Hand all complete messages in read_buf to the subclass.
+ * Returns FALSE if the connection got cancelled by one of the handlers. */
+static gboolean parse_messages(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    VDAgentConnectionClass *klass = VDAGENT_CONNECTION_GET_CLASS(self);
+
+    while (TRUE) {
+        gsize avail = priv->read_end - priv->read_pos;
+        gpointer data = NULL;
+
+        if (!priv->header_read) {
+            if (avail < priv->header_size) {
+                break;
+            }
+            memcpy(priv->header_buf, priv->read_buf + priv->read_pos,
+                   priv->header_size);
+            priv->read_pos += priv->header_size;
+            priv->consumed_bytes += priv->header_size;
+            avail -= priv->header_size;
+
+            priv->data_size = klass->handle_header(self, priv->header_buf);
+            if (g_cancellable_is_cancelled(priv->cancellable)) {
+                return FALSE;
+            }
+            priv->header_read = TRUE;
+        }
+
+        if (avail < priv->data_size) {
+            break;
+        }
+
+        if (priv->data_size > 0) {
+            data = get_aligned_body(priv, priv->read_buf + priv->read_pos,
+                                    priv->data_size);
+        }
+        priv->read_pos += priv->data_size;
+        priv->consumed_bytes += priv->data_size;
+        priv->header_read = FALSE;
+
+        priv->message_body = data;
+        klass->handle_message(self, priv->header_buf, data);
+        priv->message_body = NULL;
+        /* the fds the message came with are its handler's or nobody's */
+        close_received_fds(priv, priv->consumed_bytes);
+        if (g_cancellable_is_cancelled(priv->cancellable)) {
+            return FALSE;
+        }
+        if (priv->read_paused) {
+            break;
+        }
+    }
+
+    return TRUE;
+}
+
+static void body_read_cb(GObject      *source_object,
+                         GAsyncResult *res,
+                         gpointer      user_data)
 {
     VDAgentConnection *self = user_data;
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
     GInputStream *in = G_INPUT_STREAM(source_object);
     GError *err = NULL;
-    gsize bytes_read, data_size;
+    gsize bytes_read;
 
     g_input_stream_read_all_finish(in, res, &bytes_read, &err);
     if (err) {
-        if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
-            g_error_free(err);
-        } else {
-            priv->error_cb(self, err);
-        }
+        handle_read_error(self, err);
         goto unref;
     }
 
+    if (bytes_read < priv->data_size - priv->data_read) {
+        priv->error_cb(self, NULL);
+        goto unref;
+    }
+    priv->received_bytes += bytes_read;
+    priv->consumed_bytes += priv->data_size;
+
+    priv->header_read = FALSE;
+    priv->message_body = priv->data_buf;
+    VDAGENT_CONNECTION_GET_CLASS(self)->handle_message(
+        self, priv->header_buf, priv->data_buf);
+    priv->message_body = NULL;
+    close_received_fds(priv, priv->consumed_bytes);
+
+    /* unless the handler took it */
+    if (priv->data_buf) {
+        vdagent_connection_buffer_release(self, priv->data_buf, priv->data_size);
+        priv->data_buf = NULL;
+    }
+    read_next_message(self);
+
+unref:
+    g_object_unref(self);
+}
+
+static void block_read_done(VDAgentConnection *self,
+                            gssize             bytes_read,
+                            GError            *err)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    if (err) {
+        handle_read_error(self, err);
+        return;
+    }
+
     if (bytes_read == 0) {
         /* see virtio-port.c for the rationale behind this */
         if (priv->opening) {
@@ -268,52 +1284,201 @@ static void message_read_cb(GObject      *source_object,
         } else {
             priv->error_cb(self, NULL);
         }
-        goto unref;
+        return;
     }
     priv->opening = FALSE;
+    priv->read_end += bytes_read;
+    priv->received_bytes += bytes_read;
 
-    if (!priv->data_buf) {
-        /* we've read the message header, now let's read its body */
-        data_size = VDAGENT_CONNECTION_GET_CLASS(self)->handle_header(
-            self, priv->header_buf);
+    if (parse_messages(self)) {
+        read_next_message(self);
+    }
+}
 
-        if (g_cancellable_is_cancelled(priv->cancellable)) {
-            goto unref;
-        }
+static void block_read_cb(GObject      *source_object,
+                          GAsyncResult *res,
+                          gpointer      user_data)
+{
+    VDAgentConnection *self = user_data;
+    GInputStream *in = G_INPUT_STREAM(source_object);
+    GError *err = NULL;
+    gssize bytes_read;
 
-        if (data_size > 0) {
-            priv->data_buf = g_malloc(data_size);
-            g_input_stream_read_all_async(in,
-                priv->data_buf, data_size,
-                G_PRIORITY_DEFAULT, priv->cancellable,
-                message_read_cb, g_object_ref(self));
-            goto unref;
-        }
+    bytes_read = g_input_stream_read_finish(in, res, &err);
+    block_read_done(self, bytes_read, err);
+    g_object_unref(self);
+}
+
+/* Used instead of block_read_cb() when fds are passed, the ancillary data
+ * would be dropped by a plain read */
+static gboolean socket_readable_cb(GSocket      *socket,
+                                   GIOCondition  condition,
+                                   gpointer      user_data)
+{
+    VDAgentConnection *self = user_data;
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    GInputVector vector;
+    GSocketControlMessage **messages = NULL;
+    gint n_messages = 0, flags = 0, i, j;
+    GError *err = NULL;
+    gssize bytes_read;
+
+    vector.buffer = priv->read_buf + priv->read_end;
+    vector.size = READ_BUF_SIZE - priv->read_end;
+    bytes_read = g_socket_receive_message(socket, NULL, &vector, 1,
+                                          &messages, &n_messages, &flags,
+                                          priv->cancellable, &err);
+    if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+        g_error_free(err);
+        return G_SOURCE_CONTINUE;
     }
 
-    VDAGENT_CONNECTION_GET_CLASS(self)->handle_message(
-        self, priv->header_buf, priv->data_buf);
+    for (i = 0; i < n_messages; i++) {
+        if (G_IS_UNIX_FD_MESSAGE(messages[i])) {
+            gint n_fds, *fds;
 
-    g_clear_pointer(&priv->data_buf, g_free);
-    read_next_message(self);
+            fds = g_unix_fd_message_steal_fds(G_UNIX_FD_MESSAGE(messages[i]),
+                                              &n_fds);
+            for (j = 0; j < n_fds; j++) {
+                ReceivedFd received = {
+                    .fd = fds[j],
+                    .end = priv->received_bytes + MAX(bytes_read, 0),
+                };
+                g_array_append_val(priv->received_fds, received);
+            }
+            g_free(fds);
+        }
+        g_object_unref(messages[i]);
+    }
+    g_free(messages);
 
-unref:
-    g_object_unref(self);
+    /* the kernel dropped fds that did not fit, the stream can't be trusted */
+    if (err == NULL && (flags & MSG_CTRUNC)) {
+        err = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                  "truncated ancillary data");
+    }
+    if (err) {
+        close_received_fds(priv, G_MAXUINT64);
+    }
+
+    block_read_done(self, bytes_read, err);
+    return G_SOURCE_REMOVE;
 }
 
 static void read_next_message(VDAgentConnection *self)
 {
     VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
     GInputStream *in;
+    gsize avail;
 
     if (g_cancellable_is_cancelled(priv->cancellable)) {
         return;
     }
+    if (priv->read_paused) {
+        priv->read_stalled = TRUE;
+        return;
+    }
 
     in = g_io_stream_get_input_stream(priv->io_stream);
+    avail = priv->read_end - priv->read_pos;
+
+    if (priv->header_read && priv->data_size > READ_BUF_SIZE) {
+        /* the body doesn't fit into read_buf, read the rest of it directly */
+        priv->data_buf = vdagent_connection_buffer_get(self, priv->data_size);
+        priv->data_read = avail;
+        memcpy(priv->data_buf, priv->read_buf + priv->read_pos, avail);
+        priv->read_pos = priv->read_end = 0;
+
+        g_input_stream_read_all_async(in,
+            (guint8 *)priv->data_buf + priv->data_read,
+            priv->data_size - priv->data_read,
+            G_PRIORITY_DEFAULT, priv->cancellable,
+            body_read_cb, g_object_ref(self));
+        return;
+    }
 
-    g_input_stream_read_all_async(in,
-        priv->header_buf, priv->header_size,
+    /* move the incomplete message to the start of read_buf */
+    if (priv->read_pos > 0) {
+        memmove(priv->read_buf, priv->read_buf + priv->read_pos, avail);
+        priv->read_pos = 0;
+        priv->read_end = avail;
+    }
+
+    if (priv->fd_passing) {
+        GSocket *socket;
+        GSource *source;
+
+        socket = g_socket_connection_get_socket(G_SOCKET_CONNECTION(priv->io_stream));
+        source = g_socket_create_source(socket, G_IO_IN, priv->cancellable);
+        g_source_set_callback(source, (GSourceFunc) socket_readable_cb,
+            g_object_ref(self), g_object_unref);
+        g_source_attach(source, NULL);
+        g_source_unref(source);
+        return;
+    }
+
+    g_input_stream_read_async(in,
+        priv->read_buf + priv->read_end,
+        READ_BUF_SIZE - priv->read_end,
         G_PRIORITY_DEFAULT, priv->cancellable,
-        message_read_cb, g_object_ref(self));
+        block_read_cb, g_object_ref(self));
+}
+
+void vdagent_connection_set_fd_passing(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    g_return_if_fail(priv->io_stream == NULL);
+    priv->fd_passing = TRUE;
+}
+
+gint vdagent_connection_steal_fd(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    gint fd;
+
+    if (priv->received_fds->len == 0) {
+        return -1;
+    }
+    fd = g_array_index(priv->received_fds, ReceivedFd, 0).fd;
+    g_array_remove_index(priv->received_fds, 0);
+    return fd;
+}
+
+void vdagent_connection_pause_reading(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+    priv->read_paused = TRUE;
+}
+
+static gboolean resume_reading_cb(gpointer user_data)
+{
+    VDAgentConnection *self = user_data;
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    if (priv->read_paused || !priv->read_stalled) {
+        return G_SOURCE_REMOVE;
+    }
+    priv->read_stalled = FALSE;
+
+    if (parse_messages(self)) {
+        read_next_message(self);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+void vdagent_connection_resume_reading(VDAgentConnection *self)
+{
+    VDAgentConnectionPrivate *priv = vdagent_connection_get_instance_private(self);
+
+    if (!priv->read_paused) {
+        return;
+    }
+    priv->read_paused = FALSE;
+
+    /* don't run the message handlers from within the caller */
+    if (priv->read_stalled) {
+        g_idle_add_full(G_PRIORITY_DEFAULT, resume_reading_cb,
+                        g_object_ref(self), g_object_unref);
+    }
 }
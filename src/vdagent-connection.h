@@ -29,7 +29,7 @@ G_BEGIN_DECLS
 G_DECLARE_DERIVABLE_TYPE(VDAgentConnection, vdagent_connection, VDAGENT, CONNECTION, GObject)
 
 /* Subclasses of VDAgentConnection must implement
- * handle_header and handle_message. */
+ * handle_header and handle_message, fill_write_queue is optional. */
 struct _VDAgentConnectionClass {
     GObjectClass parent_class;
 
@@ -44,10 +44,22 @@ struct _VDAgentConnectionClass {
 
     /* Called when a full message has been read.
     *
-    * @header, @data must not be freed. */
+    * Incoming data is read in large blocks and all the complete messages
+    * it contains are handled before returning to the main loop.
+    *
+    * @header, @data must not be freed, @data is only valid
+    * until the handler returns. */
     void (*handle_message) (VDAgentConnection *self,
                             gpointer           header_buf,
                             gpointer           data_buf);
+
+    /* Called before data is written while the subclass has pending
+    * bytes of its own, see vdagent_connection_add_pending_bytes().
+    *
+    * Handler should queue about @max_bytes of it, at least a single
+    * message, using vdagent_connection_write_bytes(). */
+    void (*fill_write_queue) (VDAgentConnection *self,
+                              gsize              max_bytes);
 };
 
 /* Invoked when an error occurs during read or write.
@@ -58,6 +70,21 @@ struct _VDAgentConnectionClass {
  * VDAgentConnection will not continue with the given I/O-op that failed. */
 typedef void (*VDAgentConnErrorCb)(VDAgentConnection *self, GError *err);
 
+/* Queued messages are written in the order of their priority,
+ * a message that was started is always completed first. */
+typedef enum {
+    /* input and control messages */
+    VDAGENT_CONNECTION_PRIORITY_DEFAULT,
+    /* clipboard and file contents */
+    VDAGENT_CONNECTION_PRIORITY_BULK,
+    VDAGENT_CONNECTION_N_PRIORITIES
+} VDAgentConnectionPriority;
+
+/* Invoked with @congested set to TRUE when the amount of queued data
+ * reaches the high watermark and with FALSE once it falls back to
+ * the low watermark, see vdagent_connection_set_watermarks(). */
+typedef void (*VDAgentConnFlowCb)(VDAgentConnection *self, gboolean congested);
+
 /* Open a file in @path for read and write.
  * Returns a new GIOStream to the given file or NULL when @err is set. */
 GIOStream *vdagent_file_open(const gchar *path, GError **err);
@@ -89,9 +116,184 @@ void vdagent_connection_write(VDAgentConnection *self,
                               gpointer           data,
                               gsize              size);
 
+/* Like vdagent_connection_write(), but the message is appended
+ * to the queue of the given @priority. */
+void vdagent_connection_write_with_priority(VDAgentConnection        *self,
+                                            gpointer                  data,
+                                            gsize                     size,
+                                            VDAgentConnectionPriority priority);
+
+/* Append a message made of @n_parts buffers to the queue of @priority.
+ *
+ * The parts are written back to back without being copied,
+ * VDAgentConnection holds a reference to each of them
+ * until the message is flushed. NULL parts are skipped. */
+void vdagent_connection_write_bytes(VDAgentConnection        *self,
+                                    GBytes                  **parts,
+                                    guint                     n_parts,
+                                    VDAgentConnectionPriority priority);
+
+/* Like vdagent_connection_write_bytes(), but the file descriptor @fd
+ * is passed to the peer along with the message (SCM_RIGHTS).
+ *
+ * VDAgentConnection takes ownership of @fd and closes it once sent.
+ * Requires vdagent_connection_set_fd_passing(). */
+void vdagent_connection_write_fd(VDAgentConnection        *self,
+                                 GBytes                  **parts,
+                                 guint                     n_parts,
+                                 gint                      fd,
+                                 VDAgentConnectionPriority priority);
+
+/* Queue a message of @size bytes whose contents are supplied later,
+ * piece by piece, using vdagent_connection_write_append().
+ *
+ * Only one such message can be open at a time. It takes its place in the
+ * queue with the first piece appended. Once it started to be written,
+ * nothing else is written to @self until all of its @size bytes have been
+ * appended. */
+void vdagent_connection_write_start(VDAgentConnection        *self,
+                                    gsize                     size,
+                                    VDAgentConnectionPriority priority);
+
+void vdagent_connection_write_append(VDAgentConnection *self,
+                                     GBytes            *data);
+
+/* Give up on the open message. It is dropped if none of it was written
+ * yet, otherwise the rest is filled with zeroes to keep the stream intact. */
+void vdagent_connection_write_cancel(VDAgentConnection *self);
+
+/* Let @flow_cb know when the number of queued bytes reaches
+ * @high_watermark and when it drops to @low_watermark again,
+ * so producers can pause and resume. */
+void vdagent_connection_set_watermarks(VDAgentConnection *self,
+                                       gsize              low_watermark,
+                                       gsize              high_watermark,
+                                       VDAgentConnFlowCb  flow_cb);
+
+/* Returns TRUE between crossing the high and the low watermark. */
+gboolean vdagent_connection_is_congested(VDAgentConnection *self);
+
+/* Returns the number of bytes waiting in the write queues,
+ * including the pending bytes of the subclass. */
+gsize vdagent_connection_get_queued_bytes(VDAgentConnection *self);
+
+/* Returns the number of messages waiting in the write queues. */
+guint vdagent_connection_get_queued_messages(VDAgentConnection *self);
+
+/* Traffic of a single message type, kept by the subclasses */
+typedef struct VDAgentMessageStats {
+    guint64 messages_in;
+    guint64 bytes_in;
+    guint64 messages_out;
+    guint64 bytes_out;
+} VDAgentMessageStats;
+
+/* Append the non zero entries of @stats, indexed by message type,
+ * to @out in the Prometheus text format, as <prefix>_messages_total and
+ * <prefix>_bytes_total samples. @labels, e.g. session="c2", may be NULL. */
+void vdagent_message_stats_append(GString                   *out,
+                                  const gchar               *prefix,
+                                  const gchar               *labels,
+                                  const VDAgentMessageStats *stats,
+                                  guint                      n_types);
+
+/* For subclasses implementing fill_write_queue: account for @delta bytes
+ * that are waiting to be written but are not queued yet.
+ * The watermarks are checked against the queued and pending bytes. */
+void vdagent_connection_add_pending_bytes(VDAgentConnection *self,
+                                          gssize             delta);
+
+/* Stop handling incoming messages until
+ * vdagent_connection_resume_reading() is called.
+ * Data that was already read is kept buffered. */
+void vdagent_connection_pause_reading(VDAgentConnection *self);
+
+void vdagent_connection_resume_reading(VDAgentConnection *self);
+
+/* Receive file descriptors passed along with the incoming data.
+ *
+ * Must be called before vdagent_connection_setup(),
+ * which then must be given a GUnixConnection. */
+void vdagent_connection_set_fd_passing(VDAgentConnection *self);
+
+/* Returns the oldest file descriptor received and not claimed yet
+ * or -1, the caller becomes its owner. Descriptors are received no later
+ * than the first byte of the message they were sent with, the ones its
+ * handler does not claim are closed once it returns. Truncated ancillary
+ * data is reported to the error callback as G_IO_ERROR_INVALID_DATA. */
+gint vdagent_connection_steal_fd(VDAgentConnection *self);
+
+/* Limit the number of bytes handed to the output stream in a single
+ * write operation. Several queued messages are written at once as long
+ * as their total size does not exceed @max_bytes. */
+void vdagent_connection_set_write_batch_size(VDAgentConnection *self,
+                                             gsize              max_bytes);
+
 /* Synchronously write all queued messages to the output stream. */
 void vdagent_connection_flush(VDAgentConnection *self);
 
+/* Borrow a buffer of at least @size bytes from the pool of @self.
+ *
+ * Small buffers are recycled through per size class free lists,
+ * larger ones come straight from the heap.
+ * The caller owns the buffer until it is handed back using
+ * vdagent_connection_buffer_release() with the same @size,
+ * which must happen before @self is finalized. */
+gpointer vdagent_connection_buffer_get(VDAgentConnection *self,
+                                       gsize              size);
+
+void vdagent_connection_buffer_release(VDAgentConnection *self,
+                                       gpointer           data,
+                                       gsize              size);
+
+/* Turn a buffer obtained from vdagent_connection_buffer_get() into GBytes,
+ * releasing it to the pool. Heap buffers are handed over without a copy,
+ * so the result may outlive @self. */
+GBytes *vdagent_connection_buffer_steal(VDAgentConnection *self,
+                                        gpointer           data,
+                                        gsize              size);
+
+/* Payloads: the message bodies in flight, being reassembled, queued for
+ * writing or copied out of X11, of all the connections of the process.
+ *
+ * Up to the budget they live on the heap. Beyond it, payloads of 64 KiB
+ * or more go to a memfd (an unlinked temporary file in $TMPDIR where there
+ * is no memfd_create()) that is mapped in instead, so that the kernel can
+ * swap them out rather than the process heap growing without bounds. Up to
+ * 1 GiB is spilled this way, further payloads go to the heap again. */
+
+/* Set the budget in bytes, 0 means no limit. The default is 128 MiB. */
+void vdagent_payload_set_budget(gsize budget);
+
+/* Never returns NULL, like g_malloc() */
+gpointer vdagent_payload_alloc(gsize size);
+
+void vdagent_payload_free(gpointer data, gsize size);
+
+/* Resize a payload of @old_size bytes, its content is kept */
+gpointer vdagent_payload_realloc(gpointer data, gsize old_size, gsize new_size);
+
+/* Turn the first @len bytes of a payload of @size bytes into GBytes,
+ * the payload is freed with the last reference. */
+GBytes *vdagent_payload_steal(gpointer data, gsize size, gsize len);
+
+typedef struct VDAgentPayloadStats {
+    gsize budget;
+    gsize heap_bytes;
+    gsize heap_high_water;
+    gsize spilled_bytes;
+    gsize spilled_high_water;
+    guint64 spills;
+} VDAgentPayloadStats;
+
+void vdagent_payload_get_stats(VDAgentPayloadStats *stats);
+
+/* Take the body of the message currently handed to handle_message, so
+ * it can be kept around after the handler returns. Bodies too large for
+ * the read buffer are handed over without a copy.
+ * Must only be called from handle_message, at most once per message. */
+GBytes *vdagent_connection_steal_message_data(VDAgentConnection *self);
+
 typedef struct PidUid {
     pid_t pid;
     uid_t uid;
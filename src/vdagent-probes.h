@@ -0,0 +1,63 @@
+/*  vdagent-probes.h USDT probes along the message pipeline
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDAGENT_PROBES_H
+#define __VDAGENT_PROBES_H
+
+/* Statically defined tracepoints in the spice_vdagent provider, built in
+ * with ./configure --enable-usdt and otherwise compiled out. Disabled
+ * probes cost a nop.
+ *
+ * spice-vdagentd:
+ *   virtio__chunk(port, size)                  chunk read from the port
+ *   virtio__message(id, port, type, size)      client message dispatched
+ *   mouse__inject(id, x, y, buttons)           mouse state sent to uinput
+ * both:
+ *   udscs__write(conn, type, arg1, size)       message queued
+ *   udscs__read(conn, type, arg1, size)        message dispatched
+ *   connection__write__done(conn, bytes)       bytes written to the socket
+ * spice-vdagentd:
+ *   agent__message(conn, type, arg1, size)     agent message handled
+ * spice-vdagent:
+ *   x11__selection__notify(selection, type, size)  clipboard data from X
+ *
+ * id numbers the client messages read by the daemon and mouse__inject
+ * reports the id of the last state it covers, coalesced motion is skipped.
+ * The udscs protocol has no room for an id and messages can be reordered by
+ * their priority, but there is only one clipboard request per selection in
+ * flight, so arg1, the selection, ties a paste to the X reply. With
+ * VDAGENTD_CLIPBOARD_REQUEST being 3 and VD_AGENT_MOUSE_STATE 1:
+ *
+ *   usdt:/usr/sbin/spice-vdagentd:spice_vdagent:udscs__write /arg1 == 3/
+ *     { @req[arg2] = nsecs; }
+ *   usdt:/usr/bin/spice-vdagent:spice_vdagent:x11__selection__notify
+ *     /@req[arg0]/ { @paste = hist(nsecs - @req[arg0]); delete(@req[arg0]); }
+ *
+ *   usdt:/usr/sbin/spice-vdagentd:spice_vdagent:virtio__message /arg2 == 1/
+ *     { @mouse[arg0] = nsecs; }
+ *   usdt:/usr/sbin/spice-vdagentd:spice_vdagent:mouse__inject /@mouse[arg0]/
+ *     { @lat = hist(nsecs - @mouse[arg0]); clear(@mouse); }
+ */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+#define VDAGENT_PROBE(...) STAP_PROBEV(spice_vdagent, __VA_ARGS__)
+#else
+#define VDAGENT_PROBE(...) do { } while (0)
+#endif
+
+#endif
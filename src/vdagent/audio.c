@@ -28,28 +28,77 @@
 #define ALSA_MUTE   0
 #define ALSA_UNMUTE 1
 
-static snd_mixer_elem_t *
-get_alsa_default_mixer_by_name(snd_mixer_t **handle, const char *name)
+typedef struct AudioVolume {
+    uint8_t mute;
+    uint8_t nchannels;
+    uint16_t *volume;
+} AudioVolume;
+
+/* Mixer of the default device, kept open between volume changes */
+static snd_mixer_t *mixer_handle;
+
+/* Latest volume of each direction that is not applied yet */
+static AudioVolume *pending_playback;
+static AudioVolume *pending_record;
+static guint pending_source_id;
+
+static void close_alsa_default_mixer(void)
 {
-    snd_mixer_selem_id_t *sid;
-    int err = 0;
+    if (mixer_handle != NULL) {
+        snd_mixer_close(mixer_handle);
+        mixer_handle = NULL;
+    }
+}
+
+static int open_alsa_default_mixer(void)
+{
+    int err;
+
+    if ((err = snd_mixer_open(&mixer_handle, 0)) < 0)
+        goto fail;
 
-    if ((err = snd_mixer_open(handle, 0)) < 0)
+    if ((err = snd_mixer_attach(mixer_handle, "default")) < 0)
         goto fail;
 
-    if ((err = snd_mixer_attach(*handle, "default")) < 0)
+    if ((err = snd_mixer_selem_register(mixer_handle, NULL, NULL)) < 0)
         goto fail;
 
-    if ((err = snd_mixer_selem_register(*handle, NULL, NULL)) < 0)
+    if ((err = snd_mixer_load(mixer_handle)) < 0)
         goto fail;
 
-    if ((err = snd_mixer_load(*handle)) < 0)
+    return 0;
+
+fail:
+    close_alsa_default_mixer();
+    return err;
+}
+
+static snd_mixer_elem_t *
+get_alsa_default_mixer_by_name(const char *name)
+{
+    snd_mixer_selem_id_t *sid;
+    snd_mixer_elem_t *e;
+    int err = 0;
+
+    if (mixer_handle != NULL) {
+        /* pick up the elements added or removed since the last change,
+           an error means the device went away */
+        if ((err = snd_mixer_handle_events(mixer_handle)) < 0) {
+            syslog(LOG_DEBUG, "%s: reopening mixer: %s", __func__, snd_strerror(err));
+            close_alsa_default_mixer();
+        }
+    }
+
+    if (mixer_handle == NULL && (err = open_alsa_default_mixer()) < 0)
         goto fail;
 
     snd_mixer_selem_id_alloca(&sid);
     snd_mixer_selem_id_set_index(sid, 0);
     snd_mixer_selem_id_set_name(sid, name);
-    return snd_mixer_find_selem(*handle, sid);
+    /* a device without this control is not an error, the mixer stays
+       open, a change of the default device shows up as one above */
+    e = snd_mixer_find_selem(mixer_handle, sid);
+    return e;
 
 fail:
     syslog(LOG_WARNING, "%s fail: %s", __func__, snd_strerror(err));
@@ -58,13 +107,12 @@ fail:
 
 static bool set_alsa_capture(uint8_t mute, uint8_t nchannels, uint16_t *volume)
 {
-    snd_mixer_t *handle = NULL;
     snd_mixer_elem_t *e;
     long vol;
     bool ret = true;
     int alsa_mute;
 
-    e = get_alsa_default_mixer_by_name (&handle, "Capture");
+    e = get_alsa_default_mixer_by_name("Capture");
     if (e == NULL) {
         syslog(LOG_WARNING, "vdagent-audio: can't get default alsa mixer");
         ret = false;
@@ -97,20 +145,17 @@ static bool set_alsa_capture(uint8_t mute, uint8_t nchannels, uint16_t *volume)
         ret = false;
     }
 end:
-    if (handle != NULL)
-        snd_mixer_close(handle);
     return ret;
 }
 
 static bool set_alsa_playback (uint8_t mute, uint8_t nchannels, uint16_t *volume)
 {
-    snd_mixer_t *handle = NULL;
     snd_mixer_elem_t* e;
     long vol;
     bool ret = true;
     int alsa_mute;
 
-    e = get_alsa_default_mixer_by_name (&handle, "Master");
+    e = get_alsa_default_mixer_by_name("Master");
     if (e == NULL) {
         syslog(LOG_WARNING, "vdagent-audio: can't get default alsa mixer");
         ret = false;
@@ -143,23 +188,78 @@ static bool set_alsa_playback (uint8_t mute, uint8_t nchannels, uint16_t *volume
         ret = false;
     }
 end:
-    if (handle != NULL)
-        snd_mixer_close(handle);
     return ret;
 }
 
+static void audio_volume_free(AudioVolume *vol)
+{
+    g_free(vol->volume);
+    g_free(vol);
+}
+
+static gboolean apply_pending_volumes_cb(gpointer user_data)
+{
+    AudioVolume *vol;
+
+    pending_source_id = 0;
+
+    if ((vol = pending_playback) != NULL) {
+        pending_playback = NULL;
+        syslog(LOG_DEBUG, "%s playback mute=%s nchannels=%u",
+               __func__, (vol->mute) ? "yes" : "no", vol->nchannels);
+        if (set_alsa_playback (vol->mute, vol->nchannels, vol->volume) == false)
+            syslog(LOG_WARNING, "Fail to sync playback volume");
+        audio_volume_free(vol);
+    }
+
+    if ((vol = pending_record) != NULL) {
+        pending_record = NULL;
+        syslog(LOG_DEBUG, "%s record mute=%s nchannels=%u",
+               __func__, (vol->mute) ? "yes" : "no", vol->nchannels);
+        if (set_alsa_capture (vol->mute, vol->nchannels, vol->volume) == false)
+            syslog(LOG_WARNING, "Fail to sync record volume");
+        audio_volume_free(vol);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Dragging the volume slider in the client sends a burst of changes, they
+   are applied from an idle callback so only the latest one of each direction
+   reaches the mixer. */
+static void queue_volume(AudioVolume **pending, uint8_t mute, uint8_t nchannels,
+                         uint16_t *volume)
+{
+    AudioVolume *vol = g_new(AudioVolume, 1);
+
+    vol->mute = mute;
+    vol->nchannels = nchannels;
+    vol->volume = g_memdup2(volume, sizeof(uint16_t) * nchannels);
+
+    g_clear_pointer(pending, audio_volume_free);
+    *pending = vol;
+
+    if (pending_source_id == 0)
+        pending_source_id = g_idle_add(apply_pending_volumes_cb, NULL);
+}
+
 void vdagent_audio_playback_sync(uint8_t mute, uint8_t nchannels, uint16_t *volume)
 {
-    syslog(LOG_DEBUG, "%s mute=%s nchannels=%u",
-           __func__, (mute) ? "yes" : "no", nchannels);
-    if (set_alsa_playback (mute, nchannels, volume) == false)
-        syslog(LOG_WARNING, "Fail to sync playback volume");
+    queue_volume(&pending_playback, mute, nchannels, volume);
 }
 
 void vdagent_audio_record_sync(uint8_t mute, uint8_t nchannels, uint16_t *volume)
 {
-    syslog(LOG_DEBUG, "%s mute=%s nchannels=%u",
-           __func__, (mute) ? "yes" : "no", nchannels);
-    if (set_alsa_capture (mute, nchannels, volume) == false)
-        syslog(LOG_WARNING, "Fail to sync record volume");
+    queue_volume(&pending_record, mute, nchannels, volume);
+}
+
+void vdagent_audio_cleanup(void)
+{
+    if (pending_source_id != 0) {
+        g_source_remove(pending_source_id);
+        pending_source_id = 0;
+    }
+    g_clear_pointer(&pending_playback, audio_volume_free);
+    g_clear_pointer(&pending_record, audio_volume_free);
+    close_alsa_default_mixer();
 }
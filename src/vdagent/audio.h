@@ -23,5 +23,7 @@
 
 void vdagent_audio_playback_sync(uint8_t mute, uint8_t nchannels, uint16_t *volume);
 void vdagent_audio_record_sync(uint8_t mute, uint8_t nchannels, uint16_t *volume);
+/* Drop the volume changes not applied yet and close the mixer */
+void vdagent_audio_cleanup(void);
 
 #endif
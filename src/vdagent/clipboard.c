@@ -32,6 +32,9 @@
 #define SELECTION_COUNT (VD_AGENT_CLIPBOARD_SELECTION_PRIMARY + 1)
 #define TYPE_COUNT      (VD_AGENT_CLIPBOARD_IMAGE_JPG + 1)
 
+/* memory budget for guest data kept for repeated client requests */
+#define CACHE_MAX_SIZE  (32 * 1024 * 1024)
+
 static const GdkAtom sel_atom[] = {
     [VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD] = GDK_SELECTION_CLIPBOARD,
     [VD_AGENT_CLIPBOARD_SELECTION_PRIMARY] = GDK_SELECTION_PRIMARY,
@@ -62,6 +65,7 @@ enum {
 typedef struct {
     GMainLoop        *loop;
     GtkSelectionData *sel_data;
+    guint             type;
 } AppRequest;
 
 typedef struct {
@@ -73,6 +77,8 @@ typedef struct {
     gpointer     *last_targets_req;
 
     GdkAtom       targets[TYPE_COUNT];
+    /* data of the current owner, guest or client, dropped on owner change */
+    GBytes       *cache[TYPE_COUNT];
 } Selection;
 #endif
 
@@ -83,6 +89,7 @@ struct _VDAgentClipboards {
     UdscsConnection *conn;
 
     Selection selections[SELECTION_COUNT];
+    gsize     cache_size;
 #else
     struct vdagent_x11 *x11;
 #endif
@@ -161,6 +168,47 @@ static gboolean request_ref_is_cancelled(gpointer *ref)
     return *ref == NULL;
 }
 
+static void clipboard_cache_clear(VDAgentClipboards *c, guint sel_id)
+{
+    Selection *sel = &c->selections[sel_id];
+    guint type;
+
+    for (type = 0; type < TYPE_COUNT; type++) {
+        if (sel->cache[type] == NULL)
+            continue;
+        c->cache_size -= g_bytes_get_size(sel->cache[type]);
+        g_clear_pointer(&sel->cache[type], g_bytes_unref);
+    }
+}
+
+static void clipboard_cache_add(VDAgentClipboards *c, guint sel_id,
+                                guint type, GBytes *data)
+{
+    Selection *sel = &c->selections[sel_id];
+    gsize size = g_bytes_get_size(data);
+    guint i;
+
+    if (size > CACHE_MAX_SIZE)
+        return;
+
+    /* make room, dropping the data of the other selection first */
+    for (i = 0; i < SELECTION_COUNT; i++) {
+        if (c->cache_size + size <= CACHE_MAX_SIZE)
+            break;
+        if (i != sel_id)
+            clipboard_cache_clear(c, i);
+    }
+    if (c->cache_size + size > CACHE_MAX_SIZE)
+        clipboard_cache_clear(c, sel_id);
+
+    if (sel->cache[type] != NULL) {
+        c->cache_size -= g_bytes_get_size(sel->cache[type]);
+        g_bytes_unref(sel->cache[type]);
+    }
+    sel->cache[type] = g_bytes_ref(data);
+    c->cache_size += size;
+}
+
 static void clipboard_new_owner(VDAgentClipboards *c, guint sel_id, guint new_owner)
 {
     Selection *sel = &c->selections[sel_id];
@@ -181,6 +229,7 @@ static void clipboard_new_owner(VDAgentClipboards *c, guint sel_id, guint new_ow
     }
     g_clear_pointer(&sel->requests_from_client, g_list_free);
 
+    clipboard_cache_clear(c, sel_id);
     sel->owner = new_owner;
 }
 
@@ -250,6 +299,9 @@ static void clipboard_owner_change_cb(GtkClipboard        *clipboard,
         return;
     }
 
+    /* the data of the previous owner is stale now */
+    clipboard_cache_clear(c, sel_id);
+
     /* if there's a pending request for clipboard targets, cancel it */
     if (sel->last_targets_req)
         request_ref_cancel(sel->last_targets_req);
@@ -277,9 +329,14 @@ static void clipboard_contents_received_cb(GtkClipboard     *clipboard,
     target = get_type_from_atom(gtk_selection_data_get_target(sel_data));
 
     if (type == target) {
-        udscs_write(c->conn, VDAGENTD_CLIPBOARD_DATA, sel_id, type,
-                    gtk_selection_data_get_data(sel_data),
-                    gtk_selection_data_get_length(sel_data));
+        const guchar *data = gtk_selection_data_get_data(sel_data);
+        gint len = gtk_selection_data_get_length(sel_data);
+        GBytes *bytes = g_bytes_new(data, MAX(len, 0));
+
+        udscs_write_bytes(c->conn, VDAGENTD_CLIPBOARD_DATA, sel_id, type, bytes);
+        if (len > 0)
+            clipboard_cache_add(c, sel_id, type, bytes);
+        g_bytes_unref(bytes);
     } else {
         syslog(LOG_WARNING, "%s: sel_id=%u: expected type %u, received %u, "
                             "skipping", __func__, sel_id, target, type);
@@ -288,6 +345,18 @@ static void clipboard_contents_received_cb(GtkClipboard     *clipboard,
     }
 }
 
+static void selection_data_set_bytes(GtkSelectionData *sel_data, GBytes *data)
+{
+    gtk_selection_data_set(sel_data,
+                           gtk_selection_data_get_target(sel_data),
+                           8, g_bytes_get_data(data, NULL),
+                           g_bytes_get_size(data));
+}
+
+/* GTK wants the data before this returns, so we have to wait for the client
+   in a nested main loop. Apps asking for a type which has already been
+   requested wait for the same reply rather than for one of their own, and
+   the reply is kept, so later requests for that type do not wait at all. */
 static void clipboard_get_cb(GtkClipboard     *clipboard,
                              GtkSelectionData *sel_data,
                              guint             info,
@@ -295,20 +364,34 @@ static void clipboard_get_cb(GtkClipboard     *clipboard,
 {
     AppRequest req;
     VDAgentClipboards *c = user_data;
+    Selection *sel;
     guint sel_id, type;
+    GList *l;
 
     sel_id = sel_id_from_clip(clipboard);
-    g_return_if_fail(c->selections[sel_id].owner == OWNER_CLIENT);
+    sel = &c->selections[sel_id];
+    g_return_if_fail(sel->owner == OWNER_CLIENT);
 
     type = get_type_from_atom(gtk_selection_data_get_target(sel_data));
     g_return_if_fail(type != VD_AGENT_CLIPBOARD_NONE);
 
+    if (sel->cache[type] != NULL) {
+        selection_data_set_bytes(sel_data, sel->cache[type]);
+        return;
+    }
+
+    for (l = sel->requests_from_apps; l != NULL; l = l->next) {
+        AppRequest *pending = l->data;
+        if (pending->type == type)
+            break;
+    }
+    if (l == NULL)
+        udscs_write(c->conn, VDAGENTD_CLIPBOARD_REQUEST, sel_id, type, NULL, 0);
+
     req.sel_data = sel_data;
+    req.type = type;
     req.loop = g_main_loop_new(NULL, FALSE);
-    c->selections[sel_id].requests_from_apps =
-        g_list_prepend(c->selections[sel_id].requests_from_apps, &req);
-
-    udscs_write(c->conn, VDAGENTD_CLIPBOARD_REQUEST, sel_id, type, NULL, 0);
+    sel->requests_from_apps = g_list_prepend(sel->requests_from_apps, &req);
 
 G_GNUC_BEGIN_IGNORE_DEPRECATIONS
     gdk_threads_leave();
@@ -371,33 +454,38 @@ void vdagent_clipboard_grab(VDAgentClipboards *c, guint sel_id,
 }
 
 void vdagent_clipboard_data(VDAgentClipboards *c, guint sel_id,
-                            guint type, guchar *data, guint size)
+                            guint type, GBytes *data)
 {
 #ifndef USE_GTK_FOR_CLIPBOARD
-    vdagent_x11_clipboard_data(c->x11, sel_id, type, data, size);
+    vdagent_x11_clipboard_data(c->x11, sel_id, type, data);
 #else
     g_return_if_fail(sel_id < SELECTION_COUNT);
     Selection *sel = &c->selections[sel_id];
-    AppRequest *req;
-    GList *l;
+    gboolean found = FALSE;
+    GList *l, *next;
 
-    for (l = sel->requests_from_apps; l != NULL; l = l->next) {
-        req = l->data;
-        if (get_type_from_atom(gtk_selection_data_get_target(req->sel_data)) == type)
-            break;
+    /* answer every app waiting for this type */
+    for (l = sel->requests_from_apps; l != NULL; l = next) {
+        AppRequest *req = l->data;
+
+        next = l->next;
+        if (req->type != type)
+            continue;
+
+        sel->requests_from_apps = g_list_delete_link(sel->requests_from_apps, l);
+        selection_data_set_bytes(req->sel_data, data);
+        g_main_loop_quit(req->loop);
+        found = TRUE;
     }
-    if (l == NULL) {
+    if (!found) {
         syslog(LOG_WARNING, "%s: sel_id=%u: no corresponding request found for "
                             "type=%u, skipping", __func__, sel_id, type);
         return;
     }
-    sel->requests_from_apps = g_list_delete_link(sel->requests_from_apps, l);
 
-    gtk_selection_data_set(req->sel_data,
-                           gtk_selection_data_get_target(req->sel_data),
-                           8, data, size);
-
-    g_main_loop_quit(req->loop);
+    if (sel->owner == OWNER_CLIENT && type < TYPE_COUNT &&
+            g_bytes_get_size(data) > 0)
+        clipboard_cache_add(c, sel_id, type, data);
 #endif
 }
 
@@ -433,6 +521,10 @@ void vdagent_clipboards_release_all(VDAgentClipboards *c)
 #endif
 }
 
+/* Only types offered by the guest owner are ever requested from it, so any
+   image re-encoding happens in the owner app, not in the agent. Both backends
+   answer repeated requests from their cache, so that is done once per grab
+   and type. */
 void vdagent_clipboard_request(VDAgentClipboards *c, guint sel_id, guint type)
 {
 #ifndef USE_GTK_FOR_CLIPBOARD
@@ -454,6 +546,12 @@ void vdagent_clipboard_request(VDAgentClipboards *c, guint sel_id, guint type)
         goto err;
     }
 
+    if (sel->cache[type] != NULL) {
+        udscs_write_bytes(c->conn, VDAGENTD_CLIPBOARD_DATA, sel_id, type,
+                          sel->cache[type]);
+        return;
+    }
+
     gpointer *ref = request_ref_new(c);
     sel->requests_from_client = g_list_prepend(sel->requests_from_client, ref);
     gtk_clipboard_request_contents(sel->clipboard, sel->targets[type],
@@ -510,6 +608,9 @@ static void vdagent_clipboards_dispose(GObject *obj)
 
     if (self->conn)
         vdagent_clipboards_release_all(self);
+
+    for (sel_id = 0; sel_id < SELECTION_COUNT; sel_id++)
+        clipboard_cache_clear(self, sel_id);
 #endif
 }
 
@@ -38,7 +38,7 @@ void vdagent_clipboard_release(VDAgentClipboards *c, guint sel_id);
 void vdagent_clipboards_release_all(VDAgentClipboards *c);
 
 void vdagent_clipboard_data(VDAgentClipboards *c, guint sel_id,
-                            guint type, guchar *data, guint size);
+                            guint type, GBytes *data);
 
 void vdagent_clipboard_grab(VDAgentClipboards *c, guint sel_id,
                             guint32 *types, guint n_types);
@@ -33,6 +33,7 @@
 #include <unistd.h>
 #include <X11/extensions/Xrandr.h>
 #include <glib.h>
+#include <gio/gio.h>
 
 #include "device-info.h"
 
@@ -324,15 +325,104 @@ static bool read_hex_value_from_file(const char *path, int* value)
     return result;
 }
 
-// returns a path to a drm device found at the given PCI Address. Returned
-// string must be freed by caller.
-static char* find_device_at_pci_address(PciAddress *pci_addr, int *vendor_id, int *device_id)
+typedef struct DrmConnector {
+    uint32_t type;
+    uint32_t type_id;
+    bool valid;
+} DrmConnector;
+
+// What is needed from a DRM card to name its connectors
+typedef struct DrmCard {
+    char *dev_path;
+    PciAddress *pci_addr;
+    int vendor_id;
+    int device_id;
+    bool opened;
+    bool has_resources;
+    GArray *connectors; /* DrmConnector */
+} DrmCard;
+
+// Index of the DRM cards, built on first use and dropped when a card node
+// appears or goes away in /dev/dri
+static GPtrArray *drm_cards;
+static GFileMonitor *drm_dir_monitor;
+
+static void drm_card_free(DrmCard *card)
 {
-    g_return_val_if_fail(pci_addr != NULL, NULL);
-    g_return_val_if_fail(device_id != NULL, NULL);
-    g_return_val_if_fail(vendor_id != NULL, NULL);
-    // Look for a device that matches the PCI address parsed above. Loop
-    // through the list of cards reported by the DRM subsystem
+    g_free(card->dev_path);
+    pci_address_free(card->pci_addr);
+    if (card->connectors) {
+        g_array_unref(card->connectors);
+    }
+    g_free(card);
+}
+
+static void drm_dir_changed_cb(GFileMonitor *monitor, GFile *file, GFile *other_file,
+                               GFileMonitorEvent event_type, gpointer user_data)
+{
+    gchar *name;
+    bool is_card;
+
+    // opening the cards to index them makes events of its own, and render
+    // nodes and the like don't matter here
+    if (event_type != G_FILE_MONITOR_EVENT_CREATED &&
+        event_type != G_FILE_MONITOR_EVENT_DELETED &&
+        event_type != G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED) {
+        return;
+    }
+    name = g_file_get_basename(file);
+    is_card = g_str_has_prefix(name, "card");
+    g_free(name);
+    if (!is_card) {
+        return;
+    }
+
+    if (drm_cards) {
+        syslog(LOG_DEBUG, "DRM devices changed, dropping the card index");
+        g_clear_pointer(&drm_cards, g_ptr_array_unref);
+    }
+}
+
+static void drm_card_read_connectors(DrmCard *card)
+{
+    int drm_fd = open(card->dev_path, O_RDWR);
+    if (drm_fd < 0) {
+        syslog(LOG_WARNING, "Unable to open file %s", card->dev_path);
+        return;
+    }
+    card->opened = true;
+
+    drmModeResPtr res = drmModeGetResources(drm_fd);
+    if (res == NULL) {
+        syslog(LOG_WARNING, "Unable to get DRM resources for card %s.", card->dev_path);
+        close(drm_fd);
+        return;
+    }
+    card->has_resources = true;
+
+    card->connectors = g_array_sized_new(FALSE, TRUE, sizeof(DrmConnector),
+                                         res->count_connectors);
+    for (int i = 0; i < res->count_connectors; i++) {
+        DrmConnector connector = { 0, };
+        drmModeConnectorPtr conn = drmModeGetConnector(drm_fd, res->connectors[i]);
+
+        if (conn != NULL) {
+            connector.type = conn->connector_type;
+            connector.type_id = conn->connector_type_id;
+            connector.valid = true;
+            drmModeFreeConnector(conn);
+        }
+        g_array_append_val(card->connectors, connector);
+    }
+    drmModeFreeResources(res);
+    close(drm_fd);
+}
+
+static GPtrArray *build_drm_card_index(void)
+{
+    GPtrArray *cards = g_ptr_array_new_with_free_func((GDestroyNotify)drm_card_free);
+
+    // Loop through the list of cards reported by the DRM subsystem
     for (int i = 0; i < 10; ++i) {
         char dev_path[64];
         struct stat buf;
@@ -366,28 +456,69 @@ static char* find_device_at_pci_address(PciAddress *pci_addr, int *vendor_id, in
             continue;
         }
 
-        if (!compare_addresses(pci_addr, drm_pci_addr)) {
-            pci_address_free(drm_pci_addr);
-            continue;
-        }
-        pci_address_free(drm_pci_addr);
+        DrmCard *card = g_new0(DrmCard, 1);
+        card->dev_path = g_strdup(dev_path);
+        card->pci_addr = drm_pci_addr;
+
         char id_path[150];
         snprintf(id_path, sizeof(id_path), "%s/device/vendor", sys_path);
-        if (!read_hex_value_from_file(id_path, vendor_id)) {
+        if (!read_hex_value_from_file(id_path, &card->vendor_id)) {
             syslog(LOG_WARNING, "Unable to read vendor ID of card: %s", strerror(errno));
         }
         snprintf(id_path, sizeof(id_path), "%s/device/device", sys_path);
-        if (!read_hex_value_from_file(id_path, device_id)) {
+        if (!read_hex_value_from_file(id_path, &card->device_id)) {
             syslog(LOG_WARNING, "Unable to read device ID of card: %s", strerror(errno));
         }
 
         syslog(LOG_DEBUG, "Found card '%s' with Vendor ID %#x, Device ID %#x",
-               device_link, *device_id, *vendor_id);
-        return g_strdup(dev_path);
+               device_link, card->vendor_id, card->device_id);
+
+        drm_card_read_connectors(card);
+        g_ptr_array_add(cards, card);
+    }
+    return cards;
+}
+
+// returns the drm card found at the given PCI Address, or NULL
+static DrmCard *find_card_at_pci_address(PciAddress *pci_addr)
+{
+    g_return_val_if_fail(pci_addr != NULL, NULL);
+
+    if (drm_dir_monitor == NULL) {
+        GFile *dir = g_file_new_for_path(DRM_DIR_NAME);
+        drm_dir_monitor = g_file_monitor_directory(dir, G_FILE_MONITOR_NONE, NULL, NULL);
+        g_object_unref(dir);
+        if (drm_dir_monitor) {
+            g_signal_connect(drm_dir_monitor, "changed",
+                             G_CALLBACK(drm_dir_changed_cb), NULL);
+        }
+    }
+    // without a monitor there is no way to know when the index gets stale
+    if (drm_cards == NULL || drm_dir_monitor == NULL) {
+        g_clear_pointer(&drm_cards, g_ptr_array_unref);
+        drm_cards = build_drm_card_index();
+    }
+
+    for (guint i = 0; i < drm_cards->len; i++) {
+        DrmCard *card = g_ptr_array_index(drm_cards, i);
+        if (compare_addresses(pci_addr, card->pci_addr)) {
+            return card;
+        }
     }
     return NULL;
 }
 
+void device_info_cleanup(void)
+{
+    if (drm_dir_monitor) {
+        g_signal_handlers_disconnect_by_func(drm_dir_monitor,
+                                             G_CALLBACK(drm_dir_changed_cb), NULL);
+        g_file_monitor_cancel(drm_dir_monitor);
+    }
+    g_clear_object(&drm_dir_monitor);
+    g_clear_pointer(&drm_cards, g_ptr_array_unref);
+}
+
 
 /**
  * Look up DRM info for the device, and retrieve the expected connector name.
@@ -406,55 +537,50 @@ int get_connector_name_for_device_info(VDAgentDeviceDisplayInfo *device_info,
         return -1;
     }
 
-    int vendor_id = 0;
-    int device_id = 0;
-    char *dev_path = find_device_at_pci_address(user_pci_addr, &vendor_id, &device_id);
+    DrmCard *card = find_card_at_pci_address(user_pci_addr);
     pci_address_free(user_pci_addr);
 
-    int drm_fd = open(dev_path, O_RDWR);
-    if (drm_fd < 0) {
-        syslog(LOG_WARNING, "Unable to open file %s", dev_path);
-        g_free(dev_path);
+    if (card == NULL) {
+        syslog(LOG_WARNING, "Unable to find a DRM card at %s", device_info->device_address);
         return -1;
     }
-
-    drmModeResPtr res = drmModeGetResources(drm_fd);
-    if (res == NULL) {
+    if (!card->opened) {
+        syslog(LOG_WARNING, "DRM card %s at %s could not be opened",
+               card->dev_path, device_info->device_address);
+        return -1;
+    }
+    if (!card->has_resources) {
         syslog(LOG_WARNING,
-               "Unable to get DRM resources for card %s. "
+               "No DRM resources for card %s. "
                "Falling back to using xrandr output index.",
-               dev_path);
-        close(drm_fd);
-        g_free(dev_path);
+               card->dev_path);
         return 1;   // error out - actual handling is deferred to the caller
     }
 
-    // no need for dev_path anymore
-    g_free(dev_path);
-
     // find the drm output that is equal to device_display_id
-    if (device_info->device_display_id >= res->count_connectors) {
+    if (device_info->device_display_id >= card->connectors->len) {
         syslog(LOG_WARNING,
                "Specified display id %i is higher than the maximum display id "
                "provided by this device (%i)",
-               device_info->device_display_id, res->count_connectors - 1);
-        close(drm_fd);
+               device_info->device_display_id, (int)card->connectors->len - 1);
         return -1;
     }
 
-    drmModeConnectorPtr conn =
-        drmModeGetConnector(drm_fd, res->connectors[device_info->device_display_id]);
-    drmModeFreeResources(res);
-    res = NULL;
-    close(drm_fd);
-
-    if (conn == NULL) {
+    DrmConnector *connector = &g_array_index(card->connectors, DrmConnector,
+                                             device_info->device_display_id);
+    if (!connector->valid) {
         syslog(LOG_WARNING, "Unable to get drm connector for display id %i",
                device_info->device_display_id);
         return -1;
     }
 
+    drmModeConnector conn = {
+        .connector_type = connector->type,
+        .connector_type_id = connector->type_id,
+    };
     bool decrement_name = false;
+    int vendor_id = card->vendor_id;
+    int device_id = card->device_id;
 
     if (vendor_id == PCI_VENDOR_ID_REDHAT && device_id == PCI_DEVICE_ID_QXL
         && has_virtual_zero_display) {
@@ -468,11 +594,10 @@ int get_connector_name_for_device_info(VDAgentDeviceDisplayInfo *device_info,
     // driver, but the QXL device uses its own driver which has
     // different naming conventions
     if (vendor_id == PCI_VENDOR_ID_REDHAT && device_id == PCI_DEVICE_ID_QXL) {
-        drm_conn_name_qxl(conn, expected_name, name_size, decrement_name);
+        drm_conn_name_qxl(&conn, expected_name, name_size, decrement_name);
     } else {
-        drm_conn_name_modesetting(conn, expected_name, name_size);
+        drm_conn_name_modesetting(&conn, expected_name, name_size);
     }
-    drmModeFreeConnector(conn);
 
     return 0;
 }
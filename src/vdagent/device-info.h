@@ -33,3 +33,7 @@ bool lookup_xrandr_output_for_device_info(VDAgentDeviceDisplayInfo *device_info,
 int get_connector_name_for_device_info(VDAgentDeviceDisplayInfo *device_info,
                                        char *expected_name, size_t name_size,
                                        bool has_virtual_zero_display);
+
+/* Drop the index of the DRM cards the lookups above build, and stop
+   watching for cards coming and going */
+void device_info_cleanup(void);
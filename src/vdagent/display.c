@@ -41,8 +41,8 @@
 #include "device-info.h"
 #include "vdagentd-proto.h"
 
-#include "mutter.h"
 #include "display.h"
+#include "mutter.h"
 
 /**
  * VDAgentDisplay and the vdagent_display_*() functions are used as wrappers for display-related
@@ -62,6 +62,13 @@ struct VDAgentDisplay {
     GIOChannel *x11_channel;
     guint io_watch_source_id;
     VDAgentMutterDBus *mutter;
+    // latest monitor config from the client, not applied yet
+    VDAgentMonitorsConfig *pending_mon_config;
+    guint mon_config_source_id;
+    // the guest resolution is sent once the server is no longer grabbed
+    gboolean server_grabbed;
+    gboolean guest_res_pending;
+    gboolean guest_res_update;
 };
 
 static gint vdagent_guest_xorg_resolution_compare(gconstpointer a, gconstpointer b)
@@ -164,6 +171,13 @@ void vdagent_display_send_daemon_guest_res(VDAgentDisplay *display, gboolean upd
     GArray *res_array;
     int width = 0, height = 0, screen_count = 0;
 
+    // mutter can't answer while it is kept from talking to the server
+    if (display->server_grabbed) {
+        display->guest_res_pending = TRUE;
+        display->guest_res_update |= update;
+        return;
+    }
+
     // Try various backends one after the other.
     // We try Mutter first, because it has a bigger probability of being available.
     // Second GTK, because if/when we build with GTK4, this is the one that will work best.
@@ -288,7 +302,7 @@ VDAgentDisplay* vdagent_display_create(UdscsConnection *vdagentd, int debug, int
     display->x11->vdagent_display = display;
     display->connector_mapping = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 
-    display->mutter = vdagent_mutter_create(display->connector_mapping);
+    display->mutter = vdagent_mutter_create(display->connector_mapping, display);
 
     display->x11_channel = g_io_channel_unix_new(vdagent_x11_get_fd(display->x11));
     if (display->x11_channel == NULL) {
@@ -326,10 +340,15 @@ void vdagent_display_destroy(VDAgentDisplay *display, int vdagentd_disconnected)
     }
 
     g_source_remove(display->io_watch_source_id);
+    if (display->mon_config_source_id) {
+        g_source_remove(display->mon_config_source_id);
+    }
+    g_clear_pointer(&display->pending_mon_config, g_free);
     g_clear_pointer(&display->x11_channel, g_io_channel_unref);
     vdagent_x11_destroy(display->x11, vdagentd_disconnected);
 
     vdagent_mutter_destroy(display->mutter);
+    device_info_cleanup();
 
     g_hash_table_destroy(display->connector_mapping);
     g_free(display);
@@ -476,6 +495,42 @@ void vdagent_display_handle_graphics_device_info(VDAgentDisplay *display, uint8_
  *  no randr support in X server.
  *  invalid configuration request from client.
  */
+static void apply_monitor_config(VDAgentDisplay *display, VDAgentMonitorsConfig *mon_config,
+                                 int fallback)
+{
+    Display *xdisplay = display->x11->display;
+
+    // keep other clients from seeing, or acting on, the intermediate steps
+    XGrabServer(xdisplay);
+    display->server_grabbed = TRUE;
+    vdagent_x11_set_monitor_config(display->x11, mon_config, fallback);
+    display->server_grabbed = FALSE;
+    XUngrabServer(xdisplay);
+    XFlush(xdisplay);
+
+    if (display->guest_res_pending) {
+        display->guest_res_pending = FALSE;
+        vdagent_display_send_daemon_guest_res(display, display->guest_res_update);
+        display->guest_res_update = FALSE;
+    }
+}
+
+static gboolean apply_pending_monitor_config_cb(gpointer user_data)
+{
+    VDAgentDisplay *display = user_data;
+    VDAgentMonitorsConfig *mon_config = display->pending_mon_config;
+
+    display->pending_mon_config = NULL;
+    display->mon_config_source_id = 0;
+
+    apply_monitor_config(display, mon_config, 0);
+    g_free(mon_config);
+    return G_SOURCE_REMOVE;
+}
+
+/* While the client window is being resized, configs arrive faster than they
+ * can be applied. They are applied from an idle callback, once the messages
+ * already received have been handled, so only the latest one is used. */
 void vdagent_display_set_monitor_config(VDAgentDisplay *display, VDAgentMonitorsConfig *mon_config,
         int fallback)
 {
@@ -487,5 +542,21 @@ void vdagent_display_set_monitor_config(VDAgentDisplay *display, VDAgentMonitors
         return;
     }
 #endif
-    vdagent_x11_set_monitor_config(display->x11, mon_config, fallback);
+    if (fallback) {
+        apply_monitor_config(display, mon_config, fallback);
+        return;
+    }
+
+    if (display->pending_mon_config && display->debug) {
+        syslog(LOG_DEBUG, "Skipping superseded monitor config");
+    }
+    g_free(display->pending_mon_config);
+    display->pending_mon_config =
+        g_memdup2(mon_config, sizeof(VDAgentMonitorsConfig) +
+                  mon_config->num_of_monitors * sizeof(VDAgentMonConfig));
+
+    if (display->mon_config_source_id == 0) {
+        display->mon_config_source_id =
+            g_idle_add(apply_pending_monitor_config_cb, display);
+    }
 }
@@ -31,14 +31,28 @@
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
 #include <spice/vd_agent.h>
 #include <glib.h>
 
 #include "vdagentd-proto.h"
 #include "file-xfers.h"
 
+/* Chunks are gathered into blocks of this size before being written out */
+#define STAGE_SIZE (1024 * 1024)
+
+/* Transfers beyond this many are queued, their files aren't created
+ * and the client isn't told to send their data until others complete */
+#define MAX_OPEN_TRANSFERS 16
+
 struct vdagent_file_xfers {
     GHashTable *xfers;
+    /* tasks waiting for a free slot, smallest file first */
+    GQueue *queued;
     UdscsConnection *vdagentd;
     char *save_dir;
     int open_save_dir;
@@ -54,25 +68,82 @@ typedef struct AgentFileXferTask {
     int                            file_xfer_nr;
     int                            file_xfer_total;
     int                            debug;
+    /* bytes written out, for the progress reported with --debug */
+    uint64_t                       done_bytes;
+    /* SHA-256 the client sent for the file, the data is checked against it
+     * as it is written; NULL if the client didn't send any */
+    gchar                          *expected_sha256;
+    /* writes the data to file_fd off the main loop, in order */
+    GThreadPool                    *writer;
+    /* set once the task is removed, pending writes are then skipped */
+    gint                           cancelled;
+    /* only accessed from the writer thread */
+    gboolean                       write_failed;
+    guint8                         *stage;
+    gsize                          stage_fill;
+    uint64_t                       written_bytes;
+    uint64_t                       advised_bytes; /* dropped from the page cache */
+    unsigned int                   n_writes;
+    gint64                         start_time;
+    GChecksum                      *checksum;
+    /* held by the task table and by every pending write */
+    int                            ref_count;
 } AgentFileXferTask;
 
+/* A chunk of file data queued to the writer thread of its task */
+typedef struct AgentFileXferWrite {
+    struct vdagent_file_xfers      *xfers;
+    AgentFileXferTask              *task;
+    GBytes                         *data;
+    /* last chunk of the file, sync it before reporting success */
+    gboolean                       last;
+    int                            error;
+    /* SHA-256 of the file, set with the last chunk if it is verified */
+    gchar                          *sha256;
+} AgentFileXferWrite;
+
+static void vdagent_file_xfer_write_func(gpointer data, gpointer user_data);
+
+static void vdagent_file_xfer_task_unref(AgentFileXferTask *task)
+{
+    if (--task->ref_count > 0)
+        return;
+
+    /* only now that the writer is done with it, the file of a task which
+     * did not complete is removed */
+    if (task->file_fd > 0) {
+        close(task->file_fd);
+        unlink(task->file_name);
+    }
+    free(task->stage);
+    if (task->checksum)
+        g_checksum_free(task->checksum);
+    g_free(task->expected_sha256);
+    g_free(task->file_name);
+    g_free(task);
+}
+
 static void vdagent_file_xfer_task_free(gpointer data)
 {
     AgentFileXferTask *task = data;
 
     g_return_if_fail(task != NULL);
 
+    /* let the writer skip what is still queued, without waiting for it:
+     * this runs on the main loop. The completions of the pending writes
+     * hold their own reference to the task, the last one frees it. */
+    g_atomic_int_set(&task->cancelled, TRUE);
+    if (task->writer)
+        g_thread_pool_free(task->writer, FALSE, FALSE);
+
     if (task->file_fd > 0) {
         syslog(LOG_ERR, "file-xfer: Removing task %u and file %s due to error",
                task->id, task->file_name);
-        close(task->file_fd);
-        unlink(task->file_name);
     } else if (task->debug)
         syslog(LOG_DEBUG, "file-xfer: Removing task %u %s",
                task->id, task->file_name);
 
-    g_free(task->file_name);
-    g_free(task);
+    vdagent_file_xfer_task_unref(task);
 }
 
 struct vdagent_file_xfers *vdagent_file_xfers_create(
@@ -88,6 +159,7 @@ struct vdagent_file_xfers *vdagent_file_xfers_create(
     xfers->save_dir = g_strdup(save_dir);
     xfers->open_save_dir = open_save_dir;
     xfers->debug = debug;
+    xfers->queued = g_queue_new();
 
     return xfers;
 }
@@ -96,11 +168,44 @@ void vdagent_file_xfers_destroy(struct vdagent_file_xfers *xfers)
 {
     g_return_if_fail(xfers != NULL);
 
+    g_queue_free_full(xfers->queued, vdagent_file_xfer_task_free);
     g_hash_table_destroy(xfers->xfers);
     g_free(xfers->save_dir);
     g_free(xfers);
 }
 
+static gint vdagent_file_xfer_task_cmp_id(gconstpointer a, gconstpointer b)
+{
+    const AgentFileXferTask *task = a;
+
+    return task->id == GPOINTER_TO_UINT(b) ? 0 : 1;
+}
+
+/* Small files go first, so that they don't wait behind large ones */
+static gint vdagent_file_xfer_task_cmp_size(gconstpointer a, gconstpointer b,
+                                            gpointer user_data)
+{
+    const AgentFileXferTask *task_a = a, *task_b = b;
+
+    if (task_a->file_size != task_b->file_size)
+        return task_a->file_size < task_b->file_size ? -1 : 1;
+    return 0;
+}
+
+static AgentFileXferTask *vdagent_file_xfers_steal_queued(
+    struct vdagent_file_xfers *xfers, uint32_t id)
+{
+    GList *link = g_queue_find_custom(xfers->queued, GUINT_TO_POINTER(id),
+                                      vdagent_file_xfer_task_cmp_id);
+    AgentFileXferTask *task;
+
+    if (link == NULL)
+        return NULL;
+    task = link->data;
+    g_queue_delete_link(xfers->queued, link);
+    return task;
+}
+
 static AgentFileXferTask *vdagent_file_xfers_get_task(
     struct vdagent_file_xfers *xfers, uint32_t id)
 {
@@ -133,6 +238,7 @@ static AgentFileXferTask *vdagent_parse_start_msg(
         goto error;
     }
     task = g_new0(AgentFileXferTask, 1);
+    task->ref_count = 1;
     task->file_fd = -1;
     task->id = msg->id;
     task->file_name = g_key_file_get_string(
@@ -154,6 +260,11 @@ static AgentFileXferTask *vdagent_parse_start_msg(
         keyfile, "vdagent-file-xfer", "file-xfer-nr", NULL);
     task->file_xfer_total = g_key_file_get_integer(
         keyfile, "vdagent-file-xfer", "file-xfer-total", NULL);
+    /* Optional, lets the data be verified without reading it back */
+    task->expected_sha256 = g_key_file_get_string(
+        keyfile, "vdagent-file-xfer", "sha256", NULL);
+    if (task->expected_sha256)
+        task->checksum = g_checksum_new(G_CHECKSUM_SHA256);
 
     g_key_file_free(keyfile);
     return task;
@@ -227,26 +338,26 @@ error:
     return file_fd;
 }
 
-void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
-    VDAgentFileXferStartMessage *msg)
+/* Allocate the space for the file up front where the filesystem supports
+ * it, so that it ends up in few extents. Otherwise just set the size. */
+static int vdagent_file_xfer_reserve(int fd, uint64_t size)
 {
-    AgentFileXferTask *task;
-    uint64_t free_space;
-
-    g_return_if_fail(xfers != NULL);
-
-    if (g_hash_table_lookup(xfers->xfers, GUINT_TO_POINTER(msg->id))) {
-        syslog(LOG_ERR, "file-xfer: error id %u already exists, ignoring!",
-               msg->id);
-        return;
-    }
-
-    task = vdagent_parse_start_msg(msg);
-    if (task == NULL) {
-        goto error;
+#ifdef HAVE_FALLOCATE
+    if (size > 0) {
+        if (fallocate(fd, 0, 0, size) == 0)
+            return 0;
+        if (errno != EOPNOTSUPP && errno != ENOSYS)
+            return -1;
     }
+#endif
+    return ftruncate(fd, size);
+}
 
-    task->debug = xfers->debug;
+/* Create the file of the task and let the client send its data */
+static void vdagent_file_xfers_open(struct vdagent_file_xfers *xfers,
+                                    AgentFileXferTask *task)
+{
+    uint64_t free_space;
 
     free_space = get_free_space_available(xfers->save_dir);
     if (task->file_size > free_space) {
@@ -260,7 +371,7 @@ void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
 
         udscs_write(xfers->vdagentd,
                     VDAGENTD_FILE_XFER_STATUS,
-                    msg->id,
+                    task->id,
                     VD_AGENT_FILE_XFER_STATUS_NOT_ENOUGH_SPACE,
                     (uint8_t *)&free_space,
                     sizeof(free_space));
@@ -272,28 +383,82 @@ void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
         goto error;
     }
 
-    if (ftruncate(task->file_fd, task->file_size) < 0) {
+    if (vdagent_file_xfer_reserve(task->file_fd, task->file_size) < 0) {
         syslog(LOG_ERR, "file-xfer: err reserving %"PRIu64" bytes for %s: %s",
                task->file_size, task->file_name, strerror(errno));
         goto error;
     }
+#ifdef HAVE_POSIX_FADVISE
+    posix_fadvise(task->file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    task->start_time = g_get_monotonic_time();
+
+    task->writer = g_thread_pool_new(vdagent_file_xfer_write_func, task,
+                                     1, FALSE, NULL);
 
-    g_hash_table_insert(xfers->xfers, GUINT_TO_POINTER(msg->id), task);
+    g_hash_table_insert(xfers->xfers, GUINT_TO_POINTER(task->id), task);
 
     if (xfers->debug)
         syslog(LOG_DEBUG, "file-xfer: Adding task %u %s %"PRIu64" bytes",
                task->id, task->file_name, task->file_size);
 
     udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS,
-                msg->id, VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA, NULL, 0);
+                task->id, VD_AGENT_FILE_XFER_STATUS_CAN_SEND_DATA, NULL, 0);
     return ;
 
 error:
     udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS,
-                msg->id, VD_AGENT_FILE_XFER_STATUS_ERROR, NULL, 0);
+                task->id, VD_AGENT_FILE_XFER_STATUS_ERROR, NULL, 0);
 cleanup:
-    if (task)
-        vdagent_file_xfer_task_free(task);
+    vdagent_file_xfer_task_free(task);
+}
+
+/* Remove a task which is done with, and open the next queued one */
+static void vdagent_file_xfers_remove(struct vdagent_file_xfers *xfers,
+                                      uint32_t id)
+{
+    g_hash_table_remove(xfers->xfers, GUINT_TO_POINTER(id));
+
+    while (!g_queue_is_empty(xfers->queued) &&
+           g_hash_table_size(xfers->xfers) < MAX_OPEN_TRANSFERS) {
+        vdagent_file_xfers_open(xfers, g_queue_pop_head(xfers->queued));
+    }
+}
+
+void vdagent_file_xfers_start(struct vdagent_file_xfers *xfers,
+    VDAgentFileXferStartMessage *msg)
+{
+    AgentFileXferTask *task;
+
+    g_return_if_fail(xfers != NULL);
+
+    if (g_hash_table_lookup(xfers->xfers, GUINT_TO_POINTER(msg->id)) ||
+        g_queue_find_custom(xfers->queued, GUINT_TO_POINTER(msg->id),
+                            vdagent_file_xfer_task_cmp_id)) {
+        syslog(LOG_ERR, "file-xfer: error id %u already exists, ignoring!",
+               msg->id);
+        return;
+    }
+
+    task = vdagent_parse_start_msg(msg);
+    if (task == NULL) {
+        udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS,
+                    msg->id, VD_AGENT_FILE_XFER_STATUS_ERROR, NULL, 0);
+        return;
+    }
+
+    task->debug = xfers->debug;
+
+    if (g_hash_table_size(xfers->xfers) < MAX_OPEN_TRANSFERS) {
+        vdagent_file_xfers_open(xfers, task);
+        return;
+    }
+
+    if (xfers->debug)
+        syslog(LOG_DEBUG, "file-xfer: Queueing task %u %s %"PRIu64" bytes",
+               task->id, task->file_name, task->file_size);
+    g_queue_insert_sorted(xfers->queued, task,
+                          vdagent_file_xfer_task_cmp_size, NULL);
 }
 
 void vdagent_file_xfers_status(struct vdagent_file_xfers *xfers,
@@ -303,6 +468,13 @@ void vdagent_file_xfers_status(struct vdagent_file_xfers *xfers,
 
     g_return_if_fail(xfers != NULL);
 
+    /* not started yet, nothing to tell the client */
+    task = vdagent_file_xfers_steal_queued(xfers, msg->id);
+    if (task) {
+        vdagent_file_xfer_task_free(task);
+        return;
+    }
+
     task = vdagent_file_xfers_get_task(xfers, msg->id);
     if (!task)
         return;
@@ -314,15 +486,237 @@ void vdagent_file_xfers_status(struct vdagent_file_xfers *xfers,
         break;
     default:
         /* Cancel or Error, remove this task */
-        g_hash_table_remove(xfers->xfers, GUINT_TO_POINTER(msg->id));
+        vdagent_file_xfers_remove(xfers, msg->id);
+    }
+}
+
+/* Log every 10% of progress */
+static void vdagent_file_xfer_log_progress(AgentFileXferTask *task, gsize size)
+{
+    uint64_t before = task->done_bytes;
+    gint64 elapsed;
+    gchar *rate;
+
+    task->done_bytes += size;
+    if (task->file_size == 0 ||
+        before * 10 / task->file_size == task->done_bytes * 10 / task->file_size)
+        return;
+
+    elapsed = MAX(g_get_monotonic_time() - task->start_time, 1);
+    rate = g_format_size(task->done_bytes * G_USEC_PER_SEC / elapsed);
+    syslog(LOG_DEBUG, "file-xfer: task %u %s %"PRIu64"%% done, %s/s",
+           task->id, task->file_name,
+           task->done_bytes * 100 / task->file_size, rate);
+    g_free(rate);
+}
+
+/* Called on the main loop once a chunk has been written out */
+static gboolean vdagent_file_xfer_write_done(gpointer user_data)
+{
+    AgentFileXferWrite *w = user_data;
+    struct vdagent_file_xfers *xfers = w->xfers;
+    AgentFileXferTask *task = w->task;
+    int status = -1;
+
+    if (g_atomic_int_get(&task->cancelled))
+        goto done;
+
+    if (w->error) {
+        syslog(LOG_ERR, "file-xfer: error writing %s: %s", task->file_name,
+               strerror(w->error));
+        status = VD_AGENT_FILE_XFER_STATUS_ERROR;
+    } else {
+        /* hand the credit back to vdagentd, see FILE_XFER_WINDOW */
+        udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_ACK,
+                    task->id, g_bytes_get_size(w->data), NULL, 0);
+
+        if (xfers->debug)
+            vdagent_file_xfer_log_progress(task, g_bytes_get_size(w->data));
+
+        if (w->last && w->sha256 &&
+            g_ascii_strcasecmp(w->sha256, task->expected_sha256) != 0) {
+            syslog(LOG_ERR, "file-xfer: %s is corrupt, sha256 %s expected %s",
+                   task->file_name, w->sha256, task->expected_sha256);
+            status = VD_AGENT_FILE_XFER_STATUS_ERROR;
+        } else if (w->last) {
+            if (xfers->debug)
+                syslog(LOG_DEBUG, "file-xfer: task %u %s has completed",
+                       task->id, task->file_name);
+            close(task->file_fd);
+            task->file_fd = -1;
+            /* files may complete in any order, wait for the last one */
+            if (xfers->open_save_dir &&
+                    task->file_xfer_nr == task->file_xfer_total &&
+                    g_hash_table_size(xfers->xfers) == 1 &&
+                    g_queue_is_empty(xfers->queued)) {
+                GError *error = NULL;
+                gchar *argv[] = { "xdg-open", xfers->save_dir, NULL };
+                if (!g_spawn_async(NULL, argv, NULL,
+                                       G_SPAWN_SEARCH_PATH,
+                                       NULL, NULL, NULL, &error)) {
+                    syslog(LOG_WARNING,
+                           "file-xfer: failed to open save directory: %s",
+                           error->message);
+                    g_error_free(error);
+                }
+            }
+            status = VD_AGENT_FILE_XFER_STATUS_SUCCESS;
+        }
+    }
+
+    if (status != -1) {
+        udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS,
+                    task->id, status, NULL, 0);
+        vdagent_file_xfers_remove(xfers, task->id);
+    }
+
+done:
+    vdagent_file_xfer_task_unref(task);
+    g_bytes_unref(w->data);
+    g_free(w->sha256);
+    g_free(w);
+    return G_SOURCE_REMOVE;
+}
+
+static int write_all(int fd, const guint8 *buf, gsize size)
+{
+    gsize written = 0;
+    gssize len;
+
+    while (written < size) {
+        len = write(fd, buf + written, size - written);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        written += len;
+    }
+    return 0;
+}
+
+/* Write out a block, the blocks before it are already on their way to
+ * the disk and are dropped from the page cache so that large transfers
+ * don't evict the cache of the desktop. */
+static int vdagent_file_xfer_write_block(AgentFileXferTask *task,
+                                         const guint8 *buf, gsize size)
+{
+    int err;
+
+    err = write_all(task->file_fd, buf, size);
+    if (err)
+        return err;
+    task->n_writes++;
+
+#ifdef HAVE_POSIX_FADVISE
+    if (task->written_bytes > task->advised_bytes) {
+        posix_fadvise(task->file_fd, task->advised_bytes,
+                      task->written_bytes - task->advised_bytes,
+                      POSIX_FADV_DONTNEED);
+        task->advised_bytes = task->written_bytes;
+    }
+#endif
+    task->written_bytes += size;
+    return 0;
+}
+
+static int vdagent_file_xfer_flush_stage(AgentFileXferTask *task)
+{
+    int err = 0;
+
+    if (task->stage_fill > 0) {
+        err = vdagent_file_xfer_write_block(task, task->stage, task->stage_fill);
+        task->stage_fill = 0;
+    }
+    return err;
+}
+
+static void vdagent_file_xfer_log_stats(AgentFileXferTask *task)
+{
+    gint64 elapsed = MAX(g_get_monotonic_time() - task->start_time, 1);
+    double mib_per_s = (double)task->written_bytes * G_USEC_PER_SEC /
+                       elapsed / (1024 * 1024);
+    long extents = -1;
+
+#ifdef FS_IOC_FIEMAP
+    struct fiemap fiemap = { 0, };
+
+    /* with fm_extent_count 0 only the number of extents is returned */
+    fiemap.fm_length = FIEMAP_MAX_OFFSET;
+    fiemap.fm_flags = FIEMAP_FLAG_SYNC;
+    if (ioctl(task->file_fd, FS_IOC_FIEMAP, &fiemap) == 0)
+        extents = fiemap.fm_mapped_extents;
+#endif
+
+    syslog(LOG_DEBUG, "file-xfer: task %u wrote %"PRIu64" bytes in %u writes, "
+           "%.1f MiB/s, %ld extents", task->id, task->written_bytes,
+           task->n_writes, mib_per_s, extents);
+}
+
+/* Runs in the writer thread of the task, gathers the chunks in the
+ * staging buffer and writes them out in blocks of STAGE_SIZE */
+static void vdagent_file_xfer_write_func(gpointer data, gpointer user_data)
+{
+    AgentFileXferWrite *w = data;
+    AgentFileXferTask *task = user_data;
+    const guint8 *buf;
+    gsize size, n;
+
+    if (g_atomic_int_get(&task->cancelled) || task->write_failed)
+        goto done;
+
+    buf = g_bytes_get_data(w->data, &size);
+    if (task->checksum)
+        g_checksum_update(task->checksum, buf, size);
+
+    /* nothing to gather, skip the copy */
+    if (task->stage_fill == 0 && size >= STAGE_SIZE) {
+        w->error = vdagent_file_xfer_write_block(task, buf, size);
+        size = 0;
+    }
+
+    while (size > 0 && !w->error) {
+        if (task->stage == NULL) {
+            w->error = posix_memalign((void **)&task->stage,
+                                      sysconf(_SC_PAGESIZE), STAGE_SIZE);
+            if (w->error)
+                break;
+        }
+        n = MIN(size, STAGE_SIZE - task->stage_fill);
+        memcpy(task->stage + task->stage_fill, buf, n);
+        task->stage_fill += n;
+        buf += n;
+        size -= n;
+        if (task->stage_fill == STAGE_SIZE)
+            w->error = vdagent_file_xfer_flush_stage(task);
     }
+
+    if (!w->error && w->last) {
+        w->error = vdagent_file_xfer_flush_stage(task);
+        /* only report success once the file is on disk */
+        if (!w->error && fdatasync(task->file_fd) < 0)
+            w->error = errno;
+#ifdef HAVE_POSIX_FADVISE
+        if (!w->error)
+            posix_fadvise(task->file_fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+        if (!w->error && task->debug)
+            vdagent_file_xfer_log_stats(task);
+        if (task->checksum)
+            w->sha256 = g_strdup(g_checksum_get_string(task->checksum));
+    }
+    if (w->error)
+        task->write_failed = TRUE;
+
+done:
+    g_idle_add(vdagent_file_xfer_write_done, w);
 }
 
 void vdagent_file_xfers_data(struct vdagent_file_xfers *xfers,
     VDAgentFileXferDataMessage *msg)
 {
     AgentFileXferTask *task;
-    int len, status = -1;
+    AgentFileXferWrite *w;
 
     g_return_if_fail(xfers != NULL);
 
@@ -330,47 +724,22 @@ void vdagent_file_xfers_data(struct vdagent_file_xfers *xfers,
     if (!task)
         return;
 
-    len = write(task->file_fd, msg->data, msg->size);
-    if (len == msg->size) {
-        task->read_bytes += msg->size;
-        if (task->read_bytes >= task->file_size) {
-            if (task->read_bytes == task->file_size) {
-                if (xfers->debug)
-                    syslog(LOG_DEBUG, "file-xfer: task %u %s has completed",
-                           task->id, task->file_name);
-                close(task->file_fd);
-                task->file_fd = -1;
-                if (xfers->open_save_dir &&
-                        task->file_xfer_nr == task->file_xfer_total &&
-                        g_hash_table_size(xfers->xfers) == 1) {
-                    GError *error = NULL;
-                    gchar *argv[] = { "xdg-open", xfers->save_dir, NULL };
-                    if (!g_spawn_async(NULL, argv, NULL,
-                                           G_SPAWN_SEARCH_PATH,
-                                           NULL, NULL, NULL, &error)) {
-                        syslog(LOG_WARNING,
-                               "file-xfer: failed to open save directory: %s",
-                               error->message);
-                        g_error_free(error);
-                    }
-                }
-                status = VD_AGENT_FILE_XFER_STATUS_SUCCESS;
-            } else {
-                syslog(LOG_ERR, "file-xfer: error received too much data");
-                status = VD_AGENT_FILE_XFER_STATUS_ERROR;
-            }
-        }
-    } else {
-        syslog(LOG_ERR, "file-xfer: error writing %s: %s", task->file_name,
-               strerror(errno));
-        status = VD_AGENT_FILE_XFER_STATUS_ERROR;
-    }
-
-    if (status != -1) {
+    if (msg->size > task->file_size - task->read_bytes) {
+        syslog(LOG_ERR, "file-xfer: error received too much data");
         udscs_write(xfers->vdagentd, VDAGENTD_FILE_XFER_STATUS,
-                    msg->id, status, NULL, 0);
-        g_hash_table_remove(xfers->xfers, GUINT_TO_POINTER(msg->id));
+                    msg->id, VD_AGENT_FILE_XFER_STATUS_ERROR, NULL, 0);
+        vdagent_file_xfers_remove(xfers, msg->id);
+        return;
     }
+    task->read_bytes += msg->size;
+
+    w = g_new0(AgentFileXferWrite, 1);
+    w->xfers = xfers;
+    w->task = task;
+    w->data = g_bytes_new(msg->data, msg->size);
+    w->last = task->read_bytes == task->file_size;
+    task->ref_count++;
+    g_thread_pool_push(task->writer, w, NULL);
 }
 
 void vdagent_file_xfers_error_disabled(UdscsConnection *vdagentd, uint32_t msg_id)
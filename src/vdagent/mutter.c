@@ -25,8 +25,11 @@
 #include <gio/gio.h>
 
 #include <syslog.h>
+#include <spice/vd_agent.h>
 
 #include "vdagentd-proto.h"
+#include "udscs.h"
+#include "display.h"
 #include "mutter.h"
 
 // MUTTER DBUS FORMAT STRINGS
@@ -47,8 +50,41 @@
 struct VDAgentMutterDBus {
     GDBusProxy *dbus_proxy;
     GHashTable *connector_mapping;
+    VDAgentDisplay *display;
+    GCancellable *cancellable;
+
+    // last GetCurrentState reply, NULL until there is one. Kept as is and
+    // parsed on demand, so the connectors get mapped to SPICE displays with
+    // the connector_mapping of the time.
+    GVariant *state;
 };
 
+static void vdagent_mutter_update(VDAgentMutterDBus *mutter);
+
+static void vdagent_mutter_signal_cb(GDBusProxy *proxy, const gchar *sender_name,
+                                     const gchar *signal_name, GVariant *parameters,
+                                     gpointer user_data)
+{
+    if (g_strcmp0(signal_name, "MonitorsChanged") == 0) {
+        vdagent_mutter_update(user_data);
+    }
+}
+
+static void vdagent_mutter_name_owner_cb(GObject *object, GParamSpec *pspec,
+                                         gpointer user_data)
+{
+    VDAgentMutterDBus *mutter = user_data;
+    gchar *owner = g_dbus_proxy_get_name_owner(mutter->dbus_proxy);
+
+    if (owner) {
+        vdagent_mutter_update(mutter);
+    } else {
+        g_cancellable_cancel(mutter->cancellable);
+        g_clear_pointer(&mutter->state, g_variant_unref);
+    }
+    g_free(owner);
+}
+
 /**
  * Initialise a communication to Mutter through its DBUS interface.
  *
@@ -59,16 +95,18 @@ struct VDAgentMutterDBus {
  * An initialise VDAgentMutterDBus structure if successful.
  * NULL if an error occurred.
  */
-VDAgentMutterDBus *vdagent_mutter_create(GHashTable *connector_mapping)
+VDAgentMutterDBus *vdagent_mutter_create(GHashTable *connector_mapping,
+                                         VDAgentDisplay *display)
 {
     GError *error = NULL;
     VDAgentMutterDBus *mutter = g_new0(VDAgentMutterDBus, 1);
 
     mutter->connector_mapping = g_hash_table_ref(connector_mapping);
+    mutter->display = display;
+    mutter->cancellable = g_cancellable_new();
 
     GDBusProxyFlags flags = (G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START
-                            | G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES
-                            | G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS);
+                            | G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES);
 
     mutter->dbus_proxy = g_dbus_proxy_new_for_bus_sync(G_BUS_TYPE_SESSION,
                                                        flags,
@@ -85,13 +123,27 @@ VDAgentMutterDBus *vdagent_mutter_create(GHashTable *connector_mapping)
         return NULL;
     }
 
+    // The monitor state is fetched asynchronously, and again whenever mutter
+    // signals a change, so getting the resolutions never waits on mutter.
+    g_signal_connect(mutter->dbus_proxy, "g-signal",
+                     G_CALLBACK(vdagent_mutter_signal_cb), mutter);
+    g_signal_connect(mutter->dbus_proxy, "notify::g-name-owner",
+                     G_CALLBACK(vdagent_mutter_name_owner_cb), mutter);
+    vdagent_mutter_name_owner_cb(NULL, NULL, mutter);
+
     return mutter;
 }
 
 
 void vdagent_mutter_destroy(VDAgentMutterDBus *mutter)
 {
+    g_cancellable_cancel(mutter->cancellable);
+    g_clear_object(&mutter->cancellable);
+    if (mutter->dbus_proxy) {
+        g_signal_handlers_disconnect_by_data(mutter->dbus_proxy, mutter);
+    }
     g_clear_object(&mutter->dbus_proxy);
+    g_clear_pointer(&mutter->state, g_variant_unref);
     g_hash_table_unref(mutter->connector_mapping);
     g_free(mutter);
 }
@@ -145,37 +197,17 @@ static void vdagent_mutter_get_monitor_position(GVariantIter *logical_monitors,
     g_variant_iter_free(logical_monitor_iterator);
 }
 
-GArray *vdagent_mutter_get_resolutions(VDAgentMutterDBus *mutter,
-                                       int *desktop_width, int *desktop_height, int *screen_count)
+static GArray *vdagent_mutter_parse_state(VDAgentMutterDBus *mutter, GVariant *values,
+                                         int *desktop_width, int *desktop_height,
+                                         int *screen_count)
 {
-    GError *error = NULL;
-    GArray *res_array = NULL;
+    GArray *res_array;
 
     // keep track of monitors we find and are not mapped to SPICE displays
     // we will map them back later (assuming display ID == monitor index)
     // this prevents the need from looping twice on all DBUS items
     GArray *not_found_array = NULL;
 
-    if (!mutter) {
-        return res_array;
-    }
-
-    GVariant *values = g_dbus_proxy_call_sync(mutter->dbus_proxy,
-                                              "GetCurrentState",
-                                              NULL,
-                                              G_DBUS_CALL_FLAGS_NONE,
-                                              -1,   // use proxy default timeout
-                                              NULL,
-                                              &error);
-    if (!values) {
-        syslog(LOG_WARNING, "display: failed to call GetCurrentState from mutter over DBUS");
-        if (error != NULL) {
-            syslog(LOG_WARNING, "   error message: %s", error->message);
-            g_clear_error(&error);
-        }
-        return res_array;
-    }
-
     res_array = g_array_new(FALSE, FALSE, sizeof(struct vdagentd_guest_xorg_resolution));
     not_found_array = g_array_new(FALSE, FALSE, sizeof(struct vdagentd_guest_xorg_resolution));
 
@@ -271,6 +303,65 @@ GArray *vdagent_mutter_get_resolutions(VDAgentMutterDBus *mutter,
         g_array_free(not_found_array, TRUE);
     }
 
-    g_variant_unref(values);
     return res_array;
 }
+
+static void vdagent_mutter_get_current_state_cb(GObject *source_object,
+                                                GAsyncResult *res,
+                                                gpointer user_data)
+{
+    GError *error = NULL;
+    GVariant *values = g_dbus_proxy_call_finish(G_DBUS_PROXY(source_object), res, &error);
+    VDAgentMutterDBus *mutter;
+
+    if (!values) {
+        if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            // mutter may be gone already
+            g_clear_error(&error);
+            return;
+        }
+        syslog(LOG_WARNING, "display: failed to call GetCurrentState from mutter over DBUS");
+        syslog(LOG_WARNING, "   error message: %s", error->message);
+        g_clear_error(&error);
+        mutter = user_data;
+        g_clear_pointer(&mutter->state, g_variant_unref);
+        return;
+    }
+
+    mutter = user_data;
+    g_clear_pointer(&mutter->state, g_variant_unref);
+    mutter->state = values;
+
+    vdagent_display_send_daemon_guest_res(mutter->display, FALSE);
+}
+
+/* Fetch the monitor state, dropping the reply to a previous request */
+static void vdagent_mutter_update(VDAgentMutterDBus *mutter)
+{
+    g_cancellable_cancel(mutter->cancellable);
+    g_object_unref(mutter->cancellable);
+    mutter->cancellable = g_cancellable_new();
+
+    g_dbus_proxy_call(mutter->dbus_proxy,
+                      "GetCurrentState",
+                      NULL,
+                      G_DBUS_CALL_FLAGS_NONE,
+                      -1,   // use proxy default timeout
+                      mutter->cancellable,
+                      vdagent_mutter_get_current_state_cb,
+                      mutter);
+}
+
+/* Returns the resolutions from the last state received from mutter, or NULL
+ * when mutter is not running, or has not answered yet. */
+GArray *vdagent_mutter_get_resolutions(VDAgentMutterDBus *mutter,
+                                       int *desktop_width, int *desktop_height, int *screen_count)
+{
+    if (!mutter || !mutter->state) {
+        return NULL;
+    }
+
+    *desktop_width = *desktop_height = *screen_count = 0;
+    return vdagent_mutter_parse_state(mutter, mutter->state, desktop_width,
+                                      desktop_height, screen_count);
+}
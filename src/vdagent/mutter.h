@@ -22,9 +22,14 @@
 #ifndef SRC_VDAGENT_MUTTER_H_
 #define SRC_VDAGENT_MUTTER_H_
 
+#include <glib.h>
+
+#include "display.h"
+
 typedef struct VDAgentMutterDBus VDAgentMutterDBus;
 
-VDAgentMutterDBus *vdagent_mutter_create(GHashTable *connector_mapping);
+VDAgentMutterDBus *vdagent_mutter_create(GHashTable *connector_mapping,
+                                         VDAgentDisplay *display);
 void vdagent_mutter_destroy(VDAgentMutterDBus *mutter);
 
 GArray *vdagent_mutter_get_resolutions(VDAgentMutterDBus *mutter, int *width, int *height, int *screen_count);
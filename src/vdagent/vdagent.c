@@ -48,8 +48,15 @@ typedef struct VDAgent {
     VDAgentClipboards *clipboards;
     VDAgentDisplay *display;
     struct vdagent_file_xfers *xfers;
+    gboolean xfers_disabled; /* by vdagentd, or no save dir */
     UdscsConnection *conn;
     gint udscs_num_retry;
+    /* wakes us up as soon as vdagentd creates its socket */
+    GFileMonitor *socket_monitor;
+    guint connect_retry_id;
+    /* the next attempt is an extra one, not counted in udscs_num_retry */
+    gboolean socket_created;
+    gint64 start_time;
 
     GMainLoop *loop;
 } VDAgent;
@@ -66,6 +73,7 @@ static gint fx_open_dir = -1;
 static gchar *fx_dir = NULL;
 static gchar *portdev = NULL;
 static gchar *vdagentd_socket = NULL;
+static gint payload_budget_mb = -1;
 
 static GOptionEntry entries[] = {
     { "debug", 'd',
@@ -92,6 +100,10 @@ static GOptionEntry entries[] = {
       G_OPTION_FLAG_NONE,
       G_OPTION_ARG_INT, &fx_open_dir,
       "Open directory after completing file transfer", "<0|1>" },
+    { "payload-budget", 0,
+      G_OPTION_FLAG_NONE,
+      G_OPTION_ARG_INT, &payload_budget_mb,
+      "Keep at most <MiB> of clipboard data on the heap, 0 for no limit (128)", "<MiB>" },
     { "x11-abort-on-error", 'y',
       G_OPTION_FLAG_HIDDEN,
       G_OPTION_ARG_NONE, &x11_sync,
@@ -142,6 +154,7 @@ static gboolean vdagent_init_file_xfer(VDAgent *agent)
         syslog(LOG_WARNING,
                "warning could not get file xfer save dir, "
                "file transfers will be disabled");
+        agent->xfers_disabled = TRUE;
         return FALSE;
     }
 
@@ -154,6 +167,16 @@ static gboolean vdagent_init_file_xfer(VDAgent *agent)
     return (agent->xfers != NULL);
 }
 
+/* File-xfer is set up on the first transfer rather than at startup: looking
+ * up the save directory and the desktop icons setting is not free, and
+ * most sessions never receive a file */
+static struct vdagent_file_xfers *vdagent_get_file_xfers(VDAgent *agent)
+{
+    if (agent->xfers == NULL && !agent->xfers_disabled)
+        vdagent_init_file_xfer(agent);
+    return agent->xfers;
+}
+
 static gboolean vdagent_finalize_file_xfer(VDAgent *agent)
 {
     if (agent->xfers == NULL)
@@ -190,10 +213,14 @@ static void daemon_read_complete(UdscsConnection *conn,
         vdagent_clipboard_grab(agent->clipboards, header->arg1,
                                (guint32 *)data, header->size / sizeof(guint32));
         break;
-    case VDAGENTD_CLIPBOARD_DATA:
+    case VDAGENTD_CLIPBOARD_DATA: {
+        /* may outlive this message, while being sent to the requestor */
+        GBytes *bytes = udscs_steal_message_data(conn);
         vdagent_clipboard_data(agent->clipboards, header->arg1, header->arg2,
-                               data, header->size);
+                               bytes);
+        g_bytes_unref(bytes);
         break;
+    }
     case VDAGENTD_CLIPBOARD_RELEASE:
         vdagent_clipboard_release(agent->clipboards, header->arg1);
         break;
@@ -206,7 +233,7 @@ static void daemon_read_complete(UdscsConnection *conn,
         }
         break;
     case VDAGENTD_FILE_XFER_START:
-        if (agent->xfers != NULL) {
+        if (vdagent_get_file_xfers(agent) != NULL) {
             vdagent_file_xfers_start(agent->xfers,
                                      (VDAgentFileXferStartMessage *)data);
         } else {
@@ -227,6 +254,7 @@ static void daemon_read_complete(UdscsConnection *conn,
         if (debug)
             syslog(LOG_DEBUG, "Disabling file-xfers");
 
+        agent->xfers_disabled = TRUE;
         vdagent_finalize_file_xfer(agent);
         break;
     case VDAGENTD_AUDIO_VOLUME_SYNC: {
@@ -255,9 +283,8 @@ static void daemon_read_complete(UdscsConnection *conn,
         break;
     case VDAGENTD_CLIENT_DISCONNECTED:
         vdagent_clipboards_release_all(agent->clipboards);
-        if (vdagent_finalize_file_xfer(agent)) {
-            vdagent_init_file_xfer(agent);
-        }
+        /* drops all transfers, the next client gets a fresh one on demand */
+        vdagent_finalize_file_xfer(agent);
         break;
     default:
         syslog(LOG_ERR, "Unknown message from vdagentd type: %d, ignoring",
@@ -347,6 +374,42 @@ gboolean vdagent_signal_handler(gpointer user_data)
     return G_SOURCE_REMOVE;
 }
 
+/* Logs the traffic of the daemon connection, see spice-vdagentd --stats-socket */
+static gboolean vdagent_stats_signal_handler(gpointer user_data)
+{
+    VDAgent *agent = user_data;
+    GString *report;
+    VDAgentPayloadStats payloads;
+    gchar **lines, **line;
+
+    if (agent->conn == NULL) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    report = g_string_new(NULL);
+    g_string_append_printf(report,
+        "spice_vdagent_queued_messages %u\nspice_vdagent_queued_bytes %" G_GSIZE_FORMAT "\n",
+        vdagent_connection_get_queued_messages(VDAGENT_CONNECTION(agent->conn)),
+        vdagent_connection_get_queued_bytes(VDAGENT_CONNECTION(agent->conn)));
+    vdagent_message_stats_append(report, "spice_vdagent_udscs", NULL,
+                                 udscs_get_stats(agent->conn),
+                                 VDAGENTD_NO_MESSAGES);
+    vdagent_payload_get_stats(&payloads);
+    g_string_append_printf(report,
+        "spice_vdagent_payload_heap_high_water_bytes %" G_GSIZE_FORMAT "\n"
+        "spice_vdagent_payload_spilled_high_water_bytes %" G_GSIZE_FORMAT "\n"
+        "spice_vdagent_payload_spills_total %" G_GUINT64_FORMAT "\n",
+        payloads.heap_high_water, payloads.spilled_high_water, payloads.spills);
+    lines = g_strsplit(report->str, "\n", -1);
+    for (line = lines; *line; line++) {
+        if (**line)
+            syslog(LOG_INFO, "%s", *line);
+    }
+    g_strfreev(lines);
+    g_string_free(report, TRUE);
+    return G_SOURCE_CONTINUE;
+}
+
 static VDAgent *vdagent_new(void)
 {
     VDAgent *agent = g_new0(VDAgent, 1);
@@ -356,14 +419,20 @@ static VDAgent *vdagent_new(void)
     g_unix_signal_add(SIGINT, vdagent_signal_handler, agent);
     g_unix_signal_add(SIGHUP, vdagent_signal_handler, agent);
     g_unix_signal_add(SIGTERM, vdagent_signal_handler, agent);
+    g_unix_signal_add(SIGUSR1, vdagent_stats_signal_handler, agent);
 
     return agent;
 }
 
 static void vdagent_destroy(VDAgent *agent)
 {
+    if (agent->socket_monitor) {
+        g_file_monitor_cancel(agent->socket_monitor);
+        g_clear_object(&agent->socket_monitor);
+    }
     vdagent_finalize_file_xfer(agent);
     vdagent_display_destroy(agent->display, agent->conn == NULL);
+    vdagent_audio_cleanup();
     g_clear_pointer(&agent->conn, vdagent_connection_destroy);
 
     while (g_source_remove_by_user_data(agent))
@@ -373,10 +442,66 @@ static void vdagent_destroy(VDAgent *agent)
     g_free(agent);
 }
 
+static gboolean vdagent_init_async_cb(gpointer user_data);
+
+static void socket_changed_cb(GFileMonitor     *monitor,
+                              GFile            *file,
+                              GFile            *other_file,
+                              GFileMonitorEvent event_type,
+                              gpointer          user_data)
+{
+    VDAgent *agent = user_data;
+
+    if (event_type != G_FILE_MONITOR_EVENT_CREATED || agent->conn != NULL)
+        return;
+
+    /* vdagentd is up, don't wait for the next retry */
+    if (agent->connect_retry_id != 0)
+        g_source_remove(agent->connect_retry_id);
+    agent->socket_created = TRUE;
+    agent->connect_retry_id = g_idle_add(vdagent_init_async_cb, agent);
+}
+
+static void vdagent_wait_for_daemon(VDAgent *agent)
+{
+    if (agent->socket_monitor == NULL) {
+        GFile *file = g_file_new_for_path(vdagentd_socket);
+
+        agent->socket_monitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE,
+                                                    NULL, NULL);
+        g_object_unref(file);
+        if (agent->socket_monitor != NULL) {
+            g_signal_connect(agent->socket_monitor, "changed",
+                             G_CALLBACK(socket_changed_cb), agent);
+        }
+    }
+
+    /* keep polling too: the socket may already exist with nobody
+     * listening yet, e.g. while vdagentd restarts */
+    agent->connect_retry_id = g_timeout_add_seconds(1, vdagent_init_async_cb, agent);
+}
+
+static void vdagent_log_startup_phase(const char *phase, gint64 *phase_start)
+{
+    gint64 now = g_get_monotonic_time();
+
+    if (debug)
+        syslog(LOG_DEBUG, "startup: %s took %" G_GINT64_FORMAT " ms",
+               phase, (now - *phase_start) / 1000);
+    *phase_start = now;
+}
+
 static gboolean vdagent_init_async_cb(gpointer user_data)
 {
     VDAgent *agent = user_data;
     GError *err = NULL;
+    gint64 phase_start;
+    gboolean counted = !agent->socket_created;
+
+    agent->connect_retry_id = 0;
+    agent->socket_created = FALSE;
+    if (agent->start_time == 0)
+        agent->start_time = g_get_monotonic_time();
 
     agent->conn = udscs_connect(vdagentd_socket,
                                 daemon_read_complete,
@@ -398,10 +523,17 @@ static gboolean vdagent_init_async_cb(gpointer user_data)
                    err->message);
         }
         g_error_free(err);
-        agent->udscs_num_retry++;
-        g_timeout_add_seconds(1, vdagent_init_async_cb, agent);
+        if (counted)
+            agent->udscs_num_retry++;
+        vdagent_wait_for_daemon(agent);
         return G_SOURCE_REMOVE;
     }
+    if (agent->socket_monitor) {
+        g_file_monitor_cancel(agent->socket_monitor);
+        g_clear_object(&agent->socket_monitor);
+    }
+    phase_start = agent->start_time;
+    vdagent_log_startup_phase("connecting to vdagentd", &phase_start);
     if (agent->udscs_num_retry != 0) {
         syslog(LOG_DEBUG,
                "Connected with spice-vdagentd after %d attempts",
@@ -413,13 +545,11 @@ static gboolean vdagent_init_async_cb(gpointer user_data)
     agent->display = vdagent_display_create(agent->conn, debug, x11_sync);
     if (agent->display == NULL)
         goto err_init;
-
-
-    if (!vdagent_init_file_xfer(agent))
-        syslog(LOG_WARNING, "File transfer is disabled");
+    vdagent_log_startup_phase("display", &phase_start);
 
     agent->clipboards = vdagent_clipboards_new(vdagent_display_get_x11(agent->display));
     vdagent_clipboards_set_conn(agent->clipboards, agent->conn);
+    vdagent_log_startup_phase("clipboards", &phase_start);
 
     if (parent_socket != -1) {
         if (write(parent_socket, "OK", 2) != 2)
@@ -428,6 +558,9 @@ static gboolean vdagent_init_async_cb(gpointer user_data)
         parent_socket = -1;
     }
 
+    if (debug)
+        syslog(LOG_DEBUG, "startup: ready after %" G_GINT64_FORMAT " ms",
+               (g_get_monotonic_time() - agent->start_time) / 1000);
     return G_SOURCE_REMOVE;
 
 err_init:
@@ -464,6 +597,9 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    if (payload_budget_mb >= 0)
+        vdagent_payload_set_budget((gsize)payload_budget_mb * 1024 * 1024);
+
     /* Set default path value if none was set */
     if (portdev == NULL)
         portdev = g_strdup(DEFAULT_VIRTIO_PORT_PATH);
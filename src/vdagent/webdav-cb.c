@@ -46,6 +46,9 @@ typedef enum clipboard_action {
 static GMount *webdav_mount;
 static GVolumeMonitor *monitor;
 static GCancellable *cancellable;
+/* translations waiting for the mount in progress */
+static GQueue pending_tasks = G_QUEUE_INIT;
+static gboolean mounting;
 
 static gchar *clipboard_data_to_uris(const gchar *target, const gchar *mount_uri,
     const gchar *data, gsize size, GError **err)
@@ -184,33 +187,51 @@ static void resolve_task(GTask *task, const gchar *target, GBytes *data)
 static void unmounted_cb(GMount *mount, gpointer user_data)
 {
     syslog(LOG_DEBUG, "%s unmounted", CLIPBOARD_WEBDAV_URI);
+    g_signal_handlers_disconnect_by_func(mount, unmounted_cb, NULL);
     g_clear_object(&webdav_mount);
 }
 
+/* resolve, or fail, all the translations that waited for the mount */
+static void mount_done(GError *err)
+{
+    GTask *task;
+
+    mounting = FALSE;
+    while ((task = g_queue_pop_head(&pending_tasks)) != NULL) {
+        if (err) {
+            g_task_return_error(task, g_error_copy(err));
+            g_object_unref(task);
+            continue;
+        }
+        gchar *target = g_object_get_data(G_OBJECT(task), "target");
+        GBytes *data = g_task_get_task_data(task);
+        resolve_task(task, target, data);
+    }
+}
+
 static void mount_found_cb(GObject *source, GAsyncResult *res, gpointer user_data)
 {
-    GTask *task = user_data;
     GError *err = NULL;
+    GMount *mount;
 
-    webdav_mount = g_file_find_enclosing_mount_finish(G_FILE(source), res, &err);
-
+    mount = g_file_find_enclosing_mount_finish(G_FILE(source), res, &err);
     if (err) {
-        g_task_return_error(task, err);
-        g_object_unref(task);
+        syslog(LOG_WARNING, "mount %s not found: %s", CLIPBOARD_WEBDAV_URI, err->message);
+        mount_done(err);
+        g_error_free(err);
+        return;
     }
     syslog(LOG_DEBUG, "mount %s found", CLIPBOARD_WEBDAV_URI);
 
+    webdav_mount = mount;
     g_signal_connect(webdav_mount, "unmounted", G_CALLBACK(unmounted_cb), NULL);
 
-    gchar *target = g_object_get_data(G_OBJECT(task), "target");
-    GBytes *data = g_task_get_task_data(task);
-    resolve_task(task, target, data);
+    mount_done(NULL);
 }
 
 static void mounted_cb(GObject *source, GAsyncResult *res, gpointer user_data)
 {
     GFile *f = G_FILE(source);
-    GTask *task = user_data;
     GError *err = NULL;
 
     g_file_mount_enclosing_volume_finish(f, res, &err);
@@ -218,28 +239,33 @@ static void mounted_cb(GObject *source, GAsyncResult *res, gpointer user_data)
     if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_ALREADY_MOUNTED)) {
         g_clear_error(&err);
     } else if (err) {
-        g_task_return_error(task, err);
-        g_object_unref(task);
+        syslog(LOG_WARNING, "mounting %s failed: %s", CLIPBOARD_WEBDAV_URI, err->message);
+        mount_done(err);
+        g_error_free(err);
         return;
     }
     syslog(LOG_DEBUG, "%s mounted successfully", CLIPBOARD_WEBDAV_URI);
 
-    g_file_find_enclosing_mount_async(f, G_PRIORITY_DEFAULT, cancellable, mount_found_cb, task);
+    g_file_find_enclosing_mount_async(f, G_PRIORITY_DEFAULT, cancellable, mount_found_cb, NULL);
 }
 
-static void clipboard_webdav_mount_async(GTask *task)
+/* starts mounting, unless it is mounted or being mounted already */
+static void clipboard_webdav_mount_async(void)
 {
-    g_return_if_fail(webdav_mount == NULL);
+    if (webdav_mount || mounting) {
+        return;
+    }
 
     syslog(LOG_DEBUG, "mounting %s", CLIPBOARD_WEBDAV_URI);
 
+    mounting = TRUE;
     GFile *f = g_file_new_for_uri(CLIPBOARD_WEBDAV_URI);
     g_file_mount_enclosing_volume(f,
                                   G_MOUNT_MOUNT_NONE,
                                   NULL, /* GMountOperation */
                                   cancellable,
                                   mounted_cb,
-                                  task);
+                                  NULL);
     g_object_unref(f);
 }
 
@@ -264,13 +290,19 @@ void clipboard_data_translate_to_uris_async(const gchar *target, GBytes *data,
     if (!webdav_mount) {
         g_task_set_task_data(task, g_bytes_ref(data), (GDestroyNotify)g_bytes_unref);
         g_object_set_data_full(G_OBJECT(task), "target", g_strdup(target), g_free);
-        clipboard_webdav_mount_async(task);
+        g_queue_push_tail(&pending_tasks, task);
+        clipboard_webdav_mount_async();
         return;
     }
 
     resolve_task(task, target, data);
 }
 
+void clipboard_webdav_prepare()
+{
+    clipboard_webdav_mount_async();
+}
+
 void clipboard_webdav_init()
 {
     /* we listen to the "unmounted" signal,
@@ -285,8 +317,16 @@ void clipboard_webdav_init()
 
 void clipboard_webdav_finalize()
 {
+    GError *err = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                                      "clipboard is going away");
+
+    mount_done(err);
+    g_error_free(err);
     g_cancellable_cancel(cancellable);
     g_clear_object(&cancellable);
-    g_clear_object(&webdav_mount);
+    if (webdav_mount) {
+        g_signal_handlers_disconnect_by_func(webdav_mount, unmounted_cb, NULL);
+        g_clear_object(&webdav_mount);
+    }
     g_clear_object(&monitor);
 }
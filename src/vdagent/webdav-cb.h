@@ -23,6 +23,10 @@
 void clipboard_webdav_init();
 void clipboard_webdav_finalize();
 
+/* mounts the client's shared folder in the background, so it is ready by the
+ * time a file list is pasted */
+void clipboard_webdav_prepare();
+
 /* converts the @data received from spice-gtk to the given @target;
  * supported targets are:
  * - "text/uri-list"
@@ -74,16 +74,22 @@ static const struct clipboard_format_tmpl clipboard_format_templates[] = {
 
 #define clipboard_format_count (sizeof(clipboard_format_templates)/sizeof(clipboard_format_templates[0]))
 
-#define ATOM_NAME_CACHE_SIZE 16
-struct atom_name_cache_item {
-    Atom atom;
-    char *name;
-};
+/* Incr chunks grow while the requestor takes them faster than
+   INCR_FAST_RTT and shrink when it takes longer than INCR_SLOW_RTT (usec) */
+#define INCR_MAX_CHUNK_SIZE (16 * 1024 * 1024)
+#define INCR_FAST_RTT (5 * 1000)
+#define INCR_SLOW_RTT (50 * 1000)
+
+/* Memory budget for guest clipboard data kept for repeated client requests */
+#define CLIPBOARD_CACHE_MAX_SIZE (32 * 1024 * 1024)
+#define CLIPBOARD_CACHE_TYPES (VD_AGENT_CLIPBOARD_FILE_LIST + 1)
 #endif
 
 #define MAX_SCREENS 16
 /* Same as qxl_dev.h client_monitors_config.heads count */
 #define MONITOR_SIZE_COUNT 64
+/* Number of recently used custom modes kept per output */
+#define MODE_CACHE_SIZE 4
 
 struct monitor_size {
     int width;
@@ -100,11 +106,19 @@ struct vdagent_x11 {
     Atom incr_atom;
     Atom multiple_atom;
     Atom timestamp_atom;
-    struct atom_name_cache_item atom_name_cache[ATOM_NAME_CACHE_SIZE];
-    int atom_name_cache_next;
+    /* Atom -> name, X never frees atoms so this can keep them */
+    GHashTable *atom_names;
+    /* target Atom -> VD_AGENT_CLIPBOARD type, index 1 is used while
+       the clipboard holds files */
+    GHashTable *target_types[2];
     Window selection_window;
     int xfixes_event_base;
     int max_prop_size;
+    /* Upper bound and current size of the chunks of an incr send, the size
+       adapts to how quickly the requestor takes them */
+    int max_incr_chunk_size;
+    int incr_chunk_size;
+    gint64 incr_chunk_sent_time;
     int expected_targets_notifies[256];
     int ignore_targets_notifies[256];
     int clipboard_owner[256];
@@ -120,10 +134,14 @@ struct vdagent_x11 {
     uint32_t clipboard_data_space;
     /* Data for selection_req which is currently being processed */
     struct vdagent_x11_selection_request *selection_req;
-    uint8_t *selection_req_data;
+    GBytes *selection_req_data;
     uint32_t selection_req_data_pos;
     uint32_t selection_req_data_size;
     GBytes *file_list_data[256];
+    /* Guest data sent to the client, per selection and type. Dropped when
+       the selection changes owner, which bumps the grab serial in vdagentd */
+    GBytes *clipboard_cache[256][CLIPBOARD_CACHE_TYPES];
+    gsize clipboard_cache_size;
     Atom selection_req_atom;
 #endif
     Window root_window[MAX_SCREENS];
@@ -137,6 +155,9 @@ struct vdagent_x11 {
         XRRScreenResources *res;
         XRROutputInfo **outputs;
         XRRCrtcInfo **crtcs;
+        /* request serial of the last full refresh, RRNotify events older
+           than this are already reflected in res, outputs and crtcs */
+        unsigned long res_serial;
         int event_base;
         int min_width;
         int max_width;
@@ -144,6 +165,8 @@ struct vdagent_x11 {
         int max_height;
         int num_monitors;
         struct monitor_size monitor_sizes[MONITOR_SIZE_COUNT];
+        /* sizes of the custom modes added to each output, most recent first */
+        struct monitor_size mode_cache[MONITOR_SIZE_COUNT][MODE_CACHE_SIZE];
         VDAgentMonitorsConfig *failed_conf;
     } randr;
 
@@ -100,6 +100,7 @@ static void update_randr_res(struct vdagent_x11 *x11, int poll)
     int i;
 
     free_randr_resources(x11);
+    x11->randr.res_serial = NextRequest(x11->display);
     if (poll)
         x11->randr.res = XRRGetScreenResources(x11->display, x11->root_window[0]);
     else
@@ -116,15 +117,80 @@ static void update_randr_res(struct vdagent_x11 *x11, int poll)
         x11->randr.crtcs[i] = XRRGetCrtcInfo(x11->display, x11->randr.res,
                                              x11->randr.res->crtcs[i]);
     }
-    /* XXX is this dynamic? should it be cached? */
-    if (XRRGetScreenSizeRange(x11->display, x11->root_window[0],
-                              &x11->randr.min_width,
-                              &x11->randr.min_height,
-                              &x11->randr.max_width,
-                              &x11->randr.max_height) != 1) {
-        syslog(LOG_ERR, "update_randr_res: XRRGetScreenSizeRange failed");
+    /* The size range is fixed by the driver, so only ask for it again when
+       the outputs are probed */
+    if (poll || x11->randr.max_width == 0) {
+        if (XRRGetScreenSizeRange(x11->display, x11->root_window[0],
+                                  &x11->randr.min_width,
+                                  &x11->randr.min_height,
+                                  &x11->randr.max_width,
+                                  &x11->randr.max_height) != 1) {
+            syslog(LOG_ERR, "update_randr_res: XRRGetScreenSizeRange failed");
+        }
+    }
+}
+
+#ifndef USE_GTK_FOR_MONITORS
+/* Apply a CRTC change to the cached resources without a round trip, the event
+   carries everything we use from the XRRCrtcInfo */
+static void update_randr_crtc(struct vdagent_x11 *x11,
+                              const XRRCrtcChangeNotifyEvent *ev)
+{
+    XRRCrtcInfo *crtc;
+
+    if (!x11->randr.res) {
+        update_randr_res(x11, 0);
+        return;
+    }
+    if (ev->serial < x11->randr.res_serial) {
+        return;
+    }
+
+    crtc = crtc_from_id(x11, ev->crtc);
+    if (crtc == NULL || (ev->mode != None && mode_from_id(x11, ev->mode) == NULL)) {
+        /* a CRTC or mode we have not seen yet */
+        update_randr_res(x11, 0);
+        return;
+    }
+
+    crtc->mode = ev->mode;
+    crtc->rotation = ev->rotation;
+    crtc->x = ev->x;
+    crtc->y = ev->y;
+    crtc->width = ev->width;
+    crtc->height = ev->height;
+}
+
+/* Returns TRUE when the connected outputs changed */
+static gboolean update_randr_output(struct vdagent_x11 *x11,
+                                    const XRROutputChangeNotifyEvent *ev)
+{
+    int i;
+
+    if (!x11->randr.res) {
+        update_randr_res(x11, 0);
+        return TRUE;
+    }
+    if (ev->serial < x11->randr.res_serial) {
+        return FALSE;
     }
+
+    for (i = 0 ; i < x11->randr.res->noutput; ++i) {
+        if (x11->randr.res->outputs[i] == ev->output) {
+            break;
+        }
+    }
+    if (i == x11->randr.res->noutput ||
+            x11->randr.outputs[i]->connection != ev->connection) {
+        /* hotplug, the modes of the output may have changed as well */
+        update_randr_res(x11, 0);
+        return TRUE;
+    }
+
+    x11->randr.outputs[i]->crtc = ev->crtc;
+    return FALSE;
 }
+#endif
 
 void vdagent_x11_randr_init(struct vdagent_x11 *x11)
 {
@@ -143,7 +209,8 @@ void vdagent_x11_randr_init(struct vdagent_x11 *x11)
     }
 
     XRRSelectInput(x11->display, x11->root_window[0],
-        RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask);
+        RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask |
+        RROutputChangeNotifyMask);
 
     if (x11->has_xrandr) {
         update_randr_res(x11, 0);
@@ -249,6 +316,29 @@ static void delete_mode(struct vdagent_x11 *x11, int output_index,
     update_randr_res(x11, 0);
 }
 
+/* The modes of the last few sizes of an output are kept, going back to one of
+   them then reuses it. The least recently used one is deleted once a new size
+   pushes it out. */
+static void mode_cache_use(struct vdagent_x11 *x11, int output_index,
+                           int width, int height)
+{
+    struct monitor_size *sizes = x11->randr.mode_cache[output_index];
+    int i;
+
+    for (i = 0; i < MODE_CACHE_SIZE; i++) {
+        if (sizes[i].width == width && sizes[i].height == height)
+            break;
+    }
+    if (i == MODE_CACHE_SIZE) {
+        i = MODE_CACHE_SIZE - 1;
+        delete_mode(x11, output_index, sizes[i].width, sizes[i].height);
+    }
+
+    memmove(&sizes[1], &sizes[0], i * sizeof(*sizes));
+    sizes[0].width = width;
+    sizes[0].height = height;
+}
+
 static void set_reduced_cvt_mode(XRRModeInfo *mode, int width, int height)
 {
     /* Code taken from hw/xfree86/modes/xf86cvt.c
@@ -355,8 +445,6 @@ static int xrandr_add_and_set(struct vdagent_x11 *x11, int output_index, int x,
     int xid;
     Status s;
     RROutput outputs[1];
-    int old_width;
-    int old_height;
 
     if (!x11->randr.res) {
         syslog(LOG_ERR, "%s: program error: missing RANDR", __FUNCTION__);
@@ -368,9 +456,6 @@ static int xrandr_add_and_set(struct vdagent_x11 *x11, int output_index, int x,
         return 0;
     }
 
-    old_width  = x11->randr.monitor_sizes[output_index].width;
-    old_height = x11->randr.monitor_sizes[output_index].height;
-
     if (x11->set_crtc_config_not_functional) {
         /* fail, set_best_mode will find something close. */
         return 0;
@@ -398,9 +483,7 @@ static int xrandr_add_and_set(struct vdagent_x11 *x11, int output_index, int x,
         return 0;
     }
 
-    /* clean the previous name, if any */
-    if (width != old_width || height != old_height)
-        delete_mode(x11, output_index, old_width, old_height);
+    mode_cache_use(x11, output_index, width, height);
 
     return 1;
 }
@@ -453,8 +536,7 @@ static void xrandr_disable_nth_output(struct vdagent_x11 *x11, int output_index)
     if (s != RRSetConfigSuccess)
         syslog(LOG_ERR, "failed to disable monitor");
 
-    delete_mode(x11, output_index, x11->randr.monitor_sizes[output_index].width,
-                             x11->randr.monitor_sizes[output_index].height);
+    /* the mode stays in the mode cache, for when the output is enabled again */
     x11->randr.monitor_sizes[output_index].width  = 0;
     x11->randr.monitor_sizes[output_index].height = 0;
 }
@@ -550,9 +632,22 @@ int vdagent_x11_randr_handle_event(struct vdagent_x11 *x11,
             break;
         }
         case RRNotify: {
+            const XRRNotifyEvent *ne = (const XRRNotifyEvent *) event;
+
+            if (ne->subtype == RRNotify_CrtcChange) {
 #ifndef USE_GTK_FOR_MONITORS
-            update_randr_res(x11, 0);
+                update_randr_crtc(x11, (const XRRCrtcChangeNotifyEvent *) event);
+#endif
+            } else if (ne->subtype == RRNotify_OutputChange) {
+                /* only hotplug is of interest to the client */
+#ifndef USE_GTK_FOR_MONITORS
+                if (!update_randr_output(x11,
+                        (const XRROutputChangeNotifyEvent *) event))
 #endif
+                    break;
+            } else {
+                break;
+            }
             if (!x11->dont_send_guest_xorg_res)
                 vdagent_display_send_daemon_guest_res(x11->vdagent_display, TRUE);
             break;
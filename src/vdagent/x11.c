@@ -54,6 +54,7 @@
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
 #include <X11/extensions/Xfixes.h>
+#include "vdagent-probes.h"
 #include "vdagentd-proto.h"
 #include "x11.h"
 #include "x11-priv.h"
@@ -192,6 +193,75 @@ gchar *vdagent_x11_get_wm_name(struct vdagent_x11 *x11)
     return net_wm_name;
 }
 
+#ifndef USE_GTK_FOR_CLIPBOARD
+/* Intern all the atoms we use in one round trip to the X server, and
+ * fill the caches which spare the round trips later on */
+static void vdagent_x11_intern_atoms(struct vdagent_x11 *x11)
+{
+    static const char *const fixed_names[] = {
+        "CLIPBOARD", "PRIMARY", "TARGETS", "INCR", "MULTIPLE", "TIMESTAMP",
+    };
+    Atom *const fixed_atoms[G_N_ELEMENTS(fixed_names)] = {
+        &x11->clipboard_atom, &x11->clipboard_primary_atom, &x11->targets_atom,
+        &x11->incr_atom, &x11->multiple_atom, &x11->timestamp_atom,
+    };
+    char *names[G_N_ELEMENTS(fixed_names) + clipboard_format_count *
+                G_N_ELEMENTS(clipboard_format_templates[0].atom_names)];
+    Atom atoms[G_N_ELEMENTS(names)];
+    int i, j, n = 0, count;
+    guint files;
+
+    for (i = 0; i < G_N_ELEMENTS(fixed_names); i++)
+        names[n++] = (char *)fixed_names[i];
+    for (i = 0; i < clipboard_format_count; i++)
+        for (j = 0; clipboard_format_templates[i].atom_names[j]; j++)
+            names[n++] = (char *)clipboard_format_templates[i].atom_names[j];
+    count = n;
+
+    XInternAtoms(x11->display, names, count, False, atoms);
+
+    n = 0;
+    for (i = 0; i < G_N_ELEMENTS(fixed_names); i++)
+        *fixed_atoms[i] = atoms[n++];
+    for (i = 0; i < clipboard_format_count; i++) {
+        x11->clipboard_formats[i].type = clipboard_format_templates[i].type;
+        for (j = 0; clipboard_format_templates[i].atom_names[j]; j++)
+            x11->clipboard_formats[i].atoms[j] = atoms[n++];
+        x11->clipboard_formats[i].atom_count = j;
+    }
+
+    x11->atom_names = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                            NULL, g_free);
+    for (i = 0; i < count; i++) {
+        if (!g_hash_table_contains(x11->atom_names, GUINT_TO_POINTER(atoms[i])))
+            g_hash_table_insert(x11->atom_names, GUINT_TO_POINTER(atoms[i]),
+                                g_strdup(names[i]));
+    }
+
+    /* The first format listing a target wins. Targets for
+       VD_AGENT_CLIPBOARD_FILE_LIST overlap with the text targets, so
+       the text format is left out while the clipboard holds files,
+       and the file list format otherwise. */
+    for (files = 0; files < 2; files++) {
+        x11->target_types[files] = g_hash_table_new(g_direct_hash, g_direct_equal);
+        for (i = 0; i < clipboard_format_count; i++) {
+            uint32_t type = x11->clipboard_formats[i].type;
+
+            if (type == (files ? VD_AGENT_CLIPBOARD_UTF8_TEXT :
+                                 VD_AGENT_CLIPBOARD_FILE_LIST))
+                continue;
+            for (j = 0; j < x11->clipboard_formats[i].atom_count; j++) {
+                gpointer atom = GUINT_TO_POINTER(x11->clipboard_formats[i].atoms[j]);
+
+                if (!g_hash_table_contains(x11->target_types[files], atom))
+                    g_hash_table_insert(x11->target_types[files], atom,
+                                        GUINT_TO_POINTER(type));
+            }
+        }
+    }
+}
+#endif
+
 struct vdagent_x11 *vdagent_x11_create(UdscsConnection *vdagentd,
                                        int debug, int sync)
 {
@@ -200,7 +270,7 @@ struct vdagent_x11 *vdagent_x11_create(UdscsConnection *vdagentd,
 #ifdef USE_GTK_FOR_CLIPBOARD
     int i;
 #else
-    int i, j, major, minor;
+    int i, major, minor;
 #endif
 
     x11 = g_new0(struct vdagent_x11, 1);
@@ -237,22 +307,7 @@ struct vdagent_x11 *vdagent_x11_create(UdscsConnection *vdagentd,
     for (i = 0; i < x11->screen_count; i++)
         x11->root_window[i] = RootWindow(x11->display, i);
 #ifndef USE_GTK_FOR_CLIPBOARD
-    x11->clipboard_atom = XInternAtom(x11->display, "CLIPBOARD", False);
-    x11->clipboard_primary_atom = XInternAtom(x11->display, "PRIMARY", False);
-    x11->targets_atom = XInternAtom(x11->display, "TARGETS", False);
-    x11->incr_atom = XInternAtom(x11->display, "INCR", False);
-    x11->multiple_atom = XInternAtom(x11->display, "MULTIPLE", False);
-    x11->timestamp_atom = XInternAtom(x11->display, "TIMESTAMP", False);
-    for(i = 0; i < clipboard_format_count; i++) {
-        x11->clipboard_formats[i].type = clipboard_format_templates[i].type;
-        for(j = 0; clipboard_format_templates[i].atom_names[j]; j++) {
-            x11->clipboard_formats[i].atoms[j] =
-                XInternAtom(x11->display,
-                            clipboard_format_templates[i].atom_names[j],
-                            False);
-        }
-        x11->clipboard_formats[i].atom_count = j;
-    }
+    vdagent_x11_intern_atoms(x11);
 
     /* We should not store properties (for selections) on the root window */
     x11->selection_window = XCreateSimpleWindow(x11->display, x11->root_window[0],
@@ -285,9 +340,13 @@ struct vdagent_x11 *vdagent_x11_create(UdscsConnection *vdagentd,
     } else {
         x11->max_prop_size = XMaxRequestSize(x11->display) - 100;
     }
+    /* Incr chunks may grow up to the real request size limit, which is
+       counted in 4 byte units */
+    x11->max_incr_chunk_size = MIN(x11->max_prop_size, INCR_MAX_CHUNK_SIZE / 4) * 4;
     /* Be a good X11 citizen and maximize the amount of data we send at once */
     if (x11->max_prop_size > 262144)
         x11->max_prop_size = 262144;
+    x11->max_incr_chunk_size = MAX(x11->max_incr_chunk_size, x11->max_prop_size);
 
     clipboard_webdav_init();
 #endif
@@ -319,11 +378,9 @@ void vdagent_x11_destroy(struct vdagent_x11 *x11, int vdagentd_disconnected)
         vdagent_x11_set_clipboard_owner(x11, sel, owner_none);
     }
 
-    for (int i = 0; i < ATOM_NAME_CACHE_SIZE; i++) {
-        if (x11->atom_name_cache[i].name) {
-            XFree(x11->atom_name_cache[i].name);
-        }
-    }
+    g_hash_table_destroy(x11->atom_names);
+    g_hash_table_destroy(x11->target_types[0]);
+    g_hash_table_destroy(x11->target_types[1]);
 
     clipboard_webdav_finalize();
 #endif
@@ -356,6 +413,52 @@ static void vdagent_x11_next_conversion_request(struct vdagent_x11 *x11)
     free(conversion_req);
 }
 
+static void vdagent_x11_clipboard_cache_clear(struct vdagent_x11 *x11,
+                                              uint8_t selection)
+{
+    uint32_t type;
+
+    for (type = 0; type < CLIPBOARD_CACHE_TYPES; type++) {
+        GBytes *bytes = x11->clipboard_cache[selection][type];
+
+        if (bytes) {
+            x11->clipboard_cache_size -= g_bytes_get_size(bytes);
+            g_bytes_unref(bytes);
+            x11->clipboard_cache[selection][type] = NULL;
+        }
+    }
+}
+
+/* Keep the converted data around so a repeated client request for the same
+   type can be answered without asking the owner again */
+static void vdagent_x11_clipboard_cache_add(struct vdagent_x11 *x11,
+    uint8_t selection, uint32_t type, GBytes *bytes)
+{
+    gsize size = g_bytes_get_size(bytes);
+    uint8_t sel;
+
+    if (type >= CLIPBOARD_CACHE_TYPES || size > CLIPBOARD_CACHE_MAX_SIZE)
+        return;
+
+    /* make room, dropping the data of the other selections first */
+    for (sel = 0; sel < VD_AGENT_CLIPBOARD_SELECTION_SECONDARY; sel++) {
+        if (x11->clipboard_cache_size + size <= CLIPBOARD_CACHE_MAX_SIZE)
+            break;
+        if (sel != selection)
+            vdagent_x11_clipboard_cache_clear(x11, sel);
+    }
+    if (x11->clipboard_cache_size + size > CLIPBOARD_CACHE_MAX_SIZE)
+        vdagent_x11_clipboard_cache_clear(x11, selection);
+
+    if (x11->clipboard_cache[selection][type]) {
+        x11->clipboard_cache_size -=
+            g_bytes_get_size(x11->clipboard_cache[selection][type]);
+        g_bytes_unref(x11->clipboard_cache[selection][type]);
+    }
+    x11->clipboard_cache[selection][type] = g_bytes_ref(bytes);
+    x11->clipboard_cache_size += size;
+}
+
 static void vdagent_x11_set_clipboard_owner(struct vdagent_x11 *x11,
     uint8_t selection, int new_owner)
 {
@@ -379,8 +482,7 @@ static void vdagent_x11_set_clipboard_owner(struct vdagent_x11 *x11,
             vdagent_x11_send_selection_notify(x11, None, curr_sel);
             if (prev_sel == NULL) {
                 x11->selection_req = next_sel;
-                free(x11->selection_req_data);
-                x11->selection_req_data = NULL;
+                g_clear_pointer(&x11->selection_req_data, g_bytes_unref);
                 x11->selection_req_data_pos = 0;
                 x11->selection_req_data_size = 0;
                 x11->selection_req_atom = None;
@@ -423,6 +525,7 @@ static void vdagent_x11_set_clipboard_owner(struct vdagent_x11 *x11,
 
     x11->clipboard_has_files[selection] = False;
     g_clear_pointer(&x11->file_list_data[selection], g_bytes_unref);
+    vdagent_x11_clipboard_cache_clear(x11, selection);
 
     if (new_owner == owner_none) {
         /* When going from owner_guest to owner_none we need to send a
@@ -522,6 +625,9 @@ static void vdagent_x11_handle_event(struct vdagent_x11 *x11, const XEvent *even
             return;
         }
 
+        /* The data cached from the previous owner is stale now */
+        vdagent_x11_clipboard_cache_clear(x11, selection);
+
         /* Request the supported targets from the new owner */
         XConvertSelection(x11->display, ev.xfev.selection, x11->targets_atom,
                           x11->targets_atom, x11->selection_window,
@@ -630,24 +736,48 @@ void vdagent_x11_do_read(struct vdagent_x11 *x11)
 #ifndef USE_GTK_FOR_CLIPBOARD
 static const char *vdagent_x11_get_atom_name(struct vdagent_x11 *x11, Atom a)
 {
+    char *name, *x_name;
+
     if (a == None)
         return "None";
 
-    for (int i = 0; i < ATOM_NAME_CACHE_SIZE; i++) {
-        if (x11->atom_name_cache[i].atom == a) {
-            return x11->atom_name_cache[i].name;
-        }
-    }
+    name = g_hash_table_lookup(x11->atom_names, GUINT_TO_POINTER(a));
+    if (name)
+        return name;
+
+    x_name = XGetAtomName(x11->display, a);
+    if (!x_name)
+        return NULL;
+    name = g_strdup(x_name);
+    XFree(x_name);
+    g_hash_table_insert(x11->atom_names, GUINT_TO_POINTER(a), name);
+    return name;
+}
 
-    struct atom_name_cache_item *cch;
-    cch = &x11->atom_name_cache[x11->atom_name_cache_next];
-    if (cch->name) {
-        XFree(cch->name);
+/* Look up the names of all atoms not in the cache yet in one round trip */
+static void vdagent_x11_cache_atom_names(struct vdagent_x11 *x11,
+                                         Atom *atoms, int count)
+{
+    Atom *missing = g_new(Atom, count);
+    char **names;
+    int i, n = 0;
+
+    for (i = 0; i < count; i++) {
+        if (atoms[i] != None &&
+            !g_hash_table_contains(x11->atom_names, GUINT_TO_POINTER(atoms[i])))
+            missing[n++] = atoms[i];
+    }
+
+    names = g_new0(char *, n);
+    if (n && XGetAtomNames(x11->display, missing, n, names)) {
+        for (i = 0; i < n; i++) {
+            g_hash_table_insert(x11->atom_names, GUINT_TO_POINTER(missing[i]),
+                                g_strdup(names[i]));
+            XFree(names[i]);
+        }
     }
-    cch->atom = a;
-    cch->name = XGetAtomName(x11->display, a);
-    x11->atom_name_cache_next = (x11->atom_name_cache_next + 1) % ATOM_NAME_CACHE_SIZE;
-    return cch->name;
+    g_free(names);
+    g_free(missing);
 }
 
 static int vdagent_x11_get_selection(struct vdagent_x11 *x11, const XEvent *event,
@@ -693,13 +823,9 @@ static int vdagent_x11_get_selection(struct vdagent_x11 *x11, const XEvent *even
             }
 
             if (x11->clipboard_data_space < prop_min_size) {
-                free(x11->clipboard_data);
-                x11->clipboard_data = malloc(prop_min_size);
-                if (!x11->clipboard_data) {
-                    SELPRINTF("out of memory allocating clipboard buffer");
-                    x11->clipboard_data_space = 0;
-                    goto exit;
-                }
+                vdagent_payload_free(x11->clipboard_data,
+                                     x11->clipboard_data_space);
+                x11->clipboard_data = vdagent_payload_alloc(prop_min_size);
                 x11->clipboard_data_space = prop_min_size;
             }
             x11->expect_property_notify = 1;
@@ -740,17 +866,20 @@ static int vdagent_x11_get_selection(struct vdagent_x11 *x11, const XEvent *even
     if (incr) {
         if (len) {
             if (x11->clipboard_data_size + len > x11->clipboard_data_space) {
-                void *old_clipboard_data = x11->clipboard_data;
-
-                x11->clipboard_data_space = x11->clipboard_data_size + len;
-                x11->clipboard_data = realloc(x11->clipboard_data,
-                                              x11->clipboard_data_space);
-                if (!x11->clipboard_data) {
-                    SELPRINTF("out of memory allocating clipboard buffer");
-                    x11->clipboard_data_space = 0;
-                    free(old_clipboard_data);
+                /* grow geometrically, so that large transfers aren't
+                 * copied over again for each chunk */
+                uint64_t space = MAX((uint64_t)x11->clipboard_data_space * 2,
+                                     (uint64_t)x11->clipboard_data_size + len);
+
+                if ((uint64_t)x11->clipboard_data_size + len > G_MAXUINT32) {
+                    SELPRINTF("clipboard data too large");
                     goto exit;
                 }
+                space = MIN(space, G_MAXUINT32);
+                x11->clipboard_data = vdagent_payload_realloc(x11->clipboard_data,
+                                                              x11->clipboard_data_space,
+                                                              space);
+                x11->clipboard_data_space = space;
             }
             memcpy(x11->clipboard_data + x11->clipboard_data_size, data, len);
             x11->clipboard_data_size += len;
@@ -788,7 +917,7 @@ static void vdagent_x11_get_selection_free(struct vdagent_x11 *x11,
     if (incr) {
         /* If the clipboard has grown large return the memory to the system */
         if (x11->clipboard_data_space > 512 * 1024) {
-            free(x11->clipboard_data);
+            vdagent_payload_free(x11->clipboard_data, x11->clipboard_data_space);
             x11->clipboard_data = NULL;
             x11->clipboard_data_space = 0;
         }
@@ -796,28 +925,35 @@ static void vdagent_x11_get_selection_free(struct vdagent_x11 *x11,
         XFree(data);
 }
 
+/* Wrap the data returned by vdagent_x11_get_selection() so it can be
+ * queued without a copy, the buffer is freed once it has been sent. */
+static GBytes *vdagent_x11_get_selection_bytes(struct vdagent_x11 *x11,
+    unsigned char *data, int len, int incr)
+{
+    if (len <= 0 || !data) {
+        vdagent_x11_get_selection_free(x11, data, incr);
+        return NULL;
+    }
+
+    if (incr) {
+        /* hand over the incr buffer, the next transfer allocates a new one */
+        GBytes *bytes = vdagent_payload_steal(data, x11->clipboard_data_space, len);
+
+        x11->clipboard_data = NULL;
+        x11->clipboard_data_space = 0;
+        return bytes;
+    }
+    return g_bytes_new_with_free_func(data, len, (GDestroyNotify)XFree, data);
+}
+
 static uint32_t vdagent_x11_target_to_type(struct vdagent_x11 *x11,
     uint8_t selection, Atom target)
 {
-    int i, j;
+    GHashTable *types = x11->target_types[x11->clipboard_has_files[selection] ? 1 : 0];
+    gpointer type;
 
-    for (i = 0; i < clipboard_format_count; i++) {
-        /* targets for VD_AGENT_CLIPBOARD_FILE_LIST overlap with the text targets */
-        if (x11->clipboard_has_files[selection]) {
-            if (x11->clipboard_formats[i].type == VD_AGENT_CLIPBOARD_UTF8_TEXT) {
-                continue;
-            }
-        } else {
-            if (x11->clipboard_formats[i].type == VD_AGENT_CLIPBOARD_FILE_LIST) {
-                continue;
-            }
-        }
-
-        for (j = 0; j < x11->clipboard_formats[i].atom_count; j++) {
-            if (x11->clipboard_formats[i].atoms[j] == target) {
-                return x11->clipboard_formats[i].type;
-            }
-        }
+    if (g_hash_table_lookup_extended(types, GUINT_TO_POINTER(target), NULL, &type)) {
+        return GPOINTER_TO_UINT(type);
     }
 
     VSELPRINTF("unexpected selection type %s",
@@ -857,6 +993,7 @@ static void vdagent_x11_handle_selection_notify(struct vdagent_x11 *x11,
 {
     int len = 0;
     unsigned char *data = NULL;
+    GBytes *bytes;
     uint32_t type;
     uint8_t selection = -1;
     Atom clip = None;
@@ -908,9 +1045,15 @@ static void vdagent_x11_handle_selection_notify(struct vdagent_x11 *x11,
         len = 0;
     }
 
-    udscs_write(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection, type,
-                data, len);
-    vdagent_x11_get_selection_free(x11, data, incr);
+    VDAGENT_PROBE(x11__selection__notify, selection, type, len);
+    bytes = vdagent_x11_get_selection_bytes(x11, data, len, incr);
+    udscs_write_bytes(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection, type,
+                      bytes);
+    if (bytes) {
+        if (type != VD_AGENT_CLIPBOARD_NONE)
+            vdagent_x11_clipboard_cache_add(x11, selection, type, bytes);
+        g_bytes_unref(bytes);
+    }
 
     vdagent_x11_next_conversion_request(x11);
     vdagent_x11_handle_conversion_request(x11);
@@ -933,6 +1076,8 @@ static void vdagent_x11_print_targets(struct vdagent_x11 *x11,
 {
     int i;
     VSELPRINTF("%s %d targets:", action, c);
+    if (x11->debug)
+        vdagent_x11_cache_atom_names(x11, atoms, c);
     for (i = 0; i < c; i++)
         VSELPRINTF("%s", vdagent_x11_get_atom_name(x11, atoms[i]));
 }
@@ -1160,6 +1305,7 @@ static void vdagent_x11_handle_property_delete_notify(struct vdagent_x11 *x11,
     XEvent *sel_event;
     int len;
     uint8_t selection;
+    gint64 now;
 
     assert(x11->selection_req);
     sel_event = &x11->selection_req->event;
@@ -1169,9 +1315,24 @@ static void vdagent_x11_handle_property_delete_notify(struct vdagent_x11 *x11,
         return;
     }
 
+    /* Send bigger chunks to requestors which keep up, so that large
+       transfers take fewer round trips, and back off for slow ones */
+    now = g_get_monotonic_time();
+    if (x11->incr_chunk_sent_time) {
+        gint64 rtt = now - x11->incr_chunk_sent_time;
+
+        if (rtt < INCR_FAST_RTT) {
+            x11->incr_chunk_size = MIN(x11->incr_chunk_size * 2,
+                                       x11->max_incr_chunk_size);
+        } else if (rtt > INCR_SLOW_RTT) {
+            x11->incr_chunk_size = MAX(x11->incr_chunk_size / 2,
+                                       x11->max_prop_size);
+        }
+    }
+
     len = x11->selection_req_data_size - x11->selection_req_data_pos;
-    if (len > x11->max_prop_size) {
-        len = x11->max_prop_size;
+    if (len > x11->incr_chunk_size) {
+        len = x11->incr_chunk_size;
     }
 
     if (len) {
@@ -1186,12 +1347,14 @@ static void vdagent_x11_handle_property_delete_notify(struct vdagent_x11 *x11,
     XChangeProperty(x11->display, sel_event->xselectionrequest.requestor,
                     x11->selection_req_atom,
                     sel_event->xselectionrequest.target, 8, PropModeReplace,
-                    x11->selection_req_data + x11->selection_req_data_pos,
+                    (const guint8 *)g_bytes_get_data(x11->selection_req_data, NULL) +
+                    x11->selection_req_data_pos,
                     len);
     if (vdagent_x11_restore_error_handler(x11)) {
         SELPRINTF("incr sent failed, requestor window gone");
         len = 0;
     }
+    x11->incr_chunk_sent_time = now;
 
     x11->selection_req_data_pos += len;
 
@@ -1199,8 +1362,7 @@ static void vdagent_x11_handle_property_delete_notify(struct vdagent_x11 *x11,
        incr transfer is done. Hence we do not check if we've send all data
        but instead check we've send the final 0 sized XChangeProperty. */
     if (len == 0) {
-        free(x11->selection_req_data);
-        x11->selection_req_data = NULL;
+        g_clear_pointer(&x11->selection_req_data, g_bytes_unref);
         x11->selection_req_data_pos = 0;
         x11->selection_req_data_size = 0;
         x11->selection_req_atom = None;
@@ -1231,6 +1393,13 @@ void vdagent_x11_clipboard_request(struct vdagent_x11 *x11,
         goto none;
     }
 
+    if (type < CLIPBOARD_CACHE_TYPES && x11->clipboard_cache[selection][type]) {
+        VSELPRINTF("answering clipboard request for type %u from cache", type);
+        udscs_write_bytes(x11->vdagentd, VDAGENTD_CLIPBOARD_DATA, selection,
+                          type, x11->clipboard_cache[selection][type]);
+        return;
+    }
+
     new_req = malloc(sizeof(*new_req));
     if (!new_req) {
         SELPRINTF("out of memory on client clipboard request, ignoring.");
@@ -1287,6 +1456,7 @@ void vdagent_x11_clipboard_grab(struct vdagent_x11 *x11, uint8_t selection,
     for (int i = 0; i < x11->clipboard_type_count[selection]; i++) {
         if (x11->clipboard_agent_types[selection][i] == VD_AGENT_CLIPBOARD_FILE_LIST) {
             x11->clipboard_has_files[selection] = True;
+            clipboard_webdav_prepare();
             break;
         }
     }
@@ -1301,10 +1471,11 @@ void vdagent_x11_clipboard_grab(struct vdagent_x11 *x11, uint8_t selection,
 }
 
 static void clipboard_data_send_to_requestor(struct vdagent_x11 *x11,
-    uint8_t selection, uint8_t *data, uint32_t size, Bool take_ownership)
+    uint8_t selection, GBytes *data)
 {
     XEvent *event;
     Atom prop;
+    gsize size = g_bytes_get_size(data);
 
     event = &x11->selection_req->event;
 
@@ -1324,21 +1495,13 @@ static void clipboard_data_send_to_requestor(struct vdagent_x11 *x11,
                         x11->incr_atom, 32, PropModeReplace,
                         (unsigned char*)&len, 1);
         if (vdagent_x11_restore_error_handler(x11) == 0) {
-            if (take_ownership) {
-                x11->selection_req_data = data;
-            } else {
-                /* duplicate data */
-                x11->selection_req_data = malloc(size);
-                if (x11->selection_req_data == NULL) {
-                    SELPRINTF("out of memory allocating selection buffer");
-                    return;
-                }
-                memcpy(x11->selection_req_data, data, size);
-            }
-
+            /* keep a reference instead of a copy */
+            x11->selection_req_data = g_bytes_ref(data);
             x11->selection_req_data_pos = 0;
             x11->selection_req_data_size = size;
             x11->selection_req_atom = prop;
+            x11->incr_chunk_size = x11->max_prop_size;
+            x11->incr_chunk_sent_time = 0;
             vdagent_x11_send_selection_notify(x11, prop, x11->selection_req);
         } else {
             SELPRINTF("clipboard data sent failed, requestor window gone");
@@ -1347,16 +1510,12 @@ static void clipboard_data_send_to_requestor(struct vdagent_x11 *x11,
         vdagent_x11_set_error_handler(x11, vdagent_x11_ignore_bad_window_handler);
         XChangeProperty(x11->display, event->xselectionrequest.requestor, prop,
                         event->xselectionrequest.target, 8, PropModeReplace,
-                        data, size);
+                        g_bytes_get_data(data, NULL), size);
         if (vdagent_x11_restore_error_handler(x11) == 0) {
             vdagent_x11_send_selection_notify(x11, prop, NULL);
         } else {
             SELPRINTF("clipboard data sent failed, requestor window gone");
         }
-
-        if (take_ownership) {
-            g_free(data);
-        }
     }
 }
 
@@ -1380,17 +1539,20 @@ static void uris_ready_cb(GObject *source, GAsyncResult *res, gpointer user_data
         g_error_free(err);
     }
 
-    clipboard_data_send_to_requestor(x11, selection, (uint8_t *)uris, size, True);
+    GBytes *data = g_bytes_new_take(uris, size);
+    clipboard_data_send_to_requestor(x11, selection, data);
+    g_bytes_unref(data);
 
     /* Flush output buffers and consume any pending events */
     vdagent_x11_do_read(x11);
 }
 
 void vdagent_x11_clipboard_data(struct vdagent_x11 *x11, uint8_t selection,
-    uint32_t type, uint8_t *data, uint32_t size)
+    uint32_t type, GBytes *data)
 {
     XEvent *event;
     uint32_t type_from_event;
+    gsize size = g_bytes_get_size(data);
 
     if (x11->selection_req_data) {
         if (type || size) {
@@ -1431,7 +1593,7 @@ void vdagent_x11_clipboard_data(struct vdagent_x11 *x11, uint8_t selection,
 
     if (type == VD_AGENT_CLIPBOARD_FILE_LIST) {
         g_clear_pointer(&x11->file_list_data[selection], g_bytes_unref);
-        x11->file_list_data[selection] = g_bytes_new(data, size);
+        x11->file_list_data[selection] = g_bytes_ref(data);
 
         clipboard_data_translate_to_uris_async(
             vdagent_x11_get_atom_name(x11, event->xselectionrequest.target),
@@ -1439,7 +1601,7 @@ void vdagent_x11_clipboard_data(struct vdagent_x11 *x11, uint8_t selection,
         );
         return;
     } else {
-        clipboard_data_send_to_requestor(x11, selection, data, size, False);
+        clipboard_data_send_to_requestor(x11, selection, data);
     }
 
     /* Flush output buffers and consume any pending events */
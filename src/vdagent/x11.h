@@ -44,7 +44,7 @@ void vdagent_x11_clipboard_grab(struct vdagent_x11 *x11, uint8_t selection,
 void vdagent_x11_clipboard_request(struct vdagent_x11 *x11,
     uint8_t selection, uint32_t type);
 void vdagent_x11_clipboard_data(struct vdagent_x11 *x11, uint8_t selection,
-    uint32_t type, uint8_t *data, uint32_t size);
+    uint32_t type, GBytes *data);
 void vdagent_x11_clipboard_release(struct vdagent_x11 *x11, uint8_t selection);
 
 void vdagent_x11_client_disconnected(struct vdagent_x11 *x11);
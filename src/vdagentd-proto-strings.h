@@ -37,6 +37,8 @@ static const char * const vdagentd_messages[] = {
         "file xfer disable",
         "client disconnected",
         "graphics device info",
+        "fd passing",
+        "file xfer ack",
 };
 
 #endif
@@ -45,6 +45,10 @@ enum {
     VDAGENTD_FILE_XFER_DISABLE,
     VDAGENTD_CLIENT_DISCONNECTED,  /* daemon -> client */
     VDAGENTD_GRAPHICS_DEVICE_INFO,  /* daemon -> client */
+    VDAGENTD_FD_PASSING, /* both ways, handled by udscs: the sender accepts
+                            large payloads passed in a sealed memfd */
+    VDAGENTD_FILE_XFER_ACK, /* agent -> daemon, arg1: task id,
+                               arg2: bytes written out */
     VDAGENTD_NO_MESSAGES /* Must always be last */
 };
 
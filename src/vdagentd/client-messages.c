@@ -0,0 +1,213 @@
+/*  client-messages.c validation and decoding of the messages from the client
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <stddef.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "client-messages.h"
+
+/* count integers of width bytes, starting offset bytes into the body,
+   are little endian, a count of 0 runs up to the end of the body */
+struct message_field {
+    uint8_t width;
+    uint8_t offset;
+    uint8_t count;
+};
+
+enum {
+    /* bodies are exactly min_size bytes, otherwise at least */
+    MESSAGE_EXACT_SIZE = 1 << 0,
+    /* with VD_AGENT_CAP_CLIPBOARD_SELECTION the body starts with 4 bytes
+       of selection, which the fields come after */
+    MESSAGE_SELECTION = 1 << 1,
+    /* with VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL 4 more bytes are required */
+    MESSAGE_GRAB_SERIAL = 1 << 2,
+};
+
+struct message_desc {
+    const char *name;
+    uint32_t min_size;
+    guint flags;
+    struct message_field fields[2];
+};
+
+#define UINT32_FIELDS  { 4, 0, 0 }
+
+static const struct message_desc message_descs[VDAGENT_CLIENT_MESSAGE_END] = {
+    [VD_AGENT_MOUSE_STATE] = {
+        "mouse-state", sizeof(VDAgentMouseState), MESSAGE_EXACT_SIZE,
+        { UINT32_FIELDS },
+    },
+    [VD_AGENT_MONITORS_CONFIG] = {
+        "monitors-config", sizeof(VDAgentMonitorsConfig), 0,
+        { UINT32_FIELDS },
+    },
+    [VD_AGENT_REPLY] = {
+        "reply", sizeof(VDAgentReply), MESSAGE_EXACT_SIZE,
+    },
+    [VD_AGENT_CLIPBOARD] = {
+        "clipboard", sizeof(VDAgentClipboard), MESSAGE_SELECTION,
+        { { 4, offsetof(VDAgentClipboard, type), 1 } },
+    },
+    [VD_AGENT_DISPLAY_CONFIG] = {
+        "display-config", sizeof(VDAgentDisplayConfig), MESSAGE_EXACT_SIZE,
+    },
+    [VD_AGENT_ANNOUNCE_CAPABILITIES] = {
+        "announce-capabilities", sizeof(VDAgentAnnounceCapabilities), 0,
+        { UINT32_FIELDS },
+    },
+    [VD_AGENT_CLIPBOARD_GRAB] = {
+        "clipboard-grab", sizeof(VDAgentClipboardGrab),
+        MESSAGE_SELECTION | MESSAGE_GRAB_SERIAL,
+        { UINT32_FIELDS },
+    },
+    [VD_AGENT_CLIPBOARD_REQUEST] = {
+        "clipboard-request", sizeof(VDAgentClipboardRequest),
+        MESSAGE_EXACT_SIZE | MESSAGE_SELECTION,
+        { { 4, offsetof(VDAgentClipboardRequest, type), 1 } },
+    },
+    [VD_AGENT_CLIPBOARD_RELEASE] = {
+        "clipboard-release", sizeof(VDAgentClipboardRelease),
+        MESSAGE_EXACT_SIZE | MESSAGE_SELECTION,
+    },
+    [VD_AGENT_FILE_XFER_START] = {
+        "file-xfer-start", sizeof(VDAgentFileXferStartMessage), 0,
+        { { 4, offsetof(VDAgentFileXferStartMessage, id), 1 } },
+    },
+    [VD_AGENT_FILE_XFER_STATUS] = {
+        "file-xfer-status", sizeof(VDAgentFileXferStatusMessage),
+        MESSAGE_EXACT_SIZE,
+        { { 4, offsetof(VDAgentFileXferStatusMessage, id), 2 } },
+    },
+    [VD_AGENT_FILE_XFER_DATA] = {
+        "file-xfer-data", sizeof(VDAgentFileXferDataMessage), 0,
+        { { 4, offsetof(VDAgentFileXferDataMessage, id), 1 },
+          { 8, offsetof(VDAgentFileXferDataMessage, size), 1 } },
+    },
+    [VD_AGENT_CLIENT_DISCONNECTED] = {
+        "client-disconnected", 0, MESSAGE_EXACT_SIZE,
+    },
+    [VD_AGENT_MAX_CLIPBOARD] = {
+        "max-clipboard", sizeof(VDAgentMaxClipboard), MESSAGE_EXACT_SIZE,
+        { UINT32_FIELDS },
+    },
+    [VD_AGENT_AUDIO_VOLUME_SYNC] = {
+        "audio-volume-sync", sizeof(VDAgentAudioVolumeSync), 0,
+        { { 2, offsetof(VDAgentAudioVolumeSync, volume), 0 } },
+    },
+    /* forwarded as is to the session agent, which converts it */
+    [VD_AGENT_GRAPHICS_DEVICE_INFO] = {
+        "graphics-device-info", sizeof(VDAgentGraphicsDeviceInfo), 0,
+    },
+#ifdef WITH_EXPERIMENTAL_PROTOCOL
+    [VDP_MOUSE_STATE_BATCH] = {
+        "mouse-state-batch", sizeof(VDPMouseStateBatch), 0,
+        { UINT32_FIELDS },
+    },
+#endif
+};
+
+#if G_BYTE_ORDER == G_BIG_ENDIAN
+/* Fields need not be aligned, the body is packed */
+static void message_field_from_le(const struct message_field *field,
+                                  uint8_t *body, uint32_t size)
+{
+    uint8_t *p = body + field->offset;
+    uint32_t i, count = (size - field->offset) / field->width;
+
+    if (field->count && field->count < count)
+        count = field->count;
+
+    for (i = 0; i < count; i++, p += field->width) {
+        switch (field->width) {
+        case 2: {
+            uint16_t v;
+            memcpy(&v, p, sizeof(v));
+            v = GUINT16_FROM_LE(v);
+            memcpy(p, &v, sizeof(v));
+            break;
+        }
+        case 4: {
+            uint32_t v;
+            memcpy(&v, p, sizeof(v));
+            v = GUINT32_FROM_LE(v);
+            memcpy(p, &v, sizeof(v));
+            break;
+        }
+        case 8: {
+            uint64_t v;
+            memcpy(&v, p, sizeof(v));
+            v = GUINT64_FROM_LE(v);
+            memcpy(p, &v, sizeof(v));
+            break;
+        }
+        }
+    }
+}
+#endif
+
+gboolean vdagent_message_decode(const VDAgentMessage *message_header,
+                                uint8_t *data,
+                                const uint32_t *caps, int caps_size)
+{
+    const struct message_desc *desc;
+    uint32_t min_size, prefix = 0;
+
+    if (message_header->protocol != VD_AGENT_PROTOCOL) {
+        syslog(LOG_ERR, "message with wrong protocol version ignoring");
+        return FALSE;
+    }
+
+    if (message_header->type >= VDAGENT_CLIENT_MESSAGE_END ||
+        message_descs[message_header->type].name == NULL) {
+        syslog(LOG_WARNING, "unknown message type %d, ignoring",
+               message_header->type);
+        return FALSE;
+    }
+    desc = &message_descs[message_header->type];
+
+    if ((desc->flags & MESSAGE_SELECTION) &&
+        VD_AGENT_HAS_CAPABILITY(caps, caps_size,
+                                VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
+        prefix = 4;
+    }
+    min_size = desc->min_size + prefix;
+    if ((desc->flags & MESSAGE_GRAB_SERIAL) &&
+        VD_AGENT_HAS_CAPABILITY(caps, caps_size,
+                                VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL)) {
+        min_size += 4;
+    }
+
+    if (message_header->size < min_size ||
+        ((desc->flags & MESSAGE_EXACT_SIZE) &&
+         message_header->size != min_size)) {
+        syslog(LOG_ERR, "read: invalid message size: %u for message type: %s",
+               message_header->size, desc->name);
+        return FALSE;
+    }
+
+#if G_BYTE_ORDER == G_BIG_ENDIAN
+    for (guint i = 0; i < G_N_ELEMENTS(desc->fields) && desc->fields[i].width; i++) {
+        message_field_from_le(&desc->fields[i], data + prefix,
+                              message_header->size - prefix);
+    }
+#endif
+    return TRUE;
+}
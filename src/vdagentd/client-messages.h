@@ -0,0 +1,76 @@
+/*  client-messages.h validation and decoding of the messages from the client
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __CLIENT_MESSAGES_H
+#define __CLIENT_MESSAGES_H
+
+#include <stdint.h>
+#include <glib.h>
+#include <spice/vd_agent.h>
+
+#ifdef WITH_EXPERIMENTAL_PROTOCOL
+/* Not part of spice-protocol: once the agent announced
+   VDP_CAP_MOUSE_STATE_BATCH, the client can send the mouse states it
+   sampled since its last message in one VDP_MOUSE_STATE_BATCH. Nothing
+   reserves the message type or the capability number upstream, this is
+   only for testing with a client built with the same extension. */
+#define VDP_MOUSE_STATE_BATCH 17
+#define VDP_CAP_MOUSE_STATE_BATCH 19
+
+/* Most samples in a batch */
+#define VDP_MOUSE_STATE_BATCH_MAX 64
+
+#include <spice/start-packed.h>
+
+typedef struct SPICE_ATTR_PACKED VDPMouseSample {
+    /* us since the previous sample, for the first one since the last
+       sample of the previous batch. uinput timestamps the events as they
+       are written, so vdagentd keeps the order but not the pacing */
+    uint32_t time;
+    uint32_t x;
+    uint32_t y;
+    uint32_t buttons;
+    uint32_t display_id;
+} VDPMouseSample;
+
+typedef struct SPICE_ATTR_PACKED VDPMouseStateBatch {
+    uint32_t count;
+    VDPMouseSample samples[0];
+} VDPMouseStateBatch;
+
+#include <spice/end-packed.h>
+
+/* Message types known to vdagent_message_decode(), the ones of
+   spice-protocol and the above */
+#define VDAGENT_CLIENT_MESSAGE_END \
+    MAX(VD_AGENT_END_MESSAGE, VDP_MOUSE_STATE_BATCH + 1)
+#else
+#define VDAGENT_CLIENT_MESSAGE_END VD_AGENT_END_MESSAGE
+#endif
+
+/* Checks the size of the message against the layout of its type, given
+   the capabilities announced by the client, and converts the integers of
+   the body to host byte order in place. Returns FALSE, after logging why,
+   if the message is to be ignored.
+
+   Little endian hosts have nothing to convert, there this only checks. */
+gboolean vdagent_message_decode(const VDAgentMessage *message_header,
+                                uint8_t *data,
+                                const uint32_t *caps, int caps_size);
+
+#endif
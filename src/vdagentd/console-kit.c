@@ -39,6 +39,10 @@ struct session_info {
     gchar *match_session_signals;
     gboolean session_is_locked;
     gboolean session_idle_hint;
+    /* Answers of the blocking ConsoleKit calls we would otherwise repeat,
+     * dropped whenever the active session changes */
+    gint active_session_is_user; /* -1 when unknown */
+    GHashTable *session_uids;    /* session object path -> uid */
 };
 
 #define INTERFACE_CONSOLE_KIT "org.freedesktop.ConsoleKit"
@@ -61,6 +65,12 @@ struct session_info {
 static char *console_kit_get_first_seat(struct session_info *info);
 static char *console_kit_check_active_session_change(struct session_info *info);
 
+static void si_session_cache_clear(struct session_info *info)
+{
+    info->active_session_is_user = -1;
+    g_hash_table_remove_all(info->session_uids);
+}
+
 static void si_dbus_match_remove(struct session_info *info)
 {
     DBusError error;
@@ -160,6 +170,7 @@ si_dbus_read_signals(struct session_info *info)
             gchar *session;
 
             g_clear_pointer(&info->active_session, g_free);
+            si_session_cache_clear(info);
 
             dbus_message_iter_init(message, &iter);
             type = dbus_message_iter_get_arg_type(&iter);
@@ -222,6 +233,9 @@ struct session_info *session_info_create(int verbose)
     info->verbose = verbose;
     info->session_is_locked = FALSE;
     info->session_idle_hint = FALSE;
+    info->active_session_is_user = -1;
+    info->session_uids = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, NULL);
 
     dbus_error_init(&error);
     info->connection = dbus_bus_get_private(DBUS_BUS_SYSTEM, &error);
@@ -232,6 +246,7 @@ struct session_info *session_info_create(int verbose)
              dbus_error_free(&error);
         } else
              syslog(LOG_ERR, "Unable to connect to system bus");
+        g_hash_table_destroy(info->session_uids);
         g_free(info);
         return NULL;
     }
@@ -260,6 +275,7 @@ void session_info_destroy(struct session_info *info)
     dbus_connection_close(info->connection);
     g_free(info->seat);
     g_free(info->active_session);
+    g_hash_table_destroy(info->session_uids);
     g_free(info);
 }
 
@@ -512,6 +528,9 @@ gboolean session_info_is_user(struct session_info *info)
     g_return_val_if_fail (info->connection != NULL, TRUE);
     g_return_val_if_fail (info->active_session != NULL, TRUE);
 
+    if (info->active_session_is_user != -1)
+        return info->active_session_is_user;
+
     message = dbus_message_new_method_call(INTERFACE_CONSOLE_KIT,
                                            info->active_session,
                                            INTERFACE_CONSOLE_KIT_SESSION,
@@ -558,6 +577,7 @@ gboolean session_info_is_user(struct session_info *info)
         syslog(LOG_DEBUG, "(console-kit) session-type is '%s'", session_type);
 
     ret = (g_strcmp0 (session_type, "LoginWindow") != 0);
+    info->active_session_is_user = ret;
 
 exit:
     if (reply != NULL) {
@@ -577,11 +597,18 @@ uid_t session_info_uid_for_session(struct session_info *info, const char *sessio
     uint32_t uid;
     uid_t ret = -1;
     const char *err_msg;
+    gpointer cached_uid;
 
     g_return_val_if_fail(info != NULL, ret);
     g_return_val_if_fail(info->connection != NULL, ret);
     g_return_val_if_fail(info->active_session != NULL, ret);
 
+    if (session != NULL &&
+        g_hash_table_lookup_extended(info->session_uids, session,
+                                     NULL, &cached_uid)) {
+        return GPOINTER_TO_UINT(cached_uid);
+    }
+
     dbus_error_init(&error);
 
     err_msg = "(console-kit) Unable to create dbus message for GetUnixUser";
@@ -617,6 +644,9 @@ uid_t session_info_uid_for_session(struct session_info *info, const char *sessio
 
     err_msg = NULL;
     ret = uid;
+    if (session != NULL)
+        g_hash_table_insert(info->session_uids, g_strdup(session),
+                            GUINT_TO_POINTER(uid));
 
 exit:
     if (err_msg) {
@@ -0,0 +1,424 @@
+/*  input-thread.c vdagentd mouse injection thread
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <string.h>
+#include <syslog.h>
+#include <glib.h>
+
+#include "input-thread.h"
+#include "vdagent-probes.h"
+
+/* Mouse states the main thread can queue ahead of the input thread,
+ * must be a power of 2 */
+#define INPUT_RING_SIZE 256
+
+struct input_mouse {
+    VDAgentMouseState mouse;
+    guint64 id;
+    gint64 time;
+    /* part of a batch, so never coalesced */
+    gboolean batched;
+};
+
+/* Immutable once published, the thread keeps the one the tablet was set
+ * up with, as the tablet refers to its screen_info */
+struct input_geometry {
+    gboolean close;
+    int width;
+    int height;
+    struct vdagentd_guest_xorg_resolution *screen_info;
+    int screen_count;
+};
+
+struct vdagentd_input {
+    /* Single producer, single consumer ring: only the main thread
+     * advances head, only the input thread advances tail */
+    struct input_mouse ring[INPUT_RING_SIZE];
+    guint head;
+    guint tail;
+    /* states queued before this head are dropped */
+    guint drop_head;
+
+    /* Latest geometry the thread did not pick up yet, it is swapped out
+     * whole, so the thread never sees a half updated one */
+    struct input_geometry *geometry;
+
+    /* only taken to sleep and wake up */
+    GMutex lock;
+    GCond cond;
+    gint waiting;
+    gboolean quit;
+    GThread *thread;
+
+    vdagentd_input_error_cb error_cb;
+
+    GMutex stats_lock;
+    struct vdagentd_input_stats stats;
+
+    /* owned by the thread */
+    const char *devname;
+    int debug;
+    int fake;
+    struct vdagentd_uinput *uinput;
+    struct input_geometry *current;
+    gboolean failed;
+    /* buttons of the last state written to the tablet */
+    guint32 last_buttons;
+    /* states injected with the next write to the tablet */
+    struct input_mouse frames[INPUT_RING_SIZE];
+    VDAgentMouseState states[INPUT_RING_SIZE];
+};
+
+static void input_geometry_free(struct input_geometry *geometry)
+{
+    if (geometry) {
+        g_free(geometry->screen_info);
+        g_free(geometry);
+    }
+}
+
+/* Hand @geometry to the thread, returns the one it did not pick up */
+static struct input_geometry *input_geometry_swap(struct vdagentd_input *input,
+                                                  struct input_geometry *geometry)
+{
+    struct input_geometry *old;
+
+    do {
+        old = g_atomic_pointer_get(&input->geometry);
+    } while (!g_atomic_pointer_compare_and_exchange(&input->geometry,
+                                                    old, geometry));
+    return old;
+}
+
+static gboolean input_has_work(struct vdagentd_input *input)
+{
+    return g_atomic_int_get(&input->head) != input->tail ||
+           g_atomic_pointer_get(&input->geometry) != NULL;
+}
+
+static void input_wake(struct vdagentd_input *input)
+{
+    /* the thread sets waiting before checking for work one last time */
+    if (g_atomic_int_get(&input->waiting)) {
+        g_mutex_lock(&input->lock);
+        g_cond_signal(&input->cond);
+        g_mutex_unlock(&input->lock);
+    }
+}
+
+/* Returns FALSE when the thread is to quit */
+static gboolean input_wait(struct vdagentd_input *input)
+{
+    gboolean quit;
+
+    g_mutex_lock(&input->lock);
+    g_atomic_int_set(&input->waiting, TRUE);
+    while (!input->quit && !input_has_work(input)) {
+        g_cond_wait(&input->cond, &input->lock);
+    }
+    g_atomic_int_set(&input->waiting, FALSE);
+    quit = input->quit;
+    g_mutex_unlock(&input->lock);
+    return !quit;
+}
+
+static gboolean input_error_idle(gpointer user_data)
+{
+    struct vdagentd_input *input = user_data;
+
+    input->error_cb();
+    return G_SOURCE_REMOVE;
+}
+
+static void input_open(struct vdagentd_input *input)
+{
+    struct input_geometry *geometry = input->current;
+
+    if (input->failed) {
+        return;
+    }
+    /* A tablet handed to vdagentd_input_new() which failed can't be
+     * reopened before a geometry came in, this is fatal as well */
+    if (geometry == NULL) {
+        input->failed = TRUE;
+        g_idle_add(input_error_idle, input);
+        return;
+    }
+    input->last_buttons = 0;
+    input->uinput = vdagentd_uinput_create(input->devname,
+                                           geometry->width, geometry->height,
+                                           geometry->screen_info,
+                                           geometry->screen_count,
+                                           input->debug, input->fake);
+    if (!input->uinput) {
+        input->failed = TRUE;
+        g_idle_add(input_error_idle, input);
+    }
+}
+
+static void input_update_geometry(struct vdagentd_input *input)
+{
+    struct input_geometry *geometry = input_geometry_swap(input, NULL);
+
+    if (geometry == NULL) {
+        return;
+    }
+    if (geometry->close) {
+        vdagentd_uinput_destroy(&input->uinput);
+        input_geometry_free(geometry);
+        g_clear_pointer(&input->current, input_geometry_free);
+        return;
+    }
+
+    if (input->uinput) {
+        vdagentd_uinput_update_size(&input->uinput,
+                                    geometry->width, geometry->height,
+                                    geometry->screen_info,
+                                    geometry->screen_count);
+    }
+    /* the tablet refers to the new screen_info now */
+    input_geometry_free(input->current);
+    input->current = geometry;
+    if (!input->uinput) {
+        input_open(input);
+    }
+}
+
+static gboolean input_pop(struct vdagentd_input *input, struct input_mouse *mouse)
+{
+    while (input->tail != g_atomic_int_get(&input->head)) {
+        guint drop_head = g_atomic_int_get(&input->drop_head);
+        gboolean drop = (gint)(drop_head - input->tail) > 0;
+
+        *mouse = input->ring[input->tail & (INPUT_RING_SIZE - 1)];
+        g_atomic_int_set(&input->tail, input->tail + 1);
+        if (!drop) {
+            return TRUE;
+        }
+        g_mutex_lock(&input->stats_lock);
+        input->stats.states_dropped++;
+        g_mutex_unlock(&input->stats_lock);
+    }
+    return FALSE;
+}
+
+static void input_inject(struct vdagentd_input *input, guint n_frames)
+{
+    gint64 now;
+    guint i;
+
+    /* the tablet is closed while there is no agent in the active session */
+    if (n_frames == 0 || (input->uinput == NULL && input->current == NULL)) {
+        return;
+    }
+
+    for (i = 0; i < n_frames; i++) {
+        struct input_mouse *mouse = &input->frames[i];
+
+        VDAGENT_PROBE(mouse__inject, mouse->id, mouse->mouse.x, mouse->mouse.y,
+                      mouse->mouse.buttons);
+        input->states[i] = mouse->mouse;
+    }
+    vdagentd_uinput_do_mouse_batch(&input->uinput, input->states, n_frames);
+    input->last_buttons = input->frames[n_frames - 1].mouse.buttons;
+    if (!input->uinput) {
+        /* Try to re-open the tablet */
+        input_open(input);
+    }
+
+    now = g_get_monotonic_time();
+    g_mutex_lock(&input->stats_lock);
+    for (i = 0; i < n_frames; i++) {
+        stats_histogram_add(&input->stats.latency, now - input->frames[i].time);
+    }
+    g_mutex_unlock(&input->stats_lock);
+}
+
+/* Whether @next can replace frames[n_frames - 1]: both must be plain
+ * motion, the frame being replaced must not carry a button or wheel
+ * transition from the one before it, as its position would be lost */
+static gboolean input_can_coalesce(struct vdagentd_input *input,
+                                   guint n_frames,
+                                   const struct input_mouse *next)
+{
+    const struct input_mouse *last;
+    guint32 prev_buttons;
+
+    if (n_frames == 0) {
+        return FALSE;
+    }
+    last = &input->frames[n_frames - 1];
+    prev_buttons = n_frames > 1 ? input->frames[n_frames - 2].mouse.buttons :
+                                  input->last_buttons;
+    return !last->batched && !next->batched &&
+           last->mouse.buttons == prev_buttons &&
+           last->mouse.display_id == next->mouse.display_id &&
+           last->mouse.buttons == next->mouse.buttons;
+}
+
+static gpointer input_thread(gpointer user_data)
+{
+    struct vdagentd_input *input = user_data;
+    struct input_mouse next;
+    guint n_frames;
+    guint64 coalesced;
+
+    while (input_wait(input)) {
+        input_update_geometry(input);
+
+        /* Everything queued goes to the tablet with one write. Button and
+         * wheel transitions and batched states get a frame of their own,
+         * so only plain motion gets coalesced */
+        n_frames = 0;
+        coalesced = 0;
+        while (n_frames < INPUT_RING_SIZE && input_pop(input, &next)) {
+            if (input_can_coalesce(input, n_frames, &next)) {
+                input->frames[n_frames - 1] = next;
+                coalesced++;
+            } else {
+                input->frames[n_frames++] = next;
+            }
+        }
+        input_inject(input, n_frames);
+        if (coalesced) {
+            g_mutex_lock(&input->stats_lock);
+            input->stats.motion_coalesced += coalesced;
+            g_mutex_unlock(&input->stats_lock);
+        }
+    }
+
+    vdagentd_uinput_destroy(&input->uinput);
+    g_clear_pointer(&input->current, input_geometry_free);
+    return NULL;
+}
+
+struct vdagentd_input *vdagentd_input_new(const char *devname,
+    int debug, int fake, struct vdagentd_uinput *uinput,
+    vdagentd_input_error_cb error_cb)
+{
+    struct vdagentd_input *input = g_new0(struct vdagentd_input, 1);
+
+    input->devname = devname;
+    input->debug = debug;
+    input->fake = fake;
+    input->uinput = uinput;
+    input->error_cb = error_cb;
+    g_mutex_init(&input->lock);
+    g_cond_init(&input->cond);
+    g_mutex_init(&input->stats_lock);
+    input->thread = g_thread_new("input", input_thread, input);
+    return input;
+}
+
+void vdagentd_input_destroy(struct vdagentd_input *input)
+{
+    if (!input)
+        return;
+
+    g_mutex_lock(&input->lock);
+    input->quit = TRUE;
+    g_cond_signal(&input->cond);
+    g_mutex_unlock(&input->lock);
+    g_thread_join(input->thread);
+
+    /* a pending error report refers to input */
+    while (g_idle_remove_by_data(input)) {
+        continue;
+    }
+    input_geometry_free(input_geometry_swap(input, NULL));
+    g_mutex_clear(&input->lock);
+    g_cond_clear(&input->cond);
+    g_mutex_clear(&input->stats_lock);
+    g_free(input);
+}
+
+static gboolean input_push(struct vdagentd_input *input,
+    const VDAgentMouseState *mice, guint count, guint64 id, gboolean batched)
+{
+    guint head = input->head;
+    gint64 now = g_get_monotonic_time();
+    guint i;
+
+    if (INPUT_RING_SIZE - (head - g_atomic_int_get(&input->tail)) < count) {
+        return FALSE;
+    }
+
+    for (i = 0; i < count; i++) {
+        struct input_mouse *slot = &input->ring[(head + i) & (INPUT_RING_SIZE - 1)];
+
+        slot->mouse = mice[i];
+        slot->id = id;
+        slot->time = now;
+        slot->batched = batched;
+    }
+    g_atomic_int_set(&input->head, head + count);
+    input_wake(input);
+    return TRUE;
+}
+
+gboolean vdagentd_input_push_mouse(struct vdagentd_input *input,
+    const VDAgentMouseState *mouse, guint64 id)
+{
+    return input_push(input, mouse, 1, id, FALSE);
+}
+
+gboolean vdagentd_input_push_mouse_batch(struct vdagentd_input *input,
+    const VDAgentMouseState *mice, guint count, guint64 id)
+{
+    return input_push(input, mice, count, id, TRUE);
+}
+
+void vdagentd_input_drop_mouse(struct vdagentd_input *input)
+{
+    g_atomic_int_set(&input->drop_head, input->head);
+}
+
+void vdagentd_input_set_geometry(struct vdagentd_input *input,
+    int width, int height,
+    const struct vdagentd_guest_xorg_resolution *screen_info,
+    int screen_count)
+{
+    struct input_geometry *geometry = g_new0(struct input_geometry, 1);
+
+    geometry->width = width;
+    geometry->height = height;
+    geometry->screen_info = g_memdup2(screen_info,
+                                      screen_count * sizeof(*screen_info));
+    geometry->screen_count = screen_count;
+
+    input_geometry_free(input_geometry_swap(input, geometry));
+    input_wake(input);
+}
+
+void vdagentd_input_close(struct vdagentd_input *input)
+{
+    struct input_geometry *geometry = g_new0(struct input_geometry, 1);
+
+    geometry->close = TRUE;
+    input_geometry_free(input_geometry_swap(input, geometry));
+    input_wake(input);
+}
+
+void vdagentd_input_get_stats(struct vdagentd_input *input,
+    struct vdagentd_input_stats *stats)
+{
+    g_mutex_lock(&input->stats_lock);
+    *stats = input->stats;
+    g_mutex_unlock(&input->stats_lock);
+}
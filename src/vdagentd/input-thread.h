@@ -0,0 +1,78 @@
+/*  input-thread.h vdagentd mouse injection thread header
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __VDAGENTD_INPUT_THREAD_H
+#define __VDAGENTD_INPUT_THREAD_H
+
+#include <glib.h>
+#include <spice/vd_agent.h>
+#include "uinput.h"
+#include "stats.h"
+
+/* The input thread owns the uinput tablet and injects the client mouse
+ * states into it, so that the main loop, busy with the clipboard, file
+ * transfers and session changes, doesn't add to the cursor latency.
+ *
+ * All the functions below are to be called from the main thread. */
+struct vdagentd_input;
+
+/* Called from the main context when the tablet could not be (re)opened */
+typedef void (*vdagentd_input_error_cb)(void);
+
+/* @uinput, which may be NULL, is handed over to the thread */
+struct vdagentd_input *vdagentd_input_new(const char *devname,
+    int debug, int fake, struct vdagentd_uinput *uinput,
+    vdagentd_input_error_cb error_cb);
+void vdagentd_input_destroy(struct vdagentd_input *input);
+
+/* Queue @mouse for injection, @id is reported by the mouse__inject probe.
+ * Motion on the same display with unchanged buttons that queued up while
+ * the thread was busy is coalesced. Returns FALSE when the queue was full
+ * and @mouse was dropped. */
+gboolean vdagentd_input_push_mouse(struct vdagentd_input *input,
+    const VDAgentMouseState *mouse, guint64 id);
+
+/* Queue the @count states of a batch, they are injected in order, none of
+ * them coalesced, with as few writes to uinput as possible. Returns FALSE
+ * when the queue had no room for all of them and the batch was dropped. */
+gboolean vdagentd_input_push_mouse_batch(struct vdagentd_input *input,
+    const VDAgentMouseState *mice, guint count, guint64 id);
+
+/* Drop the mouse states that were queued but not injected yet */
+void vdagentd_input_drop_mouse(struct vdagentd_input *input);
+
+/* Publish the geometry of the active session, the thread opens or resizes
+ * the tablet once it picks it up. @screen_info is copied. */
+void vdagentd_input_set_geometry(struct vdagentd_input *input,
+    int width, int height,
+    const struct vdagentd_guest_xorg_resolution *screen_info,
+    int screen_count);
+
+/* Close the tablet, the next vdagentd_input_set_geometry() opens it again */
+void vdagentd_input_close(struct vdagentd_input *input);
+
+struct vdagentd_input_stats {
+    guint64 motion_coalesced;
+    guint64 states_dropped;
+    /* from vdagentd_input_push_mouse() to the write to uinput */
+    StatsHistogram latency;
+};
+
+void vdagentd_input_get_stats(struct vdagentd_input *input,
+    struct vdagentd_input_stats *stats);
+
+#endif
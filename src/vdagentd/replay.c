@@ -0,0 +1,220 @@
+/*  replay.c spice-vdagentd-replay, plays back a virtio port capture
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
+#include <glib/gstdio.h>
+#include <spice/vd_agent.h>
+
+#include "virtio-capture.h"
+
+static gboolean fast = FALSE;
+static gchar **arguments = NULL;
+
+static GOptionEntry entries[] = {
+    { "fast", 'f', 0, G_OPTION_ARG_NONE, &fast,
+      "Send as fast as possible instead of at the recorded pace", NULL },
+    { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &arguments,
+      NULL, "<capture> <socket>" },
+    { NULL }
+};
+
+/* Reads and drops whatever spice-vdagentd sends, so it never blocks */
+static gpointer drain_thread(gpointer user_data)
+{
+    GInputStream *in = user_data;
+    char buf[64 * 1024];
+
+    while (g_input_stream_read(in, buf, sizeof(buf), NULL, NULL) > 0) {
+        continue;
+    }
+    return NULL;
+}
+
+static gboolean send_chunk(GOutputStream *out, uint32_t port,
+                           const void *data, uint32_t size, GError **err)
+{
+    VDIChunkHeader header = {
+        .port = GUINT32_TO_LE(port),
+        .size = GUINT32_TO_LE(size),
+    };
+
+    return g_output_stream_write_all(out, &header, sizeof(header),
+                                     NULL, NULL, err) &&
+           g_output_stream_write_all(out, data, size, NULL, NULL, err);
+}
+
+/* Only the header of the message was captured, send a zero filled body */
+static gboolean send_message(GOutputStream *out, uint32_t port, uint32_t type,
+                             uint32_t size, GError **err)
+{
+    static uint8_t chunk[VD_AGENT_MAX_DATA_SIZE];
+    VDAgentMessage *message = (VDAgentMessage *)chunk;
+    gsize remaining = sizeof(*message) + (gsize) size;
+    gsize chunk_size = MIN(remaining, sizeof(chunk));
+
+    memset(chunk, 0, sizeof(chunk));
+    message->protocol = GUINT32_TO_LE(VD_AGENT_PROTOCOL);
+    message->type = GUINT32_TO_LE(type);
+    message->size = GUINT32_TO_LE(size);
+    do {
+        if (!send_chunk(out, port, chunk, chunk_size, err)) {
+            return FALSE;
+        }
+        memset(chunk, 0, sizeof(*message));
+        remaining -= chunk_size;
+        chunk_size = MIN(remaining, sizeof(chunk));
+    } while (remaining > 0);
+    return TRUE;
+}
+
+static GSocketConnection *wait_for_daemon(const char *path, GError **err)
+{
+    GSocketListener *listener;
+    GSocketAddress *addr;
+    GSocketConnection *conn = NULL;
+
+    listener = g_socket_listener_new();
+    addr = g_unix_socket_address_new(path);
+    if (g_socket_listener_add_address(listener, addr, G_SOCKET_TYPE_STREAM,
+                                      G_SOCKET_PROTOCOL_DEFAULT,
+                                      NULL, NULL, err)) {
+        g_print("waiting for spice-vdagentd -s %s\n", path);
+        conn = g_socket_listener_accept(listener, NULL, NULL, err);
+    }
+    g_object_unref(addr);
+    g_object_unref(listener);
+    g_unlink(path);
+    return conn;
+}
+
+int main(int argc, char *argv[])
+{
+    GOptionContext *context;
+    GSocketConnection *conn;
+    GOutputStream *out;
+    GThread *drain;
+    GError *err = NULL;
+    FILE *capture;
+    char magic[VIRTIO_CAPTURE_MAGIC_SIZE];
+    VirtioCaptureRecord record;
+    guint8 *data = NULL;
+    guint64 first_timestamp = 0, n_records = 0, n_bytes = 0;
+    gint64 start_time;
+    int ret = 1;
+
+    context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, entries, NULL);
+    g_option_context_set_summary(context,
+        "Sends what the client sent in a capture recorded with\n"
+        "spice-vdagentd --capture to a spice-vdagentd started with\n"
+        "-s <socket>, as if it came from its virtio port.");
+    if (!g_option_context_parse(context, &argc, &argv, &err) ||
+        arguments == NULL || g_strv_length(arguments) != 2) {
+        g_printerr("Invalid arguments, %s\n",
+                   err ? err->message : "expected <capture> <socket>");
+        g_clear_error(&err);
+        g_option_context_free(context);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    capture = fopen(arguments[0], "rb");
+    if (capture == NULL ||
+        fread(magic, sizeof(magic), 1, capture) != 1 ||
+        memcmp(magic, VIRTIO_CAPTURE_MAGIC, sizeof(magic)) != 0) {
+        g_printerr("%s is not a virtio port capture\n", arguments[0]);
+        goto out;
+    }
+
+    conn = wait_for_daemon(arguments[1], &err);
+    if (conn == NULL) {
+        g_printerr("Could not get a connection on %s: %s\n",
+                   arguments[1], err->message);
+        g_clear_error(&err);
+        goto out;
+    }
+    out = g_io_stream_get_output_stream(G_IO_STREAM(conn));
+    drain = g_thread_new("drain", drain_thread,
+                         g_io_stream_get_input_stream(G_IO_STREAM(conn)));
+
+    data = g_malloc(VD_AGENT_MAX_DATA_SIZE);
+    start_time = g_get_monotonic_time();
+    while (fread(&record, sizeof(record), 1, capture) == 1) {
+        guint64 timestamp = GUINT64_FROM_LE(record.timestamp);
+        uint32_t size = GUINT32_FROM_LE(record.size);
+        uint32_t port = GUINT16_FROM_LE(record.port);
+        gboolean ok = TRUE;
+
+        if (record.kind == VIRTIO_CAPTURE_CHUNK) {
+            if (size > VD_AGENT_MAX_DATA_SIZE ||
+                fread(data, size, 1, capture) != 1) {
+                g_printerr("Truncated or corrupted capture\n");
+                break;
+            }
+        }
+        if (record.direction != VIRTIO_CAPTURE_IN) {
+            continue;
+        }
+
+        if (n_records == 0) {
+            first_timestamp = timestamp;
+        }
+        if (!fast) {
+            gint64 delay = start_time + (timestamp - first_timestamp) -
+                           g_get_monotonic_time();
+            if (delay > 0) {
+                g_usleep(delay);
+            }
+        }
+
+        if (record.kind == VIRTIO_CAPTURE_CHUNK) {
+            ok = send_chunk(out, port, data, size, &err);
+        } else if (record.kind == VIRTIO_CAPTURE_MESSAGE) {
+            ok = send_message(out, port, GUINT32_FROM_LE(record.type), size, &err);
+        }
+        if (!ok) {
+            g_printerr("spice-vdagentd went away: %s\n", err->message);
+            g_clear_error(&err);
+            break;
+        }
+        n_records++;
+        n_bytes += size;
+    }
+
+    g_print("replayed %" G_GUINT64_FORMAT " records, %" G_GUINT64_FORMAT
+            " bytes in %.3f s\n", n_records, n_bytes,
+            (g_get_monotonic_time() - start_time) / 1e6);
+    ret = 0;
+
+    /* wakes up the drain thread */
+    g_socket_shutdown(g_socket_connection_get_socket(conn), TRUE, TRUE, NULL);
+    g_thread_join(drain);
+    g_object_unref(conn);
+out:
+    if (capture) {
+        fclose(capture);
+    }
+    g_free(data);
+    g_strfreev(arguments);
+    return ret;
+}
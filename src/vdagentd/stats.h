@@ -0,0 +1,46 @@
+/*  stats.h vdagentd latency histograms, see spice-vdagentd --stats-socket
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VDAGENTD_STATS_H
+#define __VDAGENTD_STATS_H
+
+#include <glib.h>
+
+/* Latencies in us, bucket i counts values up to 2^i us, the last one
+ * everything above */
+#define STATS_HISTOGRAM_BUCKETS 22
+
+typedef struct StatsHistogram {
+    guint64 buckets[STATS_HISTOGRAM_BUCKETS];
+    guint64 count;
+    guint64 sum;
+} StatsHistogram;
+
+static inline void stats_histogram_add(StatsHistogram *histogram, gint64 us)
+{
+    guint i = 0;
+
+    while (i < STATS_HISTOGRAM_BUCKETS - 1 && us > ((gint64)1 << i)) {
+        i++;
+    }
+    histogram->buckets[i]++;
+    histogram->count++;
+    histogram->sum += MAX(us, 0);
+}
+
+#endif
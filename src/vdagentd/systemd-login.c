@@ -35,9 +35,13 @@ struct session_info {
     struct {
         DBusConnection *system_connection;
         char *match_session_signals;
+        char *session_object;
     } dbus;
     gboolean session_is_locked;
     gboolean session_locked_hint;
+    /* FALSE until LockedHint was read for the current session, or after
+     * logind invalidated it; kept up to date from PropertiesChanged */
+    gboolean session_locked_hint_valid;
 };
 
 #define LOGIND_INTERFACE            "org.freedesktop.login1"
@@ -52,6 +56,8 @@ struct session_info {
 
 #define SESSION_PROP_LOCKED_HINT    "LockedHint"
 
+#define PROPERTIES_SIGNAL_CHANGED   "PropertiesChanged"
+
 /* dbus related */
 static DBusConnection *si_dbus_get_system_bus(void)
 {
@@ -85,6 +91,7 @@ static void si_dbus_match_remove(struct session_info *si)
                           &error);
 
     g_clear_pointer(&si->dbus.match_session_signals, g_free);
+    g_clear_pointer(&si->dbus.session_object, g_free);
 }
 
 static void si_dbus_match_rule_update(struct session_info *si)
@@ -97,11 +104,13 @@ static void si_dbus_match_rule_update(struct session_info *si)
 
     si_dbus_match_remove(si);
 
+    /* No interface in the rule: we want both the Lock/Unlock signals of the
+     * session and the PropertiesChanged signals carrying its LockedHint */
+    si->dbus.session_object =
+        g_strdup_printf(LOGIND_SESSION_OBJ_TEMPLATE, si->session);
     si->dbus.match_session_signals =
-        g_strdup_printf ("type='signal',interface='%s',path='"
-                         LOGIND_SESSION_OBJ_TEMPLATE"'",
-                         LOGIND_SESSION_INTERFACE,
-                         si->session);
+        g_strdup_printf ("type='signal',path='%s'",
+                         si->dbus.session_object);
     if (si->verbose)
         syslog(LOG_DEBUG, "logind match: %s", si->dbus.match_session_signals);
 
@@ -117,6 +126,56 @@ static void si_dbus_match_rule_update(struct session_info *si)
     }
 }
 
+static void
+si_dbus_read_properties_changed(struct session_info *si, DBusMessage *message)
+{
+    DBusMessageIter iter, iter_array, iter_entry, iter_variant;
+    const gchar *interface, *property;
+    dbus_bool_t locked_hint;
+
+    dbus_message_iter_init(message, &iter);
+    if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
+        return;
+    dbus_message_iter_get_basic(&iter, &interface);
+    if (g_strcmp0(interface, LOGIND_SESSION_INTERFACE) != 0)
+        return;
+
+    /* changed properties: a{sv} */
+    if (!dbus_message_iter_next(&iter) ||
+        dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+        return;
+    dbus_message_iter_recurse(&iter, &iter_array);
+    while (dbus_message_iter_get_arg_type(&iter_array) == DBUS_TYPE_DICT_ENTRY) {
+        dbus_message_iter_recurse(&iter_array, &iter_entry);
+        if (dbus_message_iter_get_arg_type(&iter_entry) == DBUS_TYPE_STRING) {
+            dbus_message_iter_get_basic(&iter_entry, &property);
+            if (g_strcmp0(property, SESSION_PROP_LOCKED_HINT) == 0 &&
+                dbus_message_iter_next(&iter_entry) &&
+                dbus_message_iter_get_arg_type(&iter_entry) == DBUS_TYPE_VARIANT) {
+                dbus_message_iter_recurse(&iter_entry, &iter_variant);
+                if (dbus_message_iter_get_arg_type(&iter_variant) == DBUS_TYPE_BOOLEAN) {
+                    dbus_message_iter_get_basic(&iter_variant, &locked_hint);
+                    si->session_locked_hint = (locked_hint) ? TRUE : FALSE;
+                    si->session_locked_hint_valid = TRUE;
+                }
+            }
+        }
+        dbus_message_iter_next(&iter_array);
+    }
+
+    /* invalidated properties: as */
+    if (!dbus_message_iter_next(&iter) ||
+        dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+        return;
+    dbus_message_iter_recurse(&iter, &iter_array);
+    while (dbus_message_iter_get_arg_type(&iter_array) == DBUS_TYPE_STRING) {
+        dbus_message_iter_get_basic(&iter_array, &property);
+        if (g_strcmp0(property, SESSION_PROP_LOCKED_HINT) == 0)
+            si->session_locked_hint_valid = FALSE;
+        dbus_message_iter_next(&iter_array);
+    }
+}
+
 static void
 si_dbus_read_properties(struct session_info *si)
 {
@@ -129,9 +188,13 @@ si_dbus_read_properties(struct session_info *si)
     gchar *session_object;
     const gchar *interface, *property;
 
-    if (si->session == NULL)
+    if (si->session == NULL || si->dbus.system_connection == NULL)
         return;
 
+    /* Only tried once per session: on failure we fall back to the Lock and
+     * Unlock signals rather than blocking on every lookup */
+    si->session_locked_hint_valid = TRUE;
+
     session_object = g_strdup_printf(LOGIND_SESSION_OBJ_TEMPLATE, si->session);
     message = dbus_message_new_method_call(LOGIND_INTERFACE,
                                            session_object,
@@ -200,16 +263,30 @@ si_dbus_read_signals(struct session_info *si)
 {
     DBusMessage *message = NULL;
 
+    if (si->dbus.system_connection == NULL)
+        return;
+
     dbus_connection_read_write(si->dbus.system_connection, 0);
     message = dbus_connection_pop_message(si->dbus.system_connection);
     while (message != NULL) {
         const char *member;
 
         member = dbus_message_get_member (message);
-        if (g_strcmp0(member, SESSION_SIGNAL_LOCK) == 0) {
+        if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_SIGNAL &&
+            g_strcmp0(dbus_message_get_path(message),
+                      si->dbus.session_object) != 0) {
+            /* queued before we switched to another session */
+            if (si->verbose)
+                syslog(LOG_DEBUG, "(systemd-login) Ignoring %s from %s", member,
+                       dbus_message_get_path(message));
+        } else if (g_strcmp0(member, SESSION_SIGNAL_LOCK) == 0) {
             si->session_is_locked = TRUE;
         } else if (g_strcmp0(member, SESSION_SIGNAL_UNLOCK) == 0) {
             si->session_is_locked = FALSE;
+        } else if (g_strcmp0(member, PROPERTIES_SIGNAL_CHANGED) == 0 &&
+                   g_strcmp0(dbus_message_get_interface(message),
+                             DBUS_PROPERTIES_INTERFACE) == 0) {
+            si_dbus_read_properties_changed(si, message);
         } else {
             if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL) {
                 syslog(LOG_WARNING, "(systemd-login) received non signal message");
@@ -280,9 +357,17 @@ const char *session_info_get_active_session(struct session_info *si)
         syslog(LOG_INFO, "Active session: %s", si->session);
 
     sd_login_monitor_flush(si->mon);
+
+    /* This runs on every logind event, only talk to the bus when the
+     * active session actually changed */
+    if (si->session && g_strcmp0(old_session, si->session) != 0) {
+        si->session_is_locked = FALSE;
+        si->session_locked_hint = FALSE;
+        si->session_locked_hint_valid = FALSE;
+        si_dbus_match_rule_update(si);
+    }
     g_free(old_session);
 
-    si_dbus_match_rule_update(si);
     return si->session;
 }
 
@@ -358,8 +443,11 @@ gboolean session_info_session_is_locked(struct session_info *si)
 
     g_return_val_if_fail (si != NULL, FALSE);
 
+    /* Lock state is tracked from the session signals, the blocking
+     * Properties.Get is only needed when we don't know the hint yet */
     si_dbus_read_signals(si);
-    si_dbus_read_properties(si);
+    if (!si->session_locked_hint_valid)
+        si_dbus_read_properties(si);
 
     locked = (si->session_is_locked || si->session_locked_hint);
     if (si->verbose) {
@@ -22,6 +22,7 @@
 #include <config.h>
 
 #include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -32,6 +33,24 @@
 #include <glib.h>
 #include "uinput.h"
 
+/* VDAgentMouseState.display_id is 8 bit */
+#define DISPLAY_ID_COUNT 256
+
+/* abs-x, abs-y, 5 buttons, 2 wheel directions and syn */
+#define MAX_FRAME_EVENTS 10
+/* Frames of a batch submitted per write() */
+#define BATCH_FRAMES 32
+
+/* Fractional bits of the WITH_STATIC_UINPUT scale factors */
+#define SCALE_SHIFT 16
+
+/* Position of a display within the tablet, precomputed per display_id */
+struct display_transform {
+    int valid;
+    int x;
+    int y;
+};
+
 struct vdagentd_uinput {
     const char *devname;
     int fd;
@@ -42,8 +61,46 @@ struct vdagentd_uinput {
     int screen_count;
     VDAgentMouseState last;
     int fake;
+    struct display_transform displays[DISPLAY_ID_COUNT];
+#ifdef WITH_STATIC_UINPUT
+    gint64 scale_x;
+    gint64 scale_y;
+#endif
 };
 
+/* Rebuild the display_id indexed transform table from screen_info */
+static void update_display_transforms(struct vdagentd_uinput *uinput)
+{
+    int i;
+
+    memset(uinput->displays, 0, sizeof(uinput->displays));
+    for (i = 0; i < uinput->screen_count; i++) {
+        struct display_transform *display;
+        int id = uinput->screen_info[i].display_id;
+
+        if (id < 0 || id >= DISPLAY_ID_COUNT) {
+            continue;
+        }
+        display = &uinput->displays[id];
+        /* the first matching screen wins */
+        if (display->valid) {
+            continue;
+        }
+        display->valid = 1;
+        display->x = uinput->screen_info[i].x;
+        display->y = uinput->screen_info[i].y;
+    }
+
+#ifdef WITH_STATIC_UINPUT
+    /* fixed point factors mapping the desktop to 0 - 32767, rounded up
+       so the last pixel reaches the maximum */
+    uinput->scale_x = ((32767LL << SCALE_SHIFT) + uinput->width - 2) /
+                      MAX(uinput->width - 1, 1);
+    uinput->scale_y = ((32767LL << SCALE_SHIFT) + uinput->height - 2) /
+                      MAX(uinput->height - 1, 1);
+#endif
+}
+
 struct vdagentd_uinput *vdagentd_uinput_create(const char *devname,
     int width, int height,
     struct vdagentd_guest_xorg_resolution *screen_info, int screen_count,
@@ -103,11 +160,14 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
     uinput->screen_info  = screen_info;
     uinput->screen_count = screen_count;
 
-    if (uinput->width == width && uinput->height == height)
+    if (uinput->width == width && uinput->height == height) {
+        update_display_transforms(uinput);
         return;
+    }
 
     uinput->width  = width;
     uinput->height = height;
+    update_display_transforms(uinput);
 
     if (uinput->fd != -1)
 #ifndef WITH_STATIC_UINPUT
@@ -159,40 +219,37 @@ void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
     }
 }
 
-static void uinput_send_event(struct vdagentd_uinput **uinputp,
+static void uinput_add_event(struct input_event *events, int *n_events,
     __u16 type, __u16 code, __s32 value)
 {
-    struct vdagentd_uinput *uinput = *uinputp;
-    struct input_event event = {
-        .type  = type,
-        .code  = code,
-        .value = value,
-    };
-    int rc;
+    struct input_event *event = &events[(*n_events)++];
 
-    rc = write(uinput->fd, &event, sizeof(event));
-    if (rc != sizeof(event)) {
-        syslog(LOG_ERR, "write %s: %m", uinput->devname);
-        vdagentd_uinput_destroy(uinputp);
-    }
+    memset(event, 0, sizeof(*event));
+    event->type  = type;
+    event->code  = code;
+    event->value = value;
 }
 
-static struct vdagentd_guest_xorg_resolution* lookup_screen_info(struct vdagentd_uinput *uinput, int display_id)
+/* Submit a whole frame of events with a single write() */
+static void uinput_send_events(struct vdagentd_uinput **uinputp,
+    const struct input_event *events, int n_events)
 {
-    int i;
-    for (i = 0; i < uinput->screen_count; i++) {
-        if (uinput->screen_info[i].display_id == display_id) {
-            return &uinput->screen_info[i];
-        }
+    struct vdagentd_uinput *uinput = *uinputp;
+    ssize_t rc;
+
+    rc = write(uinput->fd, events, n_events * sizeof(*events));
+    if (rc != (ssize_t)(n_events * sizeof(*events))) {
+        syslog(LOG_ERR, "write %s: %m", uinput->devname);
+        vdagentd_uinput_destroy(uinputp);
     }
-    syslog(LOG_WARNING, "Unable to find output index for display id %d", display_id);
-    return NULL;
 }
 
-void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
-        VDAgentMouseState *mouse)
+/* Append the frame of events moving the tablet from uinput->last to @mouse,
+   which is translated to tablet coordinates. Returns FALSE, adding nothing,
+   for a display the tablet does not cover. */
+static gboolean uinput_add_mouse_events(struct vdagentd_uinput *uinput,
+    VDAgentMouseState *mouse, struct input_event *events, int *n_events)
 {
-    struct vdagentd_uinput *uinput = *uinputp;
     struct button_s {
         const char *name;
         int mask;
@@ -209,37 +266,36 @@ void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
         { .name = "up",     .mask =  VD_AGENT_UBUTTON_MASK, .btn = 1  },
         { .name = "down",   .mask =  VD_AGENT_DBUTTON_MASK, .btn = -1 },
     };
+    const struct display_transform *display;
     int i, down;
 
-    if (*uinputp) {
-        struct vdagentd_guest_xorg_resolution *screen_info = lookup_screen_info(uinput, mouse->display_id);
-        if (screen_info == NULL) {
-            syslog(LOG_WARNING, "mouse event for unknown monitor %d",
-                   mouse->display_id);
-            return;
-        }
-        if (uinput->debug)
-            syslog(LOG_DEBUG, "mouse-event: mon %d %dx%d", mouse->display_id,
-                   mouse->x, mouse->y);
-        mouse->x += screen_info->x;
-        mouse->y += screen_info->y;
+    display = &uinput->displays[mouse->display_id];
+    if (!display->valid) {
+        syslog(LOG_WARNING, "mouse event for unknown monitor %d",
+               mouse->display_id);
+        return FALSE;
+    }
+    if (uinput->debug)
+        syslog(LOG_DEBUG, "mouse-event: mon %d %dx%d", mouse->display_id,
+               mouse->x, mouse->y);
+    mouse->x += display->x;
+    mouse->y += display->y;
 #ifdef WITH_STATIC_UINPUT
-        mouse->x = mouse->x * 32767 / (uinput->width - 1);
-        mouse->y = mouse->y * 32767 / (uinput->height - 1);
+    mouse->x = MIN((mouse->x * uinput->scale_x) >> SCALE_SHIFT, 32767);
+    mouse->y = MIN((mouse->y * uinput->scale_y) >> SCALE_SHIFT, 32767);
 #endif
-    }
 
-    if (*uinputp && uinput->last.x != mouse->x) {
+    if (uinput->last.x != mouse->x) {
         if (uinput->debug)
             syslog(LOG_DEBUG, "mouse: abs-x %d", mouse->x);
-        uinput_send_event(uinputp, EV_ABS, ABS_X, mouse->x);
+        uinput_add_event(events, n_events, EV_ABS, ABS_X, mouse->x);
     }
-    if (*uinputp && uinput->last.y != mouse->y) {
+    if (uinput->last.y != mouse->y) {
         if (uinput->debug)
             syslog(LOG_DEBUG, "mouse: abs-y %d", mouse->y);
-        uinput_send_event(uinputp, EV_ABS, ABS_Y, mouse->y);
+        uinput_add_event(events, n_events, EV_ABS, ABS_Y, mouse->y);
     }
-    for (i = 0; i < sizeof(btns)/sizeof(btns[0]) && *uinputp; i++) {
+    for (i = 0; i < sizeof(btns)/sizeof(btns[0]); i++) {
         if ((uinput->last.buttons & btns[i].mask) ==
                 (mouse->buttons & btns[i].mask))
             continue;
@@ -247,25 +303,46 @@ void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
         if (uinput->debug)
             syslog(LOG_DEBUG, "mouse: btn-%s %s",
                     btns[i].name, down ? "down" : "up");
-        uinput_send_event(uinputp, EV_KEY, btns[i].btn, down);
+        uinput_add_event(events, n_events, EV_KEY, btns[i].btn, down);
     }
-    for (i = 0; i < sizeof(wheel)/sizeof(wheel[0]) && *uinputp; i++) {
+    for (i = 0; i < sizeof(wheel)/sizeof(wheel[0]); i++) {
         if ((uinput->last.buttons & wheel[i].mask) ==
                 (mouse->buttons & wheel[i].mask))
             continue;
         if (mouse->buttons & wheel[i].mask) {
             if (uinput->debug)
                 syslog(LOG_DEBUG, "mouse: wheel-%s", wheel[i].name);
-            uinput_send_event(uinputp, EV_REL, REL_WHEEL, wheel[i].btn);
+            uinput_add_event(events, n_events, EV_REL, REL_WHEEL, wheel[i].btn);
         }
     }
 
-    if (*uinputp) {
-        if (uinput->debug)
-            syslog(LOG_DEBUG, "mouse: syn");
-        uinput_send_event(uinputp, EV_SYN, SYN_REPORT, 0);
-    }
+    if (uinput->debug)
+        syslog(LOG_DEBUG, "mouse: syn");
+    uinput_add_event(events, n_events, EV_SYN, SYN_REPORT, 0);
 
-    if (*uinputp)
-        uinput->last = *mouse;
+    uinput->last = *mouse;
+    return TRUE;
+}
+
+void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
+        VDAgentMouseState *mouse)
+{
+    vdagentd_uinput_do_mouse_batch(uinputp, mouse, 1);
+}
+
+void vdagentd_uinput_do_mouse_batch(struct vdagentd_uinput **uinputp,
+        VDAgentMouseState *mice, int count)
+{
+    struct input_event events[BATCH_FRAMES * MAX_FRAME_EVENTS];
+    int i, frames = 0, n_events = 0;
+
+    for (i = 0; i < count && *uinputp; i++) {
+        if (uinput_add_mouse_events(*uinputp, &mice[i], events, &n_events))
+            frames++;
+        if (frames == BATCH_FRAMES || (i == count - 1 && n_events > 0)) {
+            uinput_send_events(uinputp, events, n_events);
+            frames = 0;
+            n_events = 0;
+        }
+    }
 }
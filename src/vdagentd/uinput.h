@@ -35,6 +35,10 @@ void vdagentd_uinput_destroy(struct vdagentd_uinput **uinputp);
 
 void vdagentd_uinput_do_mouse(struct vdagentd_uinput **uinputp,
         VDAgentMouseState *mouse);
+/* Same as calling vdagentd_uinput_do_mouse() for each of the @count states,
+   with the frames of events submitted together */
+void vdagentd_uinput_do_mouse_batch(struct vdagentd_uinput **uinputp,
+        VDAgentMouseState *mice, int count);
 void vdagentd_uinput_update_size(struct vdagentd_uinput **uinputp,
         int width, int height,
         struct vdagentd_guest_xorg_resolution *screen_info,
@@ -41,9 +41,13 @@
 #include "udscs.h"
 #include "vdagentd-proto.h"
 #include "uinput.h"
+#include "input-thread.h"
 #include "xorg-conf.h"
 #include "virtio-port.h"
+#include "client-messages.h"
+#include "virtio-capture.h"
 #include "session-info.h"
+#include "vdagent-probes.h"
 
 #define DEFAULT_UINPUT_DEVICE "/dev/uinput"
 
@@ -55,12 +59,50 @@
 // descriptors for the transfers but the agents do.
 #define MAX_ACTIVE_TRANSFERS 128
 
+// Agents are stopped from sending more data towards the client while
+// this much is waiting to be written to the virtio port, and resume
+// when it drains to the low watermark.
+#define VIRTIO_PORT_HIGH_WATERMARK (8 * 1024 * 1024)
+#define VIRTIO_PORT_LOW_WATERMARK  (1024 * 1024)
+
+// Clipboard data from the client larger than this is collected fragment by
+// fragment into the payload sent to the session agent, rather than copied
+// out of the reassembled message.
+#define CLIPBOARD_STREAM_THRESHOLD (64 * 1024)
+
+// Bytes of a file transfer which can be forwarded to the session agent
+// before it acknowledges having written them. Data of a transfer that
+// used up its window is held back, without holding up everything else
+// coming from the client.
+#define FILE_XFER_WINDOW (4 * 1024 * 1024)
+
+// Reading from the client is paused while this much file data is held
+// back, and resumes once the agents wrote half of it. A transfer is only
+// cancelled when it gets twice as far behind, which takes a client that
+// ignores the port being paused.
+#define FILE_XFER_HOLD_LIMIT (16 * 1024 * 1024)
+
+// The tablet device is kept this long (in seconds) after the active session
+// lost its agent, so that switching back to a session of the same size does
+// not make the guest rescan its input devices.
+#define UINPUT_LINGER_TIMEOUT 30
+
+struct file_xfer {
+    uint32_t id;
+    UdscsConnection *conn;
+    uint64_t unacked; /* bytes forwarded but not yet written by the agent */
+    GQueue held; /* of GBytes, FILE_XFER_DATA messages waiting for credit */
+    uint64_t held_bytes; /* of file data in held */
+};
+
 struct agent_data {
     char *session;
     int width;
     int height;
     struct vdagentd_guest_xorg_resolution *screen_info;
     int screen_count;
+    /* last grab of the agent, announced again when its session gets back */
+    GBytes *clipboard_grab[VD_AGENT_CLIPBOARD_SELECTION_SECONDARY + 1];
 };
 
 static const char pidfilename[] = "/run/spice-vdagentd/spice-vdagentd.pid";
@@ -74,12 +116,21 @@ static gboolean uinput_fake = FALSE;
 static gboolean only_once = FALSE;
 static gboolean do_daemonize = TRUE;
 static gboolean want_session_info = TRUE;
+static gchar *capture_path = NULL;
+static gboolean capture_payloads = FALSE;
+static FILE *capture_file = NULL;
 
 static struct udscs_server *server = NULL;
 static VirtioPort *virtio_port = NULL;
 static GHashTable *active_xfers = NULL;
+/* session id -> UdscsConnection of the agent running in it */
+static GHashTable *session_conns = NULL;
 static struct session_info *session_info = NULL;
-static struct vdagentd_uinput *uinput = NULL;
+#ifndef __APPLE__
+/* owns the uinput tablet */
+static struct vdagentd_input *input = NULL;
+static bool uinput_open = false;
+#endif
 static VDAgentMonitorsConfig *mon_config = NULL;
 static uint32_t *capabilities = NULL;
 static int capabilities_size = 0;
@@ -91,18 +142,74 @@ static int retval = 0;
 static bool client_connected = false;
 static int max_clipboard = -1;
 static uint32_t clipboard_serial[256];
+static bool virtio_port_congested = false;
+/* file data held back by all the transfers, see FILE_XFER_HOLD_LIMIT */
+static uint64_t file_xfers_held_bytes = 0;
+static bool file_xfers_paused = false;
+/* numbers the messages read from the client, for the probes */
+static guint64 client_message_id = 0;
+#ifndef __APPLE__
+static guint uinput_linger_id = 0;
+#endif
+
+/* State of the clipboard message being streamed from the client */
+static struct {
+    UdscsConnection *conn; /* NULL when the remaining fragments are dropped */
+    uint8_t prefix[8]; /* selection and VDAgentClipboard.type */
+    uint32_t prefix_size;
+    uint32_t prefix_read;
+    uint32_t selection;
+    uint32_t type;
+    uint8_t *data; /* payload of the clipboard data, once the prefix was read */
+    uint32_t size;
+    uint32_t filled;
+} clipboard_stream;
+
+/* see stats_report */
+static gchar *stats_socket_path = NULL;
+static gint payload_budget_mb = -1;
+static GSocketService *stats_service = NULL;
+static StatsHistogram client_dispatch_latency;
+static StatsHistogram agent_dispatch_latency;
+#ifndef __APPLE__
+/* mouse states the input thread had no room for */
+static guint64 mouse_states_dropped = 0;
+#endif
 
 static GMainLoop *loop;
 
 static void update_active_session_connection(UdscsConnection *new_conn);
+static void agent_disconnect(VDAgentConnection *conn, GError *err);
+static void clipboard_stream_abort(void);
 
 static void agent_data_destroy(struct agent_data *agent_data)
 {
+    int sel;
+
+    for (sel = 0; sel <= VD_AGENT_CLIPBOARD_SELECTION_SECONDARY; sel++) {
+        g_clear_pointer(&agent_data->clipboard_grab[sel], g_bytes_unref);
+    }
     g_free(agent_data->session);
     g_free(agent_data->screen_info);
     g_free(agent_data);
 }
 
+static void agent_data_set_clipboard_grab(UdscsConnection *conn, uint8_t selection,
+                                          const uint8_t *data, uint32_t size)
+{
+    struct agent_data *agent_data;
+
+    if (conn == NULL || selection > VD_AGENT_CLIPBOARD_SELECTION_SECONDARY)
+        return;
+    agent_data = g_object_get_data(G_OBJECT(conn), "agent_data");
+    if (agent_data == NULL)
+        return;
+
+    g_clear_pointer(&agent_data->clipboard_grab[selection], g_bytes_unref);
+    if (data != NULL)
+        agent_data->clipboard_grab[selection] = g_bytes_new(data, size);
+}
+
 static void vdagentd_quit(gint exit_code)
 {
     retval = exit_code;
@@ -119,25 +226,6 @@ static void virtio_msg_uint32_to_le(uint8_t *_msg, uint32_t size, uint32_t offse
         msg[i] = GUINT32_TO_LE(msg[i]);
 }
 
-static void virtio_msg_uint32_from_le(uint8_t *_msg, uint32_t size, uint32_t offset)
-{
-    uint32_t i, *msg = (uint32_t *)(_msg + offset);
-
-    /* offset - size % 4 should be 0 - extra bytes are ignored */
-    for (i = 0; i < (size - offset) / 4; i++)
-        msg[i] = GUINT32_FROM_LE(msg[i]);
-}
-
-static void virtio_msg_uint16_from_le(uint8_t *_msg, uint32_t size, uint32_t offset)
-{
-    uint32_t i;
-    uint16_t *msg = (uint16_t *)(_msg + offset);
-
-    /* offset - size % 2 should be 0 - extra bytes are ignored */
-    for (i = 0; i < (size - offset) / 2; i++)
-        msg[i] = GUINT16_FROM_LE(msg[i]);
-}
-
 /* vdagentd <-> spice-client communication handling */
 static void send_capabilities(VirtioPort *vport,
     uint32_t request)
@@ -151,6 +239,9 @@ static void send_capabilities(VirtioPort *vport,
 #ifndef __APPLE__
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_MOUSE_STATE);
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_MONITORS_CONFIG);
+#ifdef WITH_EXPERIMENTAL_PROTOCOL
+    VD_AGENT_SET_CAPABILITY(caps->caps, VDP_CAP_MOUSE_STATE_BATCH);
+#endif
 #endif
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_REPLY);
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_CLIPBOARD_BY_DEMAND);
@@ -162,6 +253,9 @@ static void send_capabilities(VirtioPort *vport,
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_GRAPHICS_DEVICE_INFO);
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_CLIPBOARD_NO_RELEASE_ON_REGRAB);
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL);
+#ifdef WITH_EXPERIMENTAL_PROTOCOL
+    VD_AGENT_SET_CAPABILITY(caps->caps, VDP_CAP_COMPRESSED_DATA);
+#endif
     virtio_msg_uint32_to_le((uint8_t *)caps, size, 0);
 
     vdagent_virtio_port_write(vport, VDP_CLIENT_PORT,
@@ -172,6 +266,10 @@ static void send_capabilities(VirtioPort *vport,
 
 static void do_client_disconnect(void)
 {
+#ifndef __APPLE__
+    vdagentd_input_drop_mouse(input);
+#endif
+    clipboard_stream_abort();
     g_hash_table_remove_all(active_xfers);
     if (client_connected) {
         udscs_server_write_all(server, VDAGENTD_CLIENT_DISCONNECTED, 0, 0,
@@ -181,32 +279,62 @@ static void do_client_disconnect(void)
 }
 
 #ifndef __APPLE__
-void do_client_mouse(struct vdagentd_uinput **uinputp, VDAgentMouseState *mouse)
+static void input_error_cb(void)
 {
-    vdagentd_uinput_do_mouse(uinputp, mouse);
-    if (!*uinputp) {
-        /* Try to re-open the tablet */
-        if (active_session_conn) {
-            const struct agent_data *agent_data =
-            g_object_get_data(G_OBJECT(active_session_conn), "agent_data");
-            *uinputp = vdagentd_uinput_create(uinput_device,
-                                              agent_data->width,
-                                              agent_data->height,
-                                              agent_data->screen_info,
-                                              agent_data->screen_count,
-                                              debug > 1,
-                                              uinput_fake);
-        }
-        if (!*uinputp) {
-            syslog(LOG_CRIT, "Fatal uinput error");
-            vdagentd_quit(1);
+    syslog(LOG_CRIT, "Fatal uinput error");
+    vdagentd_quit(1);
+}
+
+/* Mouse states go straight to the input thread, which coalesces them */
+static void do_client_mouse(VirtioPort *vport, int port_nr,
+    VDAgentMessage *message_header, uint8_t *data)
+{
+    VDAgentMouseState *mouse = (VDAgentMouseState *)data;
+
+    if (!vdagentd_input_push_mouse(input, mouse, client_message_id))
+        mouse_states_dropped++;
+}
+
+#ifdef WITH_EXPERIMENTAL_PROTOCOL
+/* The samples of a batch are all injected, with one write to uinput */
+static void do_client_mouse_batch(VirtioPort *vport, int port_nr,
+    VDAgentMessage *message_header, uint8_t *data)
+{
+    VDPMouseStateBatch *batch = (VDPMouseStateBatch *)data;
+    VDAgentMouseState mice[VDP_MOUSE_STATE_BATCH_MAX];
+    uint32_t i;
+
+    if (batch->count > VDP_MOUSE_STATE_BATCH_MAX ||
+        message_header->size != sizeof(VDPMouseStateBatch) +
+                                batch->count * sizeof(VDPMouseSample)) {
+        syslog(LOG_ERR, "invalid message size for VDPMouseStateBatch");
+        return;
+    }
+
+    for (i = 0; i < batch->count; i++) {
+        VDPMouseSample *sample = &batch->samples[i];
+
+        if (sample->display_id > G_MAXUINT8) {
+            syslog(LOG_WARNING, "mouse event for unknown monitor %u",
+                   sample->display_id);
+            return;
         }
+        mice[i].x = sample->x;
+        mice[i].y = sample->y;
+        mice[i].buttons = sample->buttons;
+        mice[i].display_id = sample->display_id;
     }
+
+    if (!vdagentd_input_push_mouse_batch(input, mice, batch->count,
+                                         client_message_id))
+        mouse_states_dropped += batch->count;
 }
+#endif
 
 static void do_client_monitors(VirtioPort *vport, int port_nr,
-    VDAgentMessage *message_header, VDAgentMonitorsConfig *new_monitors)
+    VDAgentMessage *message_header, uint8_t *data)
 {
+    VDAgentMonitorsConfig *new_monitors = (VDAgentMonitorsConfig *)data;
     VDAgentReply reply;
     uint32_t size;
 
@@ -240,8 +368,7 @@ static void do_client_monitors(VirtioPort *vport, int port_nr,
 #endif
 
 static void do_client_volume_sync(VirtioPort *vport, int port_nr,
-    VDAgentMessage *message_header,
-    VDAgentAudioVolumeSync *avs)
+    VDAgentMessage *message_header, uint8_t *data)
 {
     if (active_session_conn == NULL) {
         syslog(LOG_DEBUG, "No active session - Can't volume-sync");
@@ -249,13 +376,14 @@ static void do_client_volume_sync(VirtioPort *vport, int port_nr,
     }
 
     udscs_write(active_session_conn, VDAGENTD_AUDIO_VOLUME_SYNC, 0, 0,
-                (uint8_t *)avs, message_header->size);
+                data, message_header->size);
 }
 
-static void do_client_capabilities(VirtioPort *vport,
-    VDAgentMessage *message_header,
-    VDAgentAnnounceCapabilities *caps)
+static void do_client_capabilities(VirtioPort *vport, int port_nr,
+    VDAgentMessage *message_header, uint8_t *data)
 {
+    VDAgentAnnounceCapabilities *caps = (VDAgentAnnounceCapabilities *)data;
+
     capabilities_size = VD_AGENT_CAPS_SIZE_FROM_MSG_SIZE(message_header->size);
     g_free(capabilities);
     capabilities = g_memdup2(caps->caps, capabilities_size * sizeof(uint32_t));
@@ -269,11 +397,18 @@ static void do_client_capabilities(VirtioPort *vport,
         memset(clipboard_serial, 0, sizeof(clipboard_serial));
         send_capabilities(vport, 0);
     }
+
+#ifdef WITH_EXPERIMENTAL_PROTOCOL
+    vdagent_virtio_port_set_compression(vport, VDP_CLIENT_PORT,
+        VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
+                                VDP_CAP_COMPRESSED_DATA));
+#endif
 }
 
-static void do_client_clipboard(VirtioPort *vport,
+static void do_client_clipboard(VirtioPort *vport, int port_nr,
     VDAgentMessage *message_header, uint8_t *data)
 {
+    uint8_t *message_data = data;
     uint32_t msg_type = 0, data_type = 0, size = message_header->size;
     uint8_t selection = VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
     uint32_t serial;
@@ -313,6 +448,7 @@ static void do_client_clipboard(VirtioPort *vport,
 
         msg_type = VDAGENTD_CLIPBOARD_GRAB;
         agent_owns_clipboard[selection] = false;
+        agent_data_set_clipboard_grab(active_session_conn, selection, NULL, 0);
         break;
     case VD_AGENT_CLIPBOARD_REQUEST: {
         VDAgentClipboardRequest *req = (VDAgentClipboardRequest *)data;
@@ -324,11 +460,20 @@ static void do_client_clipboard(VirtioPort *vport,
     }
     case VD_AGENT_CLIPBOARD: {
         VDAgentClipboard *clipboard = (VDAgentClipboard *)data;
-        msg_type = VDAGENTD_CLIPBOARD_DATA;
+        GBytes *message_bytes, *payload;
+
         data_type = clipboard->type;
         size = size - sizeof(VDAgentClipboard);
-        data = clipboard->data;
-        break;
+
+        /* forward the clipboard contents without copying them */
+        message_bytes = vdagent_virtio_port_steal_message_data(vport, port_nr);
+        payload = g_bytes_new_from_bytes(message_bytes,
+                                         clipboard->data - message_data, size);
+        udscs_write_bytes(active_session_conn, VDAGENTD_CLIPBOARD_DATA,
+                          selection, data_type, payload);
+        g_bytes_unref(payload);
+        g_bytes_unref(message_bytes);
+        return;
     }
     case VD_AGENT_CLIPBOARD_RELEASE:
         msg_type = VDAGENTD_CLIPBOARD_RELEASE;
@@ -341,6 +486,113 @@ static void do_client_clipboard(VirtioPort *vport,
                 data, size);
 }
 
+/* The data is only sent once complete, like a message which isn't streamed */
+static void clipboard_stream_abort(void)
+{
+    if (clipboard_stream.data) {
+        vdagent_payload_free(clipboard_stream.data, clipboard_stream.size);
+        clipboard_stream.data = NULL;
+    }
+    clipboard_stream.conn = NULL;
+}
+
+static void clipboard_stream_start(VDAgentMessage *message_header)
+{
+    uint8_t selection = VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
+    uint8_t *prefix = clipboard_stream.prefix;
+    VDAgentMessage prefix_header = *message_header;
+    uint32_t data_type;
+
+    /* checks and converts the prefix as it would the whole message */
+    prefix_header.size = clipboard_stream.prefix_size;
+    if (!vdagent_message_decode(&prefix_header, prefix,
+                                capabilities, capabilities_size)) {
+        clipboard_stream.conn = NULL;
+        return;
+    }
+
+    if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
+                                VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
+        selection = prefix[0];
+        prefix += 4;
+    }
+    memcpy(&data_type, prefix, sizeof(data_type));
+
+    clipboard_stream.selection = selection;
+    clipboard_stream.type = data_type;
+    clipboard_stream.size = message_header->size - clipboard_stream.prefix_size;
+    clipboard_stream.filled = 0;
+    clipboard_stream.data = vdagent_payload_alloc(clipboard_stream.size);
+}
+
+/* Large clipboard data is put together in the payload sent to the session
+ * agent as the chunks arrive. It is queued as a whole once complete, an
+ * open message would hold up everything else sent to the agent. */
+static gboolean virtio_port_stream_cb(VirtioPort *vport, int port_nr,
+    VDAgentMessage *message_header, const uint8_t *data, uint32_t size,
+    uint32_t offset)
+{
+    uint32_t n;
+    bool done = offset + size == message_header->size;
+
+    if (data == NULL) {
+        if (message_header->type != VD_AGENT_CLIPBOARD ||
+            message_header->protocol != VD_AGENT_PROTOCOL ||
+            message_header->size < CLIPBOARD_STREAM_THRESHOLD ||
+            !active_session_conn) {
+            return FALSE;
+        }
+
+        clipboard_stream_abort();
+        clipboard_stream.conn = active_session_conn;
+        clipboard_stream.prefix_size = sizeof(VDAgentClipboard);
+        if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
+                                    VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
+            clipboard_stream.prefix_size += 4;
+        }
+        clipboard_stream.prefix_read = 0;
+
+        client_message_id++;
+        VDAGENT_PROBE(virtio__message, client_message_id, port_nr,
+                      message_header->type, message_header->size);
+        return TRUE;
+    }
+
+    /* the selection and data type come first */
+    if (clipboard_stream.prefix_read < clipboard_stream.prefix_size) {
+        n = MIN(size, clipboard_stream.prefix_size - clipboard_stream.prefix_read);
+        memcpy(clipboard_stream.prefix + clipboard_stream.prefix_read, data, n);
+        clipboard_stream.prefix_read += n;
+        data += n;
+        size -= n;
+
+        if (clipboard_stream.prefix_read == clipboard_stream.prefix_size &&
+            clipboard_stream.conn) {
+            clipboard_stream_start(message_header);
+        }
+    }
+
+    if (clipboard_stream.data && size > 0) {
+        memcpy(clipboard_stream.data + clipboard_stream.filled, data, size);
+        clipboard_stream.filled += size;
+    }
+
+    if (done) {
+        if (clipboard_stream.data) {
+            GBytes *bytes = vdagent_payload_steal(clipboard_stream.data,
+                                                  clipboard_stream.size,
+                                                  clipboard_stream.size);
+            clipboard_stream.data = NULL;
+            udscs_write_bytes(clipboard_stream.conn, VDAGENTD_CLIPBOARD_DATA,
+                              clipboard_stream.selection, clipboard_stream.type,
+                              bytes);
+            g_bytes_unref(bytes);
+        }
+        clipboard_stream.conn = NULL;
+    }
+    return TRUE;
+}
+
 /* Send file-xfer status to the client. In the case status is an error,
  * optional data for the client and log message may be specified. */
 static void send_file_xfer_status(VirtioPort *vport,
@@ -375,12 +627,86 @@ static void send_file_xfer_status(VirtioPort *vport,
     g_free(status);
 }
 
+/* Stop reading from the client while the agents are behind on the data
+ * already sent, rather than letting the held data pile up */
+static void file_xfers_update_reading(void)
+{
+    if (!file_xfers_paused && file_xfers_held_bytes >= FILE_XFER_HOLD_LIMIT) {
+        file_xfers_paused = true;
+        if (debug)
+            syslog(LOG_DEBUG, "file-xfer data held back, pausing the client");
+        if (virtio_port)
+            vdagent_connection_pause_reading(VDAGENT_CONNECTION(virtio_port));
+    } else if (file_xfers_paused &&
+               file_xfers_held_bytes <= FILE_XFER_HOLD_LIMIT / 2) {
+        file_xfers_paused = false;
+        if (debug)
+            syslog(LOG_DEBUG, "file-xfer data released, resuming the client");
+        if (virtio_port)
+            vdagent_connection_resume_reading(VDAGENT_CONNECTION(virtio_port));
+    }
+}
+
+static void file_xfer_free(gpointer data)
+{
+    struct file_xfer *xfer = data;
+
+    g_queue_clear_full(&xfer->held, (GDestroyNotify)g_bytes_unref);
+    file_xfers_held_bytes -= xfer->held_bytes;
+    g_free(xfer);
+    file_xfers_update_reading();
+}
+
+/* The file data carried by a FILE_XFER_DATA message, do_client_file_xfer()
+ * only lets through those whose size field agrees with it */
+static uint64_t file_xfer_data_size(GBytes *message)
+{
+    return g_bytes_get_size(message) - sizeof(VDAgentFileXferDataMessage);
+}
+
+/* Forward the held data of @xfer the agent has room for again */
+static void file_xfer_release_held(struct file_xfer *xfer)
+{
+    while (!g_queue_is_empty(&xfer->held)) {
+        GBytes *message = g_queue_peek_head(&xfer->held);
+        uint64_t size = file_xfer_data_size(message);
+
+        if (xfer->unacked > 0 && xfer->unacked + size > FILE_XFER_WINDOW) {
+            break;
+        }
+        g_queue_pop_head(&xfer->held);
+        xfer->held_bytes -= size;
+        file_xfers_held_bytes -= size;
+        xfer->unacked += size;
+        udscs_write_bytes(xfer->conn, VDAGENTD_FILE_XFER_DATA, 0, 0, message);
+        g_bytes_unref(message);
+    }
+}
+
+/* Cancel @xfer on both sides, @msg is logged with the id of the transfer */
+static void file_xfer_cancel(VirtioPort *vport, struct file_xfer *xfer,
+                             const char *msg)
+{
+    VDAgentFileXferStatusMessage status = {
+        .id = xfer->id,
+        .result = VD_AGENT_FILE_XFER_STATUS_CANCELLED,
+    };
+
+    udscs_write(xfer->conn, VDAGENTD_FILE_XFER_STATUS, 0, 0,
+                (uint8_t *)&status, sizeof(status));
+    send_file_xfer_status(vport, msg,
+        xfer->id, VD_AGENT_FILE_XFER_STATUS_ERROR, NULL, 0);
+    g_hash_table_remove(active_xfers, GUINT_TO_POINTER(xfer->id));
+}
+
 static void do_client_file_xfer(VirtioPort *vport,
+                                int port_nr,
                                 VDAgentMessage *message_header,
                                 uint8_t *data)
 {
     uint32_t msg_type, id;
-    UdscsConnection *conn;
+    uint64_t data_size = 0;
+    struct file_xfer *xfer;
 
     switch (message_header->type) {
     case VD_AGENT_FILE_XFER_START: {
@@ -424,7 +750,10 @@ static void do_client_file_xfer(VirtioPort *vport,
         msg_type = VDAGENTD_FILE_XFER_START;
         id = s->id;
         // associate the id with the active connection
-        g_hash_table_insert(active_xfers, GUINT_TO_POINTER(id), active_session_conn);
+        xfer = g_new0(struct file_xfer, 1);
+        xfer->id = id;
+        xfer->conn = active_session_conn;
+        g_hash_table_insert(active_xfers, GUINT_TO_POINTER(id), xfer);
         break;
     }
     case VD_AGENT_FILE_XFER_STATUS: {
@@ -437,19 +766,48 @@ static void do_client_file_xfer(VirtioPort *vport,
         VDAgentFileXferDataMessage *d = (VDAgentFileXferDataMessage *)data;
         msg_type = VDAGENTD_FILE_XFER_DATA;
         id = d->id;
+        data_size = message_header->size - sizeof(*d);
         break;
     }
     default:
         g_return_if_reached(); /* quiet uninitialized variable warning */
     }
 
-    conn = g_hash_table_lookup(active_xfers, GUINT_TO_POINTER(id));
-    if (!conn) {
+    xfer = g_hash_table_lookup(active_xfers, GUINT_TO_POINTER(id));
+    if (!xfer) {
         if (debug)
             syslog(LOG_DEBUG, "Could not find file-xfer %u (cancelled?)", id);
         return;
     }
-    udscs_write(conn, msg_type, 0, 0, data, message_header->size);
+
+    if (message_header->type == VD_AGENT_FILE_XFER_DATA &&
+        ((VDAgentFileXferDataMessage *)data)->size != data_size) {
+        /* the agent writes, and acknowledges, as much as the field says */
+        file_xfer_cancel(vport, xfer,
+            "File data does not match its size, cancelling file-xfer %u");
+        return;
+    }
+
+    if (data_size > 0) {
+        /* Out of credit, or behind data already held: keep the message
+         * until the agent has caught up, see do_agent_file_xfer_ack() */
+        if (!g_queue_is_empty(&xfer->held) ||
+            (xfer->unacked > 0 && xfer->unacked + data_size > FILE_XFER_WINDOW)) {
+            if (xfer->held_bytes + data_size > 2 * FILE_XFER_HOLD_LIMIT) {
+                file_xfer_cancel(vport, xfer,
+                    "Client keeps sending while paused, cancelling file-xfer %u");
+                return;
+            }
+            g_queue_push_tail(&xfer->held,
+                              vdagent_virtio_port_steal_message_data(vport, port_nr));
+            xfer->held_bytes += data_size;
+            file_xfers_held_bytes += data_size;
+            file_xfers_update_reading();
+            return;
+        }
+        xfer->unacked += data_size;
+    }
+    udscs_write(xfer->conn, msg_type, 0, 0, data, message_header->size);
 
     // client told that transfer is ended, agents too stop the transfer
     // and release resources
@@ -468,211 +826,129 @@ static void forward_data_to_session_agent(uint32_t type, uint8_t *data, size_t s
     udscs_write(active_session_conn, type, 0, 0, data, size);
 }
 
-static const gsize vdagent_message_min_size[] =
-{
-    -1, /* Does not exist */
-    sizeof(VDAgentMouseState), /* VD_AGENT_MOUSE_STATE */
-    sizeof(VDAgentMonitorsConfig), /* VD_AGENT_MONITORS_CONFIG */
-    sizeof(VDAgentReply), /* VD_AGENT_REPLY */
-    sizeof(VDAgentClipboard), /* VD_AGENT_CLIPBOARD */
-    sizeof(VDAgentDisplayConfig), /* VD_AGENT_DISPLAY_CONFIG */
-    sizeof(VDAgentAnnounceCapabilities), /* VD_AGENT_ANNOUNCE_CAPABILITIES */
-    sizeof(VDAgentClipboardGrab), /* VD_AGENT_CLIPBOARD_GRAB */
-    sizeof(VDAgentClipboardRequest), /* VD_AGENT_CLIPBOARD_REQUEST */
-    sizeof(VDAgentClipboardRelease), /* VD_AGENT_CLIPBOARD_RELEASE */
-    sizeof(VDAgentFileXferStartMessage), /* VD_AGENT_FILE_XFER_START */
-    sizeof(VDAgentFileXferStatusMessage), /* VD_AGENT_FILE_XFER_STATUS */
-    sizeof(VDAgentFileXferDataMessage), /* VD_AGENT_FILE_XFER_DATA */
-    0, /* VD_AGENT_CLIENT_DISCONNECTED */
-    sizeof(VDAgentMaxClipboard), /* VD_AGENT_MAX_CLIPBOARD */
-    sizeof(VDAgentAudioVolumeSync), /* VD_AGENT_AUDIO_VOLUME_SYNC */
-    sizeof(VDAgentGraphicsDeviceInfo), /* VD_AGENT_GRAPHICS_DEVICE_INFO */
-};
+static VDAgentGraphicsDeviceInfo *device_info = NULL;
+static size_t device_info_size = 0;
 
-static void vdagent_message_clipboard_from_le(VDAgentMessage *message_header,
-        uint8_t *data)
+static void do_client_graphics_device_info(VirtioPort *vport, int port_nr,
+    VDAgentMessage *message_header, uint8_t *data)
 {
-    gsize min_size = vdagent_message_min_size[message_header->type];
-    uint32_t *data_type = (uint32_t *) data;
-
-    if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
-        min_size += 4;
-        data_type++;
-    }
-
-    switch (message_header->type) {
-    case VD_AGENT_CLIPBOARD_REQUEST:
-    case VD_AGENT_CLIPBOARD:
-        *data_type = GUINT32_FROM_LE(*data_type);
-        break;
-    case VD_AGENT_CLIPBOARD_GRAB:
-        virtio_msg_uint32_from_le(data, message_header->size, min_size);
-        break;
-    case VD_AGENT_CLIPBOARD_RELEASE:
-        break;
-    default:
-        g_warn_if_reached();
-    }
+    // store device info for re-sending when a session agent reconnects
+    g_free(device_info);
+    device_info = g_memdup2(data, message_header->size);
+    device_info_size = message_header->size;
+    forward_data_to_session_agent(VDAGENTD_GRAPHICS_DEVICE_INFO, data, message_header->size);
 }
 
-static void vdagent_message_file_xfer_from_le(VDAgentMessage *message_header,
-        uint8_t *data)
+static void do_client_max_clipboard(VirtioPort *vport, int port_nr,
+    VDAgentMessage *message_header, uint8_t *data)
 {
-    uint32_t *id = (uint32_t *)data;
-    *id = GUINT32_FROM_LE(*id);
-    id++; /* status */
-
-    switch (message_header->type) {
-    case VD_AGENT_FILE_XFER_DATA: {
-       VDAgentFileXferDataMessage *msg = (VDAgentFileXferDataMessage *)data;
-       msg->size = GUINT64_FROM_LE(msg->size);
-       break;
-    }
-    case VD_AGENT_FILE_XFER_STATUS:
-       *id = GUINT32_FROM_LE(*id); /* status */
-       break;
-    }
+    max_clipboard = ((VDAgentMaxClipboard *)data)->max;
+    syslog(LOG_DEBUG, "Set max clipboard: %d", max_clipboard);
 }
 
-static gboolean vdagent_message_check_size(const VDAgentMessage *message_header)
+static void do_client_disconnected(VirtioPort *vport, int port_nr,
+    VDAgentMessage *message_header, uint8_t *data)
 {
-    uint32_t min_size = 0;
-
-    if (message_header->protocol != VD_AGENT_PROTOCOL) {
-        syslog(LOG_ERR, "message with wrong protocol version ignoring");
-        return FALSE;
-    }
-
-    if (!message_header->type ||
-        message_header->type >= G_N_ELEMENTS(vdagent_message_min_size)) {
-        syslog(LOG_WARNING, "unknown message type %d, ignoring",
-               message_header->type);
-        return FALSE;
-    }
-
-    min_size = vdagent_message_min_size[message_header->type];
-    if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                VD_AGENT_CAP_CLIPBOARD_SELECTION)) {
-        switch (message_header->type) {
-        case VD_AGENT_CLIPBOARD_GRAB:
-        case VD_AGENT_CLIPBOARD_REQUEST:
-        case VD_AGENT_CLIPBOARD:
-        case VD_AGENT_CLIPBOARD_RELEASE:
-          min_size += 4;
-        }
-    }
+    vdagent_virtio_port_reset(vport, VDP_CLIENT_PORT);
+    do_client_disconnect();
+}
 
-    if (VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
-                                VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL)
-        && message_header->type == VD_AGENT_CLIPBOARD_GRAB) {
-        min_size += 4;
-    }
+typedef void (*client_message_handler)(VirtioPort *vport, int port_nr,
+                                       VDAgentMessage *message_header,
+                                       uint8_t *data);
 
-    switch (message_header->type) {
-    case VD_AGENT_MONITORS_CONFIG:
-    case VD_AGENT_FILE_XFER_START:
-    case VD_AGENT_FILE_XFER_DATA:
-    case VD_AGENT_CLIPBOARD:
-    case VD_AGENT_CLIPBOARD_GRAB:
-    case VD_AGENT_AUDIO_VOLUME_SYNC:
-    case VD_AGENT_ANNOUNCE_CAPABILITIES:
-    case VD_AGENT_GRAPHICS_DEVICE_INFO:
-        if (message_header->size < min_size) {
-            syslog(LOG_ERR, "read: invalid message size: %u for message type: %u",
-                   message_header->size, message_header->type);
-            return FALSE;
-        }
-        break;
-    case VD_AGENT_MOUSE_STATE:
-    case VD_AGENT_FILE_XFER_STATUS:
-    case VD_AGENT_DISPLAY_CONFIG:
-    case VD_AGENT_REPLY:
-    case VD_AGENT_CLIPBOARD_REQUEST:
-    case VD_AGENT_CLIPBOARD_RELEASE:
-    case VD_AGENT_MAX_CLIPBOARD:
-    case VD_AGENT_CLIENT_DISCONNECTED:
-        if (message_header->size != min_size) {
-            syslog(LOG_ERR, "read: invalid message size: %u for message type: %u",
-                   message_header->size, message_header->type);
-            return FALSE;
-        }
-        break;
-    default:
-        g_warn_if_reached();
-        return FALSE;
-    }
-    return TRUE;
-}
+/* Called once vdagent_message_decode() checked the size of the message and
+   converted it to host byte order, types without a handler are ignored */
+static const client_message_handler client_message_handlers[VDAGENT_CLIENT_MESSAGE_END] = {
+#ifndef __APPLE__
+    [VD_AGENT_MOUSE_STATE] = do_client_mouse,
+    [VD_AGENT_MONITORS_CONFIG] = do_client_monitors,
+#ifdef WITH_EXPERIMENTAL_PROTOCOL
+    [VDP_MOUSE_STATE_BATCH] = do_client_mouse_batch,
+#endif
+#endif
+    [VD_AGENT_ANNOUNCE_CAPABILITIES] = do_client_capabilities,
+    [VD_AGENT_CLIPBOARD] = do_client_clipboard,
+    [VD_AGENT_CLIPBOARD_GRAB] = do_client_clipboard,
+    [VD_AGENT_CLIPBOARD_REQUEST] = do_client_clipboard,
+    [VD_AGENT_CLIPBOARD_RELEASE] = do_client_clipboard,
+    [VD_AGENT_FILE_XFER_START] = do_client_file_xfer,
+    [VD_AGENT_FILE_XFER_STATUS] = do_client_file_xfer,
+    [VD_AGENT_FILE_XFER_DATA] = do_client_file_xfer,
+    [VD_AGENT_CLIENT_DISCONNECTED] = do_client_disconnected,
+    [VD_AGENT_MAX_CLIPBOARD] = do_client_max_clipboard,
+    [VD_AGENT_AUDIO_VOLUME_SYNC] = do_client_volume_sync,
+    [VD_AGENT_GRAPHICS_DEVICE_INFO] = do_client_graphics_device_info,
+};
 
-static VDAgentGraphicsDeviceInfo *device_info = NULL;
-static size_t device_info_size = 0;
 static void virtio_port_read_complete(
         VirtioPort *vport,
         int port_nr,
         VDAgentMessage *message_header,
         uint8_t *data)
 {
-    if (!vdagent_message_check_size(message_header))
+    client_message_handler handler;
+    gint64 start_time;
+
+    if (!vdagent_message_decode(message_header, data,
+                                capabilities, capabilities_size))
         return;
 
-    switch (message_header->type) {
-#ifndef __APPLE__
-    case VD_AGENT_MOUSE_STATE:
-        virtio_msg_uint32_from_le(data, message_header->size, 0);
-        do_client_mouse(&uinput, (VDAgentMouseState *)data);
-        break;
-    case VD_AGENT_MONITORS_CONFIG:
-        virtio_msg_uint32_from_le(data, message_header->size, 0);
-        do_client_monitors(vport, port_nr, message_header,
-                    (VDAgentMonitorsConfig *)data);
-        break;
-#endif
-    case VD_AGENT_ANNOUNCE_CAPABILITIES:
-        virtio_msg_uint32_from_le(data, message_header->size, 0);
-        do_client_capabilities(vport, message_header,
-                        (VDAgentAnnounceCapabilities *)data);
-        break;
-    case VD_AGENT_CLIPBOARD_GRAB:
-    case VD_AGENT_CLIPBOARD_REQUEST:
-    case VD_AGENT_CLIPBOARD:
-    case VD_AGENT_CLIPBOARD_RELEASE:
-        vdagent_message_clipboard_from_le(message_header, data);
-        do_client_clipboard(vport, message_header, data);
-        break;
-    case VD_AGENT_FILE_XFER_START:
-    case VD_AGENT_FILE_XFER_STATUS:
-    case VD_AGENT_FILE_XFER_DATA:
-        vdagent_message_file_xfer_from_le(message_header, data);
-        do_client_file_xfer(vport, message_header, data);
-        break;
-    case VD_AGENT_CLIENT_DISCONNECTED:
-        vdagent_virtio_port_reset(vport, VDP_CLIENT_PORT);
-        do_client_disconnect();
-        break;
-    case VD_AGENT_MAX_CLIPBOARD: {
-        max_clipboard = GUINT32_FROM_LE(((VDAgentMaxClipboard *)data)->max);
-        syslog(LOG_DEBUG, "Set max clipboard: %d", max_clipboard);
-        break;
-    }
-    case VD_AGENT_GRAPHICS_DEVICE_INFO: {
-        // store device info for re-sending when a session agent reconnects
-        g_free(device_info);
-        device_info = g_memdup2(data, message_header->size);
-        device_info_size = message_header->size;
-        forward_data_to_session_agent(VDAGENTD_GRAPHICS_DEVICE_INFO, data, message_header->size);
-        break;
+    start_time = g_get_monotonic_time();
+    client_message_id++;
+    VDAGENT_PROBE(virtio__message, client_message_id, port_nr,
+                  message_header->type, message_header->size);
+
+    handler = client_message_handlers[message_header->type];
+    if (handler) {
+        handler(vport, port_nr, message_header, data);
+    } else if (debug) {
+        syslog(LOG_DEBUG, "ignoring message of type %u", message_header->type);
     }
-    case VD_AGENT_AUDIO_VOLUME_SYNC: {
-        VDAgentAudioVolumeSync *vdata = (VDAgentAudioVolumeSync *)data;
-        virtio_msg_uint16_from_le((uint8_t *)vdata, message_header->size,
-            offsetof(VDAgentAudioVolumeSync, volume));
+    stats_histogram_add(&client_dispatch_latency,
+                        g_get_monotonic_time() - start_time);
+}
 
-        do_client_volume_sync(vport, port_nr, message_header, vdata);
-        break;
+static int agent_update_reading(UdscsConnection *conn, void *priv)
+{
+    if (virtio_port_congested) {
+        vdagent_connection_pause_reading(VDAGENT_CONNECTION(conn));
+    } else {
+        vdagent_connection_resume_reading(VDAGENT_CONNECTION(conn));
     }
-    default:
-        g_warn_if_reached();
+    return 0;
+}
+
+static void virtio_port_flow_cb(VDAgentConnection *conn, gboolean congested)
+{
+    if (debug)
+        syslog(LOG_DEBUG, "virtio port %s", congested ?
+               "congested, pausing agents" : "drained, resuming agents");
+
+    virtio_port_congested = congested;
+    udscs_server_for_all_clients(server, agent_update_reading, NULL);
+}
+
+static void virtio_port_configure(VirtioPort *vport)
+{
+    vdagent_connection_set_watermarks(VDAGENT_CONNECTION(vport),
+                                      VIRTIO_PORT_LOW_WATERMARK,
+                                      VIRTIO_PORT_HIGH_WATERMARK,
+                                      virtio_port_flow_cb);
+    vdagent_virtio_port_set_stream_callback(vport, virtio_port_stream_cb);
+    if (file_xfers_paused) {
+        vdagent_connection_pause_reading(VDAGENT_CONNECTION(vport));
+    }
+    /* a port which failed to write the capture stopped it, don't give the
+       next one a stream with a hole in it */
+    if (capture_file && ferror(capture_file)) {
+        syslog(LOG_ERR, "capture %s is incomplete, no longer recording",
+               capture_path);
+        fclose(capture_file);
+        capture_file = NULL;
+    }
+    if (capture_file) {
+        vdagent_virtio_port_set_capture(vport, capture_file, capture_payloads);
     }
 }
 
@@ -682,8 +958,14 @@ static void virtio_port_error_cb(VDAgentConnection *conn, GError *err)
     syslog(LOG_CRIT, "AIIEEE lost spice client connection, reconnecting (err: %s)",
                      err ? err->message : "");
     g_clear_error(&err);
+    if (capture_file) {
+        fflush(capture_file);
+    }
 
     vdagent_connection_destroy(virtio_port);
+    if (virtio_port_congested) {
+        virtio_port_flow_cb(NULL, FALSE);
+    }
     virtio_port = vdagent_virtio_port_create(portdev,
                                              virtio_port_read_complete,
                                              virtio_port_error_cb);
@@ -692,6 +974,7 @@ static void virtio_port_error_cb(VDAgentConnection *conn, GError *err)
         vdagentd_quit(1);
         return;
     }
+    virtio_port_configure(virtio_port);
     do_client_disconnect();
     client_connected = old_client_connected;
 }
@@ -746,6 +1029,15 @@ static void do_agent_clipboard(UdscsConnection *conn,
     uint8_t selection = header->arg1;
     uint32_t msg_type = 0, data_type = -1, size = header->size;
 
+    /* Remember what the agent owns even when the client can't be told now,
+     * see restore_clipboards(). Before virtio_write_clipboard() converts
+     * the types in place. */
+    if (header->type == VDAGENTD_CLIPBOARD_GRAB) {
+        agent_data_set_clipboard_grab(conn, selection, data, header->size);
+    } else if (header->type == VDAGENTD_CLIPBOARD_RELEASE) {
+        agent_data_set_clipboard_grab(conn, selection, NULL, 0);
+    }
+
     if (!VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
                                  VD_AGENT_CAP_CLIPBOARD_BY_DEMAND))
         goto error;
@@ -758,7 +1050,13 @@ static void do_agent_clipboard(UdscsConnection *conn,
                               "the active session?", conn);
         goto error;
 #else
+        /* The grab is forwarded below, restore_clipboards() must not
+         * announce it as well */
+        if (header->type == VDAGENTD_CLIPBOARD_GRAB)
+            agent_data_set_clipboard_grab(conn, selection, NULL, 0);
         update_active_session_connection(conn);
+        if (header->type == VDAGENTD_CLIPBOARD_GRAB)
+            agent_data_set_clipboard_grab(conn, selection, data, header->size);
 #endif
     }
 
@@ -806,7 +1104,7 @@ static void do_agent_clipboard(UdscsConnection *conn,
     if (size != header->size) {
         syslog(LOG_ERR,
                "unexpected extra data in clipboard msg, disconnecting agent");
-        udscs_server_destroy_connection(server, conn);
+        agent_disconnect(VDAGENT_CONNECTION(conn), NULL);
         return;
     }
 
@@ -822,13 +1120,25 @@ error:
     }
 }
 
+#if !defined(__APPLE__) && !defined(WITH_STATIC_UINPUT)
+static gboolean uinput_linger_cb(gpointer user_data)
+{
+    uinput_linger_id = 0;
+    if (debug)
+        syslog(LOG_DEBUG, "no session agent came back, closing uinput device");
+    vdagentd_input_close(input);
+    uinput_open = false;
+    return G_SOURCE_REMOVE;
+}
+#endif
+
 /* When we open the vdagent virtio channel, the server automatically goes into
    client mouse mode, so we can only have the channel open when we know the
    active session resolution. This function checks that we have an agent in the
    active session, and that it has told us its resolution. If these conditions
    are met it sets the uinput tablet device's resolution and opens the virtio
    channel (if it is not already open). If these conditions are not met, it
-   closes both. */
+   closes the channel, and the tablet device UINPUT_LINGER_TIMEOUT later. */
 static void check_xorg_resolution(void)
 {
     const struct agent_data *agent_data = NULL;
@@ -837,25 +1147,18 @@ static void check_xorg_resolution(void)
 
 #ifndef __APPLE__
     if (agent_data && agent_data->screen_info) {
-        if (!uinput)
-            uinput = vdagentd_uinput_create(uinput_device,
-                                            agent_data->width,
-                                            agent_data->height,
-                                            agent_data->screen_info,
-                                            agent_data->screen_count,
-                                            debug > 1,
-                                            uinput_fake);
-        else
-            vdagentd_uinput_update_size(&uinput,
-                                        agent_data->width,
-                                        agent_data->height,
-                                        agent_data->screen_info,
-                                        agent_data->screen_count);
-        if (!uinput) {
-            syslog(LOG_CRIT, "Fatal uinput error");
-            vdagentd_quit(1);
-            return;
+        if (uinput_linger_id) {
+            g_source_remove(uinput_linger_id);
+            uinput_linger_id = 0;
         }
+        /* the input thread opens the tablet, or resizes it, see
+         * vdagentd_uinput_update_size(), it calls input_error_cb() on failure */
+        vdagentd_input_set_geometry(input,
+                                    agent_data->width,
+                                    agent_data->height,
+                                    agent_data->screen_info,
+                                    agent_data->screen_count);
+        uinput_open = true;
 #else
     if (agent_data) {
 #endif
@@ -870,12 +1173,16 @@ static void check_xorg_resolution(void)
                 vdagentd_quit(1);
                 return;
             }
+            virtio_port_configure(virtio_port);
             send_capabilities(virtio_port, 1);
         }
     } else {
 #ifndef WITH_STATIC_UINPUT
 #ifndef __APPLE__
-        vdagentd_uinput_destroy(&uinput);
+        vdagentd_input_drop_mouse(input);
+        if (uinput_open && !uinput_linger_id)
+            uinput_linger_id = g_timeout_add_seconds(UINPUT_LINGER_TIMEOUT,
+                                                     uinput_linger_cb, NULL);
 #endif
 #endif
         if (virtio_port) {
@@ -886,27 +1193,14 @@ static void check_xorg_resolution(void)
             }
             vdagent_connection_flush(VDAGENT_CONNECTION(virtio_port));
             g_clear_pointer(&virtio_port, vdagent_connection_destroy);
+            if (virtio_port_congested) {
+                virtio_port_flow_cb(NULL, FALSE);
+            }
             syslog(LOG_INFO, "closed vdagent virtio channel");
         }
     }
 }
 
-static int connection_matches_active_session(UdscsConnection *conn,
-    void *priv)
-{
-    UdscsConnection **conn_ret = (UdscsConnection **)priv;
-    const struct agent_data *agent_data = g_object_get_data(G_OBJECT(conn), "agent_data");
-
-    /* Check if this connection matches the currently active session */
-    if (!agent_data->session || !active_session)
-        return 0;
-    if (strcmp(agent_data->session, active_session))
-        return 0;
-
-    *conn_ret = conn;
-    return 1;
-}
-
 static void release_clipboards(void)
 {
     uint8_t sel;
@@ -920,15 +1214,53 @@ static void release_clipboards(void)
     }
 }
 
+/* Announce again the clipboards the agent of the new active session owned
+ * when its session was switched away from */
+static void restore_clipboards(void)
+{
+    const struct agent_data *agent_data;
+    uint8_t sel;
+
+    if (!active_session_conn || !virtio_port ||
+        !VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
+                                 VD_AGENT_CAP_CLIPBOARD_BY_DEMAND))
+        return;
+    agent_data = g_object_get_data(G_OBJECT(active_session_conn), "agent_data");
+    if (!agent_data)
+        return;
+
+    for (sel = 0; sel <= VD_AGENT_CLIPBOARD_SELECTION_SECONDARY; sel++) {
+        GBytes *grab = agent_data->clipboard_grab[sel];
+        gsize size;
+        uint8_t *types;
+
+        if (!grab)
+            continue;
+        if (sel != VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD &&
+            !VD_AGENT_HAS_CAPABILITY(capabilities, capabilities_size,
+                                     VD_AGENT_CAP_CLIPBOARD_SELECTION))
+            continue;
+
+        if (debug)
+            syslog(LOG_DEBUG, "restoring clipboard grab of selection %u", sel);
+        /* the copy gets converted to little endian in place */
+        types = g_bytes_unref_to_data(g_bytes_ref(grab), &size);
+        virtio_write_clipboard(sel, VD_AGENT_CLIPBOARD_GRAB, -1, types, size);
+        g_free(types);
+        agent_owns_clipboard[sel] = true;
+    }
+}
+
 static void update_active_session_connection(UdscsConnection *new_conn)
 {
     if (session_info) {
         new_conn = NULL;
         if (!active_session)
             active_session = session_info_get_active_session(session_info);
-        session_count = udscs_server_for_all_clients(server,
-                                         connection_matches_active_session,
-                                         (void*)&new_conn);
+        /* agent_connect() refuses a second agent for the same session */
+        if (active_session)
+            new_conn = g_hash_table_lookup(session_conns, active_session);
+        session_count = new_conn ? 1 : 0;
     } else {
 #ifdef WITH_SESSION_SECURITY
         if (new_conn)
@@ -971,11 +1303,15 @@ static void update_active_session_connection(UdscsConnection *new_conn)
     release_clipboards();
 
     check_xorg_resolution();
+
+    restore_clipboards();
 }
 
 static gboolean remove_active_xfers(gpointer key, gpointer value, gpointer conn)
 {
-    if (value == conn) {
+    struct file_xfer *xfer = value;
+
+    if (xfer->conn == conn) {
         send_file_xfer_status(virtio_port,
                               "Agent disc; cancelling file-xfer %u",
                               GPOINTER_TO_UINT(key),
@@ -985,20 +1321,6 @@ static gboolean remove_active_xfers(gpointer key, gpointer value, gpointer conn)
         return 0;
 }
 
-/* Check if this connection matches the passed session */
-static int connection_matches_session(UdscsConnection *conn, void *priv)
-{
-    const char *session = priv;
-    const struct agent_data *agent_data = g_object_get_data(G_OBJECT(conn), "agent_data");
-
-    if (!agent_data || !agent_data->session ||
-        strcmp(agent_data->session, session) != 0) {
-        return 0;
-    }
-
-    return 1;
-}
-
 /* Check a given process has a given UID */
 static bool check_uid_of_pid(pid_t pid, uid_t uid)
 {
@@ -1055,18 +1377,22 @@ static void agent_connect(UdscsConnection *conn)
         }
 
         // Check there are no other connection for this session
-        // Note that "conn" is not counted as "agent_data" is still not attached to it
-        if (udscs_server_for_all_clients(server, connection_matches_session,
-                                         agent_data->session) > 0) {
+        if (agent_data->session &&
+            g_hash_table_contains(session_conns, agent_data->session)) {
             syslog(LOG_ERR, "An agent is already connected for this session");
             agent_data_destroy(agent_data);
             udscs_server_destroy_connection(server, conn);
             return;
         }
+        if (agent_data->session)
+            g_hash_table_insert(session_conns, g_strdup(agent_data->session), conn);
     }
 
     g_object_set_data_full(G_OBJECT(conn), "agent_data", agent_data,
                            (GDestroyNotify) agent_data_destroy);
+    if (virtio_port_congested) {
+        vdagent_connection_pause_reading(VDAGENT_CONNECTION(conn));
+    }
     udscs_write(conn, VDAGENTD_VERSION, 0, 0,
                 (uint8_t *)VERSION, strlen(VERSION) + 1);
     update_active_session_connection(conn);
@@ -1079,8 +1405,19 @@ static void agent_connect(UdscsConnection *conn)
 
 static void agent_disconnect(VDAgentConnection *conn, GError *err)
 {
+    const struct agent_data *agent_data = g_object_get_data(G_OBJECT(conn), "agent_data");
+
     g_hash_table_foreach_remove(active_xfers, remove_active_xfers, conn);
 
+    if (agent_data && agent_data->session &&
+        g_hash_table_lookup(session_conns, agent_data->session) == conn) {
+        g_hash_table_remove(session_conns, agent_data->session);
+    }
+
+    if (clipboard_stream.conn == UDSCS_CONNECTION(conn)) {
+        clipboard_stream_abort();
+    }
+
     if (err) {
         syslog(LOG_ERR, "%s", err->message);
         g_error_free(err);
@@ -1111,7 +1448,7 @@ static void do_agent_xorg_resolution(UdscsConnection             *conn,
     if (header->size != n * res_size) {
         syslog(LOG_ERR, "guest xorg resolution message has wrong size, "
                         "disconnecting agent");
-        udscs_server_destroy_connection(server, conn);
+        agent_disconnect(VDAGENT_CONNECTION(conn), NULL);
         return;
     }
 
@@ -1133,8 +1470,8 @@ static void do_agent_file_xfer_status(UdscsConnection             *conn,
     const gchar *log_msg = NULL;
     guint data_size = 0;
 
-    UdscsConnection *task_conn = g_hash_table_lookup(active_xfers, task_id);
-    if (task_conn == NULL || task_conn != conn) {
+    struct file_xfer *xfer = g_hash_table_lookup(active_xfers, task_id);
+    if (xfer == NULL || xfer->conn != conn) {
         // Protect against misbehaving agent.
         // Ignore the message, but do not disconnect the agent, to protect against
         // a misbehaving client that tries to disconnect a good agent
@@ -1161,9 +1498,29 @@ static void do_agent_file_xfer_status(UdscsConnection             *conn,
     }
 }
 
+/* header->arg1 = file xfer task id, header->arg2 = bytes written */
+static void do_agent_file_xfer_ack(UdscsConnection             *conn,
+                                   struct udscs_message_header *header)
+{
+    struct file_xfer *xfer = g_hash_table_lookup(active_xfers,
+                                                 GUINT_TO_POINTER(header->arg1));
+    if (xfer == NULL || xfer->conn != conn) {
+        return;
+    }
+
+    xfer->unacked -= MIN(xfer->unacked, header->arg2);
+    file_xfer_release_held(xfer);
+    file_xfers_update_reading();
+}
+
 static void agent_read_complete(UdscsConnection *conn,
     struct udscs_message_header *header, uint8_t *data)
 {
+    gint64 start_time = g_get_monotonic_time();
+
+    VDAGENT_PROBE(agent__message, conn, header->type, header->arg1,
+                  header->size);
+
     switch (header->type) {
 #ifndef __APPLE__
     case VDAGENTD_GUEST_XORG_RESOLUTION:
@@ -1179,11 +1536,16 @@ static void agent_read_complete(UdscsConnection *conn,
     case VDAGENTD_FILE_XFER_STATUS:
         do_agent_file_xfer_status(conn, header, data);
         break;
+    case VDAGENTD_FILE_XFER_ACK:
+        do_agent_file_xfer_ack(conn, header);
+        break;
 
     default:
         syslog(LOG_ERR, "unknown message from vdagent: %u, ignoring",
                header->type);
     }
+    stats_histogram_add(&agent_dispatch_latency,
+                        g_get_monotonic_time() - start_time);
 }
 
 static gboolean si_io_channel_cb(GIOChannel  *source,
@@ -1242,6 +1604,179 @@ static gboolean signal_handler(gpointer user_data)
     return G_SOURCE_REMOVE;
 }
 
+/* stats */
+
+static void stats_histogram_append(GString *out, const gchar *name,
+                                   const StatsHistogram *histogram)
+{
+    guint64 total = 0;
+    guint i;
+
+    g_string_append_printf(out, "# TYPE %s histogram\n", name);
+    for (i = 0; i < STATS_HISTOGRAM_BUCKETS - 1; i++) {
+        total += histogram->buckets[i];
+        g_string_append_printf(out, "%s_bucket{le=\"%g\"} %" G_GUINT64_FORMAT "\n",
+                               name, (double)((gint64)1 << i) / 1e6, total);
+    }
+    g_string_append_printf(out, "%s_bucket{le=\"+Inf\"} %" G_GUINT64_FORMAT "\n",
+                           name, histogram->count);
+    g_string_append_printf(out, "%s_sum %g\n", name, histogram->sum / 1e6);
+    g_string_append_printf(out, "%s_count %" G_GUINT64_FORMAT "\n",
+                           name, histogram->count);
+}
+
+static void stats_connection_append(GString *out, const gchar *labels,
+                                    VDAgentConnection *conn)
+{
+    g_string_append_printf(out,
+        "spice_vdagentd_queued_messages{%s} %u\n"
+        "spice_vdagentd_queued_bytes{%s} %" G_GSIZE_FORMAT "\n"
+        "spice_vdagentd_congested{%s} %d\n",
+        labels, vdagent_connection_get_queued_messages(conn),
+        labels, vdagent_connection_get_queued_bytes(conn),
+        labels, vdagent_connection_is_congested(conn) ? 1 : 0);
+}
+
+static int stats_agent_append(UdscsConnection *conn, void *priv)
+{
+    const struct agent_data *agent_data =
+        g_object_get_data(G_OBJECT(conn), "agent_data");
+    GString *out = priv;
+    gchar *labels;
+
+    labels = g_strdup_printf("connection=\"agent\",session=\"%s\"",
+                             agent_data && agent_data->session ?
+                             agent_data->session : "");
+    stats_connection_append(out, labels, VDAGENT_CONNECTION(conn));
+    vdagent_message_stats_append(out, "spice_vdagentd_udscs", labels,
+                                 udscs_get_stats(conn), VDAGENTD_NO_MESSAGES);
+    g_free(labels);
+    return 1;
+}
+
+/* Returns the daemon statistics in the Prometheus text format */
+static GString *stats_report(void)
+{
+    GString *out = g_string_new(NULL);
+    VDAgentPayloadStats payloads;
+#ifndef __APPLE__
+    struct vdagentd_input_stats input_stats;
+#endif
+    int n_agents;
+
+    if (virtio_port) {
+        stats_connection_append(out, "connection=\"virtio\"",
+                                VDAGENT_CONNECTION(virtio_port));
+        vdagent_message_stats_append(out, "spice_vdagentd_virtio", NULL,
+                                     vdagent_virtio_port_get_stats(virtio_port),
+                                     VDAGENT_CLIENT_MESSAGE_END);
+    }
+    n_agents = udscs_server_for_all_clients(server, stats_agent_append, out);
+    g_string_append_printf(out,
+        "spice_vdagentd_agents %d\n"
+        "spice_vdagentd_client_connected %d\n"
+        "spice_vdagentd_file_xfers_active %u\n"
+        "spice_vdagentd_file_xfers_max %d\n",
+        n_agents, client_connected ? 1 : 0,
+        active_xfers ? g_hash_table_size(active_xfers) : 0,
+        MAX_ACTIVE_TRANSFERS);
+    vdagent_payload_get_stats(&payloads);
+    g_string_append_printf(out,
+        "spice_vdagentd_payload_budget_bytes %" G_GSIZE_FORMAT "\n"
+        "spice_vdagentd_payload_heap_bytes %" G_GSIZE_FORMAT "\n"
+        "spice_vdagentd_payload_heap_high_water_bytes %" G_GSIZE_FORMAT "\n"
+        "spice_vdagentd_payload_spilled_bytes %" G_GSIZE_FORMAT "\n"
+        "spice_vdagentd_payload_spilled_high_water_bytes %" G_GSIZE_FORMAT "\n"
+        "spice_vdagentd_payload_spills_total %" G_GUINT64_FORMAT "\n",
+        payloads.budget, payloads.heap_bytes, payloads.heap_high_water,
+        payloads.spilled_bytes, payloads.spilled_high_water, payloads.spills);
+    stats_histogram_append(out, "spice_vdagentd_client_dispatch_seconds",
+                           &client_dispatch_latency);
+    stats_histogram_append(out, "spice_vdagentd_agent_dispatch_seconds",
+                           &agent_dispatch_latency);
+#ifndef __APPLE__
+    vdagentd_input_get_stats(input, &input_stats);
+    g_string_append_printf(out,
+        "spice_vdagentd_mouse_motion_coalesced_total %" G_GUINT64_FORMAT "\n"
+        "spice_vdagentd_mouse_states_dropped_total %" G_GUINT64_FORMAT "\n",
+        input_stats.motion_coalesced,
+        input_stats.states_dropped + mouse_states_dropped);
+    stats_histogram_append(out, "spice_vdagentd_mouse_latency_seconds",
+                           &input_stats.latency);
+#endif
+    return out;
+}
+
+static gboolean stats_signal_handler(gpointer user_data)
+{
+    GString *report = stats_report();
+    gchar **lines = g_strsplit(report->str, "\n", -1);
+    gchar **line;
+
+    for (line = lines; *line; line++) {
+        if (**line && **line != '#')
+            syslog(LOG_INFO, "%s", *line);
+    }
+    g_strfreev(lines);
+    g_string_free(report, TRUE);
+    return G_SOURCE_CONTINUE;
+}
+
+static void stats_write_cb(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    GSocketConnection *connection = user_data;
+
+    g_output_stream_write_all_finish(G_OUTPUT_STREAM(source), res, NULL, NULL);
+    g_io_stream_close(G_IO_STREAM(connection), NULL, NULL);
+    g_object_unref(connection);
+}
+
+/* Every connection to the stats socket gets a report, then it is closed */
+static gboolean stats_incoming(GSocketService    *service,
+                               GSocketConnection *connection,
+                               GObject           *source_object,
+                               gpointer           user_data)
+{
+    GString *report = stats_report();
+    GOutputStream *out = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+    gsize size = report->len;
+
+    /* the stream reads the data as it goes, so keep it around with the connection */
+    g_object_set_data_full(G_OBJECT(connection), "report",
+                           g_string_free(report, FALSE), g_free);
+    g_output_stream_write_all_async(out,
+                                    g_object_get_data(G_OBJECT(connection), "report"),
+                                    size, G_PRIORITY_DEFAULT, NULL,
+                                    stats_write_cb, g_object_ref(connection));
+    return TRUE;
+}
+
+static void stats_listen(const gchar *path)
+{
+    GSocketAddress *addr;
+    GError *err = NULL;
+    mode_t mode;
+
+    g_unlink(path);
+    stats_service = g_socket_service_new();
+    addr = g_unix_socket_address_new(path);
+    /* the report tells who is logged in, the socket is created 0600 */
+    mode = umask(0177);
+    g_socket_listener_add_address(G_SOCKET_LISTENER(stats_service), addr,
+                                  G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT,
+                                  NULL, NULL, &err);
+    umask(mode);
+    g_object_unref(addr);
+    if (err) {
+        syslog(LOG_ERR, "Could not listen on %s: %s", path, err->message);
+        g_error_free(err);
+        g_clear_object(&stats_service);
+        return;
+    }
+    g_signal_connect(stats_service, "incoming", G_CALLBACK(stats_incoming), NULL);
+    g_socket_service_start(stats_service);
+}
+
 static gboolean parse_debug_level_cb(const gchar *option_name,
                                      const gchar *value,
                                      gpointer     data,
@@ -1280,6 +1815,22 @@ static GOptionEntry cmd_entries[] = {
       G_OPTION_ARG_NONE, &only_once,
       "Only handle one virtio serial session", NULL },
 
+    { "capture", 0, 0,
+      G_OPTION_ARG_FILENAME, &capture_path,
+      "Record the virtio port traffic into <file>", "<file>" },
+
+    { "capture-payloads", 0, 0,
+      G_OPTION_ARG_NONE, &capture_payloads,
+      "Also record the data sent by the client, for spice-vdagentd-replay", NULL },
+
+    { "stats-socket", 0, 0,
+      G_OPTION_ARG_FILENAME, &stats_socket_path,
+      "Serve statistics in the Prometheus text format on <socket>", "<socket>" },
+
+    { "payload-budget", 0, 0,
+      G_OPTION_ARG_INT, &payload_budget_mb,
+      "Keep at most <MiB> of message data on the heap, 0 for no limit (128)", "<MiB>" },
+
 #if defined(HAVE_CONSOLE_KIT) || defined (HAVE_LIBSYSTEMD_LOGIN)
     { "disable-session-integration", 'X', G_OPTION_FLAG_REVERSE,
       G_OPTION_ARG_NONE, &want_session_info,
@@ -1296,6 +1847,9 @@ int main(int argc, char *argv[])
     gboolean own_socket = TRUE;
     GIOChannel *si_io_channel = NULL;
     guint si_watch_id = 0;
+#ifndef __APPLE__
+    struct vdagentd_uinput *uinput = NULL;
+#endif
 
     context = g_option_context_new(NULL);
     g_option_context_add_main_entries(context, cmd_entries, NULL);
@@ -1310,6 +1864,9 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (payload_budget_mb >= 0)
+        vdagent_payload_set_budget((gsize)payload_budget_mb * 1024 * 1024);
+
     if (portdev == NULL) {
         portdev = g_strdup(DEFAULT_VIRTIO_PORT_PATH);
     }
@@ -1322,6 +1879,27 @@ int main(int argc, char *argv[])
 
     openlog("spice-vdagentd", do_daemonize ? 0 : LOG_PERROR, LOG_USER);
 
+    if (capture_path) {
+        /* the capture holds client data, don't follow links to somewhere
+           else or write into a file someone else prepared */
+        int capture_fd = open(capture_path,
+                              O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                              0600);
+        if (capture_fd != -1) {
+            capture_file = fdopen(capture_fd, "wb");
+            if (capture_file == NULL) {
+                close(capture_fd);
+            }
+        }
+        if (capture_file == NULL ||
+            fwrite(VIRTIO_CAPTURE_MAGIC, VIRTIO_CAPTURE_MAGIC_SIZE, 1,
+                   capture_file) != 1) {
+            syslog(LOG_CRIT, "Fatal could not create capture %s: %m", capture_path);
+            return 1;
+        }
+        syslog(LOG_INFO, "recording virtio port traffic into %s", capture_path);
+    }
+
     /* Setup communication with vdagent process(es) */
     server = udscs_server_new(agent_connect, agent_read_complete,
                               agent_disconnect, debug);
@@ -1364,9 +1942,16 @@ int main(int argc, char *argv[])
     if (do_daemonize)
         daemonize();
 
+#ifndef __APPLE__
+    /* after daemonize(), threads don't survive fork() */
+    input = vdagentd_input_new(uinput_device, debug > 1, uinput_fake,
+                               uinput, input_error_cb);
+#endif
+
     g_unix_signal_add(SIGINT, signal_handler, NULL);
     g_unix_signal_add(SIGHUP, signal_handler, NULL);
     g_unix_signal_add(SIGTERM, signal_handler, NULL);
+    g_unix_signal_add(SIGUSR1, stats_signal_handler, NULL);
 
     if (want_session_info)
         session_info = session_info_create(debug);
@@ -1380,22 +1965,37 @@ int main(int argc, char *argv[])
 #endif
     }
 
-    active_xfers = g_hash_table_new(g_direct_hash, g_direct_equal);
+    active_xfers = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                         NULL, file_xfer_free);
+    session_conns = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                          g_free, NULL);
 
     udscs_server_start(server);
+    if (stats_socket_path)
+        stats_listen(stats_socket_path);
     loop = g_main_loop_new(NULL, FALSE);
     g_main_loop_run(loop);
 
     release_clipboards();
 
 #ifndef __APPLE__
-    vdagentd_uinput_destroy(&uinput);
+    if (uinput_linger_id) {
+        g_source_remove(uinput_linger_id);
+        uinput_linger_id = 0;
+    }
+    g_clear_pointer(&input, vdagentd_input_destroy);
 #endif
     if (si_watch_id > 0) {
         g_source_remove(si_watch_id);
     }
+    if (stats_service) {
+        g_socket_service_stop(stats_service);
+        g_clear_object(&stats_service);
+        g_unlink(stats_socket_path);
+    }
     g_clear_pointer(&session_info, session_info_destroy);
     g_clear_pointer(&server, udscs_destroy_server);
+    g_clear_pointer(&session_conns, g_hash_table_destroy);
     if (virtio_port) {
         vdagent_connection_flush(VDAGENT_CONNECTION(virtio_port));
         g_clear_pointer(&virtio_port, vdagent_connection_destroy);
@@ -1416,9 +2016,15 @@ int main(int argc, char *argv[])
     if (do_daemonize)
         unlink(pidfilename);
 
+    if (capture_file) {
+        fclose(capture_file);
+    }
+
     g_free(portdev);
     g_free(vdagentd_socket);
     g_free(uinput_device);
+    g_free(capture_path);
+    g_free(stats_socket_path);
 
     return retval;
 }
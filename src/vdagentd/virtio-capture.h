@@ -0,0 +1,53 @@
+/*  virtio-capture.h file format of the virtio port traffic captures
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __VIRTIO_CAPTURE_H
+#define __VIRTIO_CAPTURE_H
+
+#include <stdint.h>
+
+/* A capture starts with these 8 bytes, followed by records, each one
+   a VirtioCaptureRecord possibly followed by data. Written by
+   spice-vdagentd --capture, read by spice-vdagentd-replay. */
+#define VIRTIO_CAPTURE_MAGIC "VDCAPT01"
+#define VIRTIO_CAPTURE_MAGIC_SIZE 8
+
+enum {
+    /* a chunk as read from the port, its size bytes follow */
+    VIRTIO_CAPTURE_CHUNK,
+    /* the header of a message, the body is not recorded */
+    VIRTIO_CAPTURE_MESSAGE,
+};
+
+enum {
+    VIRTIO_CAPTURE_IN,  /* from the client */
+    VIRTIO_CAPTURE_OUT, /* to the client */
+};
+
+/* All fields are little endian */
+typedef struct VirtioCaptureRecord {
+    uint64_t timestamp; /* monotonic time, in us */
+    uint8_t kind;
+    uint8_t direction;
+    uint16_t port;
+    uint32_t type;      /* VDAgentMessage type, 0 for chunks */
+    uint32_t size;      /* of the chunk, or of the message body */
+    uint32_t reserved;
+} VirtioCaptureRecord;
+
+#endif
@@ -20,6 +20,7 @@
 */
 #include <config.h>
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
@@ -28,12 +29,39 @@
 
 #include "vdagent-connection.h"
 #include "virtio-port.h"
+#include "virtio-capture.h"
+#include "client-messages.h"
+#include "vdagent-probes.h"
 
+/* Outgoing messages are split into chunks of at most this size,
+   so messages for other ports and classes can be sent in between */
+#define MAX_OUT_CHUNK_SIZE VD_AGENT_MAX_DATA_SIZE
+
+/* Bulk messages smaller than this aren't worth compressing */
+#define COMPRESS_MIN_SIZE 4096
+
+/* Compressing runs on the main loop, larger messages are sent as is so
+   that it stays responsive */
+#define COMPRESS_MAX_SIZE (256 * 1024)
+
+/* Upper bound for the size of a decompressed message body */
+#define MAX_INFLATED_SIZE (256 * 1024 * 1024)
+
+/* Output is produced in steps of this size while decompressing */
+#define INFLATE_STEP (64 * 1024)
 
 struct vdagent_virtio_port_buf {
     uint8_t *buf;
     size_t size;
     size_t write_pos;
+    uint32_t port_nr;
+    VDAgentConnectionPriority priority;
+};
+
+/* A complete vdagent message (header and body) waiting to be chunked */
+struct vdagent_virtio_port_out_msg {
+    GBytes *data;
+    size_t pos;
 };
 
 /* Data to keep track of the assembling of vdagent messages per chunk port,
@@ -43,6 +71,16 @@ struct vdagent_virtio_port_chunk_port_data {
     int message_data_pos;
     VDAgentMessage message_header;
     uint8_t *message_data;
+    /* body is passed to stream_callback instead of being reassembled */
+    gboolean streaming;
+    /* peer may compress message bodies, see vdagent_virtio_port_set_compression */
+    gboolean compression;
+    /* compressed body is decompressed into inflated as the chunks arrive */
+    GConverter *decompressor;
+    uint8_t *inflated; /* a payload, see vdagent_payload_alloc() */
+    gsize inflated_size;
+    gsize inflated_len;
+    gboolean inflate_failed;
 };
 
 struct _VirtioPort {
@@ -53,9 +91,26 @@ struct _VirtioPort {
 
     struct vdagent_virtio_port_buf write_buf;
 
+    /* Outgoing messages per chunk port and priority, at message boundaries
+       a port sends its default priority messages first */
+    GQueue *out_queue[VDP_END_PORT][VDAGENT_CONNECTION_N_PRIORITIES];
+    /* Message being chunked per port, it has to be completed before
+       the next one for the same port starts */
+    struct vdagent_virtio_port_out_msg *out_current[VDP_END_PORT];
+    /* Ports take turns sending a chunk */
+    int out_next_port;
+
     /* Callbacks */
     vdagent_virtio_port_read_callback read_callback;
+    vdagent_virtio_port_stream_callback stream_callback;
     VDAgentConnErrorCb error_cb;
+
+    /* see vdagent_virtio_port_set_capture */
+    FILE *capture;
+    gboolean capture_payloads;
+
+    /* traffic per message type, see vdagent_virtio_port_get_stats */
+    VDAgentMessageStats stats[VDAGENT_CLIENT_MESSAGE_END];
 };
 
 G_DEFINE_TYPE(VirtioPort, virtio_port, VDAGENT_TYPE_CONNECTION)
@@ -64,6 +119,26 @@ static void vdagent_virtio_port_do_chunk(VDAgentConnection *conn,
                                          gpointer header_data,
                                          gpointer chunk_data);
 
+static void capture_record(VirtioPort *vport, uint8_t kind, uint8_t direction,
+                           uint32_t port, uint32_t type, uint32_t size,
+                           gconstpointer data)
+{
+    VirtioCaptureRecord record = {
+        .timestamp = GUINT64_TO_LE(g_get_monotonic_time()),
+        .kind = kind,
+        .direction = direction,
+        .port = GUINT16_TO_LE(port),
+        .type = GUINT32_TO_LE(type),
+        .size = GUINT32_TO_LE(size),
+    };
+
+    if (fwrite(&record, sizeof(record), 1, vport->capture) != 1 ||
+        (data && size && fwrite(data, size, 1, vport->capture) != 1)) {
+        syslog(LOG_ERR, "Failed to write capture, stopping it: %m");
+        vport->capture = NULL;
+    }
+}
+
 static gsize conn_handle_header(VDAgentConnection *conn,
                                 gpointer header_buf)
 {
@@ -90,19 +165,116 @@ static gsize conn_handle_header(VDAgentConnection *conn,
     return header->size;
 }
 
+static void port_data_clear_inflate(struct vdagent_virtio_port_chunk_port_data *port)
+{
+    g_clear_object(&port->decompressor);
+    if (port->inflated) {
+        vdagent_payload_free(port->inflated, port->inflated_size);
+        port->inflated = NULL;
+    }
+    port->inflated_size = 0;
+    port->inflated_len = 0;
+    port->inflate_failed = FALSE;
+}
+
+static void out_msg_free(struct vdagent_virtio_port_out_msg *msg)
+{
+    g_bytes_unref(msg->data);
+    g_free(msg);
+}
+
+/* Returns the message to take the next chunk for @port from, if any */
+static struct vdagent_virtio_port_out_msg *next_out_msg(VirtioPort *vport,
+                                                        int port)
+{
+    guint prio;
+
+    if (vport->out_current[port] == NULL) {
+        for (prio = 0; prio < VDAGENT_CONNECTION_N_PRIORITIES; prio++) {
+            vport->out_current[port] = g_queue_pop_head(vport->out_queue[port][prio]);
+            if (vport->out_current[port]) {
+                break;
+            }
+        }
+    }
+    return vport->out_current[port];
+}
+
+/* Queue chunks round-robin across the ports with pending messages */
+static void conn_fill_write_queue(VDAgentConnection *conn, gsize max_bytes)
+{
+    VirtioPort *vport = VIRTIO_PORT(conn);
+    struct vdagent_virtio_port_out_msg *msg;
+    VDIChunkHeader chunk_header;
+    GBytes *parts[2];
+    gsize queued = 0, size;
+    int port, idle = 0;
+
+    while (queued < max_bytes && idle < VDP_END_PORT) {
+        port = vport->out_next_port;
+        vport->out_next_port = (port + 1) % VDP_END_PORT;
+
+        msg = next_out_msg(vport, port);
+        if (msg == NULL) {
+            idle++;
+            continue;
+        }
+        idle = 0;
+
+        size = MIN(g_bytes_get_size(msg->data) - msg->pos, MAX_OUT_CHUNK_SIZE);
+        chunk_header.port = GUINT32_TO_LE(port);
+        chunk_header.size = GUINT32_TO_LE(size);
+
+        parts[0] = g_bytes_new(&chunk_header, sizeof(chunk_header));
+        parts[1] = g_bytes_new_from_bytes(msg->data, msg->pos, size);
+        vdagent_connection_write_bytes(conn, parts, 2,
+                                       VDAGENT_CONNECTION_PRIORITY_DEFAULT);
+        g_bytes_unref(parts[0]);
+        g_bytes_unref(parts[1]);
+        vdagent_connection_add_pending_bytes(conn, -(gssize)size);
+        queued += sizeof(chunk_header) + size;
+
+        msg->pos += size;
+        if (msg->pos == g_bytes_get_size(msg->data)) {
+            out_msg_free(msg);
+            vport->out_current[port] = NULL;
+        }
+    }
+}
+
 static void virtio_port_init(VirtioPort *self)
 {
+    guint i, prio;
+
+    for (i = 0; i < VDP_END_PORT; i++) {
+        for (prio = 0; prio < VDAGENT_CONNECTION_N_PRIORITIES; prio++) {
+            self->out_queue[i][prio] = g_queue_new();
+        }
+    }
 }
 
 static void virtio_port_finalize(GObject *obj)
 {
     VirtioPort *self = VIRTIO_PORT(obj);
-    guint i;
+    guint i, prio;
+
+    vdagent_payload_free(self->write_buf.buf, self->write_buf.size);
 
-    g_free(self->write_buf.buf);
+    for (i = 0; i < VDP_END_PORT; i++) {
+        for (prio = 0; prio < VDAGENT_CONNECTION_N_PRIORITIES; prio++) {
+            g_queue_free_full(self->out_queue[i][prio],
+                              (GDestroyNotify)out_msg_free);
+        }
+        g_clear_pointer(&self->out_current[i], out_msg_free);
+    }
 
     for (i = 0; i < VDP_END_PORT; i++) {
-        g_free(self->port_data[i].message_data);
+        if (self->port_data[i].message_data) {
+            vdagent_connection_buffer_release(VDAGENT_CONNECTION(self),
+                                              self->port_data[i].message_data,
+                                              self->port_data[i].message_header.size);
+        }
+        port_data_clear_inflate(&self->port_data[i]);
     }
 
     G_OBJECT_CLASS(virtio_port_parent_class)->finalize(obj);
@@ -117,6 +289,7 @@ static void virtio_port_class_init(VirtioPortClass *klass)
 
     conn_class->handle_header = conn_handle_header;
     conn_class->handle_message = vdagent_virtio_port_do_chunk;
+    conn_class->fill_write_queue = conn_fill_write_queue;
 }
 
 VirtioPort *vdagent_virtio_port_create(const char *portname,
@@ -173,6 +346,68 @@ VirtioPort *vdagent_virtio_port_create(const char *portname,
     return vport;
 }
 
+/* Returns the message in @buf with its body zlib compressed,
+ * or NULL if that wouldn't make it smaller */
+static GBytes *compress_message(const uint8_t *buf, size_t size)
+{
+    const VDAgentMessage *message_header = (const VDAgentMessage *)buf;
+    VDAgentMessage *header;
+    GConverter *compressor;
+    GConverterResult res;
+    uint8_t *out;
+    gsize in_pos = sizeof(*header), out_pos = sizeof(*header);
+    gsize read, written;
+
+    /* give up once the output isn't smaller than the input */
+    out = vdagent_payload_alloc(size - 1);
+    compressor = G_CONVERTER(g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB, 1));
+    do {
+        res = g_converter_convert(compressor, buf + in_pos, size - in_pos,
+                                  out + out_pos, size - 1 - out_pos,
+                                  G_CONVERTER_INPUT_AT_END, &read, &written, NULL);
+        in_pos += read;
+        out_pos += written;
+    } while (res == G_CONVERTER_CONVERTED);
+    g_object_unref(compressor);
+
+    if (res != G_CONVERTER_FINISHED) {
+        vdagent_payload_free(out, size - 1);
+        return NULL;
+    }
+
+    header = (VDAgentMessage *)out;
+    *header = *message_header;
+    header->opaque = GUINT64_TO_LE(VDP_COMPRESSION_ZLIB);
+    header->size = GUINT32_TO_LE(out_pos - sizeof(*header));
+    return vdagent_payload_steal(out, size - 1, out_pos);
+}
+
+/* Hand the completed write_buf over to the scheduler */
+static void vdagent_virtio_port_write_done(VirtioPort *vport)
+{
+    struct vdagent_virtio_port_buf *wbuf = &vport->write_buf;
+    struct vdagent_virtio_port_out_msg *msg;
+
+    msg = g_new0(struct vdagent_virtio_port_out_msg, 1);
+    if (vport->port_data[wbuf->port_nr].compression &&
+        wbuf->priority == VDAGENT_CONNECTION_PRIORITY_BULK &&
+        wbuf->size >= sizeof(VDAgentMessage) + COMPRESS_MIN_SIZE &&
+        wbuf->size <= sizeof(VDAgentMessage) + COMPRESS_MAX_SIZE &&
+        ((VDAgentMessage *)wbuf->buf)->opaque == 0) {
+        msg->data = compress_message(wbuf->buf, wbuf->size);
+    }
+    if (msg->data) {
+        vdagent_payload_free(wbuf->buf, wbuf->size);
+    } else {
+        msg->data = vdagent_payload_steal(wbuf->buf, wbuf->size, wbuf->size);
+    }
+    wbuf->buf = NULL;
+
+    g_queue_push_tail(vport->out_queue[wbuf->port_nr][wbuf->priority], msg);
+    vdagent_connection_add_pending_bytes(VDAGENT_CONNECTION(vport),
+                                         g_bytes_get_size(msg->data));
+}
+
 void vdagent_virtio_port_write_start(
         VirtioPort *vport,
         uint32_t port_nr,
@@ -181,20 +416,29 @@ void vdagent_virtio_port_write_start(
         uint32_t data_size)
 {
     struct vdagent_virtio_port_buf *new_wbuf;
-    VDIChunkHeader *chunk_header;
     VDAgentMessage *message_header;
 
     g_return_if_fail(vport->write_buf.buf == NULL);
+    g_return_if_fail(port_nr < VDP_END_PORT);
 
     new_wbuf = &vport->write_buf;
     new_wbuf->write_pos = 0;
-    new_wbuf->size = sizeof(*chunk_header) + sizeof(*message_header) + data_size;
-    new_wbuf->buf = g_malloc(new_wbuf->size);
-
-    chunk_header = (VDIChunkHeader *) (new_wbuf->buf + new_wbuf->write_pos);
-    chunk_header->port = GUINT32_TO_LE(port_nr);
-    chunk_header->size = GUINT32_TO_LE(sizeof(*message_header) + data_size);
-    new_wbuf->write_pos += sizeof(*chunk_header);
+    new_wbuf->port_nr = port_nr;
+    /* Clipboard and file contents must not hold up control messages,
+     * the other clipboard messages stay in order with the data */
+    switch (message_type) {
+    case VD_AGENT_CLIPBOARD_GRAB:
+    case VD_AGENT_CLIPBOARD_REQUEST:
+    case VD_AGENT_CLIPBOARD:
+    case VD_AGENT_CLIPBOARD_RELEASE:
+    case VD_AGENT_FILE_XFER_DATA:
+        new_wbuf->priority = VDAGENT_CONNECTION_PRIORITY_BULK;
+        break;
+    default:
+        new_wbuf->priority = VDAGENT_CONNECTION_PRIORITY_DEFAULT;
+    }
+    new_wbuf->size = sizeof(*message_header) + data_size;
+    new_wbuf->buf = vdagent_payload_alloc(new_wbuf->size);
 
     message_header = (VDAgentMessage *) (new_wbuf->buf + new_wbuf->write_pos);
     message_header->protocol = GUINT32_TO_LE(VD_AGENT_PROTOCOL);
@@ -202,6 +446,19 @@ void vdagent_virtio_port_write_start(
     message_header->opaque = GUINT64_TO_LE(message_opaque);
     message_header->size = GUINT32_TO_LE(data_size);
     new_wbuf->write_pos += sizeof(*message_header);
+
+    if (vport->capture) {
+        capture_record(vport, VIRTIO_CAPTURE_MESSAGE, VIRTIO_CAPTURE_OUT,
+                       port_nr, message_type, data_size, NULL);
+    }
+    if (message_type < VDAGENT_CLIENT_MESSAGE_END) {
+        vport->stats[message_type].messages_out++;
+        vport->stats[message_type].bytes_out += data_size;
+    }
+
+    if (data_size == 0) {
+        vdagent_virtio_port_write_done(vport);
+    }
 }
 
 int vdagent_virtio_port_write_append(VirtioPort *vport,
@@ -228,8 +485,7 @@ int vdagent_virtio_port_write_append(VirtioPort *vport,
     wbuf->write_pos += size;
 
     if (wbuf->write_pos == wbuf->size) {
-        vdagent_connection_write(VDAGENT_CONNECTION(vport), wbuf->buf, wbuf->size);
-        wbuf->buf = NULL;
+        vdagent_virtio_port_write_done(vport);
     }
     return 0;
 }
@@ -253,10 +509,117 @@ void vdagent_virtio_port_reset(VirtioPort *vport, int port)
         syslog(LOG_ERR, "vdagent_virtio_port_reset port out of range");
         return;
     }
-    g_free(vport->port_data[port].message_data);
+    if (vport->port_data[port].message_data) {
+        vdagent_connection_buffer_release(VDAGENT_CONNECTION(vport),
+                                          vport->port_data[port].message_data,
+                                          vport->port_data[port].message_header.size);
+    }
+    port_data_clear_inflate(&vport->port_data[port]);
     memset(&vport->port_data[port], 0, sizeof(vport->port_data[0]));
 }
 
+void vdagent_virtio_port_set_compression(VirtioPort *vport, int port,
+                                         gboolean enable)
+{
+    g_return_if_fail(port < VDP_END_PORT);
+
+    vport->port_data[port].compression = enable;
+}
+
+void vdagent_virtio_port_set_capture(VirtioPort *vport, FILE *capture,
+                                     gboolean payloads)
+{
+    vport->capture = capture;
+    vport->capture_payloads = payloads;
+}
+
+const VDAgentMessageStats *vdagent_virtio_port_get_stats(VirtioPort *vport)
+{
+    return vport->stats;
+}
+
+void vdagent_virtio_port_set_stream_callback(VirtioPort *vport,
+    vdagent_virtio_port_stream_callback stream_callback)
+{
+    vport->stream_callback = stream_callback;
+}
+
+GBytes *vdagent_virtio_port_steal_message_data(VirtioPort *vport, int port)
+{
+    struct vdagent_virtio_port_chunk_port_data *port_data;
+    GBytes *bytes;
+
+    g_return_val_if_fail(port < VDP_END_PORT, NULL);
+
+    port_data = &vport->port_data[port];
+    if (port_data->inflated) {
+        bytes = vdagent_payload_steal(port_data->inflated,
+                                      port_data->inflated_size,
+                                      port_data->inflated_len);
+        port_data->inflated = NULL;
+        return bytes;
+    }
+    g_return_val_if_fail(port_data->message_data != NULL, NULL);
+
+    bytes = vdagent_connection_buffer_steal(VDAGENT_CONNECTION(vport),
+                                            port_data->message_data,
+                                            port_data->message_header.size);
+    port_data->message_data = NULL;
+    return bytes;
+}
+
+/* Feed a fragment of a compressed body to the decompressor of @port,
+ * returns FALSE if the body is corrupt or too large */
+static gboolean inflate_fragment(struct vdagent_virtio_port_chunk_port_data *port,
+                                 const uint8_t *data, gsize size, gboolean last)
+{
+    GConverterResult res;
+    GError *err = NULL;
+    gsize read, written;
+    gsize len;
+
+    while (TRUE) {
+        len = port->inflated_len;
+        if (len + INFLATE_STEP > MAX_INFLATED_SIZE) {
+            syslog(LOG_ERR, "decompressed message too large, dropping it");
+            return FALSE;
+        }
+        /* grown by doubling, as each step copies what was inflated */
+        if (len + INFLATE_STEP > port->inflated_size) {
+            gsize new_size = MIN(MAX(port->inflated_size * 2, len + INFLATE_STEP),
+                                 MAX_INFLATED_SIZE);
+
+            port->inflated = vdagent_payload_realloc(port->inflated,
+                                                     port->inflated_size, new_size);
+            port->inflated_size = new_size;
+        }
+        res = g_converter_convert(port->decompressor, data, size,
+                                  port->inflated + len, INFLATE_STEP,
+                                  last ? G_CONVERTER_INPUT_AT_END : G_CONVERTER_NO_FLAGS,
+                                  &read, &written, &err);
+        if (res == G_CONVERTER_ERROR) {
+            /* the rest of the input is in the next chunk */
+            if (!last && g_error_matches(err, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT)) {
+                g_error_free(err);
+                return TRUE;
+            }
+            syslog(LOG_ERR, "decompressing message: %s", err->message);
+            g_error_free(err);
+            return FALSE;
+        }
+        port->inflated_len = len + written;
+        data += read;
+        size -= read;
+
+        if (res == G_CONVERTER_FINISHED) {
+            return TRUE;
+        }
+        if (size == 0 && !last) {
+            return TRUE;
+        }
+    }
+}
+
 static void vdagent_virtio_port_do_chunk(VDAgentConnection *conn,
                                          gpointer header_data,
                                          gpointer chunk_data)
@@ -267,6 +630,12 @@ static void vdagent_virtio_port_do_chunk(VDAgentConnection *conn,
     struct vdagent_virtio_port_chunk_port_data *port =
         &vport->port_data[chunk_header->port];
 
+    VDAGENT_PROBE(virtio__chunk, chunk_header->port, chunk_header->size);
+    if (vport->capture && vport->capture_payloads) {
+        capture_record(vport, VIRTIO_CAPTURE_CHUNK, VIRTIO_CAPTURE_IN,
+                       chunk_header->port, 0, chunk_header->size, chunk_data);
+    }
+
     if (port->message_header_read < sizeof(port->message_header)) {
         read = sizeof(port->message_header) - port->message_header_read;
         if (read > chunk_header->size) {
@@ -282,8 +651,30 @@ static void vdagent_virtio_port_do_chunk(VDAgentConnection *conn,
             port->message_header.opaque = GUINT64_FROM_LE(port->message_header.opaque);
             port->message_header.size = GUINT32_FROM_LE(port->message_header.size);
 
-            if (port->message_header.size) {
-                port->message_data = g_malloc(port->message_header.size);
+            if (vport->capture && !vport->capture_payloads) {
+                capture_record(vport, VIRTIO_CAPTURE_MESSAGE, VIRTIO_CAPTURE_IN,
+                               chunk_header->port, port->message_header.type,
+                               port->message_header.size, NULL);
+            }
+            if (port->message_header.type < VDAGENT_CLIENT_MESSAGE_END) {
+                VDAgentMessageStats *stats =
+                    &vport->stats[port->message_header.type];
+
+                stats->messages_in++;
+                stats->bytes_in += port->message_header.size;
+            }
+
+            if (port->compression &&
+                port->message_header.opaque == VDP_COMPRESSION_ZLIB) {
+                port->decompressor = G_CONVERTER(
+                    g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB));
+            } else if (vport->stream_callback &&
+                vport->stream_callback(vport, chunk_header->port,
+                                       &port->message_header, NULL, 0, 0)) {
+                port->streaming = TRUE;
+            } else if (port->message_header.size) {
+                port->message_data = vdagent_connection_buffer_get(conn,
+                    port->message_header.size);
             }
         }
         pos = read;
@@ -303,20 +694,51 @@ static void vdagent_virtio_port_do_chunk(VDAgentConnection *conn,
         if (avail < read)
             read = avail;
 
-        if (read) {
+        if (port->decompressor) {
+            gboolean last = port->message_data_pos + read == port->message_header.size;
+
+            if (!port->inflate_failed &&
+                !inflate_fragment(port, (const uint8_t *)chunk_data + pos, read, last)) {
+                port->inflate_failed = TRUE;
+            }
+            port->message_data_pos += read;
+        } else if (port->streaming) {
+            if (read) {
+                vport->stream_callback(vport, chunk_header->port,
+                                       &port->message_header,
+                                       (const uint8_t *)chunk_data + pos, read,
+                                       port->message_data_pos);
+                port->message_data_pos += read;
+            }
+        } else if (read) {
             memcpy(port->message_data + port->message_data_pos,
                    chunk_data + pos, read);
             port->message_data_pos += read;
         }
 
         if (port->message_data_pos == port->message_header.size) {
-            if (vport->read_callback) {
+            if (port->decompressor) {
+                VDAgentMessage message_header = port->message_header;
+
+                message_header.opaque = 0;
+                message_header.size = port->inflated_len;
+                if (!port->inflate_failed && vport->read_callback) {
+                    vport->read_callback(vport, chunk_header->port,
+                                         &message_header, port->inflated);
+                }
+                port_data_clear_inflate(port);
+            } else if (!port->streaming && vport->read_callback) {
                 vport->read_callback(vport, chunk_header->port,
                                      &port->message_header, port->message_data);
             }
+            if (port->message_data) {
+                vdagent_connection_buffer_release(conn, port->message_data,
+                                                  port->message_header.size);
+            }
             port->message_header_read = 0;
             port->message_data_pos = 0;
-            g_clear_pointer(&port->message_data, g_free);
+            port->message_data = NULL;
+            port->streaming = FALSE;
         }
     }
 }
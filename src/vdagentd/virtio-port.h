@@ -22,6 +22,7 @@
 #ifndef __VIRTIO_PORT_H
 #define __VIRTIO_PORT_H
 
+#include <stdio.h>
 #include <stdint.h>
 #include <spice/vd_agent.h>
 #include <glib-object.h>
@@ -29,6 +30,18 @@
 
 G_BEGIN_DECLS
 
+#ifdef WITH_EXPERIMENTAL_PROTOCOL
+/* Not part of spice-protocol: client and guest can zlib compress message
+   bodies, see vdagent_virtio_port_set_compression(). Nothing reserves this
+   capability number upstream, and VDAgentMessage.opaque, which marks the
+   compressed bodies, is not meant for it either: only for testing with a
+   client built with the same extension. */
+#define VDP_CAP_COMPRESSED_DATA 18
+#endif
+
+/* VDAgentMessage.opaque of a message with a zlib compressed body */
+#define VDP_COMPRESSION_ZLIB 1
+
 #define VIRTIO_TYPE_PORT virtio_port_get_type()
 G_DECLARE_FINAL_TYPE(VirtioPort, virtio_port, VIRTIO, PORT, VDAgentConnection)
 
@@ -40,6 +53,21 @@ typedef void (*vdagent_virtio_port_read_callback)(
     VDAgentMessage *message_header,
     uint8_t *data);
 
+/* Callbacks with this type are offered each incoming message before its
+   body is read. It is first called with data set to NULL, returning TRUE
+   makes the body be passed to it in fragments as the chunks arrive,
+   instead of being reassembled and passed to the read callback.
+   offset is the position of the fragment within the body, the message is
+   complete once offset + size reaches message_header->size.
+   data is only valid until the callback returns. */
+typedef gboolean (*vdagent_virtio_port_stream_callback)(
+    VirtioPort *vport,
+    int port_nr,
+    VDAgentMessage *message_header,
+    const uint8_t *data,
+    uint32_t size,
+    uint32_t offset);
+
 /* Create a vdagent virtio port object for port portname */
 VirtioPort *vdagent_virtio_port_create(const char *portname,
     vdagent_virtio_port_read_callback read_callback,
@@ -68,6 +96,39 @@ void vdagent_virtio_port_write(
 
 void vdagent_virtio_port_reset(VirtioPort *vport, int port);
 
+/* Record the traffic through @vport into @capture, see virtio-capture.h.
+ * Messages are recorded by their header only, unless @payloads is set:
+ * then the chunks from the client are recorded as is, so that
+ * spice-vdagentd-replay can send them again. Pass NULL to stop.
+ * The caller keeps ownership of @capture. */
+void vdagent_virtio_port_set_capture(VirtioPort *vport, FILE *capture,
+                                     gboolean payloads);
+
+/* Returns the messages sent and received through @vport, an array of
+ * VDAGENT_CLIENT_MESSAGE_END entries indexed by message type, see
+ * client-messages.h. */
+const VDAgentMessageStats *vdagent_virtio_port_get_stats(VirtioPort *vport);
+
+/* Opt in to streaming delivery of message bodies, see
+   vdagent_virtio_port_stream_callback */
+void vdagent_virtio_port_set_stream_callback(VirtioPort *vport,
+    vdagent_virtio_port_stream_callback stream_callback);
+
+/* Once the peer on @port announced VDP_CAP_COMPRESSED_DATA, incoming
+ * messages marked with VDP_COMPRESSION_ZLIB are decompressed as they
+ * arrive and handed to the read callback as if they had been sent
+ * uncompressed; they are never streamed. Outgoing clipboard and file
+ * data messages of up to 256 KiB are compressed when that makes them
+ * smaller.
+ * vdagent_virtio_port_reset() disables it again. */
+void vdagent_virtio_port_set_compression(VirtioPort *vport, int port,
+                                         gboolean enable);
+
+/* Take the data of the message currently handed to the read callback
+ * of @port, so it can be forwarded without a copy.
+ * Must only be called from the read callback. */
+GBytes *vdagent_virtio_port_steal_message_data(VirtioPort *vport, int port);
+
 G_END_DECLS
 
 #endif
@@ -0,0 +1,102 @@
+/*  bench-common.c - helpers shared by the benchmark programs
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "bench-common.h"
+
+BenchRun *bench_run_new(const char *name, uint32_t type, uint32_t size,
+                        guint count)
+{
+    BenchRun *run = g_new0(BenchRun, 1);
+    guint i;
+
+    run->name = name;
+    run->type = type;
+    run->size = size;
+    run->count = count;
+    run->payload = g_malloc(MAX(size, sizeof(gint64)));
+    for (i = 0; i < size; i++) {
+        run->payload[i] = g_random_int_range(0, 256);
+    }
+    run->latencies = g_new0(gint64, count);
+    run->start_time = g_get_monotonic_time();
+    return run;
+}
+
+void bench_run_free(BenchRun *run)
+{
+    g_free(run->payload);
+    g_free(run->latencies);
+    g_free(run);
+}
+
+void bench_run_stamp(BenchRun *run)
+{
+    gint64 now = g_get_monotonic_time();
+
+    memcpy(run->payload, &now, sizeof(now));
+}
+
+gboolean bench_run_received(BenchRun *run, const uint8_t *data)
+{
+    gint64 now = g_get_monotonic_time();
+    gint64 sent_time;
+
+    g_assert_cmpuint(run->received, <, run->count);
+    if (run->size >= sizeof(sent_time)) {
+        memcpy(&sent_time, data, sizeof(sent_time));
+        run->latencies[run->received] = now - sent_time;
+    }
+    run->received++;
+    if (run->received < run->count) {
+        return FALSE;
+    }
+    run->end_time = now;
+    return TRUE;
+}
+
+static int cmp_gint64(const void *a, const void *b)
+{
+    gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+    return (x > y) - (x < y);
+}
+
+void bench_print_header(void)
+{
+    printf("%-12s %10s %12s %10s %10s %10s\n",
+           "scenario", "messages", "msgs/s", "MiB/s", "p50 us", "p99 us");
+}
+
+void bench_run_report(BenchRun *run)
+{
+    double secs = MAX(run->end_time - run->start_time, 1) / 1e6;
+    double mib = (double) run->size * run->count / (1024 * 1024);
+
+    qsort(run->latencies, run->count, sizeof(gint64), cmp_gint64);
+    printf("%-12s %10u %12.0f %10.1f %10" G_GINT64_FORMAT " %10" G_GINT64_FORMAT "\n",
+           run->name, run->count, run->count / secs, mib / secs,
+           run->latencies[run->count / 2],
+           run->latencies[MIN(run->count * 99 / 100, run->count - 1)]);
+    fflush(stdout);
+}
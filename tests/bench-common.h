@@ -0,0 +1,53 @@
+/*  bench-common.h - helpers shared by the benchmark programs
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __BENCH_COMMON_H
+#define __BENCH_COMMON_H
+
+#include <stdint.h>
+#include <glib.h>
+
+/* One scenario: count messages of size bytes sent back to back.
+ * The first 8 bytes of the payload carry the time the message was
+ * queued, so the receiver can compute the end to end latency. */
+typedef struct BenchRun {
+    const char *name;
+    uint32_t type;
+    uint32_t size;
+    guint count;
+    guint sent;
+    guint received;
+    uint8_t *payload;
+    gint64 *latencies;
+    gint64 start_time;
+    gint64 end_time;
+} BenchRun;
+
+BenchRun *bench_run_new(const char *name, uint32_t type, uint32_t size,
+                        guint count);
+void bench_run_free(BenchRun *run);
+
+/* Store the current time in run->payload, call right before queueing it */
+void bench_run_stamp(BenchRun *run);
+
+/* Account for a received payload, returns TRUE once all arrived */
+gboolean bench_run_received(BenchRun *run, const uint8_t *data);
+
+void bench_print_header(void);
+void bench_run_report(BenchRun *run);
+
+#endif
@@ -0,0 +1,102 @@
+/*  bench-decode.c - measure the cost of validating and decoding client messages
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <spice/vd_agent.h>
+
+#include "client-messages.h"
+
+static gint n_messages = 10000000;
+
+static GOptionEntry entries[] = {
+    { "messages", 'n', 0, G_OPTION_ARG_INT, &n_messages,
+      "Number of messages decoded per scenario (10000000)", "<count>" },
+    { NULL }
+};
+
+static uint32_t caps[VD_AGENT_CAPS_SIZE];
+
+static void run_scenario(const char *name, uint32_t type, uint32_t size)
+{
+    VDAgentMessage message_header = {
+        .protocol = VD_AGENT_PROTOCOL,
+        .type = type,
+        .size = size,
+    };
+    uint8_t *data = g_malloc0(size);
+    gint64 start_time, end_time;
+    double secs;
+    gint i;
+
+    start_time = g_get_monotonic_time();
+    for (i = 0; i < n_messages; i++) {
+        if (!vdagent_message_decode(&message_header, data,
+                                    caps, G_N_ELEMENTS(caps))) {
+            g_error("%s message rejected", name);
+        }
+    }
+    end_time = g_get_monotonic_time();
+
+    secs = MAX(end_time - start_time, 1) / 1e6;
+    printf("%-22s %10d %12.0f %10.1f\n", name, n_messages,
+           n_messages / secs, secs * 1e9 / n_messages);
+    fflush(stdout);
+    g_free(data);
+}
+
+int main(int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *err = NULL;
+
+    context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, entries, NULL);
+    g_option_context_set_summary(context,
+        "Runs vdagent_message_decode() over messages of each kind and\n"
+        "reports messages/s and ns/message.");
+    if (!g_option_context_parse(context, &argc, &argv, &err)) {
+        g_printerr("Invalid arguments, %s\n", err->message);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    /* what current clients announce */
+    VD_AGENT_SET_CAPABILITY(caps, VD_AGENT_CAP_CLIPBOARD_SELECTION);
+    VD_AGENT_SET_CAPABILITY(caps, VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL);
+
+    printf("%-22s %10s %12s %10s\n", "scenario", "messages", "msgs/s", "ns/msg");
+    run_scenario("mouse-state", VD_AGENT_MOUSE_STATE, sizeof(VDAgentMouseState));
+#ifdef WITH_EXPERIMENTAL_PROTOCOL
+    run_scenario("mouse-state-batch", VDP_MOUSE_STATE_BATCH,
+                 sizeof(VDPMouseStateBatch) + 16 * sizeof(VDPMouseSample));
+#endif
+    run_scenario("monitors-config", VD_AGENT_MONITORS_CONFIG,
+                 sizeof(VDAgentMonitorsConfig) + 4 * sizeof(VDAgentMonConfig));
+    run_scenario("announce-capabilities", VD_AGENT_ANNOUNCE_CAPABILITIES,
+                 sizeof(VDAgentAnnounceCapabilities) + sizeof(caps));
+    run_scenario("clipboard-grab", VD_AGENT_CLIPBOARD_GRAB,
+                 4 + 4 + 8 * sizeof(uint32_t));
+    run_scenario("clipboard-request", VD_AGENT_CLIPBOARD_REQUEST,
+                 4 + sizeof(VDAgentClipboardRequest));
+    run_scenario("file-xfer-data", VD_AGENT_FILE_XFER_DATA,
+                 sizeof(VDAgentFileXferDataMessage) + 64 * 1024);
+    return 0;
+}
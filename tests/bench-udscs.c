@@ -0,0 +1,141 @@
+/*  bench-udscs.c - measure the throughput and latency of udscs connections
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "udscs.h"
+#include "vdagentd-proto.h"
+#include "bench-common.h"
+
+/* Stop queueing messages while this much is waiting to be written */
+#define MAX_QUEUED_BYTES (8 * 1024 * 1024)
+
+static gint n_small = 200000;
+static gint n_large = 64;
+static gint stream_mb = 1024;
+
+static GOptionEntry entries[] = {
+    { "small", 'n', 0, G_OPTION_ARG_INT, &n_small,
+      "Number of small messages (200000)", "<count>" },
+    { "large", 'l', 0, G_OPTION_ARG_INT, &n_large,
+      "Number of 8 MiB clipboard messages (64)", "<count>" },
+    { "stream", 's', 0, G_OPTION_ARG_INT, &stream_mb,
+      "MiB of file-xfer data to stream (1024)", "<MiB>" },
+    { NULL }
+};
+
+static GMainLoop *loop;
+static UdscsConnection *client;
+static BenchRun *run;
+
+static gboolean produce_cb(gpointer user_data)
+{
+    while (run->sent < run->count) {
+        if (vdagent_connection_get_queued_bytes(VDAGENT_CONNECTION(client)) >=
+            MAX_QUEUED_BYTES) {
+            return G_SOURCE_CONTINUE;
+        }
+        bench_run_stamp(run);
+        udscs_write(client, run->type, 0, 0, run->payload, run->size);
+        run->sent++;
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void server_read(UdscsConnection *conn,
+                        struct udscs_message_header *header, uint8_t *data)
+{
+    if (header->type != run->type || header->size != run->size) {
+        g_error("unexpected message %u of %u bytes", header->type, header->size);
+    }
+    if (bench_run_received(run, data)) {
+        g_main_loop_quit(loop);
+    }
+}
+
+static void conn_error(VDAgentConnection *conn, GError *err)
+{
+    g_error("connection error: %s", err ? err->message : "EOF");
+}
+
+static void run_scenario(const char *name, uint32_t type, uint32_t size,
+                         guint count)
+{
+    if (count == 0) {
+        return;
+    }
+    run = bench_run_new(name, type, size, count);
+    g_idle_add(produce_cb, NULL);
+    g_main_loop_run(loop);
+    bench_run_report(run);
+    g_clear_pointer(&run, bench_run_free);
+}
+
+int main(int argc, char *argv[])
+{
+    GOptionContext *context;
+    struct udscs_server *server;
+    GError *err = NULL;
+    gchar *dir, *path;
+
+    context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, entries, NULL);
+    g_option_context_set_summary(context,
+        "Sends messages through a udscs connection over a unix socket\n"
+        "and reports messages/s, MB/s and the p50/p99 end to end latency.");
+    if (!g_option_context_parse(context, &argc, &argv, &err)) {
+        g_printerr("Invalid arguments, %s\n", err->message);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    dir = g_dir_make_tmp("bench-udscs-XXXXXX", &err);
+    g_assert_no_error(err);
+    path = g_build_filename(dir, "socket", NULL);
+
+    loop = g_main_loop_new(NULL, FALSE);
+    server = udscs_server_new(NULL, server_read, conn_error, 0);
+    udscs_server_listen_to_address(server, path, &err);
+    g_assert_no_error(err);
+    udscs_server_start(server);
+
+    client = udscs_connect(path, NULL, conn_error, 0, &err);
+    g_assert_no_error(err);
+
+    bench_print_header();
+    /* mouse flood and clipboard grabs are small and frequent */
+    run_scenario("small", VDAGENTD_CLIPBOARD_GRAB, 16, n_small);
+    run_scenario("clipboard", VDAGENTD_CLIPBOARD_DATA, 8 * 1024 * 1024, n_large);
+    run_scenario("file-xfer", VDAGENTD_FILE_XFER_DATA, 64 * 1024, stream_mb * 16);
+
+    vdagent_connection_destroy(client);
+    udscs_destroy_server(server);
+    g_main_loop_unref(loop);
+
+    g_unlink(path);
+    g_rmdir(dir);
+    g_free(path);
+    g_free(dir);
+    return 0;
+}
@@ -0,0 +1,168 @@
+/*  bench-virtio-port.c - measure the throughput and latency of a VirtioPort
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <gio/gio.h>
+#include <gio/gunixsocketaddress.h>
+#include <glib/gstdio.h>
+#include <spice/vd_agent.h>
+
+#include "virtio-port.h"
+#include "bench-common.h"
+
+/* Stop queueing messages while this much is waiting to be written */
+#define MAX_QUEUED_BYTES (8 * 1024 * 1024)
+
+static gint n_mouse = 200000;
+static gint n_clipboard = 64;
+static gint stream_mb = 1024;
+
+static GOptionEntry entries[] = {
+    { "mouse", 'n', 0, G_OPTION_ARG_INT, &n_mouse,
+      "Number of mouse messages (200000)", "<count>" },
+    { "clipboard", 'l', 0, G_OPTION_ARG_INT, &n_clipboard,
+      "Number of 8 MiB clipboard messages (64)", "<count>" },
+    { "stream", 's', 0, G_OPTION_ARG_INT, &stream_mb,
+      "MiB of file-xfer data to stream (1024)", "<MiB>" },
+    { NULL }
+};
+
+static GMainLoop *loop;
+static VirtioPort *vport;
+static BenchRun *run;
+
+static gboolean produce_cb(gpointer user_data)
+{
+    while (run->sent < run->count) {
+        if (vdagent_connection_get_queued_bytes(VDAGENT_CONNECTION(vport)) >=
+            MAX_QUEUED_BYTES) {
+            return G_SOURCE_CONTINUE;
+        }
+        bench_run_stamp(run);
+        vdagent_virtio_port_write(vport, VDP_CLIENT_PORT, run->type, 0,
+                                  run->payload, run->size);
+        run->sent++;
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void port_read(VirtioPort *port, int port_nr,
+                      VDAgentMessage *message_header, uint8_t *data)
+{
+    if (message_header->type != run->type || message_header->size != run->size) {
+        g_error("unexpected message %u of %u bytes",
+                message_header->type, message_header->size);
+    }
+    if (bench_run_received(run, data)) {
+        g_main_loop_quit(loop);
+    }
+}
+
+static void port_error(VDAgentConnection *conn, GError *err)
+{
+    g_error("virtio port error: %s", err ? err->message : "EOF");
+}
+
+/* Plays the part of spice-server: everything written to the port is
+ * sent straight back, so the port reads its own messages */
+static gboolean echo_incoming(GSocketService    *service,
+                              GSocketConnection *connection,
+                              GObject           *source_object,
+                              gpointer           user_data)
+{
+    GIOStream *stream = G_IO_STREAM(connection);
+
+    g_output_stream_splice_async(g_io_stream_get_output_stream(stream),
+                                 g_io_stream_get_input_stream(stream),
+                                 G_OUTPUT_STREAM_SPLICE_NONE,
+                                 G_PRIORITY_DEFAULT, NULL, NULL, NULL);
+    g_object_set_data_full(G_OBJECT(service), "connection",
+                           g_object_ref(connection), g_object_unref);
+    return TRUE;
+}
+
+static void run_scenario(const char *name, uint32_t type, uint32_t size,
+                         guint count)
+{
+    if (count == 0) {
+        return;
+    }
+    run = bench_run_new(name, type, size, count);
+    g_idle_add(produce_cb, NULL);
+    g_main_loop_run(loop);
+    bench_run_report(run);
+    g_clear_pointer(&run, bench_run_free);
+}
+
+int main(int argc, char *argv[])
+{
+    GOptionContext *context;
+    GSocketService *service;
+    GSocketAddress *addr;
+    GError *err = NULL;
+    gchar *dir, *path;
+
+    context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, entries, NULL);
+    g_option_context_set_summary(context,
+        "Sends messages through a VirtioPort looped back over a unix socket\n"
+        "and reports messages/s, MB/s and the p50/p99 end to end latency.");
+    if (!g_option_context_parse(context, &argc, &argv, &err)) {
+        g_printerr("Invalid arguments, %s\n", err->message);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    dir = g_dir_make_tmp("bench-virtio-port-XXXXXX", &err);
+    g_assert_no_error(err);
+    path = g_build_filename(dir, "socket", NULL);
+
+    loop = g_main_loop_new(NULL, FALSE);
+    service = g_socket_service_new();
+    addr = g_unix_socket_address_new(path);
+    g_socket_listener_add_address(G_SOCKET_LISTENER(service), addr,
+                                  G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_DEFAULT,
+                                  NULL, NULL, &err);
+    g_assert_no_error(err);
+    g_object_unref(addr);
+    g_signal_connect(service, "incoming", G_CALLBACK(echo_incoming), NULL);
+    g_socket_service_start(service);
+
+    vport = vdagent_virtio_port_create(path, port_read, port_error);
+    g_assert_nonnull(vport);
+
+    bench_print_header();
+    run_scenario("mouse", VD_AGENT_MOUSE_STATE, sizeof(VDAgentMouseState), n_mouse);
+    run_scenario("clipboard", VD_AGENT_CLIPBOARD, 8 * 1024 * 1024, n_clipboard);
+    run_scenario("file-xfer", VD_AGENT_FILE_XFER_DATA, 64 * 1024, stream_mb * 16);
+
+    vdagent_connection_destroy(vport);
+    g_socket_service_stop(service);
+    g_object_unref(service);
+    g_main_loop_unref(loop);
+
+    g_unlink(path);
+    g_rmdir(dir);
+    g_free(path);
+    g_free(dir);
+    return 0;
+}
@@ -0,0 +1,205 @@
+/*  test-client-messages.c - test the validation of the messages from the client
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <string.h>
+#include <glib.h>
+#include <spice/vd_agent.h>
+
+#include "client-messages.h"
+
+/* The layout of each message type, as spice-protocol defines it */
+typedef struct ExpectedSize {
+    uint32_t type;
+    uint32_t size;
+    gboolean exact;
+    /* prefixed by the selection with VD_AGENT_CAP_CLIPBOARD_SELECTION */
+    gboolean selection;
+    /* 4 more bytes with VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL */
+    gboolean serial;
+} ExpectedSize;
+
+static const ExpectedSize expected_sizes[] = {
+    { VD_AGENT_MOUSE_STATE, sizeof(VDAgentMouseState), TRUE },
+    { VD_AGENT_MONITORS_CONFIG, sizeof(VDAgentMonitorsConfig), FALSE },
+    { VD_AGENT_REPLY, sizeof(VDAgentReply), TRUE },
+    { VD_AGENT_CLIPBOARD, sizeof(VDAgentClipboard), FALSE, TRUE },
+    { VD_AGENT_DISPLAY_CONFIG, sizeof(VDAgentDisplayConfig), TRUE },
+    { VD_AGENT_ANNOUNCE_CAPABILITIES, sizeof(VDAgentAnnounceCapabilities), FALSE },
+    { VD_AGENT_CLIPBOARD_GRAB, sizeof(VDAgentClipboardGrab), FALSE, TRUE, TRUE },
+    { VD_AGENT_CLIPBOARD_REQUEST, sizeof(VDAgentClipboardRequest), TRUE, TRUE },
+    { VD_AGENT_CLIPBOARD_RELEASE, sizeof(VDAgentClipboardRelease), TRUE, TRUE },
+    { VD_AGENT_FILE_XFER_START, sizeof(VDAgentFileXferStartMessage), FALSE },
+    { VD_AGENT_FILE_XFER_STATUS, sizeof(VDAgentFileXferStatusMessage), TRUE },
+    { VD_AGENT_FILE_XFER_DATA, sizeof(VDAgentFileXferDataMessage), FALSE },
+    { VD_AGENT_CLIENT_DISCONNECTED, 0, TRUE },
+    { VD_AGENT_MAX_CLIPBOARD, sizeof(VDAgentMaxClipboard), TRUE },
+    { VD_AGENT_AUDIO_VOLUME_SYNC, sizeof(VDAgentAudioVolumeSync), FALSE },
+    { VD_AGENT_GRAPHICS_DEVICE_INFO, sizeof(VDAgentGraphicsDeviceInfo), FALSE },
+#ifdef WITH_EXPERIMENTAL_PROTOCOL
+    { VDP_MOUSE_STATE_BATCH, sizeof(VDPMouseStateBatch), FALSE },
+#endif
+};
+
+static uint32_t caps[VD_AGENT_CAPS_SIZE];
+
+static gboolean decode(uint32_t type, uint32_t size)
+{
+    VDAgentMessage message_header = {
+        .protocol = VD_AGENT_PROTOCOL,
+        .type = type,
+        .size = size,
+    };
+    /* room for the largest fields, zeroed so that counts are 0 */
+    uint8_t *data = g_malloc0(size + 64);
+    gboolean ret;
+
+    ret = vdagent_message_decode(&message_header, data, caps, G_N_ELEMENTS(caps));
+    g_free(data);
+    return ret;
+}
+
+/* With the client capabilities in @user_data */
+static void test_sizes(gconstpointer user_data)
+{
+    const uint32_t *client_caps = user_data;
+    gboolean has_selection, has_serial;
+    guint i;
+
+    memcpy(caps, client_caps, sizeof(caps));
+    has_selection = VD_AGENT_HAS_CAPABILITY(caps, G_N_ELEMENTS(caps),
+                                            VD_AGENT_CAP_CLIPBOARD_SELECTION);
+    has_serial = VD_AGENT_HAS_CAPABILITY(caps, G_N_ELEMENTS(caps),
+                                         VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL);
+
+    for (i = 0; i < G_N_ELEMENTS(expected_sizes); i++) {
+        const ExpectedSize *expected = &expected_sizes[i];
+        uint32_t size = expected->size;
+
+        if (expected->selection && has_selection)
+            size += 4;
+        if (expected->serial && has_serial)
+            size += 4;
+
+        g_test_message("type %u, %u bytes", expected->type, size);
+        g_assert_true(decode(expected->type, size));
+        if (size > 0) {
+            g_assert_false(decode(expected->type, size - 1));
+        }
+        if (expected->exact) {
+            g_assert_false(decode(expected->type, size + 1));
+        } else {
+            g_assert_true(decode(expected->type, size + 64));
+        }
+    }
+    memset(caps, 0, sizeof(caps));
+}
+
+static void test_unknown_types(void)
+{
+    g_assert_false(decode(0, 0));
+    g_assert_false(decode(0, 64));
+    g_assert_false(decode(VDAGENT_CLIENT_MESSAGE_END, 0));
+    g_assert_false(decode(VDAGENT_CLIENT_MESSAGE_END, 64));
+    g_assert_false(decode(G_MAXUINT32, 0));
+}
+
+static void test_wrong_protocol(void)
+{
+    VDAgentMessage message_header = {
+        .protocol = VD_AGENT_PROTOCOL + 1,
+        .type = VD_AGENT_CLIENT_DISCONNECTED,
+    };
+
+    g_assert_false(vdagent_message_decode(&message_header, NULL,
+                                          caps, G_N_ELEMENTS(caps)));
+}
+
+/* The integers of the body are little endian on the wire */
+static void test_byte_order(void)
+{
+    VDAgentMessage message_header = { .protocol = VD_AGENT_PROTOCOL };
+    VDAgentMouseState mouse;
+    VDAgentFileXferDataMessage xfer;
+    struct {
+        uint32_t selection;
+        VDAgentClipboardRequest request;
+    } request;
+
+    message_header.type = VD_AGENT_MOUSE_STATE;
+    message_header.size = sizeof(mouse);
+    mouse.x = GUINT32_TO_LE(0x01020304);
+    mouse.y = GUINT32_TO_LE(1080);
+    mouse.buttons = GUINT32_TO_LE(VD_AGENT_LBUTTON_MASK);
+    mouse.display_id = 1;
+    g_assert_true(vdagent_message_decode(&message_header, (uint8_t *)&mouse,
+                                         caps, G_N_ELEMENTS(caps)));
+    g_assert_cmphex(mouse.x, ==, 0x01020304);
+    g_assert_cmpuint(mouse.y, ==, 1080);
+    g_assert_cmpuint(mouse.buttons, ==, VD_AGENT_LBUTTON_MASK);
+    g_assert_cmpuint(mouse.display_id, ==, 1);
+
+    message_header.type = VD_AGENT_FILE_XFER_DATA;
+    message_header.size = sizeof(xfer);
+    xfer.id = GUINT32_TO_LE(7);
+    xfer.size = GUINT64_TO_LE(G_GUINT64_CONSTANT(0x0102030405060708));
+    g_assert_true(vdagent_message_decode(&message_header, (uint8_t *)&xfer,
+                                         caps, G_N_ELEMENTS(caps)));
+    g_assert_cmpuint(xfer.id, ==, 7);
+    g_assert_cmphex(xfer.size, ==, G_GUINT64_CONSTANT(0x0102030405060708));
+
+    /* the fields come after the selection */
+    VD_AGENT_SET_CAPABILITY(caps, VD_AGENT_CAP_CLIPBOARD_SELECTION);
+    message_header.type = VD_AGENT_CLIPBOARD_REQUEST;
+    message_header.size = sizeof(request);
+    request.selection = VD_AGENT_CLIPBOARD_SELECTION_PRIMARY;
+    request.request.type = GUINT32_TO_LE(VD_AGENT_CLIPBOARD_UTF8_TEXT);
+    g_assert_true(vdagent_message_decode(&message_header, (uint8_t *)&request,
+                                         caps, G_N_ELEMENTS(caps)));
+    g_assert_cmpuint(request.selection, ==, VD_AGENT_CLIPBOARD_SELECTION_PRIMARY);
+    g_assert_cmpuint(request.request.type, ==, VD_AGENT_CLIPBOARD_UTF8_TEXT);
+    memset(caps, 0, sizeof(caps));
+}
+
+int main(int argc, char *argv[])
+{
+    static uint32_t no_caps[VD_AGENT_CAPS_SIZE];
+    static uint32_t selection_caps[VD_AGENT_CAPS_SIZE];
+    static uint32_t serial_caps[VD_AGENT_CAPS_SIZE];
+    static uint32_t all_caps[VD_AGENT_CAPS_SIZE];
+
+    g_test_init(&argc, &argv, NULL);
+
+    VD_AGENT_SET_CAPABILITY(selection_caps, VD_AGENT_CAP_CLIPBOARD_SELECTION);
+    VD_AGENT_SET_CAPABILITY(serial_caps, VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL);
+    VD_AGENT_SET_CAPABILITY(all_caps, VD_AGENT_CAP_CLIPBOARD_SELECTION);
+    VD_AGENT_SET_CAPABILITY(all_caps, VD_AGENT_CAP_CLIPBOARD_GRAB_SERIAL);
+
+    g_test_add_data_func("/client-messages/sizes/no-caps", no_caps, test_sizes);
+    g_test_add_data_func("/client-messages/sizes/selection",
+                         selection_caps, test_sizes);
+    g_test_add_data_func("/client-messages/sizes/grab-serial",
+                         serial_caps, test_sizes);
+    g_test_add_data_func("/client-messages/sizes/selection-grab-serial",
+                         all_caps, test_sizes);
+    g_test_add_func("/client-messages/unknown-types", test_unknown_types);
+    g_test_add_func("/client-messages/wrong-protocol", test_wrong_protocol);
+    g_test_add_func("/client-messages/byte-order", test_byte_order);
+
+    return g_test_run();
+}
@@ -0,0 +1,126 @@
+/*  test-input-thread.c - test the mouse injection thread
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <linux/input.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "input-thread.h"
+
+/* With a 32768 pixels wide desktop the static tablet maps pixels 1:1 */
+#define DESKTOP_SIZE 32768
+
+typedef struct Frame {
+    gint x;
+    gint y;
+    gint left;
+} Frame;
+
+static void input_error(void)
+{
+    g_assert_not_reached();
+}
+
+/* Read the events of one frame, -1 is left for the fields it doesn't set */
+static void read_frame(int fd, Frame *frame)
+{
+    struct input_event event;
+
+    frame->x = frame->y = frame->left = -1;
+    for (;;) {
+        g_assert_cmpint(read(fd, &event, sizeof(event)), ==, sizeof(event));
+        if (event.type == EV_SYN) {
+            return;
+        }
+        if (event.type == EV_ABS && event.code == ABS_X) {
+            frame->x = event.value;
+        } else if (event.type == EV_ABS && event.code == ABS_Y) {
+            frame->y = event.value;
+        } else if (event.type == EV_KEY && event.code == BTN_LEFT) {
+            frame->left = event.value;
+        }
+    }
+}
+
+/* A press followed by motion which queued up behind it: the motion is
+ * coalesced, the press keeps its position */
+static void test_coalesce_press(void)
+{
+    struct vdagentd_guest_xorg_resolution screen = {
+        .width = DESKTOP_SIZE,
+        .height = DESKTOP_SIZE,
+    };
+    VDAgentMouseState states[] = {
+        { .x = 100, .y = 100, .buttons = VD_AGENT_LBUTTON_MASK },
+        { .x = 200, .y = 100, .buttons = VD_AGENT_LBUTTON_MASK },
+        { .x = 300, .y = 100, .buttons = VD_AGENT_LBUTTON_MASK },
+    };
+    struct vdagentd_input_stats stats;
+    struct vdagentd_input *input;
+    gchar *dir, *path;
+    Frame frame;
+    guint i;
+    int fd;
+
+    dir = g_dir_make_tmp("test-input-thread-XXXXXX", NULL);
+    g_assert_nonnull(dir);
+    path = g_build_filename(dir, "uinput", NULL);
+    g_assert_cmpint(mkfifo(path, 0600), ==, 0);
+
+    /* The thread blocks opening the fake tablet until it is read, so
+     * all the states are queued by the time it gets to them */
+    input = vdagentd_input_new(path, 0, 1, NULL, input_error);
+    vdagentd_input_set_geometry(input, DESKTOP_SIZE, DESKTOP_SIZE, &screen, 1);
+    for (i = 0; i < G_N_ELEMENTS(states); i++) {
+        g_assert_true(vdagentd_input_push_mouse(input, &states[i], i));
+    }
+    fd = open(path, O_RDONLY);
+    g_assert_cmpint(fd, >=, 0);
+
+    read_frame(fd, &frame);
+    g_assert_cmpint(frame.x, ==, 100);
+    g_assert_cmpint(frame.y, ==, 100);
+    g_assert_cmpint(frame.left, ==, 1);
+    read_frame(fd, &frame);
+    g_assert_cmpint(frame.x, ==, 300);
+    g_assert_cmpint(frame.y, ==, -1);
+    g_assert_cmpint(frame.left, ==, -1);
+
+    vdagentd_input_get_stats(input, &stats);
+    g_assert_cmpuint(stats.motion_coalesced, ==, 1);
+
+    vdagentd_input_destroy(input);
+    close(fd);
+    g_unlink(path);
+    g_rmdir(dir);
+    g_free(path);
+    g_free(dir);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/input-thread/coalesce/press", test_coalesce_press);
+
+    return g_test_run();
+}
@@ -0,0 +1,324 @@
+/*  test-udscs.c - test the udscs transport
+
+    Copyright 2026 Red Hat, Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <string.h>
+#include <unistd.h>
+#include <gio/gio.h>
+#include <gio/gunixfdmessage.h>
+#include <gio/gunixsocketaddress.h>
+#include <glib/gstdio.h>
+
+#include "udscs.h"
+#include "vdagentd-proto.h"
+
+typedef struct Fixture {
+    gchar *dir;
+    gchar *path;
+    struct udscs_server *server;
+    UdscsConnection *server_conn;
+    GMainLoop *loop;
+    guint timeout_id;
+    /* messages read by the server */
+    GArray *received;
+    GPtrArray *received_data;
+} Fixture;
+
+static Fixture *fixture;
+
+static void server_connect(UdscsConnection *conn)
+{
+    fixture->server_conn = conn;
+}
+
+static void server_read(UdscsConnection *conn,
+                        struct udscs_message_header *header, uint8_t *data)
+{
+    g_array_append_val(fixture->received, *header);
+    g_ptr_array_add(fixture->received_data, g_memdup2(data, header->size));
+    g_main_loop_quit(fixture->loop);
+}
+
+static void conn_error(VDAgentConnection *conn, GError *err)
+{
+    g_clear_error(&err);
+    g_main_loop_quit(fixture->loop);
+}
+
+static gboolean timeout_cb(gpointer user_data)
+{
+    g_error("timed out");
+    return G_SOURCE_REMOVE;
+}
+
+static void fixture_setup(Fixture *f, gconstpointer user_data)
+{
+    GError *err = NULL;
+
+    fixture = f;
+    f->dir = g_dir_make_tmp("test-udscs-XXXXXX", &err);
+    g_assert_no_error(err);
+    f->path = g_build_filename(f->dir, "socket", NULL);
+    f->loop = g_main_loop_new(NULL, FALSE);
+    f->received = g_array_new(FALSE, FALSE, sizeof(struct udscs_message_header));
+    f->received_data = g_ptr_array_new_with_free_func(g_free);
+
+    f->server = udscs_server_new(server_connect, server_read, conn_error, FALSE);
+    udscs_server_listen_to_address(f->server, f->path, &err);
+    g_assert_no_error(err);
+    udscs_server_start(f->server);
+    f->timeout_id = g_timeout_add_seconds(10, timeout_cb, NULL);
+}
+
+static void fixture_teardown(Fixture *f, gconstpointer user_data)
+{
+    g_source_remove(f->timeout_id);
+    udscs_destroy_server(f->server);
+    g_main_loop_unref(f->loop);
+    g_array_free(f->received, TRUE);
+    g_ptr_array_free(f->received_data, TRUE);
+    g_unlink(f->path);
+    g_rmdir(f->dir);
+    g_free(f->path);
+    g_free(f->dir);
+    fixture = NULL;
+}
+
+static void wait_for_messages(Fixture *f, guint count)
+{
+    while (f->received->len < count) {
+        g_main_loop_run(f->loop);
+    }
+}
+
+/* Connect without udscs, to send whatever a misbehaving agent could */
+static GSocketConnection *raw_connect(Fixture *f)
+{
+    GSocketClient *client = g_socket_client_new();
+    GSocketAddress *addr = g_unix_socket_address_new(f->path);
+    GSocketConnection *conn;
+    GError *err = NULL;
+
+    conn = g_socket_client_connect(client, G_SOCKET_CONNECTABLE(addr), NULL, &err);
+    g_assert_no_error(err);
+    g_object_unref(addr);
+    g_object_unref(client);
+    return conn;
+}
+
+static void raw_send(GSocketConnection *conn, uint32_t type,
+                     const void *data, uint32_t size, gint fd)
+{
+    struct udscs_message_header header = { .type = type, .size = size };
+    GOutputVector vectors[2] = {
+        { &header, sizeof(header) },
+        { data, size },
+    };
+    GSocketControlMessage *fd_msg = NULL;
+    GError *err = NULL;
+    gssize sent;
+
+    if (fd != -1) {
+        fd_msg = g_unix_fd_message_new();
+        g_unix_fd_message_append_fd(G_UNIX_FD_MESSAGE(fd_msg), fd, &err);
+        g_assert_no_error(err);
+    }
+    sent = g_socket_send_message(g_socket_connection_get_socket(conn), NULL,
+                                 vectors, size ? 2 : 1,
+                                 fd_msg ? &fd_msg : NULL, fd_msg ? 1 : 0,
+                                 0, NULL, &err);
+    g_assert_no_error(err);
+    g_assert_cmpint(sent, ==, sizeof(header) + size);
+    g_clear_object(&fd_msg);
+}
+
+/* TRUE once every copy of the write end of the pipe was closed */
+static gboolean pipe_closed(gint read_fd)
+{
+    char c;
+
+    return read(read_fd, &c, 1) == 0;
+}
+
+/* A fd sent with a message that doesn't carry its payload in a memfd is
+ * closed by the receiver once the message was handled */
+static void test_unclaimed_fd(Fixture *f, gconstpointer user_data)
+{
+    GSocketConnection *conn = raw_connect(f);
+    gint fds[2];
+
+    g_assert_cmpint(pipe(fds), ==, 0);
+    raw_send(conn, VDAGENTD_CLIPBOARD_RELEASE, NULL, 0, fds[1]);
+    close(fds[1]);
+    raw_send(conn, VDAGENTD_CLIPBOARD_RELEASE, NULL, 0, -1);
+    wait_for_messages(f, 2);
+
+    g_assert_true(pipe_closed(fds[0]));
+    close(fds[0]);
+    g_object_unref(conn);
+}
+
+/* Same for a fd the memfd message handler did not recognise */
+static void test_bogus_memfd(Fixture *f, gconstpointer user_data)
+{
+    GSocketConnection *conn = raw_connect(f);
+    gint fds[2];
+
+    g_assert_cmpint(pipe(fds), ==, 0);
+    /* VDAGENTD_CLIPBOARD_DATA with MEMFD_PAYLOAD_FLAG, an unsealed pipe */
+    raw_send(conn, VDAGENTD_CLIPBOARD_DATA | 0x80000000u, NULL, 0, fds[1]);
+    close(fds[1]);
+    raw_send(conn, VDAGENTD_CLIPBOARD_RELEASE, NULL, 0, -1);
+    wait_for_messages(f, 1);
+
+    g_assert_cmpuint(g_array_index(f->received, struct udscs_message_header, 0).type,
+                     ==, VDAGENTD_CLIPBOARD_RELEASE);
+    g_assert_true(pipe_closed(fds[0]));
+    close(fds[0]);
+    g_object_unref(conn);
+}
+
+static void client_read(UdscsConnection *conn,
+                        struct udscs_message_header *header, uint8_t *data)
+{
+    g_main_loop_quit(fixture->loop);
+}
+
+/* Large payloads make it through a memfd */
+static void test_memfd_payload(Fixture *f, gconstpointer user_data)
+{
+    UdscsConnection *client;
+    GError *err = NULL;
+    gsize size = 1024 * 1024, i;
+    guint8 *payload = g_malloc(size);
+
+    for (i = 0; i < size; i++) {
+        payload[i] = i * 7;
+    }
+
+    client = udscs_connect(f->path, client_read, conn_error, FALSE, &err);
+    g_assert_no_error(err);
+    /* the server announces fd passing first, then this reaches the client */
+    while (f->server_conn == NULL) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    udscs_write(f->server_conn, VDAGENTD_VERSION, 0, 0, (uint8_t *)"test", 5);
+    g_main_loop_run(f->loop);
+
+    udscs_write(client, VDAGENTD_CLIPBOARD_DATA, 1, 2, payload, size);
+    wait_for_messages(f, 1);
+    g_assert_cmpuint(g_array_index(f->received, struct udscs_message_header, 0).size,
+                     ==, size);
+    g_assert_cmpmem(g_ptr_array_index(f->received_data, 0), size, payload, size);
+
+    vdagent_connection_destroy(client);
+    g_free(payload);
+}
+
+/* Clipboard messages reach the other end in the order they were written,
+ * however much clipboard data is queued ahead of a grab or release */
+static void test_clipboard_order(Fixture *f, gconstpointer user_data)
+{
+    static const uint32_t types[] = {
+        VDAGENTD_CLIPBOARD_GRAB,
+        VDAGENTD_CLIPBOARD_DATA,
+        VDAGENTD_CLIPBOARD_DATA,
+        VDAGENTD_CLIPBOARD_RELEASE,
+        VDAGENTD_CLIPBOARD_GRAB,
+        VDAGENTD_CLIPBOARD_DATA,
+        VDAGENTD_CLIPBOARD_REQUEST,
+    };
+    UdscsConnection *client;
+    GError *err = NULL;
+    gsize size = 64 * 1024;
+    guint8 *payload = g_malloc0(size);
+    guint i;
+
+    client = udscs_connect(f->path, client_read, conn_error, FALSE, &err);
+    g_assert_no_error(err);
+    /* queue everything before any of it could be written */
+    for (i = 0; i < G_N_ELEMENTS(types); i++) {
+        gboolean data = types[i] == VDAGENTD_CLIPBOARD_DATA;
+
+        udscs_write(client, types[i], i, 0, payload, data ? size : 0);
+    }
+    wait_for_messages(f, G_N_ELEMENTS(types));
+
+    for (i = 0; i < G_N_ELEMENTS(types); i++) {
+        struct udscs_message_header *header =
+            &g_array_index(f->received, struct udscs_message_header, i);
+
+        g_assert_cmpuint(header->type, ==, types[i]);
+        g_assert_cmpuint(header->arg1, ==, i);
+    }
+
+    vdagent_connection_destroy(client);
+    g_free(payload);
+}
+
+/* An open message with nothing appended yet doesn't hold up the ones
+ * written after it, in its own queue or another one */
+static void test_open_message(Fixture *f, gconstpointer user_data)
+{
+    static const guint8 payload[4] = { 1, 2, 3, 4 };
+    struct udscs_message_header *header;
+    UdscsConnection *client;
+    GError *err = NULL;
+    GBytes *bytes;
+
+    client = udscs_connect(f->path, client_read, conn_error, FALSE, &err);
+    g_assert_no_error(err);
+    udscs_write_start(client, VDAGENTD_CLIPBOARD_DATA, 0, 0, sizeof(payload));
+    udscs_write(client, VDAGENTD_CLIPBOARD_GRAB, 1, 0, NULL, 0);
+    udscs_write(client, VDAGENTD_GUEST_XORG_RESOLUTION, 2, 0, NULL, 0);
+    wait_for_messages(f, 2);
+
+    bytes = g_bytes_new_static(payload, sizeof(payload));
+    udscs_write_append(client, bytes);
+    g_bytes_unref(bytes);
+    wait_for_messages(f, 3);
+
+    header = &g_array_index(f->received, struct udscs_message_header, 2);
+    g_assert_cmpuint(header->type, ==, VDAGENTD_CLIPBOARD_DATA);
+    g_assert_cmpuint(header->size, ==, sizeof(payload));
+    g_assert_cmpmem(g_ptr_array_index(f->received_data, 2), header->size,
+                    payload, sizeof(payload));
+
+    vdagent_connection_destroy(client);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add("/udscs/priority/clipboard-order", Fixture, NULL,
+               fixture_setup, test_clipboard_order, fixture_teardown);
+    g_test_add("/udscs/write/open-message", Fixture, NULL,
+               fixture_setup, test_open_message, fixture_teardown);
+
+#ifdef HAVE_MEMFD_CREATE
+    g_test_add("/udscs/fd/unclaimed", Fixture, NULL,
+               fixture_setup, test_unclaimed_fd, fixture_teardown);
+    g_test_add("/udscs/fd/bogus-memfd", Fixture, NULL,
+               fixture_setup, test_bogus_memfd, fixture_teardown);
+    g_test_add("/udscs/fd/memfd-payload", Fixture, NULL,
+               fixture_setup, test_memfd_payload, fixture_teardown);
+#endif
+
+    return g_test_run();
+}